@@ -3,8 +3,55 @@
 #define __NGX_CONF_H__
 
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include "ngx_global.h"
 
+#define NGX_CONF_MAX_LISTEN 16 // 最多监听这么多个端口
+
+// 启动时按配置项表(ngx_c_conf.cxx 中的 ngx_conf_schema)把认识的配置项全部解析好放在这里, 程序中直接读字段, 不再按名字查字符串.
+// 配置文件中没有的项取缺省值; 格式不对/超出范围的项在Load()时一次报告出来, Load()返回false.
+// 大小类的项可以带 k/m/g 后缀, 时长类的项可以带 ms/s/m/h 后缀, 不带后缀时单位见各字段注释(和以前的写法兼容).
+typedef struct
+{
+	// [Log]
+	char log[500];			 // Log, 日志文件路径
+	int log_level;			 // LogLevel
+	int log_async;			 // LogAsync
+	int log_binary;			 // LogBinary
+	int log_rotate_size;	 // LogRotateSize, 单位MB
+	int log_rotate_interval; // LogRotateInterval, 单位秒
+
+	// [Proc]
+	int worker_processes;		  // WorkerProcesses
+	int daemon;					  // Daemon
+	int recv_work_thread_count;	  // ProcMsgRecvWorkThreadCount
+	int recv_queue_size;		  // ProcMsgRecvQueueSize
+	int ordered_dispatch;		  // ProcMsgOrderedDispatch
+	int worker_shutdown_timeout;  // ProcWorkerShutdownTimeout, 单位秒
+	char worker_cpu_affinity[200]; // WorkerCpuAffinity
+
+	// [Net]
+	int listen_port_count;					// ListenPortCount
+	int listen_ports[NGX_CONF_MAX_LISTEN];	// ListenPort0, ListenPort1, ...
+	int worker_connections;					// worker_connections
+	int reactor_count;						// Sock_ReactorCount
+	char event_backend[20];					// Sock_EventBackend
+	int recv_buf_size;						// Sock_RecvBufSize, 单位字节
+	int zero_copy_recv;						// Sock_ZeroCopyRecv
+	int recv_crc_check;						// Sock_RecvCrcCheck
+	int epoll_et;							// Sock_EpollET
+	int epoll_et_budget;					// Sock_EpollETBudget
+	int wait_time_enable;					// Sock_WaitTimeEnable
+	int max_wait_time;						// Sock_MaxWaitTime, 单位秒
+	int timeout_kick;						// Sock_TimeOutKick
+
+	// [NetSecurity]
+	int flood_kick_enable;	 // Sock_FloodAttackKickEnable
+	int flood_time_interval; // Sock_FloodTimeInterval, 单位毫秒
+	int flood_kick_counter;	 // Sock_FloodKickCounter
+} ngx_conf_t;
+
 // 读取配置文件nginx.conf
 class CConfig
 {
@@ -50,11 +97,21 @@ public:
 
 public:
 	bool Load(const char *pconfName);
+	int Reload(); // 重新载入配置文件(SIGHUP)
 	const char *GetString(const char *p_itemname);
 	int GetIntDefault(const char *p_itemname, const int def);
+	const ngx_conf_t *GetConf() const { return &m_conf; } // 解析好的配置
+
+private:
+	bool Resolve(); // 按配置项表解析出m_conf
 
 public:
-	std::vector<LPCConfItem> m_ConfigItemList; // 存储配置信息的列表
+	std::vector<LPCConfItem> m_ConfigItemList; // 存储配置信息的列表, 和配置文件中的顺序一样
+
+private:
+	std::unordered_map<std::string, LPCConfItem> m_ConfigItemMap; // 配置项名(转成小写) -> 配置项, 按名字查找用
+	ngx_conf_t m_conf;
+	std::string m_strConfName; // 配置文件名, 重新载入时用
 };
 
 #endif
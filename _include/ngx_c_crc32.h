@@ -4,6 +4,10 @@
 #include <stddef.h> // NULL
 
 // 对收发的数据包进行一个简单的校验, 以确保数据包中的内容没有被篡改过.
+// 计算方式(引擎)在构造时按CPU选择, 结果都和逐字节查crc32_table完全一致(标准CRC-32, 多项式0x04c11db7的反射形式):
+// (1) pclmul: CPU支持PCLMULQDQ时, 64字节以上的部分用无进位乘法每次折叠64字节, 零头用slicing-by-8;
+// (2) slicing-by-8: 一次查8张表处理8个字节;
+// (3) bytewise: 原来的逐字节查表, 只作为非小端机器的后备.
 class CCRC32
 {
 private:
@@ -49,8 +53,25 @@ public:
 	unsigned int Reflect(unsigned int ref, char ch);
 	int Get_CRC(unsigned char *buffer, unsigned int dwSize);
 
+	// 在已有的crc值上继续计算(crc为上一次的返回值, 第一次传0), 用于分段计算, Get_CRC(buf, len) == (int)Update(0, buf, len)
+	unsigned int Update(unsigned int crc, const unsigned char *buffer, size_t dwSize) { return ~m_pfnUpdate(this, ~crc, buffer, dwSize); }
+	const char *EngineName() const { return m_pEngineName; } // 当前使用的计算方式, 打印用
+	bool SetEngine(const char *pName);						 // 指定计算方式("bytewise"/"slicing-by-8"/"pclmul"), 对比性能用, 本机不支持返回false
+
+private:
+	// 下面几个函数的crc参数/返回值都是取反前的内部状态
+	typedef unsigned int (*ngx_crc32_update_pt)(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize);
+	static unsigned int UpdateBytewise(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize);
+	static unsigned int UpdateSlice8(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize);
+	static unsigned int UpdatePclmul(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize);
+
 public:
 	unsigned int crc32_table[256]; // Lookup table arrays
+
+private:
+	unsigned int m_sliceTable[8][256]; // slicing-by-8用, m_sliceTable[k][i]是字节i后面再跟k个0字节的crc, m_sliceTable[0]同crc32_table
+	ngx_crc32_update_pt m_pfnUpdate;   // 构造时按CPU选定
+	const char *m_pEngineName;
 };
 
 #endif
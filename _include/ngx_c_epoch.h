@@ -0,0 +1,55 @@
+﻿
+#ifndef __NGX_EPOCH_H__
+#define __NGX_EPOCH_H__
+
+#include <stdint.h>
+#include <atomic>
+
+#define NGX_EPOCH_MAX_THREADS 1024 // 最多这么多个线程使用, 每个线程第一次Enter()时分到一个槽位
+
+// 基于代(epoch)的延迟回收. 用来判断 一个已经作废的对象 是否还可能被某个线程拿在手里.
+// 用法:
+// (1) 读者: 在拿到对象指针之前 Enter(), 用完后 Leave(), 中间拿到的指针都不会被回收. 可以嵌套.
+// (2) 回收者: 先让对象作废(以后的读者再也拿不到它), 再调用 Retire() 得到作废时的代;
+//     之后 IsSafe(代) 返回true时, 作废之前就进来的读者都已经离开, 对象可以回收.
+// 全局代在每次Retire()时+1, 每个线程的槽位记录它Enter()时看到的代, 不在临界区时为0.
+// 线程局部的槽位号是静态的, 所以一个进程中只能有一个CEpoch对象(CSocekt::m_epoch).
+class CEpoch
+{
+public:
+	CEpoch();
+	~CEpoch();
+
+public:
+	void Enter();						// 进入临界区
+	void Leave();						// 离开临界区
+	uint64_t Retire();					// 对象作废后调用, 返回作废时的代
+	bool IsSafe(uint64_t retireEpoch);	// 作废时的代为retireEpoch的对象, 是否已经没有线程可能持有
+	uint64_t MinActive();				// 所有在临界区中的线程看到的最小的代, 没有线程在临界区时返回UINT64_MAX
+
+private:
+	int GetSlot(); // 取本线程的槽位, 第一次调用时分配
+
+private:
+	struct alignas(64) Slot // 每个槽位独占一个cache line, 各线程Enter()/Leave()互不干扰
+	{
+		std::atomic<uint64_t> epoch;
+	};
+
+	Slot m_slots[NGX_EPOCH_MAX_THREADS];
+	std::atomic<int> m_iSlotCount;				 // 已经分配出去的槽位数
+	alignas(64) std::atomic<uint64_t> m_globalEpoch; // 全局代, 从1开始
+};
+
+// 同CLock, 构造时Enter(), 析构时Leave()
+class CEpochGuard
+{
+public:
+	CEpochGuard(CEpoch *pEpoch) : m_pEpoch(pEpoch) { m_pEpoch->Enter(); }
+	~CEpochGuard() { m_pEpoch->Leave(); }
+
+private:
+	CEpoch *m_pEpoch;
+};
+
+#endif
@@ -0,0 +1,212 @@
+﻿
+#ifndef __NGX_EVENT_H__
+#define __NGX_EVENT_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <vector>
+
+// 内核头文件里有io_uring(5.13以后的multishot poll/poll update)才编译io_uring后端, 否则只能用epoll
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_POLL_UPDATE_EVENTS) && defined(IORING_FEAT_EXT_ARG)
+#define NGX_HAVE_IO_URING 1
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_CQE_F_BUFFER) // 6.0以后的头文件: multishot recv, provided buffer ring
+#define NGX_HAVE_URING_RECV 1
+#endif
+#if defined(IORING_ACCEPT_MULTISHOT) // 5.19以后的头文件: multishot accept
+#define NGX_HAVE_URING_ACCEPT 1
+#endif
+#endif
+#endif
+
+#define NGX_EVENT_EPOLL 0	 // 事件后端: epoll
+#define NGX_EVENT_IO_URING 1 // 事件后端: io_uring
+
+#define NGX_SEND_BATCH_LINKS 4 // 一批异步发送最多几个sendmsg请求链在一起
+#define NGX_SEND_BATCH_IOVS 64	// 每个sendmsg请求最多几段数据, 和 NGX_MAX_SENDIOV 一样
+
+struct ngx_connection_s;
+
+// 交给事件后端异步发送的一批数据(io_uring下发送缓冲区满了才用): 最多 NGX_SEND_BATCH_LINKS 个sendmsg请求, 链在一起按顺序发.
+// 数据所在的包已经从连接的 发消息队列 中取出来, 由这个对象持有, 发完后由 CSocekt::ngx_write_request_handler() 取回;
+// 等不到取回(连接已经关闭)的, 后端调用pfnFree释放.
+typedef struct ngx_send_batch_s
+{
+	uint64_t userdata;								   // 哪个连接的, 同 ngx_event_userdata()
+	int links;										   // 用了几个sendmsg请求
+	struct msghdr msg[NGX_SEND_BATCH_LINKS];		   // 第i个sendmsg请求的参数
+	struct iovec iov[NGX_SEND_BATCH_LINKS][NGX_SEND_BATCH_IOVS];
+	char *ppkg[NGX_SEND_BATCH_LINKS][NGX_SEND_BATCH_IOVS]; // 和iov一一对应, 每段数据所在的包(释放用的头指针)
+	int pending;									   // 还没完成的sendmsg请求数
+	ssize_t sent;									   // 已经发出去的字节数
+	int err;										   // 出错时的errno, 0表示没出错
+	void (*pfnFree)(struct ngx_send_batch_s *pBatch);  // 释放所有的包和这个对象
+} ngx_send_batch_t;
+
+// 事件后端(每个reactor一个): 把"注册/修改/删除关心的事件"和"等待事件"抽象出来, 上层仍然按epoll的方式使用:
+// 事件类型用 EPOLLIN/EPOLLOUT/EPOLLRDHUP/EPOLLET, 等到的事件放在 struct epoll_event 中(data.ptr为连接对象),
+// 所以 CSocekt::ngx_reactor_process_events() 和 rhandler/whandler 的调用方式不用变.
+class CEventBackend
+{
+public:
+	virtual ~CEventBackend() {}
+
+	// 按配置创建一个事件后端, 失败返回NULL; io_uring不可用时退回epoll
+	static CEventBackend *Create(int type, int size);
+
+public:
+	virtual bool Init(int size) = 0;																	 // size: 预计的连接数
+	virtual int Ctl(int fd, int op, uint32_t events, struct ngx_connection_s *pConn) = 0;			 // op: EPOLL_CTL_ADD/MOD/DEL, events是完整的事件集合. 成功1, 失败-1
+	virtual int Wait(struct epoll_event *events, int maxevents, int timer) = 0;						 // 同epoll_wait(), timer单位毫秒, -1表示阻塞
+	virtual ssize_t Recv(struct ngx_connection_s *pConn, char *buff, size_t len);					 // 同recv(), 没数据时返回-1, errno为EAGAIN
+	virtual int Accept(struct ngx_connection_s *pConn, struct sockaddr *addr, socklen_t *addrlen);	 // 同accept4(SOCK_NONBLOCK), 没有新连接时返回-1, errno为EAGAIN
+	virtual bool CanSendAsync() { return false; }													 // 是否支持异步发送
+	virtual bool SendAsync(struct ngx_connection_s *pConn, ngx_send_batch_t *pBatch);				 // 把一批数据交给后端异步发送, 发完报EPOLLOUT. 不支持/投递不了返回false
+	virtual ngx_send_batch_t *SendResult(struct ngx_connection_s *pConn);							 // 取回这个连接异步发送完的那一批, 没有返回NULL
+	virtual const char *Name() = 0;
+};
+
+// epoll后端, 就是原来的 epoll_create()/epoll_ctl()/epoll_wait()
+class CEpollBackend : public CEventBackend
+{
+public:
+	CEpollBackend();
+	virtual ~CEpollBackend();
+
+public:
+	virtual bool Init(int size);
+	virtual int Ctl(int fd, int op, uint32_t events, struct ngx_connection_s *pConn);
+	virtual int Wait(struct epoll_event *events, int maxevents, int timer);
+	virtual const char *Name() { return "epoll"; }
+
+private:
+	int m_epollhandle; // epoll_create()返回的句柄
+};
+
+#ifdef NGX_HAVE_IO_URING
+
+// io_uring后端, 直接用系统调用(不依赖liburing).
+// 每个连接一个poll请求: 有EPOLLET时用multishot poll, 一次注册一直有效; 否则用一次性poll, 事件处理完后在下一次Wait()时重新投递, 效果同LT.
+// 注册/修改/重新投递都只是往提交队列(SQ)里放一项, 攒到下一次Wait()时和等待合并成一次 io_uring_enter(), 省掉每个事件的epoll_ctl().
+// 别的线程(逻辑线程发包时增加EPOLLOUT, 关闭连接)投递的请求当场提交, 因为reactor线程可能正睡在 io_uring_enter() 里.
+// 注意: poll请求持有socket的引用, 所以关闭连接前必须先 Ctl(EPOLL_CTL_DEL) 撤销poll请求, 否则close()并不会真正关闭socket.
+// 内核支持时(provided buffer ring + multishot recv), 客户端连接的读不再用poll: 每个连接投递一个multishot recv请求,
+// 内核收到数据就直接放进预先提供的缓冲区(buffer ring)里, 完成通知带着数据回来, Recv()从中拷给连接, 省掉每次可读后的recv()系统调用.
+// 这时poll请求只管EPOLLOUT.
+// 内核支持时(5.19以上), 监听socket也不用poll: 投递一个multishot accept请求, 新连接的fd随完成通知回来, Accept()直接取, 省掉accept4().
+// 发包先在调用者线程中直接sendmsg(), 发送缓冲区满了才交给后端: 剩下的数据拆成几个sendmsg请求用IOSQE_IO_LINK链起来,
+// 内核按顺序发完(MSG_WAITALL, 不用再等EPOLLOUT后续发), 最后一个完成时报EPOLLOUT, 由写处理函数用SendResult()取回结果.
+class CUringBackend : public CEventBackend
+{
+public:
+	CUringBackend();
+	virtual ~CUringBackend();
+
+public:
+	virtual bool Init(int size);
+	virtual int Ctl(int fd, int op, uint32_t events, struct ngx_connection_s *pConn);
+	virtual int Wait(struct epoll_event *events, int maxevents, int timer);
+	virtual ssize_t Recv(struct ngx_connection_s *pConn, char *buff, size_t len);
+	virtual int Accept(struct ngx_connection_s *pConn, struct sockaddr *addr, socklen_t *addrlen);
+	virtual bool CanSendAsync() { return true; }
+	virtual bool SendAsync(struct ngx_connection_s *pConn, ngx_send_batch_t *pBatch);
+	virtual ngx_send_batch_t *SendResult(struct ngx_connection_s *pConn);
+	virtual const char *Name() { return "io_uring"; }
+
+private:
+	struct io_uring_sqe *GetSqe();			  // 取一个空闲的SQE, 调用者要持有 m_sqMutex
+	bool ReserveSqes(unsigned int count);	  // 保证SQ中至少有count个空闲的SQE, 调用者要持有 m_sqMutex
+	void PrepCancel(struct io_uring_sqe *sqe, uint64_t userdata); // 填一个撤销请求
+	void PrepPoll(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t userdata); // 填一个poll请求
+	int Enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags, int timer);
+	int SubmitPending();					  // 把SQ中还没提交的请求提交给内核
+	bool IsRecvConn(struct ngx_connection_s *pConn); // 这个连接的读是否用multishot recv
+	uint32_t PollEvents(struct ngx_connection_s *pConn, uint32_t events); // poll请求要关心的事件
+	bool IsAcceptConn(struct ngx_connection_s *pConn); // 这个监听socket是否用multishot accept
+	void ReapSendDone();							   // 释放 m_sendDone 中连接已关闭的
+#ifdef NGX_HAVE_URING_RECV
+	bool InitRecvBufs();												// 创建并注册buffer ring
+	void PrepRecv(struct io_uring_sqe *sqe, int fd, uint64_t userdata); // 填一个multishot recv请求
+	void PutRecvBuf(unsigned short bid);								// 缓冲区用完, 还给buffer ring
+	void ReapRecvList();												// 去掉 m_recvList 中用完的, 连接已关闭的
+#endif
+#ifdef NGX_HAVE_URING_ACCEPT
+	void PrepAccept(struct io_uring_sqe *sqe, int fd, uint64_t userdata); // 填一个multishot accept请求
+	void ReapAcceptList();												  // 去掉 m_acceptList 中监听socket已关闭的, 关掉新连接
+#endif
+
+private:
+	int m_ringfd; // io_uring_setup()返回的句柄
+
+	// 提交队列(SQ), 和内核共享的内存
+	unsigned int *m_sqHead;
+	unsigned int *m_sqTail;
+	unsigned int m_sqMask;
+	unsigned int m_sqEntries;
+	unsigned int *m_sqArray;
+	struct io_uring_sqe *m_sqes;
+
+	// 完成队列(CQ), 和内核共享的内存
+	unsigned int *m_cqHead;
+	unsigned int *m_cqTail;
+	unsigned int m_cqMask;
+	struct io_uring_cqe *m_cqes;
+
+	void *m_pSqRing; // mmap出来的内存, 析构时释放
+	size_t m_iSqRingSize;
+	void *m_pCqRing;
+	size_t m_iCqRingSize;
+	size_t m_iSqesSize;
+
+	pthread_mutex_t m_sqMutex; // 往SQ里放请求的互斥量, reactor线程/逻辑线程都可能放
+	pthread_t m_reactorThread; // 调用Wait()的线程, 这个线程放的请求不用当场提交
+	bool m_ifReactorKnown;
+
+	// 一次性poll触发后, 等事件处理完再重新投递的连接, 只在reactor线程中访问
+	std::vector<uint64_t> m_rearmList;
+
+	// multishot accept 相关, 只在reactor线程中访问
+	bool m_ifAcceptSelect; // 监听socket是否用multishot accept, 内核不支持时为false
+#ifdef NGX_HAVE_URING_ACCEPT
+	typedef struct
+	{
+		uint64_t userdata; // 哪个监听socket的
+		int res;		   // >=0: 新连接的fd; <0: -errno
+	} ngx_uring_accept_t;
+	std::vector<ngx_uring_accept_t> m_acceptList; // 收到了还没被Accept()取走的新连接, 按收到的顺序排
+	std::vector<uint64_t> m_acceptRearm;		  // 出错结束的accept请求, 等Accept()取空了再重新投递, 免得fd用尽时不停的出错
+#endif
+
+	// 异步发送相关
+	std::vector<ngx_send_batch_t *> m_sendInflight; // 还没发完的, 关闭连接时要撤销, 由 m_sqMutex 保护
+	std::vector<ngx_send_batch_t *> m_sendDone;		// 发完了等写处理函数取回的, 只在reactor线程中访问
+
+	// multishot recv 相关
+	bool m_ifRecvSelect; // 客户端连接的读是否用multishot recv, 内核不支持时为false
+#ifdef NGX_HAVE_URING_RECV
+	struct io_uring_buf_ring *m_pBufRing; // buffer ring, 和内核共享, 里面是可以用来收数据的缓冲区
+	size_t m_iBufRingSize;
+	unsigned short m_bufTail; // buffer ring的写入位置, 只在reactor线程中访问
+	char *m_pRecvBufs;		  // 所有收数据缓冲区, 第bid个在 m_pRecvBufs + bid * NGX_URING_RECV_BUF_SIZE
+
+	// 收到了还没被Recv()取走的数据, 按收到的顺序排, 只在reactor线程中访问
+	typedef struct
+	{
+		uint64_t userdata;	// 哪个连接的, 0表示已经取完
+		int res;			// >0: 数据长度; 0: 对方关闭; <0: -errno
+		unsigned short bid; // 数据所在的缓冲区
+		int off;			// 已经取走的字节数
+	} ngx_uring_recv_t;
+	std::vector<ngx_uring_recv_t> m_recvList;
+#endif
+};
+
+#endif
+
+#endif
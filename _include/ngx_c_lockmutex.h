@@ -4,18 +4,20 @@
 
 #include <pthread.h>
 
-// 同 lock_graud()
+// 同 lock_graud(), pMutex为NULL时什么都不做(用于按条件决定是否需要加锁)
 class CLock
 {
 public:
 	CLock(pthread_mutex_t *pMutex)
 	{
 		m_pMutex = pMutex;
-		pthread_mutex_lock(m_pMutex); // 加锁
+		if (m_pMutex != NULL)
+			pthread_mutex_lock(m_pMutex); // 加锁
 	}
 	~CLock()
 	{
-		pthread_mutex_unlock(m_pMutex); //解锁
+		if (m_pMutex != NULL)
+			pthread_mutex_unlock(m_pMutex); //解锁
 	}
 
 private:
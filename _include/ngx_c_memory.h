@@ -3,16 +3,45 @@
 #define __NGX_MEMORY_H__
 
 #include <stddef.h> //NULL
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
 
 // 内存相关的单例类
+// 按大小分级(size class)的内存池: 线程本地缓存 + 无锁全局仓库(depot) + 按批切分的slab.
+// 收发包的内存块为 消息头(STRUC_MSG_HEADER,16) + 包头(COMM_PKG_HEADER,8) + 包体(最大29000), 所以最大一级为32K.
+
+#define NGX_MEM_BLOCK_HEAD 16	// 每个内存块前的块头长度, 保证返回给用户的地址16字节对齐
+#define NGX_MEM_MIN_SHIFT 5		// 最小的一级: 1<<5 = 32字节(含块头)
+#define NGX_MEM_CLASS_COUNT 11	// 32, 64, 128 ... 32768 共11级
+#define NGX_MEM_LARGE 0xFFFF	// 超过最大一级的内存块, 直接new/delete, 不进内存池
+
+// 内存块头, 紧挨着用户内存之前
+typedef struct ngx_mem_block_s
+{
+	struct ngx_mem_block_s *next; // 空闲时: 单向链表, 把同一级的空闲块串起来
+	unsigned int sizeClass;		  // 所属的级别, NGX_MEM_LARGE表示大块
+	unsigned int batchCount;	  // 作为一批(batch)的第一块放入仓库时, 记录这批的块数
+} ngx_mem_block_t, *lpngx_mem_block_t;
+
+// 内存池统计信息, 供 CSocekt::printTDInfo() 打印
+typedef struct
+{
+	uint64_t hitCount;	  // 从线程本地缓存直接拿到
+	uint64_t missCount;	  // 线程本地缓存为空, 去全局仓库/新slab拿
+	uint64_t largeCount;  // 超过最大一级, 直接new的次数
+	int64_t bytesInUse;	  // 当前分配出去还没释放的字节数(按级别大小计)
+	uint64_t slabBytes;	  // slab从系统申请的总字节数
+} ngx_mem_stat_t;
 
 class CMemory
 {
 private:
-	CMemory() {}
+	CMemory();
 
 public:
-	~CMemory(){};
+	~CMemory();
 
 private:
 	static CMemory *m_instance;
@@ -48,6 +77,34 @@ public:
 public:
 	void *AllocMemory(int memCount, bool ifmemset);
 	void FreeMemory(void *point);
+	void GetStat(ngx_mem_stat_t *pstat);
+
+public:
+	// 线程本地缓存的统计值攒够一定次数后, 一次性加到全局计数上, 避免每次分配都去抢同一条cache line
+	void FlushStat(uint64_t hits, uint64_t misses, int64_t bytes);
+
+	lpngx_mem_block_t GetBatch(unsigned int sizeClass); // 从全局仓库取一批, 仓库空则切一批新的slab
+	void PutBatch(unsigned int sizeClass, lpngx_mem_block_t pBatch, unsigned int count); // 把一批还给全局仓库
+
+	static unsigned int ClassSize(unsigned int sizeClass) { return 1u << (sizeClass + NGX_MEM_MIN_SHIFT); }
+	static unsigned int ClassBatch(unsigned int sizeClass); // 每一级一批的块数
+
+private:
+	lpngx_mem_block_t NewSlabBatch(unsigned int sizeClass);
+
+private:
+	// 全局仓库, 每一级一个无锁栈, 栈中每个元素是一批块.
+	// 64位中低48位是指针, 高16位是版本号, 用来解决ABA问题(slab内存直到进程结束才归还系统, 所以读到旧的next也不会越界).
+	std::atomic<uint64_t> m_depot[NGX_MEM_CLASS_COUNT];
+
+	pthread_mutex_t m_slabMutex;	// 只在切新slab时加锁, 属于低频操作
+	std::vector<char *> m_slabList; // 所有slab, 析构时释放
+
+	std::atomic<uint64_t> m_iHitCount;
+	std::atomic<uint64_t> m_iMissCount;
+	std::atomic<uint64_t> m_iLargeCount;
+	std::atomic<int64_t> m_iBytesInUse;
+	std::atomic<uint64_t> m_iSlabBytes;
 };
 
 #endif
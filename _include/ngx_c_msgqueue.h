@@ -0,0 +1,54 @@
+﻿
+#ifndef __NGX_MSGQUEUE_H__
+#define __NGX_MSGQUEUE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// 有界无锁多生产者多消费者(MPMC)消息队列, 算法来自 Dmitry Vyukov 的 bounded MPMC queue.
+// 每个格子带一个序号, 生产者/消费者各自用CAS抢位置, 入队/出队都不加锁, 也不分配内存.
+// 队列里放的是"消息头+包头+包体"的内存指针(char *).
+// 消费者没活干时用futex睡眠(WaitPop), 生产者只有在确实有人睡着时才做一次futex唤醒系统调用.
+class CMsgQueue
+{
+public:
+	CMsgQueue();
+	~CMsgQueue();
+
+public:
+	bool Init(size_t capacity); // capacity会向上取到2的幂
+	bool Push(char *buf);		// 队列满返回false, 永不阻塞
+	bool TryPop(char *&buf);	// 队列空返回false, 永不阻塞
+	char *WaitPop(const std::atomic<bool> &shutdown); // 队列空就睡眠等待, shutdown为true时返回NULL
+	void WakeAll();						 // 唤醒所有睡眠的消费者(退出时用)
+
+	size_t Size() const; // 近似大小, 仅用于统计
+	size_t Capacity() const { return m_mask + 1; }
+	bool IsInit() const { return m_buffer != NULL; } // 调用过Init()没有
+
+private:
+	void Wake(); // 有消费者睡着时唤醒一个
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		char *data;
+	};
+
+	// 生产者/消费者位置分别放在不同的cache line上, 防止伪共享
+	char m_pad0[64];
+	Cell *m_buffer;
+	size_t m_mask;
+	char m_pad1[64];
+	std::atomic<size_t> m_enqueuePos;
+	char m_pad2[64];
+	std::atomic<size_t> m_dequeuePos;
+	char m_pad3[64];
+	std::atomic<uint32_t> m_futexSeq; // futex等待的字, 每次唤醒+1
+	std::atomic<int> m_iWaiters;	  // 正在(或准备)睡眠的消费者数量
+	char m_pad4[64];
+};
+
+#endif
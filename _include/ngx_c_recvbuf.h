@@ -0,0 +1,101 @@
+﻿
+#ifndef __NGX_RECVBUF_H__
+#define __NGX_RECVBUF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "ngx_c_socket.h"
+
+// 收包缓冲区池相关的单例类, 用于零拷贝收包(配置项 Sock_ZeroCopyRecv = 1).
+// 所有缓冲区在一块连续的内存(arena)中, 每个缓冲区大小是2的幂并且按自身大小对齐, 头部之后是数据.
+// 连接从池中取一个缓冲区收包, 解析出的完整包不再拷贝, 直接把 指向缓冲区中包头的指针 放入收消息队列,
+// 逻辑线程通过指针按位与找到所在缓冲区的头部, 从中得到消息头. 缓冲区带引用计数, 连接自己持有1个, 每个还没处理完的包持有1个.
+// 收消息队列中因此有两种消息: CMemory分配的 消息头+包头+包体, 和 指向缓冲区中包头的指针, 用 MsgHeader()/MsgPkg()/FreeMsg() 统一处理.
+
+#define NGX_RECVBUF_HEAD 64 // 每个缓冲区的头部长度, 占一个cache line
+
+// 缓冲区头部
+struct ngx_recvbuf_s
+{
+	std::atomic<int> iRefCount; // 引用计数, 为0时归还到池中
+	uint32_t index;				// 在池中的下标
+	STRUC_MSG_HEADER msgHeader; // 消息头, 一个缓冲区中的包都属于同一个连接, 共用一个消息头
+	lpngx_recvbuf_t next;		// 空闲时: 无锁栈中的下一个
+};
+
+class CRecvBufPool
+{
+private:
+	CRecvBufPool();
+
+public:
+	~CRecvBufPool();
+
+private:
+	static CRecvBufPool *m_instance;
+
+public:
+	static CRecvBufPool *GetInstance()
+	{
+		if (m_instance == NULL)
+		{
+			// 加锁
+			if (m_instance == NULL)
+			{
+				m_instance = new CRecvBufPool();
+				static CGarhuishou cl;
+			}
+			// 放锁
+		}
+		return m_instance;
+	}
+	class CGarhuishou
+	{
+	public:
+		~CGarhuishou()
+		{
+			if (CRecvBufPool::m_instance)
+			{
+				delete CRecvBufPool::m_instance;
+				CRecvBufPool::m_instance = NULL;
+			}
+		}
+	};
+
+public:
+	bool Init(int bufSize, int count); // bufSize为每个缓冲区的大小(含头部), 必须是2的幂
+	lpngx_recvbuf_t Get(ngx_conn_handle_t hConn); // 取一个缓冲区, 引用计数为1, 池空返回NULL
+	void AddRef(lpngx_recvbuf_t pBuf) { pBuf->iRefCount.fetch_add(1, std::memory_order_relaxed); }
+	void Release(lpngx_recvbuf_t pBuf); // 引用计数-1, 为0时归还到池中
+	bool IsShared(lpngx_recvbuf_t pBuf) { return pBuf->iRefCount.load(std::memory_order_acquire) > 1; } // 是否还有包没处理完
+
+	static char *Data(lpngx_recvbuf_t pBuf) { return (char *)pBuf + NGX_RECVBUF_HEAD; }
+	int DataSize() const { return m_iBufSize - NGX_RECVBUF_HEAD; }
+	int FreeCount() const { return m_iFreeCount.load(std::memory_order_relaxed); }
+	int Count() const { return m_iCount; }
+
+	// 收消息队列中的消息
+	LPSTRUC_MSG_HEADER MsgHeader(char *pMsgBuf); // 消息头
+	char *MsgPkg(char *pMsgBuf);				 // 包头
+	void FreeMsg(char *pMsgBuf);				 // 处理完或者丢弃时释放
+
+private:
+	// 是否是指向缓冲区中的指针, 池没有初始化时总是false
+	bool Contains(const char *p) const { return ((uintptr_t)p - (uintptr_t)m_pArena) < m_iArenaSize; }
+	lpngx_recvbuf_t BufOf(const char *p) const { return (lpngx_recvbuf_t)((uintptr_t)p & ~(uintptr_t)(m_iBufSize - 1)); }
+
+private:
+	char *m_pArena;		 // 所有缓冲区所在的连续内存, 按m_iBufSize对齐
+	char *m_pMapAddr;	 // mmap()返回的地址, 为了对齐多映射了一个缓冲区
+	size_t m_iMapSize;	 // mmap()的大小
+	size_t m_iArenaSize; // m_iBufSize * m_iCount
+	int m_iBufSize;		 // 每个缓冲区的大小(含头部)
+	int m_iCount;		 // 缓冲区个数
+
+	std::atomic<uint64_t> m_freeTop; // 空闲缓冲区无锁栈的栈顶: 低32位为 下标+1(0表示栈空), 高32位为版本号, 防ABA
+	std::atomic<int> m_iFreeCount;	 // 空闲缓冲区数, 只用于统计
+};
+
+#endif
@@ -5,20 +5,35 @@
 #include <list>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <atomic>
-#include <map>
+#include <stdint.h>
 
 #include "ngx_comm.h"
+#include "ngx_c_event.h"
+#include "ngx_c_timewheel.h"
+#include "ngx_c_epoch.h"
 
 #define NGX_LISTEN_BACKLOG 511 // 已完成连接队列, nginx官方是511
 #define NGX_MAX_EVENTS 512	   // epoll_wait()一次最多接收的事件个数, nginx官方是512
+#define NGX_MAX_SENDIOV 64	   // 一次sendmsg()最多合并发送的包数
+#define NGX_ACCEPT_RETRY_MSEC 100 // fd用尽(EMFILE/ENFILE)时, 隔这么多毫秒再重新accept
+
+#define NGX_CONNPOOL_OVERCOMMIT 2 // 连接池容量 = 每个reactor的连接数 * 本值, 留出余量给 等待回收的连接 和 reactor之间分配不均
 
 typedef struct ngx_listening_s ngx_listening_t, *lpngx_listening_t;
 typedef struct ngx_connection_s ngx_connection_t, *lpngx_connection_t;
+typedef struct ngx_reactor_s ngx_reactor_t, *lpngx_reactor_t;
+typedef struct ngx_recvbuf_s ngx_recvbuf_t, *lpngx_recvbuf_t;
 typedef class CSocekt CSocekt;
 
+// 连接句柄: 高32位为代数(连接的iCurrsequence的低32位), 低32位为连接在连接池数组中的下标.
+// 消息中只保存句柄, 用的时候通过 CSocekt::ngx_get_connection_by_handle() 换回连接, 连接已经被回收或复用时代数对不上, 得到NULL.
+typedef uint64_t ngx_conn_handle_t;
+#define NGX_CONN_HANDLE_INDEX(h) ((uint32_t)(h))
+#define NGX_CONN_HANDLE_GEN(h) ((uint32_t)((h) >> 32))
+
 typedef void (CSocekt::*ngx_event_handler_pt)(lpngx_connection_t c); // 定义成员函数指针
 
 // ------------------------------------------------ 监听端口 --------------------------------------------------
@@ -33,8 +48,8 @@ struct ngx_listening_s
 
 // -------------------------------------------------- 连接池 --------------------------------------------------
 
-// 连接池 有关的结构
-struct ngx_connection_s
+// 连接池 有关的结构, 连接池是一个连续的数组(CSocekt::m_pConnPool), 每个元素按cache line对齐, 相邻连接不会伪共享
+struct alignas(64) ngx_connection_s
 {
 	// 二段式构造和析构
 
@@ -44,72 +59,133 @@ struct ngx_connection_s
 	void PutOneToFree();
 	virtual ~ngx_connection_s();
 
-	// 和连接有关
+	ngx_conn_handle_t GetHandle() const { return ((uint64_t)(uint32_t)iCurrsequence << 32) | index; } // 当前的连接句柄
+	bool MatchHandle(ngx_conn_handle_t h) const { return (uint32_t)iCurrsequence == NGX_CONN_HANDLE_GEN(h); } // 句柄是否还指向本连接的这一次使用
 
-	int fd;						 // socket
-	lpngx_listening_t listening; // 针对fd为lfd
-	struct sockaddr s_sockaddr;	 // 保存对方地址信息用的, 调用ngx_sock_ntop()可以转化为字符串
+	// 成员按访问它的线程分组, 每组从新的cache line开始(ngx_c_socket_conn.cxx中有static_assert检查):
+	// 第1行: reactor线程每个事件都要读的, 基本只读; 第2行: 收包状态, 只有reactor线程写;
+	// 发包组: 由sendMutex保护, 逻辑线程和reactor线程轮流写; 逻辑处理组: 逻辑线程写; 最后是冷数据.
+	// 这样reactor收包时不会因为逻辑线程在发包/处理业务而频繁失效自己的cache line.
 
-	// 和epoll事件有关
+	// ---- 第1行: 事件分发, reactor线程每个事件都读 (vptr 8字节 + 56字节) ----
 
 	ngx_event_handler_pt rhandler; // 读事件回调函数, 对于lfd就是CSocekt::ngx_event_accept, 对于cfd就是CSocekt::ngx_read_request_handler
 	ngx_event_handler_pt whandler; // 写事件回调函数, 对于cfd是CSocekt::ngx_write_request_handler.
+	lpngx_reactor_t reactor;	   // 所属的reactor, 连接对象创建时确定, 之后一直属于这个reactor的连接池
+	int fd;						   // socket
 	uint32_t events;
+	uint64_t iCurrsequence; // 序号, 每次分配出去时+1, 可以用来检测错包/废包
 
-	// 和收包有关
-
-	unsigned char curStat;			   // 当前的收包状态, 有4种, 详见ngx_comm.h
-	char dataHeadInfo[_DATA_BUFSIZE_]; // 保存收到的包头
-	char *precvbuf;					   // 还要继续 接收数据缓冲区的头指针, 初始指向 dataHeadInfo 首地址
-	unsigned int irecvlen;			   // 还要继续 收多少数据, 初始为 sizeof(COMM_PKG_HEADER)
-	char *precvMemPointer;			   // new出来, 用于收包(消息体+包头+包体)的内存首地址
-	// 解决收包不全的问题, 如包头8字节, 但目前只收到3字节, 此时irecvlen就是5, precvbuf指向dataHeadInfo中的第4个位置, 以便后续继续收包头.
-
-	// 和发包有关
-
-	std::atomic<int> iThrowsendCount; // 发送消息, 如果发送缓冲区满, 则用这个变量标记
-	char *psendbuf;					  // 发送数据的缓冲区的头指针, 开始其实是包头+包体
-	unsigned int isendlen;			  // 要发送多少数据
-	char *psendMemPointer;			  // 发送完成后释放用的, 整个数据(消息体+包头+包体)的头指针
+	// ---- 第2行: 收包, 只有reactor线程访问 ----
 
-	// 和逻辑处理有关
+	alignas(64) char *precvBufBase; // 当前的收包缓冲区, 大小为 CSocekt::m_iRecvBufSize, 是连接自己的(precvBufOwn) 或者 从收包缓冲区池中取的(precvBuf)
+	char *precvbuf;					// 大包收包体时(_PKG_BD_RECVING), 还要继续 接收数据缓冲区的头指针
+	char *precvMemPointer;			// new出来, 用于收包(消息体+包头+包体)的内存首地址
+	lpngx_recvbuf_t precvBuf;		// 零拷贝收包时, 从收包缓冲区池(CRecvBufPool)中取的缓冲区, 连接持有它的一个引用; 不为NULL时 precvBufBase 指向它的数据
+	unsigned int irecvBufHead;		// 收包缓冲区中 还没解析的数据 的开始位置
+	unsigned int irecvBufTail;		// 收包缓冲区中 已收到数据 的结束位置, 下次recv()从这里开始放
+	unsigned int irecvlen;			// 大包收包体时(_PKG_BD_RECVING), 还要继续 收多少数据
+	unsigned int irecvCrc;			// 大包收包体时(_PKG_BD_RECVING), 已收到的包体的crc32值, 边收边算(CCRC32::Update), 只在 Sock_RecvCrcCheck = 1 时有意义
+	// 解决收包不全的问题: 收包缓冲区中最后不完整的包留在缓冲区里(挪到开头), 等下次recv()收到后续数据再解析.
 
-	pthread_mutex_t logicPorcMutex;
+	uint64_t FloodkickLastTime; // Flood攻击上次收到包的时间
+	int FloodAttackCount;		// Flood攻击在该时间内收到包的次数统计
+	unsigned char curStat;		// 当前的收包状态, 详见ngx_comm.h
 
-	// 连接延迟回收
+	// ---- 发包, 以下成员都由 sendMutex 保护 ----
 
-	time_t inRecyTime; // 入 待释放连接队列 的时间
+	alignas(64) pthread_mutex_t sendMutex; // 发包互斥量, 逻辑线程直接发送 和 epoll线程在可写时续发 互斥
+	std::list<char *> sendMsgQueue;		   // 本连接的 发消息队列, 前边的包没发完时, 后来的包在这里排队
+	std::atomic<int> iThrowsendCount;	   // 发送缓冲区满, 已经投递了EPOLLOUT等待可写时为1, 否则为0
+	std::atomic<int> iSendCount;		   // 当前client在 发消息队列(sendMsgQueue) 中消息的数目, 若client只发不收, 则可能造成此数过大, 依据此数做出踢出处理.
+	char *psendbuf;						   // 发送数据的缓冲区的头指针, 开始其实是包头+包体
+	char *psendMemPointer;				   // 发送完成后释放用的, 整个数据(消息体+包头+包体)的头指针, 不为NULL表示有个包正发了一半
+	unsigned int isendlen;				   // 要发送多少数据
 
-	// 和心跳包有关
+	// ---- 逻辑处理, 逻辑线程访问 ----
 
+	alignas(64) pthread_mutex_t logicPorcMutex;
 	time_t lastPingTime; // 上次ping的时间, 即上次发送心跳包的时间
 
-	// 和网络安全有关
+	// ---- 冷数据: 建立/回收连接, 心跳检测时才用 ----
 
-	uint64_t iCurrsequence; // 序号, 每次分配出去时+1, 可以用来检测错包/废包
+	alignas(64) lpngx_listening_t listening; // 针对fd为lfd
+	char *precvBufOwn;						 // 连接自己的收包缓冲区, 连接对象第一次被使用时分配, 随连接对象复用
+	struct sockaddr s_sockaddr;				 // 保存对方地址信息用的, 调用ngx_sock_ntop()可以转化为字符串
+	uint64_t iRetireEpoch;					 // 入 待释放连接队列 时的代(CEpoch::Retire)
+	ngx_timer_node_t timerNode;				 // 心跳检测的定时器节点, 挂在 CSocekt::m_timeWheel 上, 由 m_timequeueMutex 保护
+	uint32_t index;							 // 在连接池数组中的下标, 创建后不变
+	lpngx_connection_t next;				 // 空闲连接无锁栈中的下一个节点, 只在连接空闲时有意义
 
-	uint64_t FloodkickLastTime; // Flood攻击上次收到包的时间
-	int FloodAttackCount;		// Flood攻击在该时间内收到包的次数统计
+	// unsigned   instance:1;  // 位域, 失效标志位, 0有效, 1失效. 官方nginx提供, 到底有什么用, ngx_epoll_process_events()中详解.
+	// char     addr_text[100]; // 地址的文本信息, 100足够, 一般其实如果是ipv4地址, 255.255.255.255, 其实只需要20字节就够
+};
 
-	std::atomic<int> iSendCount; // 当前client在 发消息队列 中消息的数目, 若client只发不收, 则可能造成此数过大, 依据此数做出踢出处理.
+// 事件后端中保存的用户数据: 连接指针 + 序号, 连接被回收/复用后序号会变, 之前投递的事件就能认出是过期的.
+// 指针只用低48位, 高16位是连接序号(iCurrsequence)的低16位.
+#define NGX_EVENT_PTR_MASK 0x0000FFFFFFFFFFFFULL
 
-	// 连接池 有关
+static inline uint64_t ngx_event_userdata(lpngx_connection_t pConn)
+{
+	return ((uint64_t)(uintptr_t)pConn & NGX_EVENT_PTR_MASK) | ((pConn->iCurrsequence & 0xFFFF) << 48);
+}
 
-	lpngx_connection_t next; // 单向链表, 指向下一个节点, 用于把空闲的连接对象串起来
+static inline lpngx_connection_t ngx_event_conn(uint64_t userdata)
+{
+	return (lpngx_connection_t)(uintptr_t)(userdata & NGX_EVENT_PTR_MASK);
+}
 
-	// unsigned   instance:1;  // 位域, 失效标志位, 0有效, 1失效. 官方nginx提供, 到底有什么用, ngx_epoll_process_events()中详解.
-	// char     addr_text[100]; // 地址的文本信息, 100足够, 一般其实如果是ipv4地址, 255.255.255.255, 其实只需要20字节就够
-};
+static inline bool ngx_event_expired(uint64_t userdata)
+{
+	return ((ngx_event_conn(userdata)->iCurrsequence & 0xFFFF) != (userdata >> 48));
+}
 
 // ---------------------------------------------- 消息头 --------------------------------------------------
 
 // 消息头, 引入的目的是当收到数据包时, 额外记录一些内容以备将来使用
 typedef struct _STRUC_MSG_HEADER
 {
-	lpngx_connection_t pConn; // 对应的"连接"
-	uint64_t iCurrsequence;	  // 收到数据包时, 对应连接(pConn)的序号, 将来能用于比较连接是否已经作废
+	ngx_conn_handle_t hConn; // 收到数据包时对应"连接"的句柄, 连接作废(回收/复用)后换不回连接
 } STRUC_MSG_HEADER, *LPSTRUC_MSG_HEADER;
 
+// 延后处理的事件: ET模式下, 一个连接本轮的处理次数用完了还没处理到EAGAIN, 留到下一轮接着处理
+typedef struct
+{
+	lpngx_connection_t pConn; // 对应的"连接"
+	uint64_t iCurrsequence;	  // 投递时连接的序号, 处理时不相等说明连接已经被回收, 事件作废
+	uint32_t revents;		  // 要处理的事件, 目前只有EPOLLIN
+} ngx_posted_event_t;
+
+// ---------------------------------------------- reactor --------------------------------------------------
+
+// 和 reactor 有关的结构: 一个worker进程中可以有多个reactor, 每个reactor一个事件后端(epoll树或io_uring), 自己的监听socket, 自己的一份连接池.
+// 0号reactor在worker进程的主线程中运行(ngx_process_events_and_timers), 其余的各有一个线程(ServerReactorThread).
+// 一个连接从accept到回收, 读/写事件都只在它所属的reactor线程中处理.
+struct ngx_reactor_s
+{
+	int index;									 // reactor编号, 从0开始
+	CEventBackend *backend;						 // 事件后端, 由配置项 Sock_EventBackend 决定是epoll还是io_uring
+	struct epoll_event events[NGX_MAX_EVENTS];	 // 用于在epoll_wait()中保存所发生的事件
+	std::vector<ngx_posted_event_t> postedEventList; // 延后到下一轮处理的事件, 只在本reactor线程中访问, 不需要互斥
+
+	// 监听socket: 0号reactor用父进程中打开的(m_ListenSocketList), 其余的在worker进程中用SO_REUSEPORT另外打开, 由内核在它们之间分配新连接
+	std::vector<lpngx_listening_t> listenList;
+	bool acceptStopped; // 已经不再接受新连接(CSocekt::StopAccepting), 只在本reactor线程中访问
+	uint64_t acceptRetryMsec; // fd用尽时, 到这个时刻(ngx_current_msec)再重新accept, 0表示没有要重试的
+
+	// 本reactor的连接池: 连接池数组(CSocekt::m_pConnPool)中 [iPoolBase, iPoolBase + iPoolCapacity) 这一段
+	int iPoolSize;						 // 本reactor分到的连接数(worker_connections / reactor数量)
+	int iPoolBase;						 // 在连接池数组中的起始下标
+	int iPoolCapacity;					 // 容量, iPoolSize * NGX_CONNPOOL_OVERCOMMIT
+	std::atomic<uint64_t> freeTop;		 // 空闲连接无锁栈(通过ngx_connection_s::next串起来)的栈顶: 低32位为 下标+1(0表示栈空), 高32位为版本号, 防ABA
+	std::atomic<int> iFreeCount;		 // 空闲连接数, 只用于统计和accept时的判断
+
+	// 线程相关, 0号reactor不用
+	pthread_t _Handle;	 // 线程句柄
+	bool bThreadStarted; // 线程已经创建, 退出时要pthread_join
+	CSocekt *_pThis;	 // 记录CSocekt的指针
+};
+
 // ---------------------------------------------- CSocekt --------------------------------------------------
 
 class CSocekt
@@ -121,16 +197,23 @@ public:
 	virtual bool Initialize_subproc(); // 初始化函数, 在子进程中执行
 	virtual void Shutdown_subproc();   // 关闭退出函数, 在子进程中执行
 	void printTDInfo();				   // 打印统计信息
+	void ReadConf();				   // 专门用于读各种配置项
+	void ReadRuntimeConf();			   // 读运行中可以直接修改的配置项(SIGHUP)
+	void StopAccepting();			   // 不再接受新连接, worker进程平滑退出时用
+	int GetOnlineUserCount() const { return m_onlineUserCount; } // 当前在线用户数
 
 public:
 	virtual void threadRecvProcFunc(char *pMsgBuf); // 处理客户端请求, 因为将来可以考虑自己来写子类继承本类
-	virtual void procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur_time);
+	virtual void procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur_time); // tmpmsg由调用者负责, 不用释放
 
 public:
 
 	int ngx_epoll_init();
 	int ngx_epoll_process_events(int timer);
 	int ngx_epoll_oper_event(int fd, uint32_t eventtype, uint32_t flag, int bcaction, lpngx_connection_t pConn);
+	void ngx_post_event(lpngx_connection_t pConn, uint32_t revents);	  // 投递一个延后处理的事件
+	void ngx_process_posted_events(lpngx_reactor_t pReactor);			  // 处理上一轮投递的事件
+	int ngx_reactor_process_events(lpngx_reactor_t pReactor, int timer); // 获取某个reactor上的事件并处理
 
 
 protected:
@@ -140,9 +223,14 @@ protected:
 	void msgSend(char *psendbuf);
 	void zdClosesocketProc(lpngx_connection_t p_Conn);
 
+	lpngx_connection_t ngx_get_connection_by_handle(ngx_conn_handle_t hConn); // 句柄换连接, 连接已经作废返回NULL
+
 private:
-	void ReadConf();					//专门用于读各种配置项
 	bool ngx_open_listening_sockets();	//监听必须的端口【支持多个端口】
+	int ngx_open_listening_socket(int iport); // 打开一个监听socket, 返回lfd, 失败返回-1
+	bool ngx_reactor_init(lpngx_reactor_t pReactor); // 初始化一个reactor: epoll树, 连接池, 监听socket
+	void ngx_reactor_free(lpngx_reactor_t pReactor); // 释放一个reactor: 事件后端, 自己打开的监听socket
+	void ngx_reactor_stop_accept(lpngx_reactor_t pReactor); // 本reactor不再接受新连接
 	void ngx_close_listening_sockets(); //关闭监听套接字
 	bool setnonblocking(int sockfd);	//设置非阻塞套接字
 
@@ -154,23 +242,34 @@ private:
 
 	ssize_t recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen); //接收从客户端来的数据专用函数
 
+	// 从收包缓冲区中解析出尽量多的完整包，我们称为包处理阶段1：写成函数，方便复用
 	void ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &isflood);
 
-	// 包头收完整后的处理，我们称为包处理阶段1：写成函数，方便复用
-	void ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool &isflood);
+	// 收到一个完整包后的处理
+	void ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool &isflood, bool ispkgok = true);
+
+	// 零拷贝收包时, 解析完后整理收包缓冲区
+	void ngx_wait_request_handler_compact(lpngx_connection_t pConn);
 
 	// 收到一个完整包后的处理, 放到一个函数中, 方便调用
 
-	void clearMsgSendQueue(); // 处理发送消息队列
+	void clearMsgSendQueue();							 // 处理发送消息队列
+	void clearConnSendQueue(lpngx_connection_t pConn);	 // 丢弃某个连接上所有待发送的数据
 
-	ssize_t sendproc(lpngx_connection_t c, char *buff, ssize_t size); //将数据发送到客户端
+	ssize_t sendproc(lpngx_connection_t c, char *buff, ssize_t size);			 //将数据发送到客户端
+	ssize_t sendvproc(lpngx_connection_t c, struct iovec *iov, int iovcnt); //将多段数据一次发送到客户端
+	int sendPendingProc(lpngx_connection_t pConn);					  // 把连接上待发送的数据尽量发出去
+	bool sendAsyncProc(lpngx_connection_t pConn);					  // 发送缓冲区满了, 剩下的数据交给事件后端异步发送
+	void sendBatchReturn(lpngx_connection_t pConn, ngx_send_batch_t *pBatch, ssize_t sent); // 异步发送的一批回来了, 发完的释放, 没发完的放回连接
+	static void freeSendBatch(ngx_send_batch_t *pBatch);			  // 释放一批异步发送的数据, 连接已经关闭时由事件后端调用
 
 	size_t ngx_sock_ntop(struct sockaddr *sa, int port, u_char *text, size_t len);
 
 	// 连接池 相关
 
-	void initconnection();
-	lpngx_connection_t ngx_get_connection(int isock);
+	bool initconnection();
+	void initconnection(lpngx_reactor_t pReactor);
+	lpngx_connection_t ngx_get_connection(lpngx_reactor_t pReactor, int isock);
 	void clearconnection();
 	void ngx_free_connection(lpngx_connection_t pConn);
 	void inRecyConnectQueue(lpngx_connection_t pConn);	 // 将要回收的连接 入待释放连接队列
@@ -179,19 +278,17 @@ private:
 	// 和时间相关的函数
 
 	void AddToTimerQueue(lpngx_connection_t pConn);
-	time_t GetEarliestTime();
-	LPSTRUC_MSG_HEADER RemoveFirstTimer();
-	LPSTRUC_MSG_HEADER GetOverTimeTimer(time_t cur_time);
 	void DeleteFromTimerQueue(lpngx_connection_t pConn);
 	void clearAllFromTimerQueue();
 
 	// 和网络安全有关
 
 	bool TestFlood(lpngx_connection_t pConn); // 测试flood攻击是否成立, 成立返回true, 否则返回false
+	bool TestPkgCrc(LPCOMM_PKG_HEADER pPkgHeader, unsigned int ibodycrc); // 在reactor线程中校验包的crc32值, 正确返回true, 否则返回false
 
 	// 线程相关函数
 
-	static void *ServerSendQueueThread(void *threadData);		  // 发送数据 的线程
+	static void *ServerReactorThread(void *threadData);			  // 1号及以后的reactor 的线程
 	static void *ServerRecyConnectionThread(void *threadData);	  // 回收连接 的线程
 	static void *ServerTimerQueueMonitorThread(void *threadData); // 时间队列监视线程, 处理到期不发心跳包的用户踢出的线程
 
@@ -200,12 +297,17 @@ protected:
 
 	size_t m_iLenPkgHeader; // 包长, sizeof(COMM_PKG_HEADER);
 	size_t m_iLenMsgHeader; // 消息体长, sizeof(STRUC_MSG_HEADER);
+	int m_ifRecvCrcCheck;	// 是否在reactor线程收包时就校验crc32值, 1是(逻辑线程不再校验), 0否. 对应配置项 Sock_RecvCrcCheck
 
 	// 时间相关
 
 	int m_ifTimeOutKick; // 当时间到达 Sock_MaxWaitTime 指定的时间时, 直接把客户端踢出去, 只有当Sock_WaitTimeEnable = 1时, 本项才有用
 	int m_iWaitTime;	 // 多少秒检测一次是否 心跳超时, 只有当Sock_WaitTimeEnable = 1时, 本项才有用
 
+	// 连接回收相关: 逻辑线程/reactor线程/时间队列监视线程 通过句柄或事件拿到连接指针之前要进入临界区(CEpochGuard), 用完离开.
+	// 连接关闭后, 等所有在它关闭之前进入临界区的线程都离开了, 回收线程才把它归还连接池.
+	CEpoch m_epoch;
+
 private:
 	// CThreadPool类中也有这个ThreadItem, 完全一样.
 	struct ThreadItem
@@ -221,50 +323,47 @@ private:
 	};
 
 	int m_worker_connections; // 每个 worker 进程允许同时连入的客户端数, 从nginx.conf中读取: Initialize() -> ReadConf()
+	int m_iRecvBufSize;		  // 每个连接的收包缓冲区大小, 对应配置项 Sock_RecvBufSize
+	int m_ifZeroCopyRecv;	  // 是否零拷贝收包, 对应配置项 Sock_ZeroCopyRecv
 
 	int m_ListenPortCount; // 要监听的端口数量, 从nginx.conf中读取: Initialize() -> ReadConf()
 
-	int m_epollhandle;							 // epoll_create()返回的句柄
-	struct epoll_event m_events[NGX_MAX_EVENTS]; // 用于在epoll_wait()中保存所发生的事件
-
-	// 和连接池有关的
+	int m_iReactorCount;					 // 每个worker进程中reactor(epoll线程)的数量, 对应配置项 Sock_ReactorCount
+	int m_iEventBackend;					 // 事件后端, NGX_EVENT_EPOLL 或 NGX_EVENT_IO_URING, 对应配置项 Sock_EventBackend
+	std::vector<lpngx_reactor_t> m_reactorList; // 所有reactor, epoll树和连接池都在reactor里
 
-	std::list<lpngx_connection_t> m_connectionList;		// 连接池
-	std::list<lpngx_connection_t> m_freeconnectionList; // 空闲连接列表
+	lpngx_connection_t m_pConnPool; // 连接池数组, 所有reactor的连接都在这一块连续内存里, 按reactor分段
+	int m_iConnPoolSize;			// 连接池数组的元素个数
 
-	// 连接池(m_connectionList/m_freeconnectionList) 相关互斥量
-	pthread_mutex_t m_connectionMutex;
+	int m_ifEpollET; // 是否使用边缘触发(ET)模式, 对应配置项 Sock_EpollET
+	int m_iETBudget; // ET模式下每个连接每轮最多 accept/recv 的次数, 对应配置项 Sock_EpollETBudget
 
 	// 连接回收
 
-	std::list<lpngx_connection_t> m_recyconnectionList; // 待释放连接队列
+	std::list<lpngx_connection_t> m_recyconnectionList; // 待释放连接队列, 没有线程还拿着的连接(m_epoch.IsSafe)就可以回收
 	std::atomic<int> m_total_recyconnection_n;			// 待释放连接队列 大小
 	pthread_mutex_t m_recyconnqueueMutex;				// 待释放连接队列 的互斥量
-	int m_RecyConnectionWaitTime;						// 等待这么些秒后才回收连接
 
 	std::vector<lpngx_listening_t> m_ListenSocketList; // 监听套接字队列
 
 	// 消息队列
 
-	std::list<char *> m_MsgSendQueue;		 // 发消息队列
-	std::atomic<int> m_iSendMsgQueueCount;	 // 发消息队列 大小
-	pthread_mutex_t m_sendMessageQueueMutex; // 发消息队列 互斥量
+	std::atomic<int> m_iSendMsgQueueCount; // 所有连接的 发消息队列 中的消息总数
 
 	// 多线程相关
 
-	std::vector<ThreadItem *> m_threadVector; // 发包线程/连接的延迟回收线程/时间队列监视和处理线程
-	sem_t m_semEventSendQueue;				  // 发包线程的信号量
+	std::vector<ThreadItem *> m_threadVector; // 连接的延迟回收线程/时间队列监视和处理线程
 
 	// 定时器相关
 
-	pthread_mutex_t m_timequeueMutex;						   // 互斥量
-	std::multimap<time_t, LPSTRUC_MSG_HEADER> m_timerQueuemap; // 时间队列, 保存用户连接建立(三次握手成功)的时间.
-	size_t m_cur_size_;										   // 时间队列的大小
-	time_t m_timer_value_;									   // 时间队列中最早的时间
+	pthread_mutex_t m_timequeueMutex; // 互斥量
+	CTimeWheel m_timeWheel;			  // 时间轮, 每个连接的定时器节点(timerNode)挂在上面, 到期时间为 上次检测时间 + m_iWaitTime
+	size_t m_cur_size_;				  // 时间轮中的节点数
 
 	// 在线用户相关
 
 	std::atomic<int> m_onlineUserCount; // 当前在线用户数
+	std::atomic<bool> m_bStopAccept;	// 不再接受新连接(平滑退出中)
 
 	// 网络安全相关
 
@@ -276,7 +375,8 @@ private:
 	// 统计用途
 
 	time_t m_lastprintTime;		// 上次打印统计信息的时间(10秒钟打印一次)
-	int m_iDiscardSendPkgCount; // 丢弃的发送数据包数量
+	std::atomic<int> m_iDiscardSendPkgCount; // 丢弃的发送数据包数量
+	std::atomic<int> m_iCrcErrorPkgCount;	 // reactor线程中crc32校验不通过而丢弃的数据包数量
 };
 
 #endif
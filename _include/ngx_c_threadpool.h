@@ -5,6 +5,8 @@
 #include <pthread.h>
 #include <atomic>
 
+#include "ngx_c_msgqueue.h"
+
 // 线程池相关类
 class CThreadPool
 {
@@ -13,15 +15,30 @@ public:
     ~CThreadPool();
 
 public:
-    bool Create(int threadNum); // 创建该线程池中的所有线程
+    bool Create(int threadNum, int queueSize, bool ordered); // 创建该线程池中的所有线程, queueSize为 收消息队列 的容量, ordered见 m_bOrderedDispatch
     void StopAll();             // 使线程池中的所有线程退出
 
     void inMsgRecvQueueAndSignal(char *buf);
     void Call();
 
-    int getRecvMsgQueueCount() // 获取接收消息队列大小
+    int getRecvMsgQueueCount() // 获取接收消息队列大小(近似值)
     {
-        return m_MsgRecvQueue.size();
+        size_t count = m_MsgRecvQueue.Size();
+        for (auto iter = m_MsgLaneQueue.begin(); iter != m_MsgLaneQueue.end(); ++iter)
+        {
+            count += (*iter)->Size();
+        }
+        return (int)count;
+    }
+
+    bool isOrderedDispatch() // 是否按连接分派, 是则同一连接的消息只会被同一个线程顺序处理, 业务逻辑不需要再加 logicPorcMutex
+    {
+        return m_bOrderedDispatch;
+    }
+
+    int getDiscardRecvPkgCount() // 获取因 收消息队列 满而丢弃的包数量
+    {
+        return m_iDiscardRecvPkgCount;
     }
 
 private:
@@ -35,25 +52,29 @@ private:
     {
         pthread_t _Handle;   // 线程句柄
         CThreadPool *_pThis; // 线程池的指针
-        bool ifrunning;      // 线程是否启动起来(只有线程运行到pthread_cond_wait()时, 线程才算启动起来), 启动起来才允许调用StopAll()来释放. 如果线程刚刚Create()就StopAll()可能会报错, 所以引入 ifrunning 标识.
+        bool ifrunning;      // 线程是否启动起来(只有线程运行到等待消息时, 线程才算启动起来), 启动起来才允许调用StopAll()来释放. 如果线程刚刚Create()就StopAll()可能会报错, 所以引入 ifrunning 标识.
+        CMsgQueue *_pQueue;  // 本线程从哪个队列取消息: 共享的 m_MsgRecvQueue, 或按连接分派时本线程独有的队列
 
-        ThreadItem(CThreadPool *pthis) : _pThis(pthis), ifrunning(false) {}
+        ThreadItem(CThreadPool *pthis, CMsgQueue *pqueue) : _pThis(pthis), ifrunning(false), _pQueue(pqueue) {}
     };
 
 private:
-    static pthread_mutex_t m_pthreadMutex; // 线程同步 互斥量
-    static pthread_cond_t m_pthreadCond;   // 线程同步 条件变量
-
-    static bool m_shutdown; // 线程退出标志, false不退出, true退出. 初始值为false, 在 StopAll() 中设置为true.
+    static std::atomic<bool> m_shutdown; // 线程退出标志, false不退出, true退出. 初始值为false, 在 StopAll() 中设置为true.
 
     std::vector<ThreadItem *> m_threadVector; // 线程池
     int m_iThreadNum;                         // 线程池 大小
 
-    std::atomic<int> m_iRunningThreadNum; // 正在处理任务的线程数量, 即不再被pthread_cond_wait()卡住的, 从 收消息队列 中取到消息的线程数量.
+    std::atomic<int> m_iRunningThreadNum; // 正在处理任务的线程数量, 即不再睡眠等待的, 从 收消息队列 中取到消息的线程数量.
 
     time_t m_iLastEmgTime; // 上次发生线程不够用的时间(紧急事件), 防止日志输出的太频繁
 
-    std::list<char *> m_MsgRecvQueue; // 收消息队列
+    CMsgQueue m_MsgRecvQueue;               // 收消息队列, 有界无锁队列, epoll线程入队永不阻塞
+
+    // 按连接分派: 每个线程一个队列, 消息按连接(pConn)哈希到固定的线程, 同一连接的消息严格按收到的顺序被处理, 不会并发.
+    // 对应配置项 ProcMsgOrderedDispatch
+    bool m_bOrderedDispatch;
+    std::vector<CMsgQueue *> m_MsgLaneQueue;
+    std::atomic<int> m_iDiscardRecvPkgCount; // 收消息队列 满时丢弃的包数量
 };
 
 #endif
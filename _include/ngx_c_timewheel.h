@@ -0,0 +1,61 @@
+﻿
+#ifndef __NGX_TIMEWHEEL_H__
+#define __NGX_TIMEWHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+// 分层时间轮(同Linux内核老的定时器实现): 第0层256个槽, 每槽1个刻度(1秒); 往上4层每层64个槽, 每槽是下一层一整圈.
+// 定时器节点直接嵌在使用者(连接对象)里, 双向链表挂在槽上, 所以 增加/删除/到期 都是O(1), 也不需要分配内存.
+// 本类不加锁, 由使用者负责互斥(CSocekt::m_timequeueMutex).
+
+#define NGX_TW_ROOT_BITS 8
+#define NGX_TW_LEVEL_BITS 6
+#define NGX_TW_ROOT_SIZE (1 << NGX_TW_ROOT_BITS)   // 256
+#define NGX_TW_LEVEL_SIZE (1 << NGX_TW_LEVEL_BITS) // 64
+#define NGX_TW_LEVELS 4							   // 第0层之外的层数
+
+// 定时器节点
+typedef struct ngx_timer_node_s
+{
+	struct ngx_timer_node_s *prev; // 双向链表, 不在时间轮中时 next 为NULL
+	struct ngx_timer_node_s *next;
+	time_t expires; // 到期时间
+	void *data;		// 节点的主人(比如连接对象)
+} ngx_timer_node_t, *lpngx_timer_node_t;
+
+class CTimeWheel
+{
+public:
+	CTimeWheel();
+	~CTimeWheel();
+
+public:
+	void Init(time_t now);									   // 从now这个时刻开始计时
+	void Add(lpngx_timer_node_t node, time_t expires);		   // 节点已经在时间轮中的, 先删除再加
+	void Del(lpngx_timer_node_t node);						   // 节点不在时间轮中的, 什么都不做
+	void Expire(time_t now, std::vector<lpngx_timer_node_t> &expired); // 把所有 expires <= now 的节点摘下来放进expired
+	void Clear();											   // 摘下所有节点
+
+	static bool IsActive(lpngx_timer_node_t node) { return node->next != NULL; }
+	size_t Size() const { return m_iCount; }
+
+private:
+	void Insert(lpngx_timer_node_t node);	   // 按到期时间挂到对应的槽上
+	void Cascade(int level, unsigned int index); // 把上层一个槽中的节点重新分配到下层
+
+	static void ListInit(lpngx_timer_node_t head);
+	static void ListAppend(lpngx_timer_node_t head, lpngx_timer_node_t node);
+	static void ListUnlink(lpngx_timer_node_t node);
+
+private:
+	uint64_t m_current; // 下一个要处理的刻度(秒)
+	size_t m_iCount;	// 时间轮中的节点数
+
+	ngx_timer_node_t m_root[NGX_TW_ROOT_SIZE];					  // 第0层, 每个元素是一个链表头(哨兵)
+	ngx_timer_node_t m_level[NGX_TW_LEVELS][NGX_TW_LEVEL_SIZE];	  // 第1~4层
+};
+
+#endif
@@ -8,15 +8,13 @@
 
 #define _PKG_MAX_LENGTH 30000 // 包长(包头+包体)的最大值, 为预留一些空间(1000), 实现时包长最大值29000
 
-// 收包状态: _PKG_HD_INIT(0) -> _PKG_HD_RECVING(1) -> _PKG_BD_INIT(2) -> _PKG_BD_RECVING(3) -> _PKG_HD_INIT(0) -> ...
+// 收包状态: _PKG_HD_INIT(0) -> _PKG_BD_RECVING(3) -> _PKG_HD_INIT(0) -> ...
 // 在 ngx_connection_t.curStat 中被使用
+// 平时一次recv()尽量多收, 收到连接的收包缓冲区中, 从缓冲区中一次解析出所有完整的包;
+// 只有比收包缓冲区还大的包, 包体才直接收到消息内存中.
 
-#define _PKG_HD_INIT 0	  // 准备接收包头
-#define _PKG_HD_RECVING 1 // 接收包头中
-#define _PKG_BD_INIT 2	  // 包头刚好收完, 准备接收包体
-#define _PKG_BD_RECVING 3 // 接收包体中.
-
-#define _DATA_BUFSIZE_ 20 // 收包头用, 要求大于 sizeof(COMM_PKG_HEADER)
+#define _PKG_HD_INIT 0	  // 从收包缓冲区中解析包
+#define _PKG_BD_RECVING 3 // 大包, 包体直接收到消息内存中
 
 #pragma pack(1) // 所有在网络上传输的结构体, 必须都采用"1字节对齐"
 
@@ -1,6 +1,10 @@
 ﻿#ifndef __NGX_FUNC_H__
 #define __NGX_FUNC_H__
 
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
 // 函数声明放在这个头文件里
 
 // 字符串相关函数
@@ -17,15 +21,40 @@ void ngx_setproctitle(const char *title);
 void ngx_log_init();
 void ngx_log_stderr(int err, const char *fmt, ...);
 void ngx_log_error_core(int level, int err, const char *fmt, ...);
+
+// 先比较日志等级再调用 ngx_log_error_core(), 不写的日志不做任何格式化. 等级是常量并且大于 NGX_LOG_MAX_LEVEL 时, 整个调用被编译掉.
+// 热路径上(每个包/每个连接)的日志都用这个, 用到的文件要包含 ngx_macro.h 和 ngx_global.h
+#define ngx_log_error(level, err, ...)                                                  \
+    do                                                                                  \
+    {                                                                                   \
+        if ((level) <= NGX_LOG_MAX_LEVEL && (level) <= ngx_log.log_level)               \
+            ngx_log_error_core((level), (err), __VA_ARGS__);                            \
+    } while (0)
 u_char *ngx_log_errno(u_char *buf, u_char *last, int err);
+void ngx_log_async_init();
+void ngx_log_async_stop();
+void ngx_log_reopen();
+void ngx_log_reload();
 u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...);
 u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...);
 u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args);
 
+// 缓存的时钟
+
+void ngx_time_update();
+void ngx_time_fork_child();
+time_t ngx_time();
+uint64_t ngx_current_msec();
+const u_char *ngx_cached_log_time();
+
 // 和信号/主流程相关相关
 
 int ngx_init_signals();
 void ngx_master_process_cycle();
+void ngx_signal_worker_processes(int signo);
+void ngx_worker_process_exited(pid_t pid);
+void ngx_set_cpu_affinity(int inum);
+void ngx_pin_thread_cpu(pthread_t thread, int index);
 int ngx_daemon();
 void ngx_process_events_and_timers();
 
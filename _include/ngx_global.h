@@ -26,6 +26,7 @@ typedef struct
 {
 	int log_level; // 日志级别 或者日志类型，ngx_macro.h里分0-8共9个级别
 	int fd;		   // 日志文件描述符
+	int binary;	   // 1: 日志文件写成二进制格式(ngx_logbin.h), 配置项 LogBinary
 } ngx_log_t;
 
 // 外部全局量声明
@@ -44,6 +45,8 @@ extern pid_t ngx_parent;
 extern ngx_log_t ngx_log;
 extern int ngx_process;
 extern sig_atomic_t ngx_reap;
+extern sig_atomic_t ngx_reconfigure;
+extern sig_atomic_t ngx_quit;
 extern int g_stopEvent;
 
 #endif
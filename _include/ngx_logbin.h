@@ -0,0 +1,45 @@
+﻿
+#ifndef __NGX_LOGBIN_H__
+#define __NGX_LOGBIN_H__
+
+#include <stdint.h>
+
+// 二进制日志(配置项 LogBinary = 1)的文件格式. 写: app/ngx_log.cxx, 读: tools/ngx_logdecode.cxx
+// 日志文件由一条条记录组成, 每条记录以 ngx_logbin_head_t 开头, len是整条记录的长度(含记录头), 本机字节序.
+// (1) NGX_LOGBIN_FMT:   格式串定义, 某个格式串第一次用到时写一条, 记录头后面跟格式串内容(不含'\0');
+// (2) NGX_LOGBIN_EVENT: 一条日志, 只有格式串ID和原始参数, 写日志时不做格式化;
+// (3) NGX_LOGBIN_TEXT:  一条已经格式化好的日志(比如ngx_log_stderr()顺带写到日志文件的), 内容原样保存.
+// 格式串ID就是格式串的地址: worker进程是master进程fork()出来的, 同一个格式串地址相同; 重启后地址可能变了,
+// 所以再加上boot(ngx_log_init()时的进程id)区分是哪一次运行写的.
+//
+// 参数按格式串中的顺序紧挨着存放, 和 ngx_vslprintf() 取参数的规则一致:
+//     %d/%ud/%xd/%Xd: 4字节;  %P: 4字节;  %L/%uL: 8字节;  %f: 8字节(double);
+//     %s: 2字节长度 + 字符串内容(不含'\0');  %%及其他: 不占位置.
+
+#define NGX_LOGBIN_FMT 1
+#define NGX_LOGBIN_EVENT 2
+#define NGX_LOGBIN_TEXT 3
+
+#pragma pack(1)
+
+typedef struct
+{
+	uint16_t type;	// NGX_LOGBIN_FMT/NGX_LOGBIN_EVENT/NGX_LOGBIN_TEXT
+	uint16_t len;	// 整条记录的长度, 含记录头
+	int32_t boot;	// 哪一次运行写的
+	uint64_t fmtid; // 格式串ID, NGX_LOGBIN_TEXT 时为0
+} ngx_logbin_head_t;
+
+// NGX_LOGBIN_EVENT/NGX_LOGBIN_TEXT 的记录头, 后面跟参数或者格式化好的内容
+typedef struct
+{
+	ngx_logbin_head_t head;
+	int64_t sec;   // 时间(秒)
+	int32_t pid;   // 进程id
+	int32_t err;   // 错误码, 0表示不是错误
+	uint8_t level; // 日志等级
+} ngx_logbin_event_t;
+
+#pragma pack()
+
+#endif
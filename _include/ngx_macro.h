@@ -38,6 +38,12 @@
 #define NGX_LOG_INFO              7    // 信息
 #define NGX_LOG_DEBUG             8    // 调试, 最低级别
 
+// 编译期的日志等级上限, 等级数字比它大的 ngx_log_error() 调用整个被编译掉, 连参数都不会求值.
+// debug版为NGX_LOG_DEBUG(全保留), release版(config.mk中DEBUG不为true)在common.mk中定义为NGX_LOG_NOTICE.
+#ifndef NGX_LOG_MAX_LEVEL
+#define NGX_LOG_MAX_LEVEL         NGX_LOG_DEBUG
+#endif
+
 #define NGX_ERROR_LOG_PATH       "error.log"   // 日志文件路径, 仅在nginx.conf中未定义Log时有效. 
 
 // ----------------------
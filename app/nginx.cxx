@@ -34,15 +34,23 @@ CThreadPool g_threadpool; // 线程池全局对象
 // 和进程本身有关的全局量
 
 int g_daemonized = 0; // 守护进程标记，标记是否启用了守护进程模式，0：未启用，1：启用了
-int g_stopEvent;      // 整个程序退出的标识, 0不退出, 1退出, 未使用.
+int g_stopEvent;      // 整个程序退出的标识, 0不退出, 1退出. worker进程平滑退出时设置
 pid_t ngx_pid;        // 当前进程的pid
 pid_t ngx_parent;     // 父进程的pid
 int ngx_process;      // 进程类型, 比如master,worker进程等
 
-// 标记子进程状态变化, 一般是子进程发来SIGCHLD信号表示退出, 未使用.
+// 标记子进程状态变化, 一般是子进程发来SIGCHLD信号表示退出, master进程主流程看到后重新创建worker进程
 // 调用: ngx_signal_handler()[ngx_signal.cxx]
 sig_atomic_t ngx_reap;
 
+// 标记收到了SIGHUP, 要重新载入配置文件, master和worker进程都用
+// 调用: ngx_signal_handler()[ngx_signal.cxx]
+sig_atomic_t ngx_reconfigure;
+
+// 标记worker进程收到了SIGQUIT, 不再接受新连接, 处理完已有的连接后退出
+// 调用: ngx_signal_handler()[ngx_signal.cxx]
+sig_atomic_t ngx_quit;
+
 int main(int argc, char *const *argv)
 {
     int exitcode = 0; // 退出代码, 0表示正常退出, 1/-1表示异常, 2表示系统找不到指定文件, 如nginx.conf
@@ -50,6 +58,7 @@ int main(int argc, char *const *argv)
 
     // (1) 无伤大雅也不需要释放的放最上边
     g_stopEvent = 0;
+    ngx_time_update(); // 日志等要用缓存的时间
     ngx_pid = getpid();
     ngx_parent = getppid();
 
@@ -69,6 +78,8 @@ int main(int argc, char *const *argv)
     ngx_log.fd = -1; // -1: 表示日志文件尚未打开, 因为后边 ngx_log_stderr 要用, 所以这里先给-1
     ngx_process = NGX_PROCESS_MASTER;
     ngx_reap = 0;
+    ngx_reconfigure = 0;
+    ngx_quit = 0;
 
     // (2) 单例类初始化
     CConfig *p_config = CConfig::GetInstance();
@@ -101,7 +112,7 @@ int main(int argc, char *const *argv)
     ngx_init_setproctitle();
 
     // (5) 创建守护进程
-    if (p_config->GetIntDefault("Daemon", 0) == 1) // 1: 按守护进程方式运行
+    if (p_config->GetConf()->daemon == 1) // 1: 按守护进程方式运行
     {
         int cdaemonresult = ngx_daemon();
         if (cdaemonresult == -1) // fork()失败
@@ -133,7 +144,7 @@ lblexit:
 
 // 专门在程序执行末尾释放资源的函数
 // 1. 设置"可执行程序标题"为环境变量分配的内存
-// 2. 关闭日志文件
+// 2. 关闭日志文件(先停掉写日志线程, 让缓冲区中的日志都写出去)
 void freeresource()
 {
     // 1. 设置"可执行程序标题"为环境变量分配的内存
@@ -144,6 +155,7 @@ void freeresource()
     }
 
     // 2. 关闭日志文件
+    ngx_log_async_stop();
     if (ngx_log.fd != STDERR_FILENO && ngx_log.fd != -1)
     {
         close(ngx_log.fd);
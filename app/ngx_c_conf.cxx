@@ -1,6 +1,10 @@
 ﻿#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strcasecmp
+#include <stddef.h>  // offsetof
+#include <ctype.h>
+#include <errno.h>
 #include <vector>
 
 // --------------------------
@@ -10,10 +14,187 @@
 // 自定义头文件放下边, 因为g++中用了-I参数，所以这里用<>也可以
 #include "ngx_func.h"   //函数声明
 #include "ngx_c_conf.h" //和配置文件处理相关的类,名字带c_表示和类有关
+#include "ngx_macro.h"
 
 // 静态成员赋值
 CConfig *CConfig::m_instance = NULL;
 
+// 配置项的类型
+#define NGX_CONF_INT 0      // 整数
+#define NGX_CONF_BOOL 1     // 开关: 1/0, on/off, yes/no, true/false
+#define NGX_CONF_SIZE 2     // 大小: 数字可以带k/m/g后缀, unit是字段的单位(字节数)
+#define NGX_CONF_DURATION 3 // 时长: 数字可以带ms/s/m/h后缀, unit是字段的单位(毫秒数)
+#define NGX_CONF_STRING 4   // 字符串, unit是字段的长度
+
+// 重新载入配置文件(SIGHUP)时, 配置项的修改怎么生效
+#define NGX_CONF_RELOAD_INPLACE 0 // 各进程直接生效, 不影响已有的连接
+#define NGX_CONF_RELOAD_RESPAWN 1 // 按新配置创建新的worker进程, 老的worker进程处理完已有的连接后退出
+#define NGX_CONF_RELOAD_RESTART 2 // 要重启整个程序才生效, 重新载入时保持原来的值
+
+// 配置项表中的一项
+typedef struct
+{
+    const char *name; // 配置项名
+    int type;         // NGX_CONF_INT 等
+    int reload;       // NGX_CONF_RELOAD_INPLACE 等
+    size_t offset;    // 在ngx_conf_t中的位置
+    int64_t unit;     // 见配置项类型的说明
+    int64_t min;      // 合法范围(数字类的)
+    int64_t max;
+    int def;          // 缺省值(数字类的)
+    const char *sdef; // 缺省值(字符串类的)
+} ngx_conf_schema_t;
+
+#define NGX_CONF_FIELD(field) offsetof(ngx_conf_t, field)
+
+// 所有认识的配置项, 加配置项时在这里和 ngx_conf_t 中各加一行
+static const ngx_conf_schema_t ngx_conf_schema[] =
+    {
+        // 配置项名, 类型, 重新载入时怎么生效, 位置, 单位, 最小值, 最大值, 缺省值(数字类), 缺省值(字符串类)
+        {"Log", NGX_CONF_STRING, NGX_CONF_RELOAD_RESTART, NGX_CONF_FIELD(log), sizeof(((ngx_conf_t *)0)->log), 0, 0, 0, NGX_ERROR_LOG_PATH},
+        {"LogLevel", NGX_CONF_INT, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(log_level), 1, NGX_LOG_STDERR, NGX_LOG_DEBUG, NGX_LOG_NOTICE, NULL},
+        {"LogAsync", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(log_async), 1, 0, 1, 0, NULL},
+        {"LogBinary", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESTART, NGX_CONF_FIELD(log_binary), 1, 0, 1, 0, NULL},
+        {"LogRotateSize", NGX_CONF_SIZE, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(log_rotate_size), 1024 * 1024, 0, INT32_MAX, 0, NULL},
+        {"LogRotateInterval", NGX_CONF_DURATION, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(log_rotate_interval), 1000, 0, INT32_MAX, 0, NULL},
+
+        {"WorkerProcesses", NGX_CONF_INT, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(worker_processes), 1, 1, 1024, 1, NULL},
+        {"Daemon", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESTART, NGX_CONF_FIELD(daemon), 1, 0, 1, 0, NULL},
+        {"ProcMsgRecvWorkThreadCount", NGX_CONF_INT, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(recv_work_thread_count), 1, 1, 10000, 5, NULL},
+        {"ProcMsgRecvQueueSize", NGX_CONF_SIZE, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(recv_queue_size), 1, 1, 1 << 30, 65536, NULL},
+        {"ProcMsgOrderedDispatch", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(ordered_dispatch), 1, 0, 1, 0, NULL},
+        {"ProcWorkerShutdownTimeout", NGX_CONF_DURATION, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(worker_shutdown_timeout), 1000, 0, INT32_MAX, 60, NULL},
+        {"WorkerCpuAffinity", NGX_CONF_STRING, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(worker_cpu_affinity), sizeof(((ngx_conf_t *)0)->worker_cpu_affinity), 0, 0, 0, ""},
+
+        {"ListenPortCount", NGX_CONF_INT, NGX_CONF_RELOAD_RESTART, NGX_CONF_FIELD(listen_port_count), 1, 0, NGX_CONF_MAX_LISTEN, 1, NULL},
+        {"worker_connections", NGX_CONF_INT, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(worker_connections), 1, 1, INT32_MAX, 1, NULL},
+        {"Sock_ReactorCount", NGX_CONF_INT, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(reactor_count), 1, 0, 1024, 1, NULL},
+        {"Sock_EventBackend", NGX_CONF_STRING, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(event_backend), sizeof(((ngx_conf_t *)0)->event_backend), 0, 0, 0, "epoll"},
+        {"Sock_RecvBufSize", NGX_CONF_SIZE, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(recv_buf_size), 1, 0, 64 * 1024 * 1024, 8192, NULL},
+        {"Sock_ZeroCopyRecv", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(zero_copy_recv), 1, 0, 1, 0, NULL},
+        {"Sock_RecvCrcCheck", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(recv_crc_check), 1, 0, 1, 0, NULL},
+        {"Sock_EpollET", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(epoll_et), 1, 0, 1, 0, NULL},
+        {"Sock_EpollETBudget", NGX_CONF_INT, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(epoll_et_budget), 1, 0, INT32_MAX, 16, NULL},
+        {"Sock_WaitTimeEnable", NGX_CONF_BOOL, NGX_CONF_RELOAD_RESPAWN, NGX_CONF_FIELD(wait_time_enable), 1, 0, 1, 0, NULL},
+        {"Sock_MaxWaitTime", NGX_CONF_DURATION, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(max_wait_time), 1000, 0, INT32_MAX, 5, NULL},
+        {"Sock_TimeOutKick", NGX_CONF_BOOL, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(timeout_kick), 1, 0, 1, 0, NULL},
+
+        {"Sock_FloodAttackKickEnable", NGX_CONF_BOOL, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(flood_kick_enable), 1, 0, 1, 0, NULL},
+        {"Sock_FloodTimeInterval", NGX_CONF_DURATION, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(flood_time_interval), 1, 0, INT32_MAX, 100, NULL},
+        {"Sock_FloodKickCounter", NGX_CONF_INT, NGX_CONF_RELOAD_INPLACE, NGX_CONF_FIELD(flood_kick_counter), 1, 0, INT32_MAX, 10, NULL},
+
+        {NULL, 0, 0, 0, 0, 0, 0, 0, NULL} // 结束标记
+};
+
+// 配置项名转成小写, 作为m_ConfigItemMap的键, 查找就不区分大小写了
+static std::string ngx_conf_key(const char *p_itemname)
+{
+    std::string key(p_itemname);
+    for (size_t i = 0; i < key.size(); ++i)
+    {
+        key[i] = (char)tolower((unsigned char)key[i]);
+    }
+    return key;
+}
+
+// 解析一个数字, 后面可以跟后缀, 后缀在suffix表中找倍数(suffix为NULL表示不能带后缀). 成功返回true
+static bool ngx_conf_parse_number(const char *pvalue, const char *const *suffix, const int64_t *scale, int64_t defscale, int64_t &result)
+{
+    char *pend;
+    errno = 0;
+    long long value = strtoll(pvalue, &pend, 10);
+    if (pend == pvalue || errno == ERANGE)
+    {
+        return false;
+    }
+    while (*pend == ' ' || *pend == '\t')
+    {
+        pend++;
+    }
+
+    int64_t mul = defscale;
+    if (*pend != '\0')
+    {
+        if (suffix == NULL)
+        {
+            return false;
+        }
+        int i;
+        for (i = 0; suffix[i] != NULL; ++i)
+        {
+            if (strcasecmp(pend, suffix[i]) == 0)
+                break;
+        }
+        if (suffix[i] == NULL)
+        {
+            return false;
+        }
+        mul = scale[i];
+    }
+    if (value != 0 && (value > INT64_MAX / mul || value < INT64_MIN / mul))
+    {
+        return false;
+    }
+    result = (int64_t)value * mul;
+    return true;
+}
+
+// 按配置项表中的一项解析配置值, 写进pconf. 格式不对/超出范围返回false
+static bool ngx_conf_parse_item(const ngx_conf_schema_t *pschema, const char *pvalue, ngx_conf_t *pconf)
+{
+    static const char *const size_suffix[] = {"k", "m", "g", NULL};
+    static const int64_t size_scale[] = {1024, 1024 * 1024, 1024 * 1024 * 1024};
+    static const char *const duration_suffix[] = {"ms", "s", "m", "h", NULL};
+    static const int64_t duration_scale[] = {1, 1000, 60 * 1000, 3600 * 1000};
+
+    char *pfield = (char *)pconf + pschema->offset;
+    int64_t value;
+
+    switch (pschema->type)
+    {
+    case NGX_CONF_STRING:
+        if (strlen(pvalue) >= (size_t)pschema->unit)
+        {
+            return false;
+        }
+        strcpy(pfield, pvalue);
+        return true;
+
+    case NGX_CONF_BOOL:
+        if (strcmp(pvalue, "1") == 0 || strcasecmp(pvalue, "on") == 0 || strcasecmp(pvalue, "yes") == 0 || strcasecmp(pvalue, "true") == 0)
+            value = 1;
+        else if (strcmp(pvalue, "0") == 0 || strcasecmp(pvalue, "off") == 0 || strcasecmp(pvalue, "no") == 0 || strcasecmp(pvalue, "false") == 0)
+            value = 0;
+        else
+            return false;
+        break;
+
+    case NGX_CONF_SIZE: // 不带后缀时就是字段的单位; 换算成字段的单位除不尽的(比如字段按MB, 写了1500k)不合法, 不能悄悄截断
+        if (!ngx_conf_parse_number(pvalue, size_suffix, size_scale, pschema->unit, value) || value % pschema->unit != 0)
+            return false;
+        value /= pschema->unit;
+        break;
+
+    case NGX_CONF_DURATION: // 同上, 比如字段按秒, 写了500ms
+        if (!ngx_conf_parse_number(pvalue, duration_suffix, duration_scale, pschema->unit, value) || value % pschema->unit != 0)
+            return false;
+        value /= pschema->unit;
+        break;
+
+    default: // NGX_CONF_INT
+        if (!ngx_conf_parse_number(pvalue, NULL, NULL, 1, value))
+            return false;
+        break;
+    }
+
+    if (value < pschema->min || value > pschema->max)
+    {
+        return false;
+    }
+    *(int *)pfield = (int)value;
+    return true;
+}
+
 // 析构函数
 CConfig::~CConfig()
 {
@@ -23,6 +204,7 @@ CConfig::~CConfig()
         delete (*pos);
     }
     m_ConfigItemList.clear();
+    m_ConfigItemMap.clear();
     return;
 }
 
@@ -81,35 +263,158 @@ bool CConfig::Load(const char *pconfName)
             printf("%s=%s\n", p_confitem->ItemName, p_confitem->ItemContent);
 
             m_ConfigItemList.push_back(p_confitem);
+            if (m_ConfigItemMap.emplace(ngx_conf_key(p_confitem->ItemName), p_confitem).second == false)
+            {
+                ngx_log_stderr(0, "配置项[%s]重复出现, 以第一个为准.", p_confitem->ItemName);
+            }
         }
 
     } // while(!feof(fp))
 
     fclose(fp);
 
-    return true;
+    m_strConfName = pconfName;
+    return Resolve();
 }
 
-// 根据ItemName获取配置信息字符串，不修改不用互斥
-const char *CConfig::GetString(const char *p_itemname)
+// 重新载入配置文件(SIGHUP). 新的配置有错时全部报告出来, 继续用原来的配置.
+// 只能重启才生效的配置项(NGX_CONF_RELOAD_RESTART)有修改时提示一下, 保持原来的值.
+// 返回值: -1, 新配置有错, 没有载入; 0, 没有修改或者修改都能直接生效; 1, 有要新创建worker进程才能生效的修改.
+// 调用: ngx_master_process_cycle(), ngx_worker_process_cycle(), 此时没有别的线程在读配置项.
+int CConfig::Reload()
 {
-    std::vector<LPCConfItem>::iterator pos;
-    for (pos = m_ConfigItemList.begin(); pos != m_ConfigItemList.end(); ++pos)
+    std::vector<LPCConfItem> oldList;
+    std::unordered_map<std::string, LPCConfItem> oldMap;
+    ngx_conf_t oldConf = m_conf;
+    oldList.swap(m_ConfigItemList);
+    oldMap.swap(m_ConfigItemMap);
+
+    bool ok = Load(m_strConfName.c_str());
+    if (ok == false) // 恢复原来的配置
     {
-        if (strcasecmp((*pos)->ItemName, p_itemname) == 0)
-            return (*pos)->ItemContent;
+        for (auto pos = m_ConfigItemList.begin(); pos != m_ConfigItemList.end(); ++pos)
+        {
+            delete (*pos);
+        }
+        m_ConfigItemList.swap(oldList);
+        m_ConfigItemMap.swap(oldMap);
+        m_conf = oldConf;
+        return -1;
     }
-    return NULL;
+    for (auto pos = oldList.begin(); pos != oldList.end(); ++pos)
+    {
+        delete (*pos);
+    }
+
+    int result = 0;
+    for (const ngx_conf_schema_t *pschema = ngx_conf_schema; pschema->name != NULL; pschema++)
+    {
+        char *pnew = (char *)&m_conf + pschema->offset;
+        char *pold = (char *)&oldConf + pschema->offset;
+        size_t size = (pschema->type == NGX_CONF_STRING) ? (size_t)pschema->unit : sizeof(int);
+        if (memcmp(pnew, pold, size) == 0)
+        {
+            continue;
+        }
+
+        if (pschema->reload == NGX_CONF_RELOAD_RESTART)
+        {
+            ngx_log_error_core(NGX_LOG_WARN, 0, "配置项[%s]的修改要重启才能生效, 这次先忽略.", pschema->name);
+            memcpy(pnew, pold, size);
+        }
+        else if (pschema->reload == NGX_CONF_RELOAD_RESPAWN)
+        {
+            result = 1;
+        }
+    }
+    if (memcmp(m_conf.listen_ports, oldConf.listen_ports, sizeof(oldConf.listen_ports)) != 0) // 监听端口也一样
+    {
+        ngx_log_error_core(NGX_LOG_WARN, 0, "配置项[ListenPort]的修改要重启才能生效, 这次先忽略.");
+        memcpy(m_conf.listen_ports, oldConf.listen_ports, sizeof(oldConf.listen_ports));
+    }
+    return result;
 }
 
-// 根据ItemName获取数字类型配置信息，不修改不用互斥
-int CConfig::GetIntDefault(const char *p_itemname, const int def)
+// 按配置项表(ngx_conf_schema)把所有认识的配置项解析到m_conf中, 没配置的取缺省值.
+// 所有格式不对/超出范围的项都报告出来后返回false; 不认识的项只提示, 可能是写错了名字.
+bool CConfig::Resolve()
 {
+    bool result = true;
+    const ngx_conf_schema_t *pschema;
+
+    memset(&m_conf, 0, sizeof(m_conf)); // 字符串后面全是0, 重新载入时才能直接memcmp比较
+    for (pschema = ngx_conf_schema; pschema->name != NULL; pschema++)
+    {
+        const char *pvalue = GetString(pschema->name);
+        if (pvalue == NULL) // 没配置, 取缺省值
+        {
+            if (pschema->type == NGX_CONF_STRING)
+                strcpy((char *)&m_conf + pschema->offset, pschema->sdef);
+            else
+                *(int *)((char *)&m_conf + pschema->offset) = pschema->def;
+            continue;
+        }
+        if (ngx_conf_parse_item(pschema, pvalue, &m_conf) == false)
+        {
+            ngx_log_stderr(0, "配置项[%s = %s]的值不合法.", pschema->name, pvalue);
+            result = false;
+        }
+    }
+
+    // 监听端口: ListenPort0, ListenPort1, ... 共ListenPortCount个
+    char strinfo[100];
+    for (int i = 0; i < m_conf.listen_port_count; i++)
+    {
+        sprintf(strinfo, "ListenPort%d", i);
+        const char *pvalue = GetString(strinfo);
+        if (pvalue == NULL)
+        {
+            m_conf.listen_ports[i] = 10000;
+            continue;
+        }
+        int64_t port;
+        if (ngx_conf_parse_number(pvalue, NULL, NULL, 1, port) == false || port <= 0 || port > 65535)
+        {
+            ngx_log_stderr(0, "配置项[%s = %s]的值不合法.", strinfo, pvalue);
+            result = false;
+            continue;
+        }
+        m_conf.listen_ports[i] = (int)port;
+    }
+
+    // 不认识的配置项
     std::vector<LPCConfItem>::iterator pos;
     for (pos = m_ConfigItemList.begin(); pos != m_ConfigItemList.end(); ++pos)
     {
-        if (strcasecmp((*pos)->ItemName, p_itemname) == 0)
-            return atoi((*pos)->ItemContent);
+        const char *pname = (*pos)->ItemName;
+        for (pschema = ngx_conf_schema; pschema->name != NULL; pschema++)
+        {
+            if (strcasecmp(pschema->name, pname) == 0)
+                break;
+        }
+        if (pschema->name == NULL && strncasecmp(pname, "ListenPort", 10) != 0)
+        {
+            ngx_log_stderr(0, "不认识的配置项[%s], 忽略.", pname);
+        }
     }
-    return def;
+    return result;
+}
+
+// 根据ItemName获取配置信息字符串(不区分大小写)，不修改不用互斥
+// 认识的配置项请直接用GetConf()中解析好的字段
+const char *CConfig::GetString(const char *p_itemname)
+{
+    auto pos = m_ConfigItemMap.find(ngx_conf_key(p_itemname));
+    if (pos == m_ConfigItemMap.end())
+        return NULL;
+    return pos->second->ItemContent;
+}
+
+// 根据ItemName获取数字类型配置信息，不修改不用互斥
+int CConfig::GetIntDefault(const char *p_itemname, const int def)
+{
+    const char *pvalue = GetString(p_itemname);
+    if (pvalue == NULL)
+        return def;
+    return atoi(pvalue);
 }
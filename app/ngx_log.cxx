@@ -7,12 +7,17 @@
 #include <sys/time.h> // gettimeofday
 #include <time.h>     // localtime_r
 #include <fcntl.h>
+#include <sys/stat.h> // fstat
 #include <errno.h>
+#include <pthread.h>
+#include <atomic>
+#include <new> // placement new
 
 #include "ngx_global.h"
 #include "ngx_macro.h"
 #include "ngx_func.h"
 #include "ngx_c_conf.h"
+#include "ngx_logbin.h"
 
 // ---------------
 // 日志相关
@@ -34,6 +39,625 @@ static u_char err_levels[][20] =
 
 ngx_log_t ngx_log;
 
+// ---------------
+// 异步日志: 每个线程一个无锁环形缓冲区(单生产者单消费者), 日志格式化好后只拷贝进自己的缓冲区就返回,
+// 由后台写日志线程定期把所有缓冲区中的日志攒成一批, 一次write()写出去. 缓冲区满了就丢弃这条日志并计数, 不会阻塞调用者.
+// 配置项 LogAsync = 1 开启. 每个进程各有自己的写日志线程, master在ngx_master_process_cycle()开头, worker在ngx_worker_process_init()中启动.
+// 注意: 进程被信号直接杀掉时, 缓冲区中最后 NGX_LOG_FLUSH_INTERVAL 毫秒内的日志可能来不及写出.
+// ---------------
+
+#define NGX_LOG_RING_SIZE (256 * 1024) // 每个线程的日志缓冲区大小, 必须是2的幂
+#define NGX_LOG_MAX_RINGS 256		  // 最多这么多个线程有自己的缓冲区, 再多的线程同步写
+#define NGX_LOG_BATCH_SIZE (64 * 1024) // 写日志线程一次write()最多写这么多
+#define NGX_LOG_FLUSH_INTERVAL 10	  // 写日志线程没活干时睡眠的毫秒数
+
+#define NGX_LOG_TARGET_STDERR 0 // 写到标准错误
+#define NGX_LOG_TARGET_FILE 1	// 写到日志文件(ngx_log.fd)
+#define NGX_LOG_RECORD_WRAP 0xFFFF // 记录头中的len为此值表示缓冲区末尾剩下的放不下, 从头开始
+
+// 缓冲区中每条日志的记录头, 后面跟着日志内容, 整条记录按4字节对齐
+typedef struct
+{
+    uint16_t len;	 // 日志内容长度
+    uint16_t target; // NGX_LOG_TARGET_STDERR 或 NGX_LOG_TARGET_FILE
+} ngx_log_record_t;
+
+// 一个线程的日志缓冲区, 位置都是一直增长的, 用 & (NGX_LOG_RING_SIZE - 1) 得到下标
+typedef struct
+{
+    alignas(64) std::atomic<uint64_t> head; // 写入位置, 只有所属线程写
+    alignas(64) std::atomic<uint64_t> tail; // 读取位置, 只有写日志线程写
+    unsigned int generation;				// 属于哪一次 ngx_log_async_init(), fork()出来的子进程中继承下来的缓冲区作废
+    char *buf;
+} ngx_log_ring_t;
+
+static ngx_log_ring_t *s_logRings[NGX_LOG_MAX_RINGS]; // 所有线程的缓冲区
+static std::atomic<int> s_logRingCount(0);			   // 已经分配出去的个数
+static std::atomic<bool> s_logAsync(false);			   // 异步日志是否在运行
+static std::atomic<bool> s_logStop(false);			   // 让写日志线程退出
+static std::atomic<bool> s_logReopen(false);		   // 让写日志线程重新打开日志文件(SIGUSR1)
+static std::atomic<uint64_t> s_logDropCount(0);		   // 缓冲区满而丢弃的日志条数
+static unsigned int s_logGeneration = 0;
+static pthread_t s_logThread;
+static thread_local ngx_log_ring_t *t_logRing = NULL;
+static thread_local bool t_logWriting = false; // 本线程正在往缓冲区里放日志, 期间被信号打断, 信号处理函数中再写日志就不能用缓冲区
+
+static bool ngx_log_reopen_file();
+static void ngx_log_rotate_check(time_t now);
+
+// 取本线程的缓冲区, 第一次用时分配并登记, 登记满了返回NULL
+static ngx_log_ring_t *ngx_log_async_ring()
+{
+    ngx_log_ring_t *pRing = t_logRing;
+    if (pRing != NULL && pRing->generation == s_logGeneration)
+    {
+        return pRing;
+    }
+
+    int idx = s_logRingCount.fetch_add(1, std::memory_order_relaxed);
+    if (idx >= NGX_LOG_MAX_RINGS)
+    {
+        s_logRingCount.fetch_sub(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    void *pMem = NULL;
+    if (posix_memalign(&pMem, alignof(ngx_log_ring_t), sizeof(ngx_log_ring_t)) != 0) // new不保证按64字节对齐
+    {
+        return NULL; // 登记的位置空着, 写日志线程会跳过
+    }
+    pRing = new (pMem) ngx_log_ring_t;
+    pRing->head.store(0, std::memory_order_relaxed);
+    pRing->tail.store(0, std::memory_order_relaxed);
+    pRing->generation = s_logGeneration;
+    pRing->buf = new char[NGX_LOG_RING_SIZE];
+    __atomic_store_n(&s_logRings[idx], pRing, __ATOMIC_RELEASE); // 写日志线程看到指针时缓冲区已经初始化好了
+    t_logRing = pRing;
+    return pRing;
+}
+
+// 把一条日志拷贝进本线程的缓冲区, 缓冲区满了丢弃并计数. 本线程还没有缓冲区并且分配不到时返回false
+static bool ngx_log_async_put(int target, const u_char *pdata, size_t len)
+{
+    ngx_log_ring_t *pRing = ngx_log_async_ring();
+    if (pRing == NULL)
+    {
+        return false;
+    }
+
+    uint64_t head = pRing->head.load(std::memory_order_relaxed);
+    uint64_t tail = pRing->tail.load(std::memory_order_acquire);
+    size_t need = (sizeof(ngx_log_record_t) + len + 3) & ~(size_t)3;
+    size_t offset = head & (NGX_LOG_RING_SIZE - 1);
+    size_t skip = (NGX_LOG_RING_SIZE - offset < need) ? (NGX_LOG_RING_SIZE - offset) : 0; // 末尾放不下, 跳到开头
+
+    if (head + skip + need - tail > NGX_LOG_RING_SIZE) // 满了, 丢弃
+    {
+        s_logDropCount.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    ngx_log_record_t *pRecord;
+    if (skip > 0)
+    {
+        pRecord = (ngx_log_record_t *)(pRing->buf + offset);
+        pRecord->len = NGX_LOG_RECORD_WRAP;
+        offset = 0;
+    }
+    pRecord = (ngx_log_record_t *)(pRing->buf + offset);
+    pRecord->len = (uint16_t)len;
+    pRecord->target = (uint16_t)target;
+    memcpy(pRecord + 1, pdata, len);
+
+    pRing->head.store(head + skip + need, std::memory_order_release);
+    return true;
+}
+
+// 把一条日志放入本线程的缓冲区.
+// 信号处理函数中也会写日志: 如果打断的正是本线程往缓冲区里放日志(或者分配缓冲区)的过程, 缓冲区只有一个生产者的前提就不成立了,
+// 这时返回false让调用者直接write(), 这条日志可能比缓冲区中的日志先写出去.
+// 返回值: true, 已经交给写日志线程了(或者缓冲区满了丢弃了); false, 没开启异步日志或者重入了, 调用者自己同步写
+static bool ngx_log_async_write(int target, const u_char *pdata, size_t len)
+{
+    if (s_logAsync.load(std::memory_order_acquire) == false || t_logWriting)
+    {
+        return false;
+    }
+    t_logWriting = true;
+    std::atomic_signal_fence(std::memory_order_seq_cst); // 标记一定在碰缓冲区之前
+
+    bool bQueued = ngx_log_async_put(target, pdata, len);
+
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    t_logWriting = false;
+    return bQueued;
+}
+
+// 写日志线程中, 把攒好的一批写出去. 失败时的处理和同步写时一样
+static void ngx_log_async_flush(int target, u_char *pbatch, size_t &len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    int fd = (target == NGX_LOG_TARGET_STDERR) ? STDERR_FILENO : ngx_log.fd;
+    ssize_t n = write(fd, pbatch, len);
+    if (n == -1 && errno != ENOSPC && fd != STDERR_FILENO)
+    {
+        n = write(STDERR_FILENO, pbatch, len);
+    }
+    len = 0;
+}
+
+// 取出所有缓冲区中的日志, 按目标攒成批写出去, 返回取出的条数
+static int ngx_log_async_drain(u_char *pbatch[2], size_t batchlen[2])
+{
+    int count = 0;
+    int ringCount = s_logRingCount.load(std::memory_order_acquire);
+    if (ringCount > NGX_LOG_MAX_RINGS)
+    {
+        ringCount = NGX_LOG_MAX_RINGS;
+    }
+
+    for (int i = 0; i < ringCount; ++i)
+    {
+        ngx_log_ring_t *pRing = __atomic_load_n(&s_logRings[i], __ATOMIC_ACQUIRE);
+        if (pRing == NULL) // 刚分配了位置, 还没登记完
+        {
+            continue;
+        }
+
+        uint64_t tail = pRing->tail.load(std::memory_order_relaxed);
+        uint64_t head = pRing->head.load(std::memory_order_acquire);
+        while (tail < head)
+        {
+            size_t offset = tail & (NGX_LOG_RING_SIZE - 1);
+            ngx_log_record_t *pRecord = (ngx_log_record_t *)(pRing->buf + offset);
+            if (pRecord->len == NGX_LOG_RECORD_WRAP)
+            {
+                tail += NGX_LOG_RING_SIZE - offset;
+                continue;
+            }
+
+            int target = pRecord->target;
+            if (batchlen[target] + pRecord->len > NGX_LOG_BATCH_SIZE)
+            {
+                ngx_log_async_flush(target, pbatch[target], batchlen[target]);
+            }
+            memcpy(pbatch[target] + batchlen[target], pRecord + 1, pRecord->len);
+            batchlen[target] += pRecord->len;
+
+            tail += (sizeof(ngx_log_record_t) + pRecord->len + 3) & ~(size_t)3;
+            ++count;
+        }
+        pRing->tail.store(tail, std::memory_order_release);
+    }
+
+    ngx_log_async_flush(NGX_LOG_TARGET_STDERR, pbatch[NGX_LOG_TARGET_STDERR], batchlen[NGX_LOG_TARGET_STDERR]);
+    ngx_log_async_flush(NGX_LOG_TARGET_FILE, pbatch[NGX_LOG_TARGET_FILE], batchlen[NGX_LOG_TARGET_FILE]);
+    return count;
+}
+
+// 写日志线程: 没日志可写时睡 NGX_LOG_FLUSH_INTERVAL 毫秒, 生产者那边不需要任何唤醒操作.
+// 有日志被丢弃时, 自己记一条日志说明丢了多少. 日志文件的重新打开/轮转也在这里做, 不影响写日志的线程.
+static void *ngx_log_async_thread(void *)
+{
+    u_char *pbatch[2];
+    size_t batchlen[2] = {0, 0};
+    pbatch[NGX_LOG_TARGET_STDERR] = new u_char[NGX_LOG_BATCH_SIZE];
+    pbatch[NGX_LOG_TARGET_FILE] = new u_char[NGX_LOG_BATCH_SIZE];
+    uint64_t reportedDrop = 0;
+    time_t lastCheck = 0;
+
+    while (s_logStop.load(std::memory_order_acquire) == false)
+    {
+        int count = ngx_log_async_drain(pbatch, batchlen);
+
+        ngx_time_update(); // master进程的缓存时钟平时只在收到信号时才更新, 这里顺便更新, 日志时间和轮转都要用
+        time_t now = ngx_time();
+        if (s_logReopen.exchange(false))
+        {
+            ngx_log_reopen_file();
+        }
+        else if (now != lastCheck) // 每秒检查一次是否要轮转
+        {
+            lastCheck = now;
+            ngx_log_rotate_check(now);
+        }
+
+        uint64_t drop = s_logDropCount.load(std::memory_order_relaxed);
+        if (drop != reportedDrop)
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, 0, "日志缓冲区满, 丢弃了%uL条日志, 累计丢弃%uL条.", drop - reportedDrop, drop);
+            reportedDrop = drop;
+            continue;
+        }
+
+        if (count == 0)
+        {
+            usleep(NGX_LOG_FLUSH_INTERVAL * 1000);
+        }
+    }
+    ngx_log_async_drain(pbatch, batchlen); // 退出前最后写一次
+
+    delete[] pbatch[NGX_LOG_TARGET_STDERR];
+    delete[] pbatch[NGX_LOG_TARGET_FILE];
+    return NULL;
+}
+
+// 启动本进程的写日志线程(配置项 LogAsync = 1 时).
+// fork()出来的子进程中写日志线程不存在了, 从父进程继承下来的缓冲区也作废(里面的日志父进程会写), 重新开始.
+// 调用: ngx_master_process_cycle(), ngx_worker_process_init()
+void ngx_log_async_init()
+{
+    // 继承下来的s_logAsync可能是true(master进程开着异步日志, SIGHUP重载时改成了LogAsync = 0, 再fork出新的worker进程),
+    // 不先清掉的话, 子进程的日志都会放进没有线程去写的缓冲区
+    s_logAsync = false;
+    if (CConfig::GetInstance()->GetConf()->log_async != 1)
+    {
+        return;
+    }
+
+    s_logStop = false;
+    ++s_logGeneration;
+    for (int i = 0; i < NGX_LOG_MAX_RINGS; ++i)
+    {
+        s_logRings[i] = NULL; // 继承下来的内存就不释放了
+    }
+    s_logRingCount = 0;
+    s_logDropCount = 0;
+
+    int err = pthread_create(&s_logThread, NULL, ngx_log_async_thread, NULL);
+    if (err != 0)
+    {
+        ngx_log_stderr(err, "ngx_log_async_init()中pthread_create()失败, 日志改为同步写.");
+        return;
+    }
+    s_logAsync = true;
+}
+
+// 停止写日志线程, 缓冲区中的日志都写出去, 之后的日志同步写
+// 调用: freeresource(), ngx_worker_process_exit(), 以及worker进程中出错直接exit()之前
+void ngx_log_async_stop()
+{
+    if (s_logAsync == false)
+    {
+        return;
+    }
+    s_logAsync = false;
+    s_logStop = true;
+    pthread_join(s_logThread, NULL);
+}
+
+// 把一条日志直接write()到日志文件, 不经过缓冲区
+static void ngx_log_file_write_direct(const u_char *pdata, size_t len)
+{
+    ssize_t n = write(ngx_log.fd, pdata, len);
+    if (-1 == n)
+    {
+        if (errno == ENOSPC)
+        {
+            // TODO: 磁盘没有空间了
+        }
+        else
+        {
+            if (ngx_log.fd != STDERR_FILENO)
+            {
+                n = write(STDERR_FILENO, pdata, len);
+            }
+        }
+    }
+}
+
+// 把一条日志写到日志文件: 开了异步日志就交给写日志线程, 否则直接write()
+static void ngx_log_file_write(const u_char *pdata, size_t len)
+{
+    if (ngx_log_async_write(NGX_LOG_TARGET_FILE, pdata, len) == true)
+    {
+        return; // 交给写日志线程了
+    }
+    ngx_log_file_write_direct(pdata, len);
+}
+
+// ---------------
+// 二进制日志: 配置项 LogBinary = 1 开启. 写日志文件时不调用ngx_vslprintf()格式化, 只写格式串ID和原始参数,
+// 格式串本身只在第一次用到时写一次, 文件格式见 ngx_logbin.h, 用 tools/ngx_logdecode 还原成文本.
+// 只影响日志文件, 标准错误上的输出还是文本.
+// ---------------
+
+#define NGX_LOGBIN_FMT_SLOTS 4096 // 记录哪些格式串已经写过定义, 必须是2的幂. 满了以后没登记上的格式串每次都写定义, 不影响解码
+
+static std::atomic<const char *> s_logFmtSeen[NGX_LOGBIN_FMT_SLOTS]; // 开放寻址的哈希表, 只增不删, 用CAS占位置
+static int32_t s_logBoot = 0;										  // 区分是哪一次运行写的日志, ngx_log_init()时的进程id
+
+// 格式串是否第一次用到, 是的话调用者要先写一条格式串定义
+static bool ngx_log_binary_fmt_new(const char *fmt)
+{
+    size_t slot = (size_t)(((uint64_t)(uintptr_t)fmt * 0x9E3779B97F4A7C15ULL) >> 32);
+    for (int i = 0; i < NGX_LOGBIN_FMT_SLOTS; ++i, ++slot)
+    {
+        std::atomic<const char *> &seen = s_logFmtSeen[slot & (NGX_LOGBIN_FMT_SLOTS - 1)];
+        const char *cur = seen.load(std::memory_order_acquire);
+        if (cur == NULL && seen.compare_exchange_strong(cur, fmt, std::memory_order_acq_rel))
+        {
+            return true;
+        }
+        if (cur == fmt) // 已经登记过(可能是刚被别的线程抢先登记的)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 填写日志记录头
+static void ngx_log_binary_head(ngx_logbin_event_t *pEvent, int type, int level, int err, const char *fmt)
+{
+    pEvent->head.type = (uint16_t)type;
+    pEvent->head.len = sizeof(ngx_logbin_event_t);
+    pEvent->head.boot = s_logBoot;
+    pEvent->head.fmtid = (uint64_t)(uintptr_t)fmt;
+    pEvent->sec = (int64_t)ngx_time();
+    pEvent->pid = (int32_t)ngx_pid;
+    pEvent->err = err;
+    pEvent->level = (uint8_t)level;
+}
+
+// 按 ngx_vslprintf() 的规则遍历fmt, 把对应的参数原样拷贝进begin. 放不下时%s截断, 其他参数不再往后放.
+static u_char *ngx_log_binary_args(u_char *begin, u_char *end, const char *fmt, va_list args)
+{
+    while (*fmt)
+    {
+        if (*fmt++ != '%')
+        {
+            continue;
+        }
+
+        while (*fmt >= '0' && *fmt <= '9') // 宽度, 解码时从格式串中取
+        {
+            fmt++;
+        }
+        switch (*fmt)
+        {
+        case 'u':
+        case 'x':
+        case 'X':
+            fmt++;
+            break;
+        case '.':
+            fmt++;
+            while (*fmt >= '0' && *fmt <= '9')
+            {
+                fmt++;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch (*fmt)
+        {
+        case 'd':
+        {
+            int32_t value = va_arg(args, int); // %ud也是4字节, 解码时按格式串再区分有无符号
+            if (begin + sizeof(value) > end)
+                return begin;
+            begin = ngx_cpymem(begin, &value, sizeof(value));
+            break;
+        }
+        case 'P':
+        {
+            int32_t value = va_arg(args, pid_t);
+            if (begin + sizeof(value) > end)
+                return begin;
+            begin = ngx_cpymem(begin, &value, sizeof(value));
+            break;
+        }
+        case 'L':
+        {
+            int64_t value = va_arg(args, int64_t);
+            if (begin + sizeof(value) > end)
+                return begin;
+            begin = ngx_cpymem(begin, &value, sizeof(value));
+            break;
+        }
+        case 'f':
+        {
+            double value = va_arg(args, double);
+            if (begin + sizeof(value) > end)
+                return begin;
+            begin = ngx_cpymem(begin, &value, sizeof(value));
+            break;
+        }
+        case 's':
+        {
+            const char *p = va_arg(args, const char *);
+            if (begin + sizeof(uint16_t) > end)
+                return begin;
+            size_t len = strlen(p);
+            if (len > (size_t)(end - begin) - sizeof(uint16_t))
+            {
+                len = (size_t)(end - begin) - sizeof(uint16_t);
+            }
+            uint16_t len16 = (uint16_t)len;
+            begin = ngx_cpymem(begin, &len16, sizeof(len16));
+            begin = ngx_cpymem(begin, p, len);
+            break;
+        }
+        case '\0':
+            return begin;
+        default: // %%等, 没有参数
+            break;
+        }
+        fmt++;
+    }
+    return begin;
+}
+
+// 在buf中组织一条格式串定义记录, 返回记录长度. buf大小为NGX_MAX_ERROR_STR, 格式串太长就截断
+static size_t ngx_log_binary_fmt_def(u_char *buf, const char *fmt)
+{
+    ngx_logbin_head_t *pHead = (ngx_logbin_head_t *)buf;
+    size_t len = strlen(fmt);
+    if (len > NGX_MAX_ERROR_STR - sizeof(ngx_logbin_head_t))
+    {
+        len = NGX_MAX_ERROR_STR - sizeof(ngx_logbin_head_t);
+    }
+    pHead->type = NGX_LOGBIN_FMT;
+    pHead->len = (uint16_t)(sizeof(ngx_logbin_head_t) + len);
+    pHead->boot = s_logBoot;
+    pHead->fmtid = (uint64_t)(uintptr_t)fmt;
+    memcpy(pHead + 1, fmt, len);
+    return pHead->len;
+}
+
+// 以二进制格式写一条日志, 格式串第一次用到时先写它的定义.
+// 定义总是直接write(), 不经过缓冲区: 格式串一登记就不会再写定义了, 放进缓冲区的话, 缓冲区满了被丢弃, 以后这个格式串的日志就都解不出来.
+// 每个格式串只写一次, 同步写的开销可以忽略. 这样定义也总在用到它的日志之前进文件.
+static void ngx_log_binary_event(int level, int err, const char *fmt, va_list args)
+{
+    u_char buf[NGX_MAX_ERROR_STR];
+    u_char *end = buf + NGX_MAX_ERROR_STR;
+
+    if (ngx_log_binary_fmt_new(fmt))
+    {
+        ngx_log_file_write_direct(buf, ngx_log_binary_fmt_def(buf, fmt));
+    }
+
+    ngx_logbin_event_t *pEvent = (ngx_logbin_event_t *)buf;
+    ngx_log_binary_head(pEvent, NGX_LOGBIN_EVENT, level, err, fmt);
+    u_char *begin = ngx_log_binary_args((u_char *)(pEvent + 1), end, fmt, args);
+    pEvent->head.len = (uint16_t)(begin - buf);
+    ngx_log_file_write(buf, begin - buf);
+}
+
+// 以二进制格式写一条已经格式化好的日志(不含末尾的'\n')
+static void ngx_log_binary_text(int level, const u_char *ptext, size_t len)
+{
+    u_char buf[NGX_MAX_ERROR_STR];
+    if (len > NGX_MAX_ERROR_STR - sizeof(ngx_logbin_event_t))
+    {
+        len = NGX_MAX_ERROR_STR - sizeof(ngx_logbin_event_t);
+    }
+
+    ngx_logbin_event_t *pEvent = (ngx_logbin_event_t *)buf;
+    ngx_log_binary_head(pEvent, NGX_LOGBIN_TEXT, level, 0, NULL);
+    memcpy(pEvent + 1, ptext, len);
+    pEvent->head.len = (uint16_t)(sizeof(ngx_logbin_event_t) + len);
+    ngx_log_file_write(buf, pEvent->head.len);
+}
+
+// ---------------
+// 日志文件的重新打开和轮转:
+// (1) 收到SIGUSR1时重新打开日志文件(同官方nginx), master进程会把信号转发给worker进程. 外部的logrotate把文件改名后发这个信号即可;
+// (2) 开启异步日志时, 写日志线程每秒检查一次: 日志文件被改名/删除了就重新打开; master进程还按大小(LogRotateSize)/时间(LogRotateInterval)自己轮转.
+// 重新打开时先open()新文件, 再dup2()到ngx_log.fd上, fd的值不变, 其他线程正在进行的write()写完旧文件后自然就写到新文件, 不需要加锁.
+// ---------------
+
+static char s_logPath[500];			// 日志文件路径
+static int64_t s_logRotateSize = 0;	// 日志文件超过这么多字节就轮转, 0: 不按大小轮转
+static int s_logRotateInterval = 0; // 日志文件打开超过这么多秒就轮转, 0: 不按时间轮转
+static time_t s_logOpenTime = 0;	// 当前日志文件的打开时间
+
+// 重新打开日志文件, 失败就继续写原来的文件.
+// 只用了open/dup2/close/write这些可以在信号处理函数中调用的系统调用.
+static bool ngx_log_reopen_file()
+{
+    if (ngx_log.fd == STDERR_FILENO) // 日志文件一开始就没打开
+    {
+        return false;
+    }
+
+    int fd = open(s_logPath, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (-1 == fd)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "重新打开日志文件[%s]失败, 继续写原来的文件.", s_logPath);
+        return false;
+    }
+    dup2(fd, ngx_log.fd);
+    close(fd);
+    s_logOpenTime = time(NULL);
+
+    // 二进制日志: 已经登记过的格式串, 定义都写在旧文件里了, 而缓冲区中还没写出的日志, 以及别的线程以后的日志, 都会写进新文件.
+    // 所以不清空登记表, 而是在新文件开头把登记过的定义全部再写一遍(同ngx_log_binary_event(), 直接write, 不经过缓冲区).
+    // 和别的线程正在登记的格式串同时发生时: 登记在这里遍历之前的, 这里会写; 之后的, 它自己的定义已经写到新文件了(dup2在前). 两边都写了也没关系, 解码时重复的定义只算一个.
+    if (ngx_log.binary)
+    {
+        u_char buf[NGX_MAX_ERROR_STR];
+        for (int i = 0; i < NGX_LOGBIN_FMT_SLOTS; ++i)
+        {
+            const char *fmt = s_logFmtSeen[i].load(std::memory_order_acquire);
+            if (fmt != NULL)
+            {
+                write(ngx_log.fd, buf, ngx_log_binary_fmt_def(buf, fmt));
+            }
+        }
+    }
+    return true;
+}
+
+// 写日志线程每秒调用一次.
+// (1) 日志文件路径指向的已经不是正在写的文件(master进程轮转了, 或者被logrotate改名/删除了), 重新打开;
+// (2) master进程按大小/时间轮转: 当前文件改名为"文件名.年月日-时分秒", 再重新打开.
+//     只让master进程改名, 免得几个进程同时改名把刚建出来的新文件又改掉, worker进程靠(1)在1秒内跟着换到新文件.
+static void ngx_log_rotate_check(time_t now)
+{
+    if (ngx_log.fd == STDERR_FILENO)
+    {
+        return;
+    }
+
+    struct stat fdstat, pathstat;
+    if (fstat(ngx_log.fd, &fdstat) == -1)
+    {
+        return;
+    }
+    if (stat(s_logPath, &pathstat) == -1 || pathstat.st_ino != fdstat.st_ino || pathstat.st_dev != fdstat.st_dev)
+    {
+        ngx_log_reopen_file();
+        return;
+    }
+
+    if (ngx_process != NGX_PROCESS_MASTER || fdstat.st_size == 0)
+    {
+        return;
+    }
+    bool bysize = (s_logRotateSize > 0 && fdstat.st_size >= s_logRotateSize);
+    bool bytime = (s_logRotateInterval > 0 && now - s_logOpenTime >= s_logRotateInterval);
+    if (!bysize && !bytime)
+    {
+        return;
+    }
+
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char newpath[600];
+    u_char *p = ngx_slprintf((u_char *)newpath, (u_char *)newpath + sizeof(newpath) - 1, "%s.%4d%02d%02d-%02d%02d%02d",
+                             s_logPath, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    *p = 0;
+    if (rename(s_logPath, newpath) == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "日志文件轮转失败, rename()到[%s]失败.", newpath);
+        s_logOpenTime = now; // 按时间轮转的话, 过一个周期再试
+        return;
+    }
+    ngx_log_reopen_file();
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "日志文件已轮转, 原来的日志改名为[%s].", newpath);
+}
+
+// 重新打开日志文件, 收到SIGUSR1时在信号处理函数中调用.
+// 有写日志线程时只做个标记, 由写日志线程去做; 否则直接做.
+void ngx_log_reopen()
+{
+    if (s_logAsync.load(std::memory_order_acquire))
+    {
+        s_logReopen = true;
+    }
+    else
+    {
+        ngx_log_reopen_file();
+    }
+}
+
 // void ngx_log_stderr(int err, const char *fmt, ...)
 // {
 //     va_list args;
@@ -105,7 +729,10 @@ void ngx_log_stderr(int err, const char *fmt, ...)
     }
     *begin++ = '\n';
 
-    write(STDERR_FILENO, errstr, begin - errstr);
+    if (ngx_log_async_write(NGX_LOG_TARGET_STDERR, errstr, begin - errstr) == false)
+    {
+        write(STDERR_FILENO, errstr, begin - errstr);
+    }
 
     // TODO
     if (ngx_log.fd > STDERR_FILENO) //如果这是个有效的日志文件，本条件肯定成立，此时也才有意义将这个信息写到日志文件
@@ -114,7 +741,14 @@ void ngx_log_stderr(int err, const char *fmt, ...)
         err = 0; //不要再次把错误信息弄到字符串里，否则字符串里重复了
         begin--;
         *begin = 0; //把原来末尾的\n干掉，因为到ngx_log_err_core中还会加这个\n
-        ngx_log_error_core(NGX_LOG_STDERR, err, (const char *)errstr);
+        if (ngx_log.binary)
+        {
+            ngx_log_binary_text(NGX_LOG_STDERR, errstr, begin - errstr); // errstr是格式化好的内容, 不能当格式串登记
+        }
+        else
+        {
+            ngx_log_error_core(NGX_LOG_STDERR, err, (const char *)errstr);
+        }
     }
 
     return;
@@ -266,33 +900,31 @@ u_char *ngx_log_errno(u_char *begin, u_char *end, int err)
 // }
 
 // 描述: 向日志文件中写日志, fmt不必要加'\n', 函数自己会加. 日志的格式: 时间-日志等级-pid-fmt内容-错误信息
-// 参数level: 日志等级, 如果这个数字比nginx.conf中的LogLevel大(不重要), 就不会写入.
+// 参数level: 日志等级, 如果这个数字比nginx.conf中的LogLevel大(不重要), 就不会写入, 在做任何格式化之前就返回.
 // 参数err: 错误码, 如果不是0, 就转换成对应的错误信息, 一起写到日志文件中.
+// 热路径上用 ngx_log_error() 宏, 连这次函数调用都省掉.
 void ngx_log_error_core(int level, int err, const char *fmt, ...)
 {
+    if (level > ngx_log.log_level)
+    {
+        return; // 当前的这个日志等级不重要, 就不写入了.
+    }
+
+    va_list args;
+    if (ngx_log.binary) // 二进制日志, 不做格式化
+    {
+        va_start(args, fmt);
+        ngx_log_binary_event(level, err, fmt, args);
+        va_end(args);
+        return;
+    }
+
     u_char errstr[NGX_MAX_ERROR_STR] = {0};
     u_char *begin = errstr;                   // 指向第一个位置
     u_char *end = errstr + NGX_MAX_ERROR_STR; // 指向最后一个位置的下一个位置
 
-    // 时间
-    struct timeval tv;
-    struct tm tm;
-    time_t sec;
-
-    memset(&tv, 0, sizeof(tv));
-    memset(&tm, 0, sizeof(tm));
-
-    gettimeofday(&tv, NULL); // 获取当前时间, 自1970-01-01 00:00:00到现在经历的秒数
-    sec = tv.tv_sec;
-    localtime_r(&sec, &tm); // 把sec转换为本地时间, 保存到tm中去. 带_r的是线程安全的版本
-    tm.tm_mon++;            // 月份调整
-    tm.tm_year += 1900;     // 年份调整
-
-    u_char strcurtime[40] = {0}; // 组合出一个当前时间字符串, 格式: 2019/01/08 19:57:11
-    ngx_slprintf(strcurtime,
-                 (u_char *)-1,                    // 0xffff ffff ffff ffff, 没什么实际作用, 就是足够大的指针, 因为此处写入固定大小的字符, 人为控制不会越界接可以了.
-                 "%04d/%02d/%02d %02d:%02d:%02d", // 格式: 年/月/日 时:分:秒
-                 tm.tm_year, tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    // 时间, 用缓存好的字符串(ngx_time_update), 格式: 2019/01/08 19:57:11
+    const u_char *strcurtime = ngx_cached_log_time();
 
     // 拷贝 时间/日志等级/pid
     begin = ngx_cpymem(begin, strcurtime, strlen((const char *)strcurtime));
@@ -300,7 +932,6 @@ void ngx_log_error_core(int level, int err, const char *fmt, ...)
     begin = ngx_slprintf(begin, end, "%P: ", ngx_pid);
 
     // 解析fmt/...
-    va_list args;
     va_start(args, fmt);
     begin = ngx_vslprintf(begin, end, fmt, args);
     va_end(args);
@@ -316,35 +947,7 @@ void ngx_log_error_core(int level, int err, const char *fmt, ...)
     }
     *begin++ = '\n';
 
-    size_t n;
-    while (1)
-    {
-        if (level > ngx_log.log_level)
-        {
-            // 当前的这个日志等级不重要, 就不写入了.
-            break;
-        }
-
-        n = write(ngx_log.fd, errstr, begin - errstr);
-        if (-1 == n)
-        {
-            // ngx_log_errno(begin, end, errno); //
-
-            if (errno == ENOSPC)
-            {
-                // TODO: 磁盘没有空间了
-            }
-            else
-            {
-                if (ngx_log.fd != STDERR_FILENO)
-                {
-                    n = write(STDERR_FILENO, errstr, begin - errstr);
-                }
-            }
-        }
-        break;
-    }
-
+    ngx_log_file_write(errstr, begin - errstr);
     return;
 }
 
@@ -377,28 +980,42 @@ void ngx_log_error_core(int level, int err, const char *fmt, ...)
 // 日志文件(ngx_log)初始化. 
 // 注意: 此处有open对应的close在main()最后的free_resource()中.
 // (1) 读取配置文件(nginx.conf)中的Log项(日志文件路径)和LogLevel项(日志等级);
-// (2) 打开日志文件, 获得fd并赋值给ngx_log.fd.
+// (2) 打开日志文件, 获得fd并赋值给ngx_log.fd;
+// (3) 读取LogBinary项(是否写二进制日志), LogRotateSize/LogRotateInterval项(日志轮转).
 void ngx_log_init()
 {
-    const char *p_logpath = NULL;
-
-    // (1) 读取配置文件(nginx.conf)中的日志文件路径(Log)和日志等级(LogLevel);
-    CConfig *p_cnofig = CConfig::GetInstance();
-    p_logpath = p_cnofig->GetString("Log");
-    if (NULL == p_logpath)
-    {
-        p_logpath = (const char *)NGX_ERROR_LOG_PATH;
-    }
-    ngx_log.log_level = p_cnofig->GetIntDefault("LogLevel", NGX_LOG_NOTICE); // 缺省日志等级为NOTIC
+    // (1) 读取配置文件(nginx.conf)中的日志文件路径(Log)和日志等级(LogLevel), 没配置时分别为NGX_ERROR_LOG_PATH和NGX_LOG_NOTICE;
+    const ngx_conf_t *pconf = CConfig::GetInstance()->GetConf();
+    const char *p_logpath = pconf->log;
+    ngx_log.log_level = pconf->log_level;
 
     // (2) 打开日志文件, 获得fd.
     // O_DIRECT: 绕过内和缓冲区, write()成功则写磁盘必然成功, 但效率可能会比较低.
     // ngx_log.fd = open((const char *)plogname, O_WRONLY | O_APPEND | O_CREAT | O_DIRECT, 0644);
+    strncpy(s_logPath, p_logpath, sizeof(s_logPath) - 1); // 重新打开时要用
+    s_logOpenTime = time(NULL);
     ngx_log.fd = open(p_logpath, O_WRONLY | O_APPEND | O_CREAT, 0644);
     if (-1 == ngx_log.fd)
     {
         ngx_log_stderr(errno, "[alter] could not open log file [%s]", p_logpath);
         ngx_log.fd = STDERR_FILENO; // 直接定位到标准错误去了
     }
+
+    // (3) 二进制日志, 日志文件没打开(写到标准错误)时不用
+    ngx_log.binary = (pconf->log_binary == 1 && ngx_log.fd != STDERR_FILENO) ? 1 : 0;
+    s_logBoot = (int32_t)getpid();
+
+    // (4) 日志轮转, 要开启异步日志(由写日志线程做)
+    s_logRotateSize = (int64_t)pconf->log_rotate_size * 1024 * 1024;
+    s_logRotateInterval = pconf->log_rotate_interval;
     return;
 }
+
+// 重新载入配置文件(SIGHUP)后调用, 日志等级和轮转条件直接生效; 日志文件路径/二进制日志要重启才生效.
+void ngx_log_reload()
+{
+    const ngx_conf_t *pconf = CConfig::GetInstance()->GetConf();
+    ngx_log.log_level = pconf->log_level;
+    s_logRotateSize = (int64_t)pconf->log_rotate_size * 1024 * 1024;
+    s_logRotateInterval = pconf->log_rotate_interval;
+}
@@ -294,7 +294,7 @@ u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...)
 // 描述: 类似与printf, 对格式化输出做解析.
 // 参数begin
 // 参数end
-// 参数fmt: 支持的格式 %d[%Xd/%xd](数字), %s(字符串), %f(浮点, double), %P(pid_t), 如 fmt = "invalid option: \"%s\",%d", args = "testinfo",123
+// 参数fmt: 支持的格式 %d[%Xd/%xd](数字), %L[%uL](64位数字), %s(字符串), %f(浮点, double), %P(pid_t), 如 fmt = "invalid option: \"%s\",%d", args = "testinfo",123
 // 参数args
 // 思路:
 //  1. 基础显示%ud;
@@ -475,13 +475,24 @@ u_char *ngx_vslprintf(u_char *begin, u_char *end, const char *fmt, va_list args)
                 sign = 1;
                 break;
 
+            case 'L': // int64_t 类型, %uL 为 uint64_t, 同官方nginx
+                if (sign)
+                {
+                    i64 = va_arg(args, int64_t);
+                }
+                else
+                {
+                    ui64 = va_arg(args, uint64_t);
+                }
+                break;
+
             default:
                 // 待后续扩展的, 如%l, 目前就直接写入吧.
                 *begin++ = *fmt++;
                 continue;
             }
 
-            // 到达此处的只有%d/%P
+            // 到达此处的只有%d/%P/%L
             // 把负数变成正数, 有符号变成无符号, 统一处理逻辑.
             if (sign)
             {
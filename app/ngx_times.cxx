@@ -0,0 +1,88 @@
+﻿#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+#include "ngx_global.h"
+#include "ngx_func.h"
+
+// -----------------
+// 缓存的时钟, 和官方nginx的ngx_time_update()一个意思:
+// 每轮epoll循环/每次定时器线程醒来时取一次时间(ngx_time_update), 热路径上只读缓存的 秒/毫秒/日志时间字符串, 不再每次调用gettimeofday()/localtime_r().
+// 毫秒每次都更新; 秒变了才换一个新的槽位重新格式化字符串, 读的人拿到槽位指针后, 至少还有 NGX_TIME_SLOTS 秒内容不会被改.
+// 多个线程同时更新时, 只有抢到锁的那个去格式化, 其他的直接返回.
+// -----------------
+
+#define NGX_TIME_SLOTS 64 // 槽位个数
+
+typedef struct
+{
+    time_t sec;                                  // 秒
+    u_char logtime[sizeof("1970/01/01 00:00:00")]; // 日志用的时间字符串, 格式: 年/月/日 时:分:秒
+} ngx_time_t;
+
+static ngx_time_t s_cachedTime[NGX_TIME_SLOTS];
+static std::atomic<ngx_time_t *> s_pCachedTime(&s_cachedTime[0]); // 当前的槽位
+static std::atomic<uint64_t> s_currentMsec(0);                     // 当前时间的毫秒表示
+static std::atomic_flag s_timeLock = ATOMIC_FLAG_INIT;
+static unsigned int s_timeSlot = 0;
+
+// 更新缓存的时间. 信号处理函数中也会调用, 所以只用原子操作和trylock, 不会死锁
+// 调用: main(), ngx_signal_handler(), CSocekt::ngx_reactor_process_events(), CSocekt::ServerTimerQueueMonitorThread()
+void ngx_time_update()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    s_currentMsec.store((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, std::memory_order_relaxed);
+    if (s_pCachedTime.load(std::memory_order_acquire)->sec == ts.tv_sec)
+    {
+        return; // 秒没变, 字符串不用重新格式化
+    }
+
+    if (s_timeLock.test_and_set(std::memory_order_acquire))
+    {
+        return; // 别的线程正在更新
+    }
+
+    s_timeSlot = (s_timeSlot + 1) % NGX_TIME_SLOTS;
+    ngx_time_t *tp = &s_cachedTime[s_timeSlot];
+
+    struct tm tm;
+    localtime_r(&ts.tv_sec, &tm);
+    tp->sec = ts.tv_sec;
+    u_char *p = ngx_slprintf(tp->logtime, tp->logtime + sizeof(tp->logtime), "%04d/%02d/%02d %02d:%02d:%02d",
+                             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    *p = 0; // 格式固定19个字符, 放得下'\0'
+
+    s_pCachedTime.store(tp, std::memory_order_release);
+    s_timeLock.clear(std::memory_order_release);
+}
+
+// fork()出来的子进程中调用: master进程的写日志线程也会更新时间, fork()时它可能正拿着s_timeLock,
+// 子进程里没有这个线程, 锁就永远不会释放了, 缓存的秒和日志时间字符串从此不再变. 这里直接把锁清掉, 再更新一次.
+// 调用: ngx_spawn_process()
+void ngx_time_fork_child()
+{
+    s_timeLock.clear(std::memory_order_release);
+    ngx_time_update();
+}
+
+// 缓存的时间, 秒, 用来代替time(NULL)
+time_t ngx_time()
+{
+    return s_pCachedTime.load(std::memory_order_acquire)->sec;
+}
+
+// 缓存的时间, 毫秒
+uint64_t ngx_current_msec()
+{
+    return s_currentMsec.load(std::memory_order_relaxed);
+}
+
+// 缓存的日志时间字符串, 格式: 2019/01/08 19:57:11
+const u_char *ngx_cached_log_time()
+{
+    return s_pCachedTime.load(std::memory_order_acquire)->logtime;
+}
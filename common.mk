@@ -5,7 +5,7 @@ ifeq ($(DEBUG),true)
 CC = g++ -std=c++11 -g 
 VERSION = debug
 else
-CC = g++ -std=c++11
+CC = g++ -std=c++11 -DNGX_LOG_MAX_LEVEL=NGX_LOG_NOTICE
 VERSION = release
 endif
 
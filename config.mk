@@ -11,7 +11,8 @@ BUILD_DIR = $(BUILD_ROOT)/signal/ \
 			$(BUILD_ROOT)/net/    \
 			$(BUILD_ROOT)/misc/   \
 			$(BUILD_ROOT)/logic/   \
-			$(BUILD_ROOT)/app/ 
+			$(BUILD_ROOT)/app/    \
+			$(BUILD_ROOT)/tools/
 
 # 是否生成调试信息
 export DEBUG = true
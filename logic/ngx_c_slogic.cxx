@@ -18,6 +18,7 @@
 #include "ngx_func.h"
 #include "ngx_c_memory.h"
 #include "ngx_c_crc32.h"
+#include "ngx_c_recvbuf.h"
 #include "ngx_c_slogic.h"
 #include "ngx_logiccomm.h"
 #include "ngx_c_lockmutex.h"
@@ -68,8 +69,9 @@ bool CLogicSocket::Initialize()
 
 /* 
 描述: 处理收到的数据包
-参数pMsgBuf: pConn->precvMemPointer, new出来的数据包(消息体+包头+包体).
-(1) 校验crc32值, 如果crc32值错, 直接丢弃.
+参数pMsgBuf: pConn->precvMemPointer, new出来的数据包(消息体+包头+包体);
+           零拷贝收包时是指向收包缓冲区中包头的指针, 消息头在缓冲区头部. 统一用CRecvBufPool::MsgHeader()/MsgPkg()取.
+(1) 校验crc32值, 如果crc32值错, 直接丢弃. 开启 Sock_RecvCrcCheck 时reactor线程已经校验过了, 这里跳过.
 (2) 通过iCurrsequence过滤废包
 (3) 判断"消息码"是否有效
 (4) 调用"消息码"对应的成员函数来处理
@@ -77,13 +79,18 @@ bool CLogicSocket::Initialize()
  */
 void CLogicSocket::threadRecvProcFunc(char *pMsgBuf)
 {
-    LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)pMsgBuf;                   // 消息头
-    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + m_iLenMsgHeader); // 包头
+    CRecvBufPool *p_recvbuf = CRecvBufPool::GetInstance();
+    LPSTRUC_MSG_HEADER pMsgHeader = p_recvbuf->MsgHeader(pMsgBuf);                 // 消息头
+    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)p_recvbuf->MsgPkg(pMsgBuf);  // 包头
     void *pPkgBody;                                                                // 包体
     unsigned short pkglen = ntohs(pPkgHeader->pkgLen);                             // 包长(包头长+包体长)
 
     // (1) 校验crc32值, 如果crc32值错, 直接丢弃.
-    if (m_iLenPkgHeader == pkglen) // 只有包头, 没有包体
+    if (m_ifRecvCrcCheck == 1) // reactor线程收包时已经校验过了
+    {
+        pPkgBody = (m_iLenPkgHeader == pkglen) ? NULL : (void *)((char *)pPkgHeader + m_iLenPkgHeader);
+    }
+    else if (m_iLenPkgHeader == pkglen) // 只有包头, 没有包体
     {
         if (pPkgHeader->crc32 != 0) // 只有包头的数据包的crc32值是0
         {
@@ -94,7 +101,7 @@ void CLogicSocket::threadRecvProcFunc(char *pMsgBuf)
     else // 有包体
     {
         pPkgHeader->crc32 = ntohl(pPkgHeader->crc32);
-        pPkgBody = (void *)(pMsgBuf + m_iLenMsgHeader + m_iLenPkgHeader);
+        pPkgBody = (void *)((char *)pPkgHeader + m_iLenPkgHeader);
 
         // 计算crc32值
         int calccrc = CCRC32::GetInstance()->Get_CRC((unsigned char *)pPkgBody, pkglen - m_iLenPkgHeader);
@@ -106,16 +113,17 @@ void CLogicSocket::threadRecvProcFunc(char *pMsgBuf)
         }
         else
         {
-            ngx_log_stderr(0, "CLogicSocket::threadRecvProcFunc()中CRC正确[服务器:%d/客户端:%d].", calccrc, pPkgHeader->crc32);
+            ngx_log_error(NGX_LOG_DEBUG, 0, "CLogicSocket::threadRecvProcFunc()中CRC正确[服务器:%d/客户端:%d].", calccrc, pPkgHeader->crc32);
         }
     }
 
     // (2) 通过iCurrsequence过滤废包
-    lpngx_connection_t p_Conn = pMsgHeader->pConn; // 消息头中保存着"连接"
     // 从 收到客户端发送来的包 到 服务器取线程池中的一个线程处理该包 的过程中,
-    // 如果该连接以被其他tcp连接(socket)占用, 则 消息头中iCurrsequence 和 连接中的iCurrsequence 是不相等的.
+    // 如果该连接以被其他tcp连接(socket)占用, 则 消息头中句柄的代数 和 连接中的iCurrsequence 是对不上的, 句柄换不回连接.
     // 这说明原来的客户端和服务器的连接断了, 这种包就是废包, 不处理.
-    if (p_Conn->iCurrsequence != pMsgHeader->iCurrsequence)
+    CEpochGuard epochGuard(&m_epoch); // 处理完之前连接不会被回收(但可能被关闭, 发送时会再判断)
+    lpngx_connection_t p_Conn = ngx_get_connection_by_handle(pMsgHeader->hConn); // 消息头中保存着"连接"的句柄
+    if (p_Conn == NULL)
     {
         return;
     }
@@ -144,11 +152,9 @@ void CLogicSocket::threadRecvProcFunc(char *pMsgBuf)
 // (2) 判断客户端是否超时不发心跳包.
 void CLogicSocket::procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur_time)
 {
-    CMemory *p_memory = CMemory::GetInstance();
-
-    if (tmpmsg->iCurrsequence == tmpmsg->pConn->iCurrsequence) // 此连接没断
+    lpngx_connection_t p_Conn = ngx_get_connection_by_handle(tmpmsg->hConn);
+    if (p_Conn != NULL) // 此连接没断
     {
-        lpngx_connection_t p_Conn = tmpmsg->pConn;
 
         if (/*m_ifkickTimeCount == 1 && */ m_ifTimeOutKick == 1) // 能调用到本函数第一个条件肯定成立， 所以第一个条件加不加无所谓， 主要是第二个条件
         {
@@ -162,13 +168,8 @@ void CLogicSocket::procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur
             ngx_log_stderr(0, "超时不发心跳包, 踢出去!"); //感觉OK
             zdClosesocketProc(p_Conn);
         }
-
-        p_memory->FreeMemory(tmpmsg); // 内存要释放
-    }
-    else // 此连接断了
-    {
-        p_memory->FreeMemory(tmpmsg); // 内存要释放
     }
+    // tmpmsg由调用者(CSocekt::ServerTimerQueueMonitorThread)负责, 不用释放
     return;
 }
 
@@ -215,7 +216,8 @@ bool CLogicSocket::_HandleRegister(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER
 
     // 对于同一个用户, 可能同时发送来多个请求过来, 造成多个线程同时为该用户服务,
     // 以网游为例, 用户要在商店中买A物品, 又买B物品, 而用户的钱只够买A或者B中的一个, 不够同时买A和B. 如果用户发送购买命令过来买了一次A, 又买了一次B, 如果是两个线程来执行同一个用户的这两次不同的购买命令, 很可能造成这个用户购买成功了A, 又购买成功了B. 所以针对某个用户的命令, 我们一般都要互斥, 我们需要增加临界的变量于 ngx_connection_s 结构中.
-    CLock lock(&pConn->logicPorcMutex); // 凡是和本用户有关的访问都互斥
+    // 按连接分派(ProcMsgOrderedDispatch = 1)时同一连接的消息不会被两个线程同时处理, 不需要再加锁.
+    CLock lock(g_threadpool.isOrderedDispatch() ? NULL : &pConn->logicPorcMutex); // 凡是和本用户有关的访问都互斥
 
     // 取得了整个发送过来的数据
     LPSTRUCT_REGISTER p_RecvInfo = (LPSTRUCT_REGISTER)pPkgBody;
@@ -271,7 +273,7 @@ bool CLogicSocket::_HandleLogIn(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMs
         return false;
     }
 
-    CLock lock(&pConn->logicPorcMutex); // 凡是和本用户有关的访问都互斥
+    CLock lock(g_threadpool.isOrderedDispatch() ? NULL : &pConn->logicPorcMutex); // 凡是和本用户有关的访问都互斥
 
     // 取得了整个发送过来的数据
     LPSTRUCT_LOGIN p_RecvInfo = (LPSTRUCT_LOGIN)pPkgBody;
@@ -302,7 +304,7 @@ bool CLogicSocket::_HandleLogIn(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMs
     // e) 包体内容全部确定好后, 计算包体的crc32值
     pPkgHeader->crc32 = p_crc32->Get_CRC((unsigned char *)p_sendInfo, iSendLen);
     pPkgHeader->crc32 = htonl(pPkgHeader->crc32);
-    ngx_log_stderr(0, "成功收到登录并返回结果!");
+    ngx_log_error(NGX_LOG_DEBUG, 0, "成功收到登录并返回结果!");
 
     // f) 发送数据包
     msgSend(p_sendbuf);
@@ -318,12 +320,12 @@ bool CLogicSocket::_HandlePing(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMsg
         return false;
     }
 
-    CLock lock(&pConn->logicPorcMutex); // 凡是和本用户有关的访问都考虑用互斥, 以免该用户同时发送过来两个命令达到各种作弊目的.
-    pConn->lastPingTime = time(NULL);   // 更新心跳包时间
+    CLock lock(g_threadpool.isOrderedDispatch() ? NULL : &pConn->logicPorcMutex); // 凡是和本用户有关的访问都考虑用互斥, 以免该用户同时发送过来两个命令达到各种作弊目的.
+    pConn->lastPingTime = ngx_time();   // 更新心跳包时间
 
     // 服务器回复一个心跳包
     SendNoBodyPkgToClient(pMsgHeader, _CMD_PING);
 
-    ngx_log_stderr(0, "成功收到了心跳包并返回结果!");
+    ngx_log_error(NGX_LOG_DEBUG, 0, "成功收到了心跳包并返回结果!");
     return true;
 }
@@ -1,11 +1,19 @@
 ﻿#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NGX_CRC32_HAVE_PCLMUL 1
+#endif
 
 #include "ngx_c_crc32.h"
 
 // 和 crc32校验算法 有关的代码
 
+#define NGX_CRC32_PCLMUL_MIN 64 // 不足这么多字节不值得用pclmul, 一次折叠64字节
+
 // 类静态变量初始化
 CCRC32 *CCRC32::m_instance = NULL;
 
@@ -13,6 +21,23 @@ CCRC32 *CCRC32::m_instance = NULL;
 CCRC32::CCRC32()
 {
 	Init_CRC32_Table();
+
+	// 选择计算方式
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	m_pfnUpdate = UpdateSlice8;
+	m_pEngineName = "slicing-by-8";
+#ifdef NGX_CRC32_HAVE_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+	{
+		m_pfnUpdate = UpdatePclmul;
+		m_pEngineName = "pclmul";
+	}
+#endif
+#else
+	m_pfnUpdate = UpdateBytewise;
+	m_pEngineName = "bytewise";
+#endif
 }
 
 // 释放函数
@@ -20,6 +45,35 @@ CCRC32::~CCRC32()
 {
 }
 
+// 指定计算方式, 构造函数选的是本机最快的, 这个函数只给性能对比程序(tools/ngx_bench_crc32)用
+bool CCRC32::SetEngine(const char *pName)
+{
+	if (strcmp(pName, "bytewise") == 0)
+	{
+		m_pfnUpdate = UpdateBytewise;
+		m_pEngineName = "bytewise";
+	}
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	else if (strcmp(pName, "slicing-by-8") == 0)
+	{
+		m_pfnUpdate = UpdateSlice8;
+		m_pEngineName = "slicing-by-8";
+	}
+#ifdef NGX_CRC32_HAVE_PCLMUL
+	else if (strcmp(pName, "pclmul") == 0 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+	{
+		m_pfnUpdate = UpdatePclmul;
+		m_pEngineName = "pclmul";
+	}
+#endif
+#endif
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
 // 初始化crc32表辅助函数, 仅仅被Init_CRC32_Table调用.
 unsigned int CCRC32::Reflect(unsigned int ref, char ch)
 {
@@ -66,10 +120,23 @@ void CCRC32::Init_CRC32_Table()
 		//if (i == 1)printf("old2--i=%d,crc32_table[%d] = %lu\r\n",i,i,crc32_table[i]);
 		crc32_table[i] = Reflect(crc32_table[i], 32);
 	}
+
+	// slicing-by-8的另外7张表: 在前一张表的基础上再多处理一个0字节
+	for (int i = 0; i <= 0xFF; i++)
+	{
+		unsigned int crc = crc32_table[i];
+		m_sliceTable[0][i] = crc;
+		for (int k = 1; k < 8; k++)
+		{
+			crc = (crc >> 8) ^ crc32_table[crc & 0xFF];
+			m_sliceTable[k][i] = crc;
+		}
+	}
 }
 
 // 给你一段buffer, 也就是一段内存, 然后给你这段内存长度, 该函数计算出一个数字来(CRC32值)返回.
 // 用crc32_table寻找表来产生数据的CRC值
+// 具体怎么算由构造函数选定的m_pfnUpdate决定, 结果都一样
 int CCRC32::Get_CRC(unsigned char *buffer, unsigned int dwSize)
 {
 	// Be sure to use unsigned variables,
@@ -77,13 +144,171 @@ int CCRC32::Get_CRC(unsigned char *buffer, unsigned int dwSize)
 	// where zero bits are required.
 	//unsigned long  crc(0xffffffff);
 	unsigned int crc(0xffffffff);
-	int len;
+	crc = m_pfnUpdate(this, crc, buffer, dwSize);
+	// Exclusive OR the result with the beginning value.
+	return crc ^ 0xffffffff;
+}
 
-	len = dwSize;
+// 逐字节查表
+unsigned int CCRC32::UpdateBytewise(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize)
+{
 	// Perform the algorithm on each character
 	// in the string, using the lookup table values.
-	while (len--)
-		crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ *buffer++];
-	// Exclusive OR the result with the beginning value.
-	return crc ^ 0xffffffff;
+	while (dwSize--)
+		crc = (crc >> 8) ^ pThis->crc32_table[(crc & 0xFF) ^ *buffer++];
+	return crc;
+}
+
+// slicing-by-8: 每次取8个字节, 前4个字节和crc异或后连同后4个字节一起查8张表, 只在小端机器上用
+unsigned int CCRC32::UpdateSlice8(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize)
+{
+	const unsigned int (*t)[256] = pThis->m_sliceTable;
+
+	// 先逐字节处理到8字节对齐
+	while (dwSize > 0 && ((uintptr_t)buffer & 7) != 0)
+	{
+		crc = (crc >> 8) ^ t[0][(crc & 0xFF) ^ *buffer++];
+		--dwSize;
+	}
+
+	while (dwSize >= 8)
+	{
+		uint32_t one, two;
+		memcpy(&one, buffer, 4);
+		memcpy(&two, buffer + 4, 4);
+		one ^= crc;
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+			  t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+		buffer += 8;
+		dwSize -= 8;
+	}
+
+	while (dwSize--)
+		crc = (crc >> 8) ^ t[0][(crc & 0xFF) ^ *buffer++];
+	return crc;
 }
+
+#ifdef NGX_CRC32_HAVE_PCLMUL
+
+// 折叠用的常数, 都是 x^n mod P(x) 的反射形式, 和Linux内核 crc32-pclmul / zlib 里的是同一组
+alignas(16) static const uint64_t ngx_crc32_k1k2[2] = {0x0154442bd4ULL, 0x01c6e41596ULL}; // 折叠512位
+alignas(16) static const uint64_t ngx_crc32_k3k4[2] = {0x01751997d0ULL, 0x00ccaa009eULL}; // 折叠128位
+alignas(16) static const uint64_t ngx_crc32_k5k0[2] = {0x0163cd6124ULL, 0x0000000000ULL}; // 128位折到64位
+alignas(16) static const uint64_t ngx_crc32_poly[2] = {0x01db710641ULL, 0x01f7011641ULL}; // P(x)和Barrett约简的u
+
+// 用PCLMULQDQ折叠: 4个128位寄存器并行, 每次吞64字节, 最后折成128位, 再Barrett约简到32位.
+// dwSize必须 >= 64 且是16的倍数, crc是取反前的内部状态
+__attribute__((target("pclmul,sse4.1"))) static unsigned int ngx_crc32_fold(unsigned int crc, const unsigned char *buffer, size_t dwSize)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buffer + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buffer + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buffer + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buffer + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	x0 = _mm_load_si128((const __m128i *)ngx_crc32_k1k2);
+	buffer += 64;
+	dwSize -= 64;
+
+	// (1) 每次折叠64字节
+	while (dwSize >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *)(buffer + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buffer + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buffer + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buffer + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		buffer += 64;
+		dwSize -= 64;
+	}
+
+	// (2) 4个寄存器折成1个
+	x0 = _mm_load_si128((const __m128i *)ngx_crc32_k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// (3) 剩下的每次折叠16字节
+	while (dwSize >= 16)
+	{
+		x2 = _mm_loadu_si128((const __m128i *)buffer);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		buffer += 16;
+		dwSize -= 16;
+	}
+
+	// (4) 128位折到64位
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)ngx_crc32_k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// (5) Barrett约简到32位
+	x0 = _mm_load_si128((const __m128i *)ngx_crc32_poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (unsigned int)_mm_extract_epi32(x1, 1);
+}
+
+// 64字节以上的部分(取16的倍数)用pclmul折叠, 零头用slicing-by-8
+unsigned int CCRC32::UpdatePclmul(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize)
+{
+	if (dwSize >= NGX_CRC32_PCLMUL_MIN)
+	{
+		size_t chunk = dwSize & ~(size_t)15;
+		crc = ngx_crc32_fold(crc, buffer, chunk);
+		buffer += chunk;
+		dwSize -= chunk;
+	}
+	return UpdateSlice8(pThis, crc, buffer, dwSize);
+}
+
+#else
+
+unsigned int CCRC32::UpdatePclmul(const CCRC32 *pThis, unsigned int crc, const unsigned char *buffer, size_t dwSize)
+{
+	return UpdateSlice8(pThis, crc, buffer, dwSize);
+}
+
+#endif
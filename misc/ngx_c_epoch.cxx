@@ -0,0 +1,103 @@
+﻿
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ngx_c_epoch.h"
+#include "ngx_func.h"
+
+// ---------------------------------------
+// 和 基于代的延迟回收 有关的函数放这里
+// ---------------------------------------
+
+static thread_local int t_epochSlot = -1; // 本线程的槽位, -1表示还没分配
+static thread_local int t_epochDepth = 0; // 本线程Enter()的嵌套层数
+
+// 构造函数
+CEpoch::CEpoch()
+{
+    for (int i = 0; i < NGX_EPOCH_MAX_THREADS; ++i)
+    {
+        m_slots[i].epoch.store(0, std::memory_order_relaxed);
+    }
+    m_iSlotCount = 0;
+    m_globalEpoch = 1; // 槽位中的0表示不在临界区, 所以代从1开始
+}
+
+// 析构函数
+CEpoch::~CEpoch()
+{
+}
+
+// 取本线程的槽位, 第一次调用时分配. 线程退出后槽位不归还, 槽位中是0, 不影响回收.
+int CEpoch::GetSlot()
+{
+    if (t_epochSlot == -1)
+    {
+        int slot = m_iSlotCount.fetch_add(1);
+        if (slot >= NGX_EPOCH_MAX_THREADS)
+        {
+            // 线程数是配置出来的, 超过这么多肯定是配置错了, 继续运行会有连接被提前回收
+            ngx_log_stderr(0, "CEpoch::GetSlot()中线程数超过了%d, 程序退出.", NGX_EPOCH_MAX_THREADS);
+            ngx_log_async_stop(); // 开了异步日志时上面这条还在缓冲区里, 先写出去
+            exit(2);
+        }
+        t_epochSlot = slot;
+    }
+    return t_epochSlot;
+}
+
+// 进入临界区: 记下当前的代, 之后作废的对象都要等本线程离开才能回收.
+// 记下代之后要有一个完整的内存屏障, 保证之后读对象(比如比较连接的序号)不会被提前到记下代之前.
+void CEpoch::Enter()
+{
+    if (t_epochDepth++ > 0)
+    {
+        return; // 嵌套, 外层已经记过了
+    }
+    Slot &slot = m_slots[GetSlot()];
+    slot.epoch.store(m_globalEpoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// 离开临界区
+void CEpoch::Leave()
+{
+    if (--t_epochDepth > 0)
+    {
+        return;
+    }
+    m_slots[t_epochSlot].epoch.store(0, std::memory_order_release);
+}
+
+// 对象作废后调用, 调用前对象必须已经作废(比如连接的序号已经变了), 返回作废时的代.
+// 在临界区中的线程, 如果记下的代 < 返回值, 说明它可能在作废之前就拿到了对象.
+uint64_t CEpoch::Retire()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return m_globalEpoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+}
+
+// 所有在临界区中的线程记下的最小的代
+uint64_t CEpoch::MinActive()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t minEpoch = UINT64_MAX;
+    int count = m_iSlotCount.load(std::memory_order_acquire);
+    count = (count < NGX_EPOCH_MAX_THREADS) ? count : NGX_EPOCH_MAX_THREADS;
+    for (int i = 0; i < count; ++i)
+    {
+        uint64_t epoch = m_slots[i].epoch.load(std::memory_order_acquire);
+        if (epoch != 0 && epoch < minEpoch)
+        {
+            minEpoch = epoch;
+        }
+    }
+    return minEpoch;
+}
+
+// 作废时的代为retireEpoch的对象, 是否已经没有线程可能持有
+bool CEpoch::IsSafe(uint64_t retireEpoch)
+{
+    return MinActive() >= retireEpoch;
+}
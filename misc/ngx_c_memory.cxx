@@ -4,20 +4,197 @@
 #include <string.h>
 
 #include "ngx_c_memory.h"
+#include "ngx_c_lockmutex.h"
 
 // ---------------------------------------
 //和 内存分配 有关的函数放这里
 // ---------------------------------------
 
+#define NGX_MEM_PTR_MASK 0x0000FFFFFFFFFFFFULL // 仓库栈顶中指针所占的低48位
+#define NGX_MEM_STAT_FLUSH 256				   // 线程本地统计攒够这么多次分配/释放后, 再加到全局计数上
+
+// 线程本地缓存, 同一个线程分配/释放时不需要任何互斥.
+// 纯POD, 零初始化, 线程退出时缓存中的块不归还(slab在进程退出时统一释放), 数量有上限, 可以接受.
+typedef struct
+{
+    lpngx_mem_block_t freeList[NGX_MEM_CLASS_COUNT]; // 每一级的空闲块链表
+    unsigned int freeCount[NGX_MEM_CLASS_COUNT];     // 每一级空闲块数量
+    uint64_t hits;
+    uint64_t misses;
+    int64_t bytes;
+    unsigned int ops;
+} ngx_mem_cache_t;
+
+static thread_local ngx_mem_cache_t t_memcache;
+
 // 类静态成员
 CMemory *CMemory::m_instance = NULL;
 
+// 构造函数
+CMemory::CMemory()
+{
+    for (int i = 0; i < NGX_MEM_CLASS_COUNT; ++i)
+    {
+        m_depot[i] = 0;
+    }
+    pthread_mutex_init(&m_slabMutex, NULL);
+
+    m_iHitCount = 0;
+    m_iMissCount = 0;
+    m_iLargeCount = 0;
+    m_iBytesInUse = 0;
+    m_iSlabBytes = 0;
+}
+
+// 析构函数, 释放所有slab
+CMemory::~CMemory()
+{
+    for (auto pos = m_slabList.begin(); pos != m_slabList.end(); ++pos)
+    {
+        delete[](*pos);
+    }
+    m_slabList.clear();
+    pthread_mutex_destroy(&m_slabMutex);
+}
+
+// 根据要分配的大小(含块头)算出级别, 超过最大一级返回 NGX_MEM_LARGE
+static inline unsigned int ngx_mem_size_class(size_t size)
+{
+    if (size <= (1u << NGX_MEM_MIN_SHIFT))
+    {
+        return 0;
+    }
+    unsigned int shift = 64 - __builtin_clzll((unsigned long long)(size - 1)); // 向上取到2的幂
+    unsigned int sizeClass = shift - NGX_MEM_MIN_SHIFT;
+    return (sizeClass < NGX_MEM_CLASS_COUNT) ? sizeClass : NGX_MEM_LARGE;
+}
+
+// 每一级一批的块数: 一批大约64K, 小块最多64个, 大块最少2个
+unsigned int CMemory::ClassBatch(unsigned int sizeClass)
+{
+    unsigned int count = (64 * 1024) / ClassSize(sizeClass);
+    if (count > 64)
+        count = 64;
+    if (count < 2)
+        count = 2;
+    return count;
+}
+
+// 切一批新的slab, 返回串好的一批块(next串起来)
+lpngx_mem_block_t CMemory::NewSlabBatch(unsigned int sizeClass)
+{
+    unsigned int blockSize = ClassSize(sizeClass);
+    unsigned int count = ClassBatch(sizeClass);
+
+    char *pSlab = new char[(size_t)blockSize * count]; // new出来的地址至少16字节对齐
+    {
+        CLock lock(&m_slabMutex);
+        m_slabList.push_back(pSlab);
+    }
+    m_iSlabBytes += (uint64_t)blockSize * count;
+
+    lpngx_mem_block_t pHead = NULL;
+    for (int i = (int)count - 1; i >= 0; --i)
+    {
+        lpngx_mem_block_t pBlock = (lpngx_mem_block_t)(pSlab + (size_t)i * blockSize);
+        pBlock->sizeClass = sizeClass;
+        pBlock->next = pHead;
+        pHead = pBlock;
+    }
+    pHead->batchCount = count;
+    return pHead;
+}
+
+// 从全局仓库(无锁栈)弹出一批, 仓库空则切一批新的slab
+lpngx_mem_block_t CMemory::GetBatch(unsigned int sizeClass)
+{
+    std::atomic<uint64_t> &top = m_depot[sizeClass];
+    uint64_t oldTop = top.load(std::memory_order_acquire);
+    while ((oldTop & NGX_MEM_PTR_MASK) != 0)
+    {
+        lpngx_mem_block_t pBatch = (lpngx_mem_block_t)(uintptr_t)(oldTop & NGX_MEM_PTR_MASK);
+        // 下一批的指针保存在这一批第一块的用户内存中
+        uint64_t nextBatch = (uint64_t)(uintptr_t)(*(lpngx_mem_block_t *)(pBatch + 1));
+        uint64_t newTop = (nextBatch & NGX_MEM_PTR_MASK) | ((oldTop & ~NGX_MEM_PTR_MASK) + (1ULL << 48));
+        if (top.compare_exchange_weak(oldTop, newTop, std::memory_order_acquire, std::memory_order_acquire))
+        {
+            return pBatch;
+        }
+    }
+    return NewSlabBatch(sizeClass);
+}
+
+// 把一批块(pBatch->next串起来, 共count块)压入全局仓库
+void CMemory::PutBatch(unsigned int sizeClass, lpngx_mem_block_t pBatch, unsigned int count)
+{
+    std::atomic<uint64_t> &top = m_depot[sizeClass];
+    pBatch->batchCount = count;
+    uint64_t oldTop = top.load(std::memory_order_relaxed);
+    uint64_t newTop;
+    do
+    {
+        *(lpngx_mem_block_t *)(pBatch + 1) = (lpngx_mem_block_t)(uintptr_t)(oldTop & NGX_MEM_PTR_MASK);
+        newTop = ((uint64_t)(uintptr_t)pBatch & NGX_MEM_PTR_MASK) | ((oldTop & ~NGX_MEM_PTR_MASK) + (1ULL << 48));
+    } while (!top.compare_exchange_weak(oldTop, newTop, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// 把线程本地的统计值加到全局计数上
+void CMemory::FlushStat(uint64_t hits, uint64_t misses, int64_t bytes)
+{
+    m_iHitCount.fetch_add(hits, std::memory_order_relaxed);
+    m_iMissCount.fetch_add(misses, std::memory_order_relaxed);
+    m_iBytesInUse.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+// 本线程的统计值攒够了就刷到全局
+static inline void ngx_mem_cache_stat(CMemory *p_memory, ngx_mem_cache_t *pCache)
+{
+    if (++pCache->ops >= NGX_MEM_STAT_FLUSH)
+    {
+        p_memory->FlushStat(pCache->hits, pCache->misses, pCache->bytes);
+        pCache->hits = 0;
+        pCache->misses = 0;
+        pCache->bytes = 0;
+        pCache->ops = 0;
+    }
+}
+
 // 分配内存
 // memCount: 分配的字节大小
 // ifmemset: 是否用 0 初始化这块内存, false可以提高点效率
 void *CMemory::AllocMemory(int memCount, bool ifmemset)
 {
-    void *tmpData = (void *)new char[memCount];
+    size_t size = (size_t)memCount + NGX_MEM_BLOCK_HEAD;
+    unsigned int sizeClass = ngx_mem_size_class(size);
+    lpngx_mem_block_t pBlock;
+
+    if (sizeClass == NGX_MEM_LARGE) // 大块, 直接new
+    {
+        pBlock = (lpngx_mem_block_t) new char[size];
+        pBlock->sizeClass = NGX_MEM_LARGE;
+        ++m_iLargeCount;
+    }
+    else
+    {
+        ngx_mem_cache_t *pCache = &t_memcache;
+        pBlock = pCache->freeList[sizeClass];
+        if (pBlock != NULL) // 线程本地缓存命中
+        {
+            ++pCache->hits;
+        }
+        else // 没命中, 去仓库取一批
+        {
+            ++pCache->misses;
+            pBlock = GetBatch(sizeClass);
+            pCache->freeCount[sizeClass] = pBlock->batchCount;
+        }
+        pCache->freeList[sizeClass] = pBlock->next;
+        --pCache->freeCount[sizeClass];
+        pCache->bytes += ClassSize(sizeClass);
+        ngx_mem_cache_stat(this, pCache);
+    }
+
+    void *tmpData = (void *)((char *)pBlock + NGX_MEM_BLOCK_HEAD);
     if (ifmemset)
     {
         memset(tmpData, 0, memCount);
@@ -28,6 +205,46 @@ void *CMemory::AllocMemory(int memCount, bool ifmemset)
 // 内存释放函数
 void CMemory::FreeMemory(void *point)
 {
-    // new 的时候是char *, 这里弄回char *, 以免出警告:  warning: deleting ‘void*’ is undefined [-Wdelete-incomplete]
-    delete[]((char *)point);
+    lpngx_mem_block_t pBlock = (lpngx_mem_block_t)((char *)point - NGX_MEM_BLOCK_HEAD);
+    unsigned int sizeClass = pBlock->sizeClass;
+
+    if (sizeClass == NGX_MEM_LARGE)
+    {
+        // new 的时候是char *, 这里弄回char *, 以免出警告:  warning: deleting ‘void*’ is undefined [-Wdelete-incomplete]
+        delete[]((char *)pBlock);
+        return;
+    }
+
+    ngx_mem_cache_t *pCache = &t_memcache;
+    pBlock->next = pCache->freeList[sizeClass];
+    pCache->freeList[sizeClass] = pBlock;
+    ++pCache->freeCount[sizeClass];
+    pCache->bytes -= ClassSize(sizeClass);
+
+    // 本线程缓存的太多了(比如epoll线程一直在分配, 逻辑线程一直在释放), 拿出一批还给仓库
+    unsigned int batch = ClassBatch(sizeClass);
+    if (pCache->freeCount[sizeClass] >= batch * 2)
+    {
+        lpngx_mem_block_t pBatch = pCache->freeList[sizeClass];
+        lpngx_mem_block_t pLast = pBatch;
+        for (unsigned int i = 1; i < batch; ++i)
+        {
+            pLast = pLast->next;
+        }
+        pCache->freeList[sizeClass] = pLast->next;
+        pCache->freeCount[sizeClass] -= batch;
+        pLast->next = NULL;
+        PutBatch(sizeClass, pBatch, batch);
+    }
+    ngx_mem_cache_stat(this, pCache);
+}
+
+// 取得统计信息, 各线程未刷到全局的部分(每线程最多 NGX_MEM_STAT_FLUSH 次)不包含在内
+void CMemory::GetStat(ngx_mem_stat_t *pstat)
+{
+    pstat->hitCount = m_iHitCount.load(std::memory_order_relaxed);
+    pstat->missCount = m_iMissCount.load(std::memory_order_relaxed);
+    pstat->largeCount = m_iLargeCount.load(std::memory_order_relaxed);
+    pstat->bytesInUse = m_iBytesInUse.load(std::memory_order_relaxed);
+    pstat->slabBytes = m_iSlabBytes.load(std::memory_order_relaxed);
 }
@@ -0,0 +1,184 @@
+﻿
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ngx_c_msgqueue.h"
+
+// ---------------------------------------
+// 和 无锁消息队列 有关的函数放这里
+// ---------------------------------------
+
+#define NGX_MSGQUEUE_SPIN 32 // 睡眠前先空转几次, 刚好有消息进来时省掉一次futex睡眠/唤醒
+
+static inline long ngx_futex(std::atomic<uint32_t> *uaddr, int op, uint32_t val)
+{
+    return syscall(SYS_futex, (uint32_t *)uaddr, op, val, NULL, NULL, 0);
+}
+
+// 构造函数
+CMsgQueue::CMsgQueue()
+{
+    m_buffer = NULL;
+    m_mask = 0;
+    m_enqueuePos = 0;
+    m_dequeuePos = 0;
+    m_futexSeq = 0;
+    m_iWaiters = 0;
+}
+
+// 析构函数, 队列中剩余的消息由使用者负责释放(CThreadPool::clearMsgRecvQueue)
+CMsgQueue::~CMsgQueue()
+{
+    if (m_buffer != NULL)
+    {
+        delete[] m_buffer;
+        m_buffer = NULL;
+    }
+}
+
+// 初始化, capacity向上取到2的幂, 方便用 & 代替 % 取下标
+bool CMsgQueue::Init(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    m_buffer = new Cell[size];
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+    {
+        m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+        m_buffer[i].data = NULL;
+    }
+    m_enqueuePos.store(0, std::memory_order_relaxed);
+    m_dequeuePos.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+// 入队, 队列满返回false
+// 格子的sequence == pos 表示这个格子空着可以写, 写完后置为 pos+1 表示可以读
+bool CMsgQueue::Push(char *buf)
+{
+    Cell *cell;
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        cell = &m_buffer[pos & m_mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0) // 队列满
+        {
+            return false;
+        }
+        else // 被别的生产者抢先了
+        {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->data = buf;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+
+    Wake();
+    return true;
+}
+
+// 出队, 队列空返回false
+// 格子的sequence == pos+1 表示有数据可读, 读完后置为 pos+mask+1 表示下一圈可以写
+bool CMsgQueue::TryPop(char *&buf)
+{
+    Cell *cell;
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        cell = &m_buffer[pos & m_mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0)
+        {
+            if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0) // 队列空
+        {
+            return false;
+        }
+        else
+        {
+            pos = m_dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+    buf = cell->data;
+    cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+// 出队, 队列空就睡眠等待.
+// 先登记m_iWaiters, 再取一次futex字, 再检查一次队列, 最后才睡; 生产者入队后看到m_iWaiters>0就改futex字并唤醒,
+// 所以"检查队列为空"和"睡下去"之间进来的消息不会丢失唤醒(futex字变了, FUTEX_WAIT会立即返回).
+char *CMsgQueue::WaitPop(const std::atomic<bool> &shutdown)
+{
+    char *buf;
+    for (;;)
+    {
+        for (int i = 0; i < NGX_MSGQUEUE_SPIN; ++i)
+        {
+            if (TryPop(buf))
+                return buf;
+            if (shutdown)
+                return NULL;
+        }
+
+        uint32_t seq = m_futexSeq.load(std::memory_order_acquire);
+        m_iWaiters.fetch_add(1, std::memory_order_seq_cst);
+        if (TryPop(buf))
+        {
+            m_iWaiters.fetch_sub(1, std::memory_order_relaxed);
+            return buf;
+        }
+        if (shutdown)
+        {
+            m_iWaiters.fetch_sub(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        ngx_futex(&m_futexSeq, FUTEX_WAIT_PRIVATE, seq);
+        m_iWaiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+// 有消费者睡着时唤醒一个, 没人睡则只是读一次原子变量, 不进内核
+void CMsgQueue::Wake()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_iWaiters.load(std::memory_order_relaxed) > 0)
+    {
+        m_futexSeq.fetch_add(1, std::memory_order_release);
+        ngx_futex(&m_futexSeq, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+// 唤醒所有睡眠的消费者
+void CMsgQueue::WakeAll()
+{
+    m_futexSeq.fetch_add(1, std::memory_order_seq_cst);
+    ngx_futex(&m_futexSeq, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+// 近似大小
+size_t CMsgQueue::Size() const
+{
+    size_t tail = m_enqueuePos.load(std::memory_order_relaxed);
+    size_t head = m_dequeuePos.load(std::memory_order_relaxed);
+    return (tail > head) ? (tail - head) : 0;
+}
@@ -5,21 +5,24 @@
 #include "ngx_func.h"
 #include "ngx_c_threadpool.h"
 #include "ngx_c_memory.h"
+#include "ngx_c_recvbuf.h"
 #include "ngx_macro.h"
 
 //和 线程池 有关的函数放这里
 
 // 静态成员初始化
-pthread_mutex_t CThreadPool::m_pthreadMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t CThreadPool::m_pthreadCond = PTHREAD_COND_INITIALIZER;
-
-bool CThreadPool::m_shutdown = false;
+std::atomic<bool> CThreadPool::m_shutdown(false);
 
 // 构造函数
 CThreadPool::CThreadPool()
 {
     m_iRunningThreadNum = 0;
     m_iLastEmgTime = 0;
+    m_iDiscardRecvPkgCount = 0;
+    m_bOrderedDispatch = false;
+
+    // 收消息队列中可能有指向收包缓冲区池的消息, 在这里先创建池单例, 保证池在线程池之后析构(clearMsgRecvQueue()还要用)
+    CRecvBufPool::GetInstance();
 }
 
 // 析构函数
@@ -33,69 +36,52 @@ CThreadPool::~CThreadPool()
 void CThreadPool::clearMsgRecvQueue()
 {
     char *sTmpMempoint;
-    CMemory *p_memory = CMemory::GetInstance();
+    CRecvBufPool *p_recvbuf = CRecvBufPool::GetInstance();
 
-    // 尾声阶段, 需要互斥?
-    while (!m_MsgRecvQueue.empty())
+    // 尾声阶段, 线程都已退出, 不需要互斥. 按连接分派时(以及master进程中)没有初始化 m_MsgRecvQueue
+    while (m_MsgRecvQueue.IsInit() && m_MsgRecvQueue.TryPop(sTmpMempoint))
     {
-        sTmpMempoint = m_MsgRecvQueue.front();
-        m_MsgRecvQueue.pop_front();
-        p_memory->FreeMemory(sTmpMempoint);
+        p_recvbuf->FreeMsg(sTmpMempoint);
+    }
+
+    for (auto iter = m_MsgLaneQueue.begin(); iter != m_MsgLaneQueue.end(); ++iter)
+    {
+        while ((*iter)->TryPop(sTmpMempoint))
+        {
+            p_recvbuf->FreeMsg(sTmpMempoint);
+        }
+        delete (*iter);
     }
+    m_MsgLaneQueue.clear();
 }
 
 // 描述: 线程入口函数, 处理接受到的消息. 如果要让线程退出, 只需要设置m_shutdown为true即可(CThreadPool::StopAll).
-// (1) 从 收消息队列 中取消息, 如果没有消息就阻塞等待.
+// (1) 从 收消息队列 中取消息, 如果没有消息就睡眠等待(CMsgQueue::WaitPop).
 // (2) 调用 CLogicSocket::threadRecvProcFunc() 处理消息.
 void *CThreadPool::ThreadFunc(void *threadData)
 {
     ThreadItem *pThread = static_cast<ThreadItem *>(threadData);
     CThreadPool *pThreadPoolObj = pThread->_pThis; // 静态成员函数不能访问成员变量, 只能通过这种方式访问.
 
-    CMemory *p_memory = CMemory::GetInstance();
-    int err;
-    while (true)
-    {
-        err = pthread_mutex_lock(&m_pthreadMutex);
-        if (err != 0)
-        {
-            ngx_log_stderr(err, "CThreadPool::ThreadFunc() 中 pthread_mutex_lock() 失败, 返回的错误码为 [%d]", err);
-        }
-
-        // 必须要用 while, 避免"虚假唤醒".
-        while ((pThreadPoolObj->m_MsgRecvQueue.size() == 0) && m_shutdown == false)
-        {
-            if (pThread->ifrunning == false)
-            {
-                // 标记为true了才允许调用StopAll(), 测试中发现如果Create()和StopAll()紧挨着调用, 就会导致线程混乱, 所以每个线程必须执行到这里, 才认为是启动成功了.
-                pThread->ifrunning = true;
-            }
+    CRecvBufPool *p_recvbuf = CRecvBufPool::GetInstance();
 
-            pthread_cond_wait(&m_pthreadCond, &m_pthreadMutex); // 线程池初始化时, 所有线程必然是卡在这里等待的.
-        }
+    // 标记为true了才允许调用StopAll(), 测试中发现如果Create()和StopAll()紧挨着调用, 就会导致线程混乱, 所以每个线程必须执行到这里, 才认为是启动成功了.
+    pThread->ifrunning = true;
 
-        // 让线程退出, 只需要设置 m_shutdown 为true.
-        if (m_shutdown)
+    while (true)
+    {
+        // 取消息, 队列空时在futex上睡眠, 不空转. 返回NULL表示要退出.
+        char *jobbuf = pThread->_pQueue->WaitPop(m_shutdown);
+        if (jobbuf == NULL)
         {
-            pthread_mutex_unlock(&m_pthreadMutex); // 解锁互斥量
             break;
         }
 
-        // 取消息
-        char *jobbuf = pThreadPoolObj->m_MsgRecvQueue.front();
-        pThreadPoolObj->m_MsgRecvQueue.pop_front();
-
-        err = pthread_mutex_unlock(&m_pthreadMutex);
-        if (err != 0)
-        {
-            ngx_log_stderr(err, "CThreadPool::ThreadFunc() 中 pthread_mutex_unlock() 失败, 返回的错误码为 [%d].", err);
-        }
-
         // 能走到这里的, 就是有消息可以处理
 
         ++pThreadPoolObj->m_iRunningThreadNum; // 1) 正在干活的线程数量+1
         g_socket.threadRecvProcFunc(jobbuf);   // 2) 处理消息
-        p_memory->FreeMemory(jobbuf);          // 3) 处理完毕, 释放消息内存
+        p_recvbuf->FreeMsg(jobbuf);            // 3) 处理完毕, 释放消息内存(或归还收包缓冲区的引用)
         --pThreadPoolObj->m_iRunningThreadNum; // 4) 正在干活的线程数量-1
     }
 
@@ -104,18 +90,50 @@ void *CThreadPool::ThreadFunc(void *threadData)
 }
 
 // 描述: 创建线程池中的所有线程
+// (0) 初始化 收消息队列, 按连接分派时每个线程一个队列
 // (1) 创建线程池中所有线程
-// (2) 确保每个线程都运行到pthread_cond_wait()
-bool CThreadPool::Create(int threadNum)
+// (2) 确保每个线程都运行到等待消息处
+bool CThreadPool::Create(int threadNum, int queueSize, bool ordered)
 {
     ThreadItem *pNew;
+    CMsgQueue *pQueue;
     int err;
 
-    // (1) 创建线程池中所有线程
+    // (0) 初始化 收消息队列, 有界队列, 容量向上取到2的幂
     m_iThreadNum = threadNum;
+    m_bOrderedDispatch = ordered;
+    if (m_bOrderedDispatch == false)
+    {
+        if (m_MsgRecvQueue.Init(queueSize) == false)
+        {
+            ngx_log_stderr(0, "CThreadPool::Create()中初始化收消息队列失败!");
+            return false;
+        }
+    }
+    else
+    {
+        // 总容量平摊到每个线程, 但每个线程的队列不能太小, 否则单个连接突发一批包就会被丢弃
+        int lanesize = queueSize / m_iThreadNum;
+        if (lanesize < 1024)
+        {
+            lanesize = 1024;
+        }
+        for (int i = 0; i < m_iThreadNum; ++i)
+        {
+            m_MsgLaneQueue.push_back(pQueue = new CMsgQueue());
+            if (pQueue->Init(lanesize) == false)
+            {
+                ngx_log_stderr(0, "CThreadPool::Create()中初始化线程%d的收消息队列失败!", i);
+                return false;
+            }
+        }
+    }
+
+    // (1) 创建线程池中所有线程
     for (int i = 0; i < m_iThreadNum; ++i)
     {
-        m_threadVector.push_back(pNew = new ThreadItem(this));
+        pQueue = m_bOrderedDispatch ? m_MsgLaneQueue[i] : &m_MsgRecvQueue;
+        m_threadVector.push_back(pNew = new ThreadItem(this, pQueue));
         err = pthread_create(&pNew->_Handle, NULL, ThreadFunc, pNew);
         if (err != 0)
         {
@@ -128,7 +146,7 @@ bool CThreadPool::Create(int threadNum)
         }
     }
 
-    // (2) 确保每个线程都运行到pthread_cond_wait(), 只有这样, 线程才能进行后续工作.
+    // (2) 确保每个线程都运行到等待消息处, 只有这样, 线程才能进行后续工作.
     bool allrunning;
     while (true)
     {
@@ -153,7 +171,7 @@ bool CThreadPool::Create(int threadNum)
 }
 
 // 描述: 使线程池中的所有线程安全退出
-// (1) 唤醒卡在 pthread_cond_wait() 的所有线程
+// (1) 唤醒睡眠等待消息的所有线程
 // (2) 调用 pthread_join() 来等待所有线程返回
 // (3) 释放(delete)线程池中的线程
 void CThreadPool::StopAll()
@@ -165,12 +183,11 @@ void CThreadPool::StopAll()
 
     m_shutdown = true;
 
-    // (1) 唤醒卡在pthread_cond_wait()的所有线程, 一定要在改变条件状态以后再给线程发信号
-    int err = pthread_cond_broadcast(&m_pthreadCond);
-    if (err != 0)
+    // (1) 唤醒睡眠等待消息的所有线程, 一定要在改变条件状态以后再唤醒
+    m_MsgRecvQueue.WakeAll();
+    for (auto laneiter = m_MsgLaneQueue.begin(); laneiter != m_MsgLaneQueue.end(); ++laneiter)
     {
-        ngx_log_stderr(err, "CThreadPool::StopAll() 中 pthread_cond_broadcast() 失败, 返回的错误码为%d!", err);
-        return;
+        (*laneiter)->WakeAll();
     }
 
     // (2) 调用pthread_join()来等待所有线程返回
@@ -180,9 +197,6 @@ void CThreadPool::StopAll()
         pthread_join((*iter)->_Handle, NULL);
     }
 
-    pthread_mutex_destroy(&m_pthreadMutex);
-    pthread_cond_destroy(&m_pthreadCond);
-
     // (3) 释放(delete)线程池中的线程
     for (iter = m_threadVector.begin(); iter != m_threadVector.end(); iter++)
     {
@@ -199,45 +213,45 @@ void CThreadPool::StopAll()
 
 // 描述: 收到一个完整消息后入消息队列, 并触发线程池中线程来处理该消息.
 // 参数buf: 实质为 pConn->precvMemPointer, new出来的, 保存"消息体+包头+包体"
-// (1) 把消息("消息体+包头+包体")入消息队列.
-// (2) 调用 Call() 来激发一个线程干活
+// (1) 把消息("消息体+包头+包体")入消息队列, 无锁, 队列满则丢弃该消息, epoll线程永不阻塞.
+//     按连接分派时, 根据消息头中的连接句柄选一个固定的线程队列.
+// (2) 调用 Call() 检查线程是否够用, 唤醒睡眠的线程在入队时已经做了.
 // 调用: CSocekt::ngx_wait_request_handler_proc_plast()
 void CThreadPool::inMsgRecvQueueAndSignal(char *buf)
 {
-    // (1) 把消息("消息体+包头+包体")入消息队列
-    int err = pthread_mutex_lock(&m_pthreadMutex); // 加锁
-    if (err != 0)
+    CMsgQueue *pQueue = &m_MsgRecvQueue;
+    if (m_bOrderedDispatch)
     {
-        ngx_log_stderr(err, "CThreadPool::inMsgRecvQueueAndSignal()-pthread_mutex_lock() 失败, 返回的错误码为 [%d].", err);
+        // 连接在连接池数组中的下标在其整个生命周期(包括被复用)内不变, 用它做哈希, 乘黄金分割数打散
+        uint64_t hash = (uint64_t)NGX_CONN_HANDLE_INDEX(CRecvBufPool::GetInstance()->MsgHeader(buf)->hConn) * 0x9E3779B97F4A7C15ULL;
+        pQueue = m_MsgLaneQueue[(hash >> 32) % m_iThreadNum];
     }
 
-    m_MsgRecvQueue.push_back(buf); // 入消息队列
-
-    err = pthread_mutex_unlock(&m_pthreadMutex); // 解锁
-    if (err != 0)
+    // (1) 把消息("消息体+包头+包体")入消息队列
+    if (pQueue->Push(buf) == false)
     {
-        ngx_log_stderr(err, "CThreadPool::inMsgRecvQueueAndSignal()-pthread_mutex_unlock() 失败, 返回的错误码为 [%d].", err);
+        // 队列满了, 说明逻辑线程处理不过来, 与其让epoll线程卡住, 不如丢掉这个包
+        CRecvBufPool::GetInstance()->FreeMsg(buf);
+        if (++m_iDiscardRecvPkgCount % 10000 == 1)
+        {
+            ngx_log_stderr(0, "CThreadPool::inMsgRecvQueueAndSignal()中收消息队列已满(%d), 丢弃数据包, 累计丢弃%d个.", (int)pQueue->Capacity(), (int)m_iDiscardRecvPkgCount);
+        }
+        return;
     }
 
-    // (2) 调用Call()来激发一个线程干活
+    // (2) 调用Call()检查线程是否够用
     Call();
 
     return;
 }
 
-// 描述: 来任务了, 取线程池中的一个线程去干活
+// 描述: 来任务了, 查看线程池中的线程是否够用. 唤醒睡眠的线程由 CMsgQueue::Push() 负责, 只有确实有线程睡着时才进内核.
 void CThreadPool::Call()
 {
-    int err = pthread_cond_signal(&m_pthreadCond); // 唤醒至少一个卡在 pthread_cond_wait() 的线程, 唤醒丢失怎么处理?
-    if (err != 0)
-    {
-        ngx_log_stderr(err, "CThreadPool::Call()中pthread_cond_signal()失败，返回的错误码为%d!", err);
-    }
-
     // 查看线程是否不够用
     if (m_iThreadNum == m_iRunningThreadNum)
     {
-        time_t currtime = time(NULL);
+        time_t currtime = ngx_time();
         if (currtime - m_iLastEmgTime > 10) // 两次报告之间的间隔必须超过10秒, 防止日志输出的太频繁
         {
             m_iLastEmgTime = currtime; // 更新时间
@@ -248,4 +262,4 @@ void CThreadPool::Call()
     return;
 }
 
-// 参考信号量解决方案：https://blog.csdn.net/yusiguyuan/article/details/20215591  linux多线程编程--信号量和条件变量 唤醒丢失事件
+// 无锁队列参考: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
@@ -0,0 +1,201 @@
+﻿
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ngx_c_timewheel.h"
+
+// ---------------------------------------
+// 和 分层时间轮 有关的函数放这里
+// ---------------------------------------
+
+#define NGX_TW_ROOT_MASK (NGX_TW_ROOT_SIZE - 1)
+#define NGX_TW_LEVEL_MASK (NGX_TW_LEVEL_SIZE - 1)
+#define NGX_TW_LEVEL_INDEX(t, n) (((t) >> (NGX_TW_ROOT_BITS + (n) * NGX_TW_LEVEL_BITS)) & NGX_TW_LEVEL_MASK) // 刻度t在第n层(从0算)中的槽
+
+// 构造函数
+CTimeWheel::CTimeWheel()
+{
+    m_current = 0;
+    m_iCount = 0;
+    for (int i = 0; i < NGX_TW_ROOT_SIZE; ++i)
+    {
+        ListInit(&m_root[i]);
+    }
+    for (int n = 0; n < NGX_TW_LEVELS; ++n)
+    {
+        for (int i = 0; i < NGX_TW_LEVEL_SIZE; ++i)
+        {
+            ListInit(&m_level[n][i]);
+        }
+    }
+}
+
+// 析构函数, 节点都是使用者的, 这里不用释放
+CTimeWheel::~CTimeWheel()
+{
+}
+
+void CTimeWheel::Init(time_t now)
+{
+    m_current = (uint64_t)now;
+}
+
+void CTimeWheel::ListInit(lpngx_timer_node_t head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+void CTimeWheel::ListAppend(lpngx_timer_node_t head, lpngx_timer_node_t node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void CTimeWheel::ListUnlink(lpngx_timer_node_t node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+// 按到期时间挂到对应的槽上: 离现在越远, 挂的层越高
+void CTimeWheel::Insert(lpngx_timer_node_t node)
+{
+    uint64_t expires = (uint64_t)node->expires;
+    lpngx_timer_node_t head;
+
+    if ((int64_t)(expires - m_current) < 0) // 已经过期的, 挂到下一个要处理的槽上
+    {
+        head = &m_root[m_current & NGX_TW_ROOT_MASK];
+    }
+    else
+    {
+        uint64_t idx = expires - m_current;
+        if (idx < NGX_TW_ROOT_SIZE)
+        {
+            head = &m_root[expires & NGX_TW_ROOT_MASK];
+        }
+        else
+        {
+            int level = 0;
+            while (level < NGX_TW_LEVELS - 1 && idx >= (1ULL << (NGX_TW_ROOT_BITS + (level + 1) * NGX_TW_LEVEL_BITS)))
+            {
+                ++level;
+            }
+            if (level == NGX_TW_LEVELS - 1 && idx >= (1ULL << (NGX_TW_ROOT_BITS + NGX_TW_LEVELS * NGX_TW_LEVEL_BITS)))
+            {
+                // 超出时间轮的范围(2^32秒), 先挂在能表示的最远处, 以后逐层往下落的时候会重新计算
+                expires = m_current + (1ULL << (NGX_TW_ROOT_BITS + NGX_TW_LEVELS * NGX_TW_LEVEL_BITS)) - 1;
+            }
+            head = &m_level[level][NGX_TW_LEVEL_INDEX(expires, level)];
+        }
+    }
+    ListAppend(head, node);
+}
+
+void CTimeWheel::Add(lpngx_timer_node_t node, time_t expires)
+{
+    if (IsActive(node))
+    {
+        ListUnlink(node);
+        --m_iCount;
+    }
+    node->expires = expires;
+    Insert(node);
+    ++m_iCount;
+}
+
+void CTimeWheel::Del(lpngx_timer_node_t node)
+{
+    if (IsActive(node))
+    {
+        ListUnlink(node);
+        --m_iCount;
+    }
+}
+
+// 把上层一个槽中的节点重新分配到下层, 它们离到期已经不到一整圈了
+void CTimeWheel::Cascade(int level, unsigned int index)
+{
+    ngx_timer_node_t head;
+    lpngx_timer_node_t slot = &m_level[level][index];
+    if (slot->next == slot)
+    {
+        return;
+    }
+
+    // 整个链表先挪到临时的表头上, 再逐个重新挂
+    head.next = slot->next;
+    head.prev = slot->prev;
+    head.next->prev = &head;
+    head.prev->next = &head;
+    ListInit(slot);
+
+    while (head.next != &head)
+    {
+        lpngx_timer_node_t node = head.next;
+        ListUnlink(node);
+        Insert(node);
+    }
+}
+
+// 一个刻度一个刻度地往前走, 直到now, 第0层走完一圈时从上层落一个槽下来.
+// 到期的节点摘下来(不再在时间轮中)放进expired.
+void CTimeWheel::Expire(time_t now, std::vector<lpngx_timer_node_t> &expired)
+{
+    while ((int64_t)((uint64_t)now - m_current) >= 0)
+    {
+        unsigned int index = m_current & NGX_TW_ROOT_MASK;
+        if (index == 0)
+        {
+            // 第0层走完一圈, 逐层往下落
+            for (int n = 0; n < NGX_TW_LEVELS; ++n)
+            {
+                unsigned int levelIndex = NGX_TW_LEVEL_INDEX(m_current, n);
+                Cascade(n, levelIndex);
+                if (levelIndex != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        lpngx_timer_node_t head = &m_root[index];
+        while (head->next != head)
+        {
+            lpngx_timer_node_t node = head->next;
+            ListUnlink(node);
+            --m_iCount;
+            expired.push_back(node);
+        }
+        ++m_current;
+    }
+}
+
+// 摘下所有节点
+void CTimeWheel::Clear()
+{
+    for (int i = 0; i < NGX_TW_ROOT_SIZE; ++i)
+    {
+        while (m_root[i].next != &m_root[i])
+        {
+            ListUnlink(m_root[i].next);
+        }
+    }
+    for (int n = 0; n < NGX_TW_LEVELS; ++n)
+    {
+        for (int i = 0; i < NGX_TW_LEVEL_SIZE; ++i)
+        {
+            while (m_level[n][i].next != &m_level[n][i])
+            {
+                ListUnlink(m_level[n][i].next);
+            }
+        }
+    }
+    m_iCount = 0;
+}
@@ -0,0 +1,1098 @@
+﻿#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "ngx_global.h"
+#include "ngx_func.h"
+#include "ngx_c_event.h"
+#include "ngx_c_socket.h"
+#include "ngx_c_lockmutex.h"
+
+// ---------------------------------------
+// 和 事件后端(epoll/io_uring) 有关的函数放这里
+// ---------------------------------------
+
+// 按配置创建一个事件后端, io_uring不可用(内核太老, 被禁用等)时退回epoll, 都失败返回NULL.
+// 调用: CSocekt::ngx_reactor_init()
+CEventBackend *CEventBackend::Create(int type, int size)
+{
+    CEventBackend *pBackend;
+
+#ifdef NGX_HAVE_IO_URING
+    if (type == NGX_EVENT_IO_URING)
+    {
+        pBackend = new CUringBackend();
+        if (pBackend->Init(size))
+        {
+            return pBackend;
+        }
+        delete pBackend;
+        ngx_log_stderr(0, "CEventBackend::Create()中io_uring不可用, 改用epoll.");
+    }
+#else
+    if (type == NGX_EVENT_IO_URING)
+    {
+        ngx_log_stderr(0, "CEventBackend::Create()中编译时没有io_uring支持, 改用epoll.");
+    }
+#endif
+
+    pBackend = new CEpollBackend();
+    if (pBackend->Init(size) == false)
+    {
+        delete pBackend;
+        return NULL;
+    }
+    return pBackend;
+}
+
+// 收数据, epoll后端就是recv(). 调用: CSocekt::recvproc()
+ssize_t CEventBackend::Recv(struct ngx_connection_s *pConn, char *buff, size_t len)
+{
+    return recv(pConn->fd, buff, len, 0);
+}
+
+// 取一个新连接, epoll后端就是accept4(). 调用: CSocekt::ngx_event_accept()
+int CEventBackend::Accept(struct ngx_connection_s *pConn, struct sockaddr *addr, socklen_t *addrlen)
+{
+    return accept4(pConn->fd, addr, addrlen, SOCK_NONBLOCK);
+}
+
+// epoll后端不支持异步发送, 发送缓冲区满了由调用者投递EPOLLOUT续发
+bool CEventBackend::SendAsync(struct ngx_connection_s *pConn, ngx_send_batch_t *pBatch)
+{
+    return false;
+}
+
+ngx_send_batch_t *CEventBackend::SendResult(struct ngx_connection_s *pConn)
+{
+    return NULL;
+}
+
+// -------------------------------- epoll --------------------------------
+
+CEpollBackend::CEpollBackend()
+{
+    m_epollhandle = -1;
+}
+
+CEpollBackend::~CEpollBackend()
+{
+    if (m_epollhandle != -1)
+    {
+        close(m_epollhandle);
+        m_epollhandle = -1;
+    }
+}
+
+// 创建epoll树
+bool CEpollBackend::Init(int size)
+{
+    m_epollhandle = epoll_create(size);
+    if (m_epollhandle == -1)
+    {
+        ngx_log_stderr(errno, "CEpollBackend::Init()中epoll_create()失败.");
+        return false;
+    }
+    return true;
+}
+
+int CEpollBackend::Ctl(int fd, int op, uint32_t events, struct ngx_connection_s *pConn)
+{
+    if (op == EPOLL_CTL_DEL)
+    {
+        return 1; // socket关闭时会自动从红黑树中移除, 不用专门删除
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = ngx_event_userdata(pConn); // 连接指针 + 序号, 取到事件时用来过滤过期事件
+    if (epoll_ctl(m_epollhandle, op, fd, &ev) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+int CEpollBackend::Wait(struct epoll_event *events, int maxevents, int timer)
+{
+    return epoll_wait(m_epollhandle, events, maxevents, timer);
+}
+
+#ifdef NGX_HAVE_IO_URING
+
+// -------------------------------- io_uring --------------------------------
+
+#define NGX_URING_SQ_ENTRIES 1024			   // 提交队列大小, 满了会先提交一次, 所以不用太大
+#define NGX_URING_RECV_BUFS 256				   // buffer ring中收数据缓冲区的个数, 必须是2的幂
+#define NGX_URING_RECV_BUF_SIZE 4096		   // 每个收数据缓冲区的大小
+#define NGX_URING_RECV_BGID 0				   // buffer ring的编号
+#define NGX_URING_RECV_TAG 1ULL				   // recv请求的user_data带这一位
+#define NGX_URING_ACCEPT_TAG 2ULL			   // accept请求的user_data带这一位
+#define NGX_URING_SEND_TAG 4ULL				   // sendmsg请求的user_data带这一位
+#define NGX_URING_TAG_MASK 7ULL
+
+// poll请求的user_data和epoll的一样, 用 ngx_event_userdata() 生成, 见ngx_c_socket.h.
+// recv/accept请求的user_data是同样的值再或上 NGX_URING_RECV_TAG/NGX_URING_ACCEPT_TAG, 连接对象按cache line对齐, 最低几位总是0, 正好用来区分同一个连接的几个请求.
+// sendmsg请求的user_data是那一批数据(ngx_send_batch_t, new出来的, 至少8字节对齐)的地址或上 NGX_URING_SEND_TAG, 一批中的几个请求都一样.
+// user_data为0的是 修改/撤销 请求本身的完成通知, 不用处理.
+
+CUringBackend::CUringBackend()
+{
+    m_ringfd = -1;
+    m_pSqRing = MAP_FAILED;
+    m_pCqRing = MAP_FAILED;
+    m_sqes = (struct io_uring_sqe *)MAP_FAILED;
+    m_iSqRingSize = 0;
+    m_iCqRingSize = 0;
+    m_iSqesSize = 0;
+    m_ifReactorKnown = false;
+    m_ifRecvSelect = false;
+    m_ifAcceptSelect = false;
+#ifdef NGX_HAVE_URING_RECV
+    m_pBufRing = (struct io_uring_buf_ring *)MAP_FAILED;
+    m_iBufRingSize = 0;
+    m_bufTail = 0;
+    m_pRecvBufs = NULL;
+#endif
+    pthread_mutex_init(&m_sqMutex, NULL);
+}
+
+CUringBackend::~CUringBackend()
+{
+    if (m_sqes != MAP_FAILED)
+    {
+        munmap(m_sqes, m_iSqesSize);
+    }
+    if (m_pCqRing != MAP_FAILED && m_pCqRing != m_pSqRing)
+    {
+        munmap(m_pCqRing, m_iCqRingSize);
+    }
+    if (m_pSqRing != MAP_FAILED)
+    {
+        munmap(m_pSqRing, m_iSqRingSize);
+    }
+    if (m_ringfd != -1)
+    {
+        close(m_ringfd);
+    }
+
+    // 还没发完/没被取回的数据, 和没被取走的新连接
+    for (auto pos = m_sendInflight.begin(); pos != m_sendInflight.end(); ++pos)
+    {
+        (*pos)->pfnFree(*pos);
+    }
+    for (auto pos = m_sendDone.begin(); pos != m_sendDone.end(); ++pos)
+    {
+        (*pos)->pfnFree(*pos);
+    }
+#ifdef NGX_HAVE_URING_ACCEPT
+    for (auto pos = m_acceptList.begin(); pos != m_acceptList.end(); ++pos)
+    {
+        if (pos->res >= 0)
+            close(pos->res);
+    }
+#endif
+#ifdef NGX_HAVE_URING_RECV
+    // io_uring关闭后内核才不再用这些缓冲区
+    if (m_pBufRing != MAP_FAILED)
+    {
+        munmap(m_pBufRing, m_iBufRingSize);
+    }
+    if (m_pRecvBufs != NULL)
+    {
+        delete[] m_pRecvBufs;
+    }
+#endif
+    pthread_mutex_destroy(&m_sqMutex);
+}
+
+// 创建io_uring, 把提交队列/完成队列映射到用户空间.
+// 需要 5.13 以上的内核: multishot poll, poll update, 带超时的等待(IORING_FEAT_EXT_ARG).
+bool CUringBackend::Init(int size)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = (size * 2 > NGX_URING_SQ_ENTRIES * 2) ? size * 2 : NGX_URING_SQ_ENTRIES * 2; // 每个连接最多同时有一个poll请求, 再留些余量
+
+    m_ringfd = (int)syscall(__NR_io_uring_setup, NGX_URING_SQ_ENTRIES, &params);
+    if (m_ringfd == -1)
+    {
+        ngx_log_stderr(errno, "CUringBackend::Init()中io_uring_setup()失败.");
+        return false;
+    }
+
+    // IORING_FEAT_RSRC_TAGS 和 multishot poll/poll update 同在5.13加入, 用它判断内核版本够不够
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_RSRC_TAGS) || !(params.features & IORING_FEAT_NODROP))
+    {
+        ngx_log_stderr(0, "CUringBackend::Init()中内核的io_uring版本太老(features=%xd).", params.features);
+        return false;
+    }
+
+    m_iSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    m_iCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) // SQ和CQ可以一起映射
+    {
+        if (m_iCqRingSize > m_iSqRingSize)
+            m_iSqRingSize = m_iCqRingSize;
+        m_iCqRingSize = m_iSqRingSize;
+    }
+
+    m_pSqRing = mmap(NULL, m_iSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+    if (m_pSqRing == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CUringBackend::Init()中mmap(IORING_OFF_SQ_RING)失败.");
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_pCqRing = m_pSqRing;
+    }
+    else
+    {
+        m_pCqRing = mmap(NULL, m_iCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_CQ_RING);
+        if (m_pCqRing == MAP_FAILED)
+        {
+            ngx_log_stderr(errno, "CUringBackend::Init()中mmap(IORING_OFF_CQ_RING)失败.");
+            return false;
+        }
+    }
+
+    m_iSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe *)mmap(NULL, m_iSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CUringBackend::Init()中mmap(IORING_OFF_SQES)失败.");
+        return false;
+    }
+
+    char *sq = (char *)m_pSqRing;
+    m_sqHead = (unsigned int *)(sq + params.sq_off.head);
+    m_sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    m_sqMask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    m_sqEntries = *(unsigned int *)(sq + params.sq_off.ring_entries);
+    m_sqArray = (unsigned int *)(sq + params.sq_off.array);
+
+    char *cq = (char *)m_pCqRing;
+    m_cqHead = (unsigned int *)(cq + params.cq_off.head);
+    m_cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    m_cqMask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+#ifdef NGX_HAVE_URING_RECV
+    m_ifRecvSelect = InitRecvBufs(); // 失败了就还是poll + recv(), 不算错误
+#endif
+#ifdef NGX_HAVE_URING_ACCEPT
+    m_ifAcceptSelect = true; // 5.19以前的内核第一个accept请求会以-EINVAL结束, 那时再退回poll, 见Wait()
+#endif
+    return true;
+}
+
+// 取一个空闲的SQE, SQ满了先提交一次. 调用者要持有 m_sqMutex, 填好后调用 __atomic_store_n(m_sqTail) 发布.
+struct io_uring_sqe *CUringBackend::GetSqe()
+{
+    unsigned int tail = *m_sqTail;
+    if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+    {
+        SubmitPending();
+        if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned int index = tail & m_sqMask;
+    struct io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    m_sqArray[index] = index;
+    return sqe;
+}
+
+// 保证SQ中至少有count个空闲的SQE, 不够先提交一次. 几个要一起投递的请求(比如链在一起的sendmsg), 先调用它, 就不会只放进去一半.
+// 调用者要持有 m_sqMutex
+bool CUringBackend::ReserveSqes(unsigned int count)
+{
+    if (*m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) + count > m_sqEntries)
+    {
+        SubmitPending();
+        if (*m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) + count > m_sqEntries)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 填一个撤销请求, 按user_data找到要撤销的请求
+void CUringBackend::PrepCancel(struct io_uring_sqe *sqe, uint64_t userdata)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = userdata;
+    sqe->user_data = 0;
+}
+
+// 填一个poll请求, 有EPOLLET用multishot(内核的poll请求默认就是边缘触发), 否则是一次性的
+void CUringBackend::PrepPoll(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t userdata)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events & ~EPOLLET;
+    sqe->len = (events & EPOLLET) ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = userdata;
+}
+
+int CUringBackend::Enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags, int timer)
+{
+    if ((flags & IORING_ENTER_GETEVENTS) && timer > 0)
+    {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (long long)(timer % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        return (int)syscall(__NR_io_uring_enter, m_ringfd, toSubmit, minComplete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    return (int)syscall(__NR_io_uring_enter, m_ringfd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+// 把SQ中还没提交的请求提交给内核, 调用者要持有 m_sqMutex
+int CUringBackend::SubmitPending()
+{
+    unsigned int toSubmit = *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (toSubmit == 0)
+    {
+        return 0;
+    }
+    return Enter(toSubmit, 0, 0, 0);
+}
+
+// 客户端连接(不是监听socket)并且内核支持时, 读用multishot recv. 监听socket的listening->connection就是它自己.
+bool CUringBackend::IsRecvConn(struct ngx_connection_s *pConn)
+{
+    return m_ifRecvSelect && !(pConn->listening != NULL && pConn->listening->connection == pConn);
+}
+
+// 监听socket并且内核支持时, 用multishot accept
+bool CUringBackend::IsAcceptConn(struct ngx_connection_s *pConn)
+{
+    return m_ifAcceptSelect && pConn->listening != NULL && pConn->listening->connection == pConn;
+}
+
+// poll请求要关心的事件: 读用multishot recv的连接, poll请求只管EPOLLOUT(EPOLLERR/EPOLLHUP内核总是会报)
+uint32_t CUringBackend::PollEvents(struct ngx_connection_s *pConn, uint32_t events)
+{
+    return IsRecvConn(pConn) ? (events & ~(uint32_t)(EPOLLIN | EPOLLRDHUP)) : events;
+}
+
+// ADD: 投递poll请求(和recv请求); MOD: 用poll update修改正在等待的poll请求的事件; DEL: 撤销poll请求(和recv请求, 还没发完的sendmsg请求).
+// 监听socket用multishot accept时, ADD投递accept请求, 去掉EPOLLIN的MOD(不再接受新连接)和DEL撤销它.
+// 一次性poll已经触发还没重新投递时, MOD会失败(ENOENT), 没关系, 重新投递时用的是 pConn->events 中最新的事件.
+// 调用者(CSocekt::zdClosesocketProc())在DEL之前已经把 pConn->fd 置为-1, 重新投递时看到-1就不会再投递.
+int CUringBackend::Ctl(int fd, int op, uint32_t events, struct ngx_connection_s *pConn)
+{
+    CLock lock(&m_sqMutex);
+
+    uint64_t userdata = ngx_event_userdata(pConn);
+    bool bRecv = (op != EPOLL_CTL_MOD && IsRecvConn(pConn));
+    ngx_send_batch_t *pSending = NULL;
+    if (op == EPOLL_CTL_DEL)
+    {
+        for (auto pos = m_sendInflight.begin(); pos != m_sendInflight.end() && pSending == NULL; ++pos)
+        {
+            if ((*pos)->userdata == userdata)
+                pSending = *pos;
+        }
+    }
+
+    // 这次要放的请求一起保证有地方, 不会只投递了一半
+    if (!ReserveSqes(1 + (bRecv ? 1 : 0) + (pSending != NULL ? 1 : 0)))
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = GetSqe();
+    if (IsAcceptConn(pConn))
+    {
+#ifdef NGX_HAVE_URING_ACCEPT
+        if (op == EPOLL_CTL_ADD)
+        {
+            PrepAccept(sqe, fd, userdata);
+        }
+        else if (op == EPOLL_CTL_MOD && (events & EPOLLIN))
+        {
+            sqe->opcode = IORING_OP_NOP; // accept请求一直有效, 不用改
+            sqe->user_data = 0;
+        }
+        else
+        {
+            PrepCancel(sqe, userdata | NGX_URING_ACCEPT_TAG);
+            for (auto pos = m_acceptRearm.begin(); pos != m_acceptRearm.end(); ++pos)
+            {
+                if (*pos == userdata)
+                {
+                    m_acceptRearm.erase(pos);
+                    break;
+                }
+            }
+        }
+#endif
+    }
+    else if (op == EPOLL_CTL_ADD)
+    {
+        PrepPoll(sqe, fd, PollEvents(pConn, events), userdata);
+    }
+    else if (op == EPOLL_CTL_MOD)
+    {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = userdata; // 要修改的poll请求
+        sqe->poll32_events = PollEvents(pConn, events) & ~EPOLLET;
+        sqe->len = IORING_POLL_UPDATE_EVENTS | ((events & EPOLLET) ? IORING_POLL_ADD_MULTI : 0);
+        sqe->user_data = 0;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = userdata; // 要撤销的poll请求
+        sqe->user_data = 0;
+    }
+    __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+
+#ifdef NGX_HAVE_URING_RECV
+    // recv请求: ADD时投递, DEL时撤销, MOD不用管
+    if (bRecv)
+    {
+        sqe = GetSqe();
+        if (op == EPOLL_CTL_ADD)
+        {
+            PrepRecv(sqe, fd, userdata);
+        }
+        else
+        {
+            PrepCancel(sqe, userdata | NGX_URING_RECV_TAG);
+        }
+        __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+    }
+#endif
+
+    // 还没发完的sendmsg请求: 对方不收数据的话会一直等下去, 也持有socket的引用. 撤销正在发的那个, 链在后面的都会以-ECANCELED结束
+    if (pSending != NULL)
+    {
+        sqe = GetSqe();
+        PrepCancel(sqe, (uint64_t)(uintptr_t)pSending | NGX_URING_SEND_TAG);
+        __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+    }
+
+    // reactor线程自己放的, 等下一次Wait()一起提交; 别的线程放的要当场提交, reactor线程可能正睡着
+    if (!m_ifReactorKnown || !pthread_equal(m_reactorThread, pthread_self()))
+    {
+        if (SubmitPending() < 0)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// (1) 重新投递上一轮结束了的一次性poll请求/recv请求/accept请求(连接还没关闭的)
+// (2) 提交所有请求, 完成队列为空并且没有收到了还没取走的数据(新连接)时顺便等待, 一次 io_uring_enter()
+// (3) 从完成队列中取出事件, 转成 struct epoll_event. recv请求收到的数据先放进 m_recvList, 每个有数据的连接报一个EPOLLIN,
+//     数据没取完的下一轮接着报(同LT), 所以ET/LT模式下读处理函数都不用变. accept请求取到的新连接放进 m_acceptList, 同样处理.
+//     一批sendmsg请求全部完成时报一个EPOLLOUT, 结果放进 m_sendDone 等写处理函数取回.
+int CUringBackend::Wait(struct epoll_event *events, int maxevents, int timer)
+{
+    for (;;)
+    {
+        unsigned int toSubmit;
+        {
+            CLock lock(&m_sqMutex);
+            if (!m_ifReactorKnown)
+            {
+                m_reactorThread = pthread_self();
+                m_ifReactorKnown = true;
+            }
+
+            // (1) 重新投递, 此时上一轮的事件都已经处理完了
+            for (auto pos = m_rearmList.begin(); pos != m_rearmList.end(); ++pos)
+            {
+                uint64_t userdata = *pos & ~NGX_URING_TAG_MASK;
+                lpngx_connection_t pConn = ngx_event_conn(userdata);
+                if (pConn->fd == -1 || ngx_event_expired(userdata)) // 连接已经关闭或者被回收
+                {
+                    continue;
+                }
+                struct io_uring_sqe *sqe = GetSqe();
+                if (sqe == NULL)
+                {
+                    ngx_log_stderr(0, "CUringBackend::Wait()中SQ满, 连接%d的请求没能重新投递.", pConn->fd);
+                    continue;
+                }
+#ifdef NGX_HAVE_URING_RECV
+                if (*pos & NGX_URING_RECV_TAG)
+                {
+                    PrepRecv(sqe, pConn->fd, userdata);
+                }
+                else
+#endif
+#ifdef NGX_HAVE_URING_ACCEPT
+                if (*pos & NGX_URING_ACCEPT_TAG)
+                {
+                    PrepAccept(sqe, pConn->fd, userdata);
+                }
+                else
+#endif
+                {
+                    PrepPoll(sqe, pConn->fd, PollEvents(pConn, pConn->events), userdata);
+                }
+                __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+            }
+            m_rearmList.clear();
+            toSubmit = *m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        }
+
+        int n = 0;
+        ReapSendDone();
+#ifdef NGX_HAVE_URING_ACCEPT
+        // 上一轮没取完的新连接, 每个监听socket先报一个EPOLLIN, 不能阻塞等待
+        ReapAcceptList();
+        for (size_t i = 0; i < m_acceptList.size() && n < maxevents; ++i)
+        {
+            size_t j = 0;
+            while (j < i && m_acceptList[j].userdata != m_acceptList[i].userdata)
+                ++j;
+            if (j == i)
+            {
+                events[n].events = EPOLLIN;
+                events[n].data.u64 = m_acceptList[i].userdata;
+                ++n;
+            }
+        }
+#endif
+#ifdef NGX_HAVE_URING_RECV
+        // 上一轮没取完的数据, 每个连接先报一个EPOLLIN, 不能阻塞等待
+        ReapRecvList();
+        for (size_t i = 0; i < m_recvList.size() && n < maxevents; ++i)
+        {
+            size_t j = 0;
+            while (j < i && m_recvList[j].userdata != m_recvList[i].userdata)
+                ++j;
+            if (j == i)
+            {
+                events[n].events = EPOLLIN;
+                events[n].data.u64 = m_recvList[i].userdata;
+                ++n;
+            }
+        }
+#endif
+        if (n > 0)
+        {
+            timer = 0;
+        }
+
+        // (2) 提交, 完成队列为空就等待
+        int ret = 0;
+        bool cqEmpty = (*m_cqHead == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE));
+        if (cqEmpty && timer != 0)
+        {
+            ret = Enter(toSubmit, 1, IORING_ENTER_GETEVENTS, timer);
+        }
+        else if (toSubmit > 0)
+        {
+            ret = Enter(toSubmit, 0, 0, 0);
+        }
+        if (ret < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN && n == 0)
+        {
+            return -1; // 包括EINTR, 由调用者按epoll_wait()的返回值处理
+        }
+
+        // (3) 取事件
+        unsigned int head = *m_cqHead;
+        unsigned int tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail && n < maxevents)
+        {
+            struct io_uring_cqe *cqe = &m_cqes[head & m_cqMask];
+            uint64_t userdata = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            ++head;
+
+            if ((userdata & NGX_URING_TAG_MASK) == NGX_URING_SEND_TAG)
+            {
+                // 一批中的sendmsg请求按顺序完成, 前面的没发完(出错/被撤销), 后面的都以-ECANCELED结束
+                ngx_send_batch_t *pBatch = (ngx_send_batch_t *)(uintptr_t)(userdata & ~NGX_URING_TAG_MASK);
+                if (res > 0)
+                    pBatch->sent += res;
+                else if (res < 0 && res != -ECANCELED && pBatch->err == 0)
+                    pBatch->err = -res;
+                if (--pBatch->pending > 0)
+                {
+                    continue;
+                }
+
+                {
+                    CLock lock(&m_sqMutex);
+                    for (auto pos = m_sendInflight.begin(); pos != m_sendInflight.end(); ++pos)
+                    {
+                        if (*pos == pBatch)
+                        {
+                            m_sendInflight.erase(pos);
+                            break;
+                        }
+                    }
+                }
+                if (ngx_event_expired(pBatch->userdata) || ngx_event_conn(pBatch->userdata)->fd == -1) // 连接已经关闭, 没人取回了
+                {
+                    pBatch->pfnFree(pBatch);
+                    continue;
+                }
+                m_sendDone.push_back(pBatch);
+                events[n].events = EPOLLOUT;
+                events[n].data.u64 = pBatch->userdata;
+                ++n;
+                continue;
+            }
+
+#ifdef NGX_HAVE_URING_ACCEPT
+            if ((userdata & NGX_URING_TAG_MASK) == NGX_URING_ACCEPT_TAG)
+            {
+                userdata &= ~NGX_URING_TAG_MASK;
+                lpngx_connection_t pConn = ngx_event_conn(userdata);
+                if (ngx_event_expired(userdata) || pConn->fd == -1 || res == -ECANCELED) // 监听socket已经关闭, 或者不再接受新连接
+                {
+                    if (res >= 0)
+                        close(res);
+                    continue;
+                }
+
+                if (res == -EINVAL) // 5.19以前的内核没有multishot accept, 退回poll + accept4()
+                {
+                    if (m_ifAcceptSelect)
+                    {
+                        CLock lock(&m_sqMutex);
+                        m_ifAcceptSelect = false;
+                        ngx_log_stderr(0, "CUringBackend::Wait()中内核不支持multishot accept, 改用poll.");
+                    }
+                    Ctl(pConn->fd, EPOLL_CTL_ADD, pConn->events, pConn);
+                    continue;
+                }
+
+                // 被内核结束了: 出错(比如fd用尽)的等Accept()把错误交出去并取空了再重新投递, 其他原因的下一轮重新投递
+                if (!(flags & IORING_CQE_F_MORE))
+                {
+                    if (res >= 0)
+                        m_rearmList.push_back(userdata | NGX_URING_ACCEPT_TAG);
+                    else
+                        m_acceptRearm.push_back(userdata);
+                }
+
+                // 新连接(或者错误)放进 m_acceptList, 这个监听socket还没有待取的才报EPOLLIN
+                bool reported = false;
+                for (auto pos = m_acceptList.begin(); pos != m_acceptList.end() && !reported; ++pos)
+                {
+                    reported = (pos->userdata == userdata);
+                }
+                ngx_uring_accept_t item;
+                item.userdata = userdata;
+                item.res = res;
+                m_acceptList.push_back(item);
+                if (!reported)
+                {
+                    events[n].events = EPOLLIN;
+                    events[n].data.u64 = userdata;
+                    ++n;
+                }
+                continue;
+            }
+#endif
+
+#ifdef NGX_HAVE_URING_RECV
+            if (userdata & NGX_URING_RECV_TAG)
+            {
+                userdata &= ~NGX_URING_RECV_TAG;
+                bool expired = ngx_event_expired(userdata) || ngx_event_conn(userdata)->fd == -1;
+                if (expired || res == -ECANCELED) // 连接已经关闭, 数据不要了
+                {
+                    if (flags & IORING_CQE_F_BUFFER)
+                        PutRecvBuf((unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT));
+                    continue;
+                }
+
+                if (res == -EINVAL && m_ifRecvSelect) // 5.19的内核有buffer ring但没有multishot recv, 退回poll + recv()
+                {
+                    CLock lock(&m_sqMutex);
+                    m_ifRecvSelect = false;
+                    ngx_log_stderr(0, "CUringBackend::Wait()中内核不支持multishot recv, 改用poll.");
+                }
+                if (!m_ifRecvSelect) // 已经退回poll, 这个连接的poll请求加上EPOLLIN
+                {
+                    lpngx_connection_t pConn = ngx_event_conn(userdata);
+                    Ctl(pConn->fd, EPOLL_CTL_MOD, pConn->events, pConn);
+                    continue;
+                }
+
+                if (!(flags & IORING_CQE_F_MORE) && (res > 0 || res == -ENOBUFS)) // 缓冲区用完等原因被内核结束, 下一轮重新投递
+                {
+                    m_rearmList.push_back(userdata | NGX_URING_RECV_TAG);
+                }
+                if (res == -ENOBUFS)
+                {
+                    continue;
+                }
+
+                // 数据(或者 对方关闭/出错 的结果)放进 m_recvList, 这个连接还没有待取的数据才报EPOLLIN
+                bool reported = false;
+                for (auto pos = m_recvList.begin(); pos != m_recvList.end() && !reported; ++pos)
+                {
+                    reported = (pos->userdata == userdata);
+                }
+                ngx_uring_recv_t item;
+                item.userdata = userdata;
+                item.res = res;
+                item.bid = (flags & IORING_CQE_F_BUFFER) ? (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT) : 0;
+                item.off = 0;
+                m_recvList.push_back(item);
+                if (!reported)
+                {
+                    events[n].events = EPOLLIN;
+                    events[n].data.u64 = userdata;
+                    ++n;
+                }
+                continue;
+            }
+#endif
+
+            if (userdata == 0 || ngx_event_expired(userdata)) // 修改/撤销请求的完成通知, 或者过期事件
+            {
+                continue;
+            }
+
+            if (!(flags & IORING_CQE_F_MORE)) // poll请求已经结束(一次性poll触发了, 或者multishot被内核终止), 处理完事件后要重新投递
+            {
+                m_rearmList.push_back(userdata);
+            }
+            if (res <= 0)
+            {
+                continue;
+            }
+
+            events[n].events = (uint32_t)res;
+            events[n].data.u64 = userdata;
+            ++n;
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+        // 取到的都是过期事件/内部通知, 阻塞等待的话接着等
+        if (n == 0 && timer == -1)
+        {
+            continue;
+        }
+        return n;
+    }
+}
+
+// 从 m_recvList 中取出这个连接收到的数据, 可以跨多个缓冲区, 最多取len字节. 同recv(): 返回取到的字节数, 对方关闭返回0, 出错返回-1.
+// 前面的数据没取完之前不会返回 对方关闭/出错, 和recv()一样.
+// 调用: CSocekt::recvproc()
+ssize_t CUringBackend::Recv(struct ngx_connection_s *pConn, char *buff, size_t len)
+{
+#ifdef NGX_HAVE_URING_RECV
+    uint64_t userdata = ngx_event_userdata(pConn);
+    size_t n = 0;
+    for (auto pos = m_recvList.begin(); pos != m_recvList.end() && n < len; ++pos)
+    {
+        if (pos->userdata != userdata)
+        {
+            continue;
+        }
+        if (pos->res <= 0)
+        {
+            if (n > 0)
+            {
+                break; // 先把前面的数据交出去
+            }
+            pos->userdata = 0;
+            if (pos->res == 0)
+            {
+                return 0;
+            }
+            errno = -pos->res;
+            return -1;
+        }
+
+        size_t size = (size_t)(pos->res - pos->off);
+        size = (size < len - n) ? size : len - n;
+        memcpy(buff + n, m_pRecvBufs + (size_t)pos->bid * NGX_URING_RECV_BUF_SIZE + pos->off, size);
+        n += size;
+        pos->off += (int)size;
+        if (pos->off == pos->res)
+        {
+            PutRecvBuf(pos->bid);
+            pos->userdata = 0;
+        }
+    }
+    if (n > 0)
+    {
+        return (ssize_t)n;
+    }
+    if (IsRecvConn(pConn))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    return CEventBackend::Recv(pConn, buff, len);
+}
+
+// 从 m_acceptList 中取出这个监听socket的一个新连接. 同accept4(SOCK_NONBLOCK): 返回新连接的fd, 没有了返回-1, errno为EAGAIN.
+// 调用: CSocekt::ngx_event_accept()
+int CUringBackend::Accept(struct ngx_connection_s *pConn, struct sockaddr *addr, socklen_t *addrlen)
+{
+#ifdef NGX_HAVE_URING_ACCEPT
+    if (IsAcceptConn(pConn))
+    {
+        uint64_t userdata = ngx_event_userdata(pConn);
+        for (auto pos = m_acceptList.begin(); pos != m_acceptList.end(); ++pos)
+        {
+            if (pos->userdata != userdata)
+            {
+                continue;
+            }
+            int res = pos->res;
+            m_acceptList.erase(pos);
+            if (res < 0)
+            {
+                errno = -res;
+                return -1;
+            }
+            // multishot accept的完成通知里没有对方地址(几个新连接共用一个请求, 没地方放), 另外取
+            if (getpeername(res, addr, addrlen) == -1)
+            {
+                memset(addr, 0, *addrlen);
+            }
+            return res;
+        }
+
+        // 取空了, 出错结束的accept请求这时才重新投递
+        for (auto pos = m_acceptRearm.begin(); pos != m_acceptRearm.end(); ++pos)
+        {
+            if (*pos != userdata)
+            {
+                continue;
+            }
+            m_acceptRearm.erase(pos);
+            CLock lock(&m_sqMutex);
+            struct io_uring_sqe *sqe = GetSqe();
+            if (sqe != NULL)
+            {
+                PrepAccept(sqe, pConn->fd, userdata);
+                __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+            }
+            break;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    return CEventBackend::Accept(pConn, addr, addrlen);
+}
+
+// 把一批数据交给内核异步发送: 每组iov一个sendmsg请求, 用IOSQE_IO_LINK链起来按顺序发, MSG_WAITALL让内核等发送缓冲区有地方了接着发.
+// SQ放不下整批时返回false, 由调用者退回EPOLLOUT续发.
+// 调用者要持有 pConn->sendMutex. 调用: CSocekt::sendAsyncProc()
+bool CUringBackend::SendAsync(struct ngx_connection_s *pConn, ngx_send_batch_t *pBatch)
+{
+    CLock lock(&m_sqMutex);
+    if (pBatch->links <= 0 || !ReserveSqes((unsigned int)pBatch->links))
+    {
+        return false;
+    }
+
+    pBatch->userdata = ngx_event_userdata(pConn);
+    pBatch->pending = pBatch->links;
+    pBatch->sent = 0;
+    pBatch->err = 0;
+    m_sendInflight.push_back(pBatch);
+    for (int i = 0; i < pBatch->links; ++i)
+    {
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = pConn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&pBatch->msg[i];
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = (i + 1 < pBatch->links) ? IOSQE_IO_LINK : 0;
+        sqe->user_data = (uint64_t)(uintptr_t)pBatch | NGX_URING_SEND_TAG;
+        __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+    }
+
+    // 同Ctl(), 逻辑线程放的要当场提交; 提交失败的留在SQ中, 下一次Wait()时再提交
+    if (!m_ifReactorKnown || !pthread_equal(m_reactorThread, pthread_self()))
+    {
+        SubmitPending();
+    }
+    return true;
+}
+
+// 取回这个连接发完了的那一批(Wait()为它报了EPOLLOUT), 只在reactor线程中调用. 调用: CSocekt::ngx_write_request_handler()
+ngx_send_batch_t *CUringBackend::SendResult(struct ngx_connection_s *pConn)
+{
+    uint64_t userdata = ngx_event_userdata(pConn);
+    for (auto pos = m_sendDone.begin(); pos != m_sendDone.end(); ++pos)
+    {
+        if ((*pos)->userdata == userdata)
+        {
+            ngx_send_batch_t *pBatch = *pos;
+            m_sendDone.erase(pos);
+            return pBatch;
+        }
+    }
+    return NULL;
+}
+
+// 发完了但连接在写处理函数取回之前关闭(或被回收)了, 数据释放掉
+void CUringBackend::ReapSendDone()
+{
+    size_t keep = 0;
+    for (size_t i = 0; i < m_sendDone.size(); ++i)
+    {
+        ngx_send_batch_t *pBatch = m_sendDone[i];
+        if (ngx_event_expired(pBatch->userdata) || ngx_event_conn(pBatch->userdata)->fd == -1)
+        {
+            pBatch->pfnFree(pBatch);
+            continue;
+        }
+        m_sendDone[keep++] = pBatch;
+    }
+    m_sendDone.resize(keep);
+}
+
+#ifdef NGX_HAVE_URING_RECV
+
+// 创建buffer ring(和内核共享的一块内存, 按页对齐), 注册给io_uring, 再把所有收数据缓冲区放进去.
+// 需要5.19以上的内核, multishot recv需要6.0以上, 只有buffer ring没有multishot recv时第一个recv请求会以-EINVAL结束(见Wait()).
+bool CUringBackend::InitRecvBufs()
+{
+    m_iBufRingSize = NGX_URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    void *pRing = mmap(NULL, m_iBufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pRing == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CUringBackend::InitRecvBufs()中mmap()失败, 不使用multishot recv.");
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)pRing;
+    reg.ring_entries = NGX_URING_RECV_BUFS;
+    reg.bgid = NGX_URING_RECV_BGID;
+    if (syscall(__NR_io_uring_register, m_ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        ngx_log_stderr(errno, "CUringBackend::InitRecvBufs()中io_uring_register(IORING_REGISTER_PBUF_RING)失败, 不使用multishot recv.");
+        munmap(pRing, m_iBufRingSize);
+        return false;
+    }
+    m_pBufRing = (struct io_uring_buf_ring *)pRing;
+    m_pRecvBufs = new char[(size_t)NGX_URING_RECV_BUFS * NGX_URING_RECV_BUF_SIZE];
+
+    m_bufTail = 0;
+    for (unsigned short bid = 0; bid < NGX_URING_RECV_BUFS; ++bid)
+    {
+        PutRecvBuf(bid);
+    }
+    return true;
+}
+
+// 填一个multishot recv请求: 有数据就从buffer ring中取一个缓冲区收进去, 一次投递一直有效
+void CUringBackend::PrepRecv(struct io_uring_sqe *sqe, int fd, uint64_t userdata)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = 0;
+    sqe->len = 0; // multishot recv要求为0, 每次收多少由缓冲区大小决定
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NGX_URING_RECV_BGID;
+    sqe->user_data = userdata | NGX_URING_RECV_TAG;
+}
+
+// 缓冲区用完, 放回buffer ring的末尾, 内核就又可以用了
+void CUringBackend::PutRecvBuf(unsigned short bid)
+{
+    // 不能用 m_pBufRing->bufs[]: 头文件里它是用 __DECLARE_FLEX_ARRAY 声明的, 前面有个空结构体, C++中空结构体占1字节, bufs会往后错8字节.
+    // buffer ring就是一个 struct io_uring_buf 数组, tail和第0项的resv重叠.
+    struct io_uring_buf *pBuf = (struct io_uring_buf *)m_pBufRing + (m_bufTail & (NGX_URING_RECV_BUFS - 1));
+    pBuf->addr = (uint64_t)(uintptr_t)(m_pRecvBufs + (size_t)bid * NGX_URING_RECV_BUF_SIZE);
+    pBuf->len = NGX_URING_RECV_BUF_SIZE;
+    pBuf->bid = bid;
+    ++m_bufTail;
+    __atomic_store_n(&m_pBufRing->tail, m_bufTail, __ATOMIC_RELEASE);
+}
+
+// 去掉 m_recvList 中已经取完的; 连接已经关闭(或被回收)的, 数据不要了, 缓冲区还回去
+void CUringBackend::ReapRecvList()
+{
+    size_t keep = 0;
+    for (size_t i = 0; i < m_recvList.size(); ++i)
+    {
+        ngx_uring_recv_t &item = m_recvList[i];
+        if (item.userdata != 0 && (ngx_event_expired(item.userdata) || ngx_event_conn(item.userdata)->fd == -1))
+        {
+            if (item.res > 0)
+                PutRecvBuf(item.bid);
+            item.userdata = 0;
+        }
+        if (item.userdata != 0)
+        {
+            m_recvList[keep++] = item;
+        }
+    }
+    m_recvList.resize(keep);
+}
+
+#endif
+
+#ifdef NGX_HAVE_URING_ACCEPT
+
+// 填一个multishot accept请求: 一次投递一直有效, 每来一个新连接内核就accept好, fd随完成通知回来
+void CUringBackend::PrepAccept(struct io_uring_sqe *sqe, int fd, uint64_t userdata)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = 0; // 不要对方地址, 见Accept()
+    sqe->addr2 = 0;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = userdata | NGX_URING_ACCEPT_TAG;
+}
+
+// 去掉 m_acceptList 中监听socket已经关闭(或被回收)的, 新连接没人要了, 关掉
+void CUringBackend::ReapAcceptList()
+{
+    size_t keep = 0;
+    for (size_t i = 0; i < m_acceptList.size(); ++i)
+    {
+        ngx_uring_accept_t &item = m_acceptList[i];
+        if (ngx_event_expired(item.userdata) || ngx_event_conn(item.userdata)->fd == -1)
+        {
+            if (item.res >= 0)
+                close(item.res);
+            continue;
+        }
+        m_acceptList[keep++] = item;
+    }
+    m_acceptList.resize(keep);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,150 @@
+﻿#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ngx_global.h"
+#include "ngx_func.h"
+#include "ngx_c_recvbuf.h"
+#include "ngx_c_memory.h"
+
+// --------------------------------------------
+// 和 零拷贝收包的缓冲区池 有关的函数放这里
+// --------------------------------------------
+
+static_assert(sizeof(ngx_recvbuf_t) <= NGX_RECVBUF_HEAD, "ngx_recvbuf_t should fit in NGX_RECVBUF_HEAD");
+
+// 类静态成员
+CRecvBufPool *CRecvBufPool::m_instance = NULL;
+
+// 构造函数
+CRecvBufPool::CRecvBufPool()
+{
+    m_pArena = NULL;
+    m_pMapAddr = NULL;
+    m_iMapSize = 0;
+    m_iArenaSize = 0;
+    m_iBufSize = 0;
+    m_iCount = 0;
+    m_freeTop = 0;
+    m_iFreeCount = 0;
+}
+
+// 析构函数
+CRecvBufPool::~CRecvBufPool()
+{
+    if (m_pMapAddr != NULL)
+    {
+        munmap(m_pMapAddr, m_iMapSize);
+        m_pMapAddr = NULL;
+    }
+}
+
+// 初始化: 映射一块 bufSize * (count + 1) 的内存, 从中取出按bufSize对齐的 bufSize * count 作为arena.
+// 用MAP_NORESERVE, 没用到的缓冲区不占物理内存.
+// 调用: CSocekt::ngx_epoll_init()
+bool CRecvBufPool::Init(int bufSize, int count)
+{
+    m_iBufSize = bufSize;
+    m_iCount = count;
+    m_iMapSize = (size_t)bufSize * (count + 1);
+    void *pAddr = mmap(NULL, m_iMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pAddr == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CRecvBufPool::Init()中mmap()失败, 大小: %uL.", (uint64_t)m_iMapSize);
+        return false;
+    }
+    m_pMapAddr = (char *)pAddr;
+    m_pArena = (char *)(((uintptr_t)pAddr + bufSize - 1) & ~(uintptr_t)(bufSize - 1));
+
+    // 倒着压栈, 先分配出去的是下标小的
+    for (int i = count - 1; i >= 0; --i)
+    {
+        lpngx_recvbuf_t pBuf = (lpngx_recvbuf_t)(m_pArena + (size_t)i * bufSize);
+        pBuf->index = i;
+        pBuf->iRefCount.store(1, std::memory_order_relaxed);
+        Release(pBuf);
+    }
+    m_iArenaSize = (size_t)bufSize * count; // 最后再设, 之前Contains()总是false
+    return true;
+}
+
+// 取一个缓冲区, 引用计数为1, 池空返回NULL.
+// reactor线程取, 逻辑线程/reactor线程还, 用带版本号的CAS.
+lpngx_recvbuf_t CRecvBufPool::Get(ngx_conn_handle_t hConn)
+{
+    lpngx_recvbuf_t pBuf = NULL;
+    uint64_t oldTop = m_freeTop.load(std::memory_order_acquire);
+    while ((uint32_t)oldTop != 0)
+    {
+        pBuf = (lpngx_recvbuf_t)(m_pArena + (size_t)((uint32_t)oldTop - 1) * m_iBufSize);
+        lpngx_recvbuf_t pNext = __atomic_load_n(&pBuf->next, __ATOMIC_RELAXED);
+        uint64_t newTop = ((oldTop >> 32) + 1) << 32 | (pNext != NULL ? pNext->index + 1 : 0);
+        if (m_freeTop.compare_exchange_weak(oldTop, newTop, std::memory_order_acquire, std::memory_order_acquire))
+        {
+            break;
+        }
+        pBuf = NULL;
+    }
+
+    if (pBuf == NULL)
+    {
+        return NULL;
+    }
+    --m_iFreeCount;
+
+    pBuf->iRefCount.store(1, std::memory_order_relaxed);
+    pBuf->msgHeader.hConn = hConn;
+    return pBuf;
+}
+
+// 引用计数-1, 为0时归还到池中
+void CRecvBufPool::Release(lpngx_recvbuf_t pBuf)
+{
+    if (pBuf->iRefCount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    uint64_t oldTop = m_freeTop.load(std::memory_order_relaxed);
+    uint64_t newTop;
+    do
+    {
+        __atomic_store_n(&pBuf->next, ((uint32_t)oldTop != 0) ? (lpngx_recvbuf_t)(m_pArena + (size_t)((uint32_t)oldTop - 1) * m_iBufSize) : NULL, __ATOMIC_RELAXED);
+        newTop = ((oldTop >> 32) + 1) << 32 | (pBuf->index + 1);
+    } while (!m_freeTop.compare_exchange_weak(oldTop, newTop, std::memory_order_release, std::memory_order_relaxed));
+    ++m_iFreeCount;
+}
+
+// 消息头: 指向缓冲区中的, 消息头在缓冲区头部; 否则在消息的开头
+LPSTRUC_MSG_HEADER CRecvBufPool::MsgHeader(char *pMsgBuf)
+{
+    if (Contains(pMsgBuf))
+    {
+        return &BufOf(pMsgBuf)->msgHeader;
+    }
+    return (LPSTRUC_MSG_HEADER)pMsgBuf;
+}
+
+// 包头: 指向缓冲区中的, 指针本身就是包头; 否则在消息头之后
+char *CRecvBufPool::MsgPkg(char *pMsgBuf)
+{
+    if (Contains(pMsgBuf))
+    {
+        return pMsgBuf;
+    }
+    return pMsgBuf + sizeof(STRUC_MSG_HEADER);
+}
+
+// 释放收消息队列中的消息
+void CRecvBufPool::FreeMsg(char *pMsgBuf)
+{
+    if (Contains(pMsgBuf))
+    {
+        Release(BufOf(pMsgBuf));
+        return;
+    }
+    CMemory::GetInstance()->FreeMemory(pMsgBuf);
+}
@@ -18,6 +18,8 @@
 #include "ngx_c_socket.h"
 #include "ngx_c_memory.h"
 #include "ngx_c_lockmutex.h"
+#include "ngx_c_recvbuf.h"
+#include "ngx_c_crc32.h"
 
 // ---------------------
 // 和网络 有关的函数放这里
@@ -28,11 +30,20 @@ CSocekt::CSocekt()
 {
     // 配置相关
     m_worker_connections = 1;      // epoll连接最大项数
+    m_iRecvBufSize = 8192;         // 每个连接的收包缓冲区大小
+    m_ifZeroCopyRecv = 0;          // 默认收到的包拷贝一份再交给逻辑线程
+    m_ifRecvCrcCheck = 0;          // 默认crc32值由逻辑线程校验
+    m_iReactorCount = 1;           // 每个worker进程一个reactor(epoll线程)
+    m_iEventBackend = NGX_EVENT_EPOLL; // 默认用epoll
+    m_ifEpollET = 0;               // 默认水平触发(LT)
+    m_iETBudget = 16;              // ET模式下每个连接每轮最多处理次数
     m_ListenPortCount = 1;         // 监听一个端口
-    m_RecyConnectionWaitTime = 60; // 等待这么些秒后才回收连接
+
+    // 连接池相关
+    m_pConnPool = NULL;
+    m_iConnPoolSize = 0;
 
     // epoll相关
-    m_epollhandle = -1; //epoll返回的句柄
     //m_pconnections = NULL;       //连接池【连接数组】先给空
     //m_pfree_connections = NULL;  //连接池中空闲的连接链
     //m_pread_events = NULL;       //读事件数组给空
@@ -49,12 +60,13 @@ CSocekt::CSocekt()
     m_iSendMsgQueueCount = 0;     //发消息队列大小
     m_total_recyconnection_n = 0; //待释放连接队列大小
     m_cur_size_ = 0;              //当前计时队列尺寸
-    m_timer_value_ = 0;           //当前计时队列头部的时间值
     m_iDiscardSendPkgCount = 0;   //丢弃的发送数据包数量
+    m_iCrcErrorPkgCount = 0;      // crc32校验不通过的数据包数量
 
     // 在线用户相关
     m_onlineUserCount = 0; // 在线用户数量
     m_lastprintTime = 0;   // 上次打印统计信息的时间，先给0
+    m_bStopAccept = false; // 收到SIGQUIT后才不再接受新连接
 
     return;
 }
@@ -72,26 +84,13 @@ bool CSocekt::Initialize()
 }
 
 // (1) 一些互斥量的初始化
-// (2) 创建 发送数据 的线程
-// (3) 创建 回收连接 的线程
+// (2) 创建 回收连接 的线程
+// (3) 创建 时间队列监视和处理 线程
+// 发送数据不再有专门的线程: 逻辑线程在 msgSend() 中直接发送, 发送缓冲区满时由epoll线程在可写时续发.
 // 调用: ngx_worker_process_init()
 bool CSocekt::Initialize_subproc()
 {
-    // (1) 一些互斥量的初始化
-
-    // 发消息 互斥量初始化
-    if (pthread_mutex_init(&m_sendMessageQueueMutex, NULL) != 0)
-    {
-        ngx_log_stderr(0, "CSocekt::Initialize_subproc()中pthread_mutex_init(&m_sendMessageQueueMutex)失败.");
-        return false;
-    }
-
-    // 连接相关 互斥量初始化
-    if (pthread_mutex_init(&m_connectionMutex, NULL) != 0)
-    {
-        ngx_log_stderr(0, "CSocekt::Initialize_subproc()中pthread_mutex_init(&m_connectionMutex)失败.");
-        return false;
-    }
+    // (1) 一些互斥量的初始化, 连接池相关的互斥量在各个reactor中(ngx_reactor_init)
 
     // 连接回收队列 相关互斥量初始化
     if (pthread_mutex_init(&m_recyconnqueueMutex, NULL) != 0)
@@ -107,27 +106,9 @@ bool CSocekt::Initialize_subproc()
         return false;
     }
 
-    // 第2个参数0, 表示信号量在线程之间共享, 非0表示在进程之间共享
-    // 第3个参数0, 表示信号量的初始值, 为0时, 调用sem_wait()就会卡在那里
-    if (sem_init(&m_semEventSendQueue, 0, 0) == -1)
-    {
-        ngx_log_stderr(0, "CSocekt::Initialize_subproc()中sem_init(&m_semEventSendQueue,0,0)失败.");
-        return false;
-    }
-
     int err;
 
-    // (2) 创建 发送数据 的线程
-    ThreadItem *pSendQueue;
-    m_threadVector.push_back(pSendQueue = new ThreadItem(this));
-    err = pthread_create(&pSendQueue->_Handle, NULL, ServerSendQueueThread, pSendQueue);
-    if (err != 0)
-    {
-        ngx_log_stderr(0, "CSocekt::Initialize_subproc()中pthread_create(ServerSendQueueThread)失败.");
-        return false;
-    }
-
-    // (3) 创建 回收连接 的线程
+    // (2) 创建 回收连接 的线程
     ThreadItem *pRecyconn;
     m_threadVector.push_back(pRecyconn = new ThreadItem(this));
     err = pthread_create(&pRecyconn->_Handle, NULL, ServerRecyConnectionThread, pRecyconn);
@@ -137,9 +118,11 @@ bool CSocekt::Initialize_subproc()
         return false;
     }
 
-    // (4) 时间队列监视和处理 线程
+    // (3) 时间队列监视和处理 线程
     if (m_ifkickTimeCount == 1)
     {
+        m_timeWheel.Init(ngx_time());
+
         ThreadItem *pTimemonitor;
         m_threadVector.push_back(pTimemonitor = new ThreadItem(this));
         err = pthread_create(&pTimemonitor->_Handle, NULL, ServerTimerQueueMonitorThread, pTimemonitor);
@@ -173,10 +156,13 @@ void CSocekt::Shutdown_subproc()
 {
     // 把干活的线程停止掉, 注意系统应该尝试通过设置 g_stopEvent = 1来 开始让整个项目停止
 
-    // 用到信号量的, 可能还需要调用一下sem_post
-    if (sem_post(&m_semEventSendQueue) == -1) // 让ServerSendQueueThread()流程走下来干活
+    // (1) 等reactor线程退出, 0号reactor在主线程中, 没有单独的线程
+    for (size_t i = 1; i < m_reactorList.size(); ++i)
     {
-        ngx_log_stderr(0, "CSocekt::Shutdown_subproc()中sem_post(&m_semEventSendQueue)失败.");
+        if (m_reactorList[i]->bThreadStarted)
+        {
+            pthread_join(m_reactorList[i]->_Handle, NULL);
+        }
     }
 
     // (2) 释放线程对象
@@ -192,121 +178,161 @@ void CSocekt::Shutdown_subproc()
     }
     m_threadVector.clear();
 
-    // (3) 队列清空
+    // (3) 队列清空, 定时器节点在连接对象里, 要在释放连接池之前摘下
     clearMsgSendQueue();
-    clearconnection();
     clearAllFromTimerQueue();
+    clearconnection();
 
-    // (4) 互斥资源的回收
-    pthread_mutex_destroy(&m_connectionMutex);       //连接相关互斥量释放
-    pthread_mutex_destroy(&m_sendMessageQueueMutex); //发消息互斥量释放
-    pthread_mutex_destroy(&m_recyconnqueueMutex);    //连接回收队列相关的互斥量释放
-    pthread_mutex_destroy(&m_timequeueMutex);        //时间处理队列相关的互斥量释放
-    sem_destroy(&m_semEventSendQueue);               //发消息相关线程信号量释放
+    // (4) 释放reactor
+    for (auto pos = m_reactorList.begin(); pos != m_reactorList.end(); ++pos)
+    {
+        ngx_reactor_free(*pos);
+    }
+    m_reactorList.clear();
+
+    // (5) 互斥资源的回收
+    pthread_mutex_destroy(&m_recyconnqueueMutex); //连接回收队列相关的互斥量释放
+    pthread_mutex_destroy(&m_timequeueMutex);     //时间处理队列相关的互斥量释放
 }
 
-// 清理TCP发送消息队列
+// 清理TCP发送消息队列, 即所有连接上待发送的数据
 void CSocekt::clearMsgSendQueue()
 {
-    char *sTmpMempoint;
+    for (auto rpos = m_reactorList.begin(); rpos != m_reactorList.end(); ++rpos)
+    {
+        for (int i = 0; i < (*rpos)->iPoolCapacity; ++i)
+        {
+            lpngx_connection_t p_Conn = &m_pConnPool[(*rpos)->iPoolBase + i];
+            CLock lock(&p_Conn->sendMutex);
+            clearConnSendQueue(p_Conn);
+        }
+    }
+}
+
+// 丢弃某个连接上所有待发送的数据(包括发了一半的包), 调用者要持有 pConn->sendMutex
+void CSocekt::clearConnSendQueue(lpngx_connection_t pConn)
+{
     CMemory *p_memory = CMemory::GetInstance();
 
-    while (!m_MsgSendQueue.empty())
+    if (pConn->psendMemPointer != NULL)
+    {
+        p_memory->FreeMemory(pConn->psendMemPointer);
+        pConn->psendMemPointer = NULL;
+    }
+    while (!pConn->sendMsgQueue.empty())
     {
-        sTmpMempoint = m_MsgSendQueue.front();
-        m_MsgSendQueue.pop_front();
-        p_memory->FreeMemory(sTmpMempoint);
+        p_memory->FreeMemory(pConn->sendMsgQueue.front());
+        pConn->sendMsgQueue.pop_front();
+        --pConn->iSendCount;
+        --m_iSendMsgQueueCount;
     }
 }
 
 // 专门用于读各种配置项
+// 调用: CSocekt::Initialize(), 重新载入配置文件(SIGHUP)后master进程创建新的worker进程之前
 void CSocekt::ReadConf()
 {
-    CConfig *p_config = CConfig::GetInstance();
-    m_worker_connections = p_config->GetIntDefault("worker_connections", m_worker_connections);
-    m_ListenPortCount = p_config->GetIntDefault("ListenPortCount", m_ListenPortCount);
-    m_RecyConnectionWaitTime = p_config->GetIntDefault("Sock_RecyConnectionWaitTime", m_RecyConnectionWaitTime); // 等待这么些秒后才回收连接
+    const ngx_conf_t *pconf = CConfig::GetInstance()->GetConf();
+    m_worker_connections = pconf->worker_connections;
+    m_ListenPortCount = pconf->listen_port_count;
 
-    m_ifkickTimeCount = p_config->GetIntDefault("Sock_WaitTimeEnable", 0);
-    m_iWaitTime = p_config->GetIntDefault("Sock_MaxWaitTime", m_iWaitTime);
-    m_iWaitTime = (m_iWaitTime > 5) ? m_iWaitTime : 5; // 不建议低于5秒钟, 无需太频繁
+    m_iRecvBufSize = pconf->recv_buf_size;
+    m_iRecvBufSize = (m_iRecvBufSize > 1024) ? m_iRecvBufSize : 1024; // 太小就没有批量收包的意义了
 
-    m_ifTimeOutKick = p_config->GetIntDefault("Sock_TimeOutKick", 0);
+    m_ifZeroCopyRecv = pconf->zero_copy_recv;
+    if (m_ifZeroCopyRecv == 1)
+    {
+        // 收包缓冲区池中的缓冲区要按自身大小对齐: Sock_RecvBufSize向上取到2的幂, 作为整个缓冲区(含头部)的大小
+        int iBufSize = 1024;
+        while (iBufSize < m_iRecvBufSize)
+        {
+            iBufSize <<= 1;
+        }
+        m_iRecvBufSize = iBufSize - NGX_RECVBUF_HEAD; // 连接自己的缓冲区也一样大, 池空时用它顶替
+    }
+
+    m_ifRecvCrcCheck = pconf->recv_crc_check;
 
-    m_floodAkEnable = p_config->GetIntDefault("Sock_FloodAttackKickEnable", 0);   // Flood攻击检测是否开启, 1开启, 0不开启
-    m_floodTimeInterval = p_config->GetIntDefault("Sock_FloodTimeInterval", 100); // 每次收到数据包的时间间隔(单位ms)
-    m_floodKickCount = p_config->GetIntDefault("Sock_FloodKickCounter", 10);      // Sock_FloodTimeInterval 条件的累计次数
+    m_iReactorCount = pconf->reactor_count;
+    m_iReactorCount = (m_iReactorCount > 0) ? m_iReactorCount : 1;
 
+    m_iEventBackend = (strcasecmp(pconf->event_backend, "io_uring") == 0) ? NGX_EVENT_IO_URING : NGX_EVENT_EPOLL;
+
+    m_ifEpollET = pconf->epoll_et;
+    m_iETBudget = pconf->epoll_et_budget;
+    m_iETBudget = (m_iETBudget > 0) ? m_iETBudget : 1;
+
+    m_ifkickTimeCount = pconf->wait_time_enable;
+
+    ReadRuntimeConf();
     return;
 }
 
-// 打开监听端口(支持多个端口), 在创建worker进程之前就要执行这个函数.
-// 调用: CSocekt::Initialize()
-bool CSocekt::ngx_open_listening_sockets()
+// 读运行中可以直接修改的配置项, 重新载入配置文件(SIGHUP)后worker进程直接调用, 不影响已有的连接
+void CSocekt::ReadRuntimeConf()
 {
-    int lfd;
-    struct sockaddr_in serv_addr; // 服务器地址
-    int iport;                    // 端口
-    char strinfo[100];            // 临时字符串
+    const ngx_conf_t *pconf = CConfig::GetInstance()->GetConf();
+    m_iWaitTime = pconf->max_wait_time;
+    m_iWaitTime = (m_iWaitTime > 5) ? m_iWaitTime : 5; // 不建议低于5秒钟, 无需太频繁
 
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY); // 监听本地所有的IP地址
+    m_ifTimeOutKick = pconf->timeout_kick;
 
-    CConfig *p_config = CConfig::GetInstance();
-    for (int i = 0; i < m_ListenPortCount; i++)
+    m_floodAkEnable = pconf->flood_kick_enable;       // Flood攻击检测是否开启, 1开启, 0不开启
+    m_floodTimeInterval = pconf->flood_time_interval; // 每次收到数据包的时间间隔(单位ms)
+    m_floodKickCount = pconf->flood_kick_counter;     // Sock_FloodTimeInterval 条件的累计次数
+
+    return;
+}
+
+// 不再接受新连接, worker进程收到SIGQUIT(平滑退出)后在主线程中调用, 已有的连接照常处理.
+// 0号reactor的监听socket是父进程打开的, master进程和新的worker进程还在用, 只是不再关心它的事件;
+// 其余reactor的监听socket是自己打开的(SO_REUSEPORT), 由各自的线程关掉(ngx_reactor_stop_accept), 内核就不再往这里分配新连接.
+void CSocekt::StopAccepting()
+{
+    if (m_bStopAccept.exchange(true))
     {
-        lfd = socket(AF_INET, SOCK_STREAM, 0); //系统函数，成功返回非负描述符，出错返回-1
-        if (lfd == -1)
-        {
-            ngx_log_stderr(errno, "CSocekt::Initialize()中socket()失败,i=%d.", i);
-            return false;
-        }
+        return;
+    }
+    ngx_reactor_stop_accept(m_reactorList[0]);
+}
 
-        // SO_REUSEADDR: 允许单进程绑定同一个端口到多个socket上, 只要每次绑定到一个不同的IP地址即可.
-        // 解决TIME_WAIT这个状态导致bind()失败的问题.
-        int reuseaddr = 1; // 1: 打开对应的设置项
-        if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&reuseaddr, sizeof(reuseaddr)) == -1)
+// 本reactor不再接受新连接, 只在reactor自己的线程中调用
+void CSocekt::ngx_reactor_stop_accept(lpngx_reactor_t pReactor)
+{
+    pReactor->acceptStopped = true;
+    for (auto pos = pReactor->listenList.begin(); pos != pReactor->listenList.end(); ++pos)
+    {
+        lpngx_connection_t p_Conn = (*pos)->connection;
+        if (pReactor->index == 0)
         {
-            ngx_log_stderr(errno, "CSocekt::Initialize()中setsockopt(SO_REUSEADDR)失败,i=%d.", i);
-            close(lfd);
-            return false;
+            ngx_epoll_oper_event((*pos)->fd, EPOLL_CTL_MOD, 0, 2, p_Conn);
+            continue;
         }
 
-        // SO_REUSEPORT: 允许完全重复的绑定, 要求在绑定同一个IP和端口的每个socket都设置了SO_REUSEPORT.
-        // 为处理惊群问题使用 REUSEPORT
-        int reuseport = 1;
-        if (setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&reuseport, sizeof(int)) == -1) // 端口复用需要内核支持
-        {
-            // 失败顶多是惊群, 但程序依旧可以正常运行.
-            ngx_log_stderr(errno, "CSocekt::Initialize()中setsockopt(SO_REUSEPORT)失败", i);
-        }
+        int fd = (*pos)->fd;
+        p_Conn->fd = -1; // 同 zdClosesocketProc(), 先置-1, 事件后端就不会再为它投递事件请求
+        (*pos)->fd = -1;
+        ngx_epoll_oper_event(fd, EPOLL_CTL_DEL, 0, 0, p_Conn);
+        close(fd); // 监听队列中还没accept的连接会被内核重置
+    }
+}
 
-        // 设置该socket为非阻塞
-        if (setnonblocking(lfd) == false)
-        {
-            ngx_log_stderr(errno, "CSocekt::Initialize()中setnonblocking()失败,i=%d.", i);
-            close(lfd);
-            return false;
-        }
+// 打开监听端口(支持多个端口), 在创建worker进程之前就要执行这个函数.
+// 调用: CSocekt::Initialize()
+bool CSocekt::ngx_open_listening_sockets()
+{
+    int lfd;
+    int iport; // 端口
 
+    const ngx_conf_t *pconf = CConfig::GetInstance()->GetConf();
+    for (int i = 0; i < m_ListenPortCount; i++)
+    {
         // 设置本服务器要监听的地址和端口, 这样客户端才能连接到该地址和端口, 并发送数据.
-        strinfo[0] = 0;
-        sprintf(strinfo, "ListenPort%d", i);
-        iport = p_config->GetIntDefault(strinfo, 10000);
-        serv_addr.sin_port = htons((in_port_t)iport);
+        iport = pconf->listen_ports[i]; // 配置项 ListenPort0, ListenPort1, ...
 
-        if (bind(lfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
-        {
-            ngx_log_stderr(errno, "CSocekt::Initialize()中bind()失败,i=%d.", i);
-            close(lfd);
-            return false;
-        }
-
-        if (listen(lfd, NGX_LISTEN_BACKLOG) == -1)
+        lfd = ngx_open_listening_socket(iport);
+        if (lfd == -1)
         {
-            ngx_log_stderr(errno, "CSocekt::Initialize()中listen()失败,i=%d.", i);
-            close(lfd);
             return false;
         }
 
@@ -324,6 +350,70 @@ bool CSocekt::ngx_open_listening_sockets()
     return true;
 }
 
+// 打开一个监听socket: socket(), 设置SO_REUSEADDR/SO_REUSEPORT和非阻塞, bind(), listen().
+// 返回值: 成功返回lfd, 失败返回-1.
+// 调用: CSocekt::ngx_open_listening_sockets()(父进程中), CSocekt::ngx_reactor_init()(worker进程中, 1号及以后的reactor)
+int CSocekt::ngx_open_listening_socket(int iport)
+{
+    int lfd;
+    struct sockaddr_in serv_addr; // 服务器地址
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY); // 监听本地所有的IP地址
+    serv_addr.sin_port = htons((in_port_t)iport);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0); //系统函数，成功返回非负描述符，出错返回-1
+    if (lfd == -1)
+    {
+        ngx_log_stderr(errno, "CSocekt::ngx_open_listening_socket()中socket()失败,port=%d.", iport);
+        return -1;
+    }
+
+    // SO_REUSEADDR: 允许单进程绑定同一个端口到多个socket上, 只要每次绑定到一个不同的IP地址即可.
+    // 解决TIME_WAIT这个状态导致bind()失败的问题.
+    int reuseaddr = 1; // 1: 打开对应的设置项
+    if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&reuseaddr, sizeof(reuseaddr)) == -1)
+    {
+        ngx_log_stderr(errno, "CSocekt::ngx_open_listening_socket()中setsockopt(SO_REUSEADDR)失败,port=%d.", iport);
+        close(lfd);
+        return -1;
+    }
+
+    // SO_REUSEPORT: 允许完全重复的绑定, 要求在绑定同一个IP和端口的每个socket都设置了SO_REUSEPORT.
+    // 为处理惊群问题使用 REUSEPORT, 多个reactor各自的监听socket也靠它绑定到同一个端口上.
+    int reuseport = 1;
+    if (setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&reuseport, sizeof(int)) == -1) // 端口复用需要内核支持
+    {
+        // 失败顶多是惊群, 但程序依旧可以正常运行(多个reactor时, 后面的reactor会bind()失败).
+        ngx_log_stderr(errno, "CSocekt::ngx_open_listening_socket()中setsockopt(SO_REUSEPORT)失败,port=%d.", iport);
+    }
+
+    // 设置该socket为非阻塞
+    if (setnonblocking(lfd) == false)
+    {
+        ngx_log_stderr(errno, "CSocekt::ngx_open_listening_socket()中setnonblocking()失败,port=%d.", iport);
+        close(lfd);
+        return -1;
+    }
+
+    if (bind(lfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
+    {
+        ngx_log_stderr(errno, "CSocekt::ngx_open_listening_socket()中bind()失败,port=%d.", iport);
+        close(lfd);
+        return -1;
+    }
+
+    if (listen(lfd, NGX_LISTEN_BACKLOG) == -1)
+    {
+        ngx_log_stderr(errno, "CSocekt::ngx_open_listening_socket()中listen()失败,port=%d.", iport);
+        close(lfd);
+        return -1;
+    }
+
+    return lfd;
+}
+
 // 设置socket连接为非阻塞模式
 bool CSocekt::setnonblocking(int sockfd)
 {
@@ -347,16 +437,15 @@ void CSocekt::ngx_close_listening_sockets()
     return;
 }
 
-// 将一个待发送消息入到 发消息队列 中
+// 发送一个消息, 由业务逻辑线程调用.
 // 1) 判断总发消息队列大小;
-// 2) 判断当前client在消息队列中消息的数目;
-// 3) 增加信号量
+// 2) 判断包是否过期, 判断当前client在消息队列中消息的数目;
+// 3) 入该连接的 发消息队列, 如果没有在等待可写(iThrowsendCount为0), 当场直接发送;
+// 4) 发送缓冲区满了发不完, 剩下的交给事件后端异步发送(io_uring), 或者投递EPOLLOUT, 由epoll线程在 ngx_write_request_handler() 中续发.
 void CSocekt::msgSend(char *psendbuf)
 {
     CMemory *p_memory = CMemory::GetInstance();
 
-    CLock lock(&m_sendMessageQueueMutex); // 开始操作队列, 需要加锁
-
     // 发消息队列 过大
     // 如客户端恶意不接受数据, 就会导致这个队列越来越大. 为了服务器安全, 干掉(free)一些数据的发送, 虽然有可能导致客户端出现问题, 但总比服务器不稳定要好很多
     if (m_iSendMsgQueueCount > 50000)
@@ -366,27 +455,59 @@ void CSocekt::msgSend(char *psendbuf)
         return;
     }
 
-    // 总体数据并无风险, 不会导致服务器崩溃, 要看看个体数据, 找一下恶意者了
     LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)psendbuf;
-    lpngx_connection_t p_Conn = pMsgHeader->pConn;
-    if (p_Conn->iSendCount > 400)
+    lpngx_connection_t p_Conn = ngx_get_connection_by_handle(pMsgHeader->hConn);
+    if (p_Conn == NULL) // 连接已经被回收复用, 不需要再发送
     {
-        // 该用户收消息太慢, 或者干脆不收消息(恶意), 该用户的 发送队列 中有的数据条目数过大, 认为是恶意用户, 直接切断
-        ngx_log_stderr(0, "CSocekt::msgSend()中发现某用户 %d 积压了大量待发送数据包, 切断与他的连接!", p_Conn->fd);
-        m_iDiscardSendPkgCount++;
         p_memory->FreeMemory(psendbuf);
-        zdClosesocketProc(p_Conn); // 直接关闭
         return;
     }
+    bool ifkick = false;
+    {
+        CLock lock(&p_Conn->sendMutex); // 只锁本连接
 
-    ++p_Conn->iSendCount; // 发消息队列 中有的数据条目数+1
-    m_MsgSendQueue.push_back(psendbuf);
-    ++m_iSendMsgQueueCount; // 原子操作, 而 m_iSendMsgQueueCount = m_iSendMsgQueueCount + 1 不是原子操作.
+        // 包过期: 连接已经关闭, 或者在加锁前刚被回收复用(代数变了), 不需要再发送
+        if (p_Conn->fd == -1 || !p_Conn->MatchHandle(pMsgHeader->hConn))
+        {
+            p_memory->FreeMemory(psendbuf);
+            return;
+        }
 
-    // 将信号量的值+1, 这样其他卡在 sem_wait 的就可以走下去
-    if (sem_post(&m_semEventSendQueue) == -1) // 让 ServerSendQueueThread() 流程走下来干活
+        // 总体数据并无风险, 不会导致服务器崩溃, 要看看个体数据, 找一下恶意者了
+        if (p_Conn->iSendCount > 400)
+        {
+            // 该用户收消息太慢, 或者干脆不收消息(恶意), 该用户的 发送队列 中有的数据条目数过大, 认为是恶意用户, 直接切断
+            ngx_log_stderr(0, "CSocekt::msgSend()中发现某用户 %d 积压了大量待发送数据包, 切断与他的连接!", p_Conn->fd);
+            m_iDiscardSendPkgCount++;
+            p_memory->FreeMemory(psendbuf);
+            ifkick = true;
+        }
+        else
+        {
+            ++p_Conn->iSendCount; // 发消息队列 中有的数据条目数+1
+            p_Conn->sendMsgQueue.push_back(psendbuf);
+            ++m_iSendMsgQueueCount; // 原子操作, 而 m_iSendMsgQueueCount = m_iSendMsgQueueCount + 1 不是原子操作.
+
+            // 已经投递了EPOLLOUT在等可写的, 排队即可, 保证包的顺序
+            if (p_Conn->iThrowsendCount == 0 && sendPendingProc(p_Conn) == 0)
+            {
+                // 发送缓冲区满了, io_uring下交给内核接着发; 否则依靠epoll驱动, 调用ngx_write_request_handler()函数发送剩余数据
+                ++p_Conn->iThrowsendCount;
+                if (!sendAsyncProc(p_Conn) && ngx_epoll_oper_event(
+                        p_Conn->fd,
+                        EPOLL_CTL_MOD, // 修改, 增加写通知
+                        EPOLLOUT, 0,   // 增加EPOLLOUT事件
+                        p_Conn) == -1)
+                {
+                    ngx_log_stderr(errno, "CSocekt::msgSend()中ngx_epoll_oper_event()失败.");
+                }
+            }
+        }
+    }
+
+    if (ifkick)
     {
-        ngx_log_stderr(0, "CSocekt::msgSend()中sem_post(&m_semEventSendQueue)失败.");
+        zdClosesocketProc(p_Conn); // 直接关闭, 里边要加 sendMutex, 所以放在锁外
     }
     return;
 }
@@ -403,17 +524,22 @@ void CSocekt::zdClosesocketProc(lpngx_connection_t p_Conn)
         DeleteFromTimerQueue(p_Conn); // 从 时间队列 中把连接干掉
     }
 
-    // 如下代码是没有加锁的, 所以有可能fd被关闭了2次
-    if (p_Conn->fd != -1)
     {
-        close(p_Conn->fd); // 这个socket关闭, 关闭后就会被从epoll红黑树中删除, 所以这之后无法收到任何epoll事件
-        p_Conn->fd = -1;
-    }
+        // 和发包互斥, 关闭之后 msgSend() 看到fd为-1就不会再往这个socket上发, 也就不会发到被复用的fd上
+        CLock lock(&p_Conn->sendMutex);
+        if (p_Conn->fd != -1)
+        {
+            int fd = p_Conn->fd;
+            p_Conn->fd = -1; // 先置-1, 事件后端看到-1就不会再为它投递事件请求
 
-    // 如下代码是没有加锁的, 所以有可能 iThrowsendCount 减到-1
-    if (p_Conn->iThrowsendCount > 0)
-    {
-        --p_Conn->iThrowsendCount; // 归 0
+            // epoll下什么都不做; io_uring下撤销poll请求, 否则poll请求持有socket的引用, close()关不掉socket
+            ngx_epoll_oper_event(fd, EPOLL_CTL_DEL, 0, 0, p_Conn);
+            close(fd); // 这个socket关闭, 关闭后就会被从epoll红黑树中删除, 所以这之后无法收到任何epoll事件
+        }
+
+        // 待发送的数据已经发不出去了, 提前释放
+        clearConnSendQueue(p_Conn);
+        p_Conn->iThrowsendCount = 0;
     }
 
     inRecyConnectQueue(p_Conn);
@@ -423,12 +549,9 @@ void CSocekt::zdClosesocketProc(lpngx_connection_t p_Conn)
 // 测试flood攻击是否成立, 成立返回true, 否则返回false
 bool CSocekt::TestFlood(lpngx_connection_t pConn)
 {
-    struct timeval sCurrTime; // 当前时间
-    uint64_t iCurrTime;       // 当前时间的毫秒表示
+    uint64_t iCurrTime = ngx_current_msec(); // 当前时间的毫秒表示, 本轮epoll循环开始时缓存的
     bool reco = false;
 
-    gettimeofday(&sCurrTime, NULL);                                   // 取得当前时间
-    iCurrTime = (sCurrTime.tv_sec * 1000 + sCurrTime.tv_usec / 1000); // 转化为毫秒表示
     if ((iCurrTime - pConn->FloodkickLastTime) < m_floodTimeInterval) // 两次收到包的时间 < 100毫秒
     {
         // 发包太频繁记录
@@ -452,10 +575,28 @@ bool CSocekt::TestFlood(lpngx_connection_t pConn)
     return reco;
 }
 
+// 在reactor线程中校验包的crc32值(Sock_RecvCrcCheck = 1 时), 正确返回true, 否则返回false.
+// ibodycrc为收包时算出的包体crc32值(CCRC32::Update), 只有包头的包算出来是0, 正好对上"只有包头的数据包的crc32值是0"的约定.
+// 校验不通过的包在这里就丢掉, 不占收消息队列, 也不用唤醒逻辑线程.
+bool CSocekt::TestPkgCrc(LPCOMM_PKG_HEADER pPkgHeader, unsigned int ibodycrc)
+{
+    int iclientcrc = (int)ntohl(pPkgHeader->crc32);
+    if ((int)ibodycrc == iclientcrc)
+    {
+        return true;
+    }
+
+    if (++m_iCrcErrorPkgCount % 1000 == 1) // 垃圾包可能很多, 不每个都打印
+    {
+        ngx_log_stderr(0, "CSocekt::TestPkgCrc() 中 CRC 错误[服务器:%d/客户端:%d], 丢弃数据, 累计丢弃%d个.", (int)ibodycrc, iclientcrc, (int)m_iCrcErrorPkgCount);
+    }
+    return false;
+}
+
 // 打印统计信息
 void CSocekt::printTDInfo()
 {
-    time_t currtime = time(NULL);
+    time_t currtime = ngx_time();
     if ((currtime - m_lastprintTime) > 10) // 超过10秒我们打印一次
     {
         int tmprmqc = g_threadpool.getRecvMsgQueueCount(); // 收消息队列
@@ -464,43 +605,157 @@ void CSocekt::printTDInfo()
         int tmpsmqc = m_iSendMsgQueueCount; // 直接打印atomic类型报错
         ngx_log_stderr(0, "------------------------------------begin--------------------------------------");
         ngx_log_stderr(0, "当前在线人数 / 总人数: (%d/%d).", tmpoLUC, m_worker_connections);
-        ngx_log_stderr(0, "连接池中空闲连接 / 总连接 / 要释放的连接: (%d/%d/%d).", m_freeconnectionList.size(), m_connectionList.size(), m_recyconnectionList.size());
-        ngx_log_stderr(0, "当前时间队列大小: (%d).", m_timerQueuemap.size());
-        ngx_log_stderr(0, "当前收消息队列 / 发消息队列大小分别为: (%d/%d), 丢弃的待发送数据包数量为%d.", tmprmqc, tmpsmqc, m_iDiscardSendPkgCount);
+        size_t freeconn = 0, totalconn = 0;
+        for (auto pos = m_reactorList.begin(); pos != m_reactorList.end(); ++pos)
+        {
+            freeconn += (*pos)->iFreeCount;
+            totalconn += (*pos)->iPoolCapacity;
+        }
+        ngx_log_stderr(0, "连接池中空闲连接 / 总连接 / 要释放的连接: (%d/%d/%d), reactor数量: %d.", freeconn, totalconn, m_recyconnectionList.size(), m_iReactorCount);
+        ngx_log_stderr(0, "当前时间队列大小: (%d).", m_timeWheel.Size());
+        ngx_log_stderr(0, "当前收消息队列 / 发消息队列大小分别为: (%d/%d), 丢弃的接收 / 待发送数据包数量为(%d/%d).", tmprmqc, tmpsmqc, g_threadpool.getDiscardRecvPkgCount(), (int)m_iDiscardSendPkgCount);
+        if (m_ifRecvCrcCheck == 1)
+        {
+            ngx_log_stderr(0, "收包时crc32校验不通过而丢弃的数据包数量: (%d).", (int)m_iCrcErrorPkgCount);
+        }
         if (tmprmqc > 100000) // 收消息队列过大, 报一下, 这个属于应该 引起警觉的, 考虑限速等等手段
         {
             ngx_log_stderr(0, "接收队列条目数量过大(%d), 要考虑限速或者增加处理线程数量了.", tmprmqc);
         }
+        ngx_mem_stat_t memstat;
+        CMemory::GetInstance()->GetStat(&memstat);
+        ngx_log_stderr(0, "内存池 命中/未命中/大块: (%uL/%uL/%uL), 使用中 / slab总量: (%LKB/%uLKB).",
+                       memstat.hitCount, memstat.missCount, memstat.largeCount, memstat.bytesInUse / 1024, memstat.slabBytes / 1024);
+        if (m_ifZeroCopyRecv == 1)
+        {
+            CRecvBufPool *p_recvbuf = CRecvBufPool::GetInstance();
+            ngx_log_stderr(0, "收包缓冲区池 空闲 / 总数: (%d/%d).", p_recvbuf->FreeCount(), p_recvbuf->Count());
+        }
         ngx_log_stderr(0, "-------------------------------------end---------------------------------------");
     }
     return;
 }
 
+// 创建 m_iReactorCount 个reactor, 每个reactor:
 // (1) 创建epoll树, 创建连接池(initconnection)
+// (2) 0号reactor用父进程打开的监听socket, 其余reactor用SO_REUSEPORT自己再打开一份
 // (3) 为每一个监听端口(ngx_listening_t)创建连接(ngx_connection_t).
 // (4) 将lfd上epoll树(ngx_epoll_oper_event).
+// 全部初始化完后, 1号及以后的reactor各启动一个线程(ServerReactorThread), 0号reactor由主线程驱动(ngx_epoll_process_events).
 // 调用: ngx_worker_process_init()
 int CSocekt::ngx_epoll_init()
 {
-    // (1) 创建epoll树
-    m_epollhandle = epoll_create(m_worker_connections);
-    if (m_epollhandle == -1)
+    for (int i = 0; i < m_iReactorCount; ++i)
     {
-        ngx_log_stderr(errno, "CSocekt::ngx_epoll_init() 中 epoll_create() 失败.");
-        exit(2); // 直接退, 资源由系统释放.
+        lpngx_reactor_t pReactor = new ngx_reactor_t;
+        pReactor->index = i;
+        pReactor->backend = NULL;
+        pReactor->acceptStopped = false;
+        pReactor->acceptRetryMsec = 0;
+        pReactor->bThreadStarted = false;
+        pReactor->iPoolSize = m_worker_connections / m_iReactorCount; // 连接池按reactor平分
+        pReactor->iPoolSize = (pReactor->iPoolSize > 0) ? pReactor->iPoolSize : 1;
+        pReactor->_pThis = this;
+        m_reactorList.push_back(pReactor);
+
+        // 连接池数组一次分配好, 每个reactor构造自己那一段
+        if (i == 0 && initconnection() == false)
+        {
+            ngx_log_async_stop(); // 开了异步日志时, 缓冲区中的日志(包括出错原因)先写出去再退
+            exit(2);
+        }
+        // 收包缓冲区池: 每个连接平时持有一个, 再留出同样多的给还没处理完的包; 池空时连接用自己的缓冲区, 只是多一次拷贝
+        if (i == 0 && m_ifZeroCopyRecv == 1 && CRecvBufPool::GetInstance()->Init(m_iRecvBufSize + NGX_RECVBUF_HEAD, m_worker_connections * 2) == false)
+        {
+            ngx_log_stderr(0, "CSocekt::ngx_epoll_init()中收包缓冲区池初始化失败, 不使用零拷贝收包.");
+            m_ifZeroCopyRecv = 0;
+        }
+        initconnection(pReactor);
+
+        if (ngx_reactor_init(pReactor) == false)
+        {
+            if (i == 0)
+            {
+                ngx_log_async_stop();
+                exit(2); // 一个reactor都没有, 致命问题, 直接退
+            }
+
+            // 后面的reactor失败(比如内核不支持SO_REUSEPORT), 就用已经初始化好的这些.
+            // 失败的这个要拆干净: 它打开的监听socket留在SO_REUSEPORT组里, 内核还会往里分配连接, 却没有线程去accept.
+            // 它那一段连接池不再使用, 析构掉即可(内存随连接池数组一起释放).
+            ngx_log_stderr(0, "CSocekt::ngx_epoll_init()中第%d个reactor初始化失败, 只使用%d个reactor.", i, i);
+            for (int j = 0; j < pReactor->iPoolCapacity; ++j)
+            {
+                m_pConnPool[pReactor->iPoolBase + j].~ngx_connection_t();
+            }
+            pReactor->iPoolCapacity = 0;
+            ngx_reactor_free(pReactor);
+            m_reactorList.pop_back();
+            m_iReactorCount = i;
+            break;
+        }
     }
 
-    // (2) 创建连接池(initconnection)
-    initconnection();
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "worker进程使用%d个reactor, 事件后端为%s.", m_iReactorCount, m_reactorList[0]->backend->Name());
 
-    // (3) 为每一个监听端口(ngx_listening_t) 创建连接(ngx_get_connection).
+    for (int i = 1; i < m_iReactorCount; ++i)
+    {
+        lpngx_reactor_t pReactor = m_reactorList[i];
+        int err = pthread_create(&pReactor->_Handle, NULL, ServerReactorThread, pReactor);
+        if (err != 0)
+        {
+            ngx_log_stderr(err, "CSocekt::ngx_epoll_init()中pthread_create(ServerReactorThread)失败.");
+            ngx_log_async_stop();
+            exit(2);
+        }
+        pReactor->bThreadStarted = true;
+        ngx_pin_thread_cpu(pReactor->_Handle, i); // 配置了 WorkerCpuAffinity 时每个reactor线程固定在一个CPU上
+    }
+
+    return 1;
+}
+
+// 初始化一个reactor, 返回值: 成功true, 失败false.
+// 调用: CSocekt::ngx_epoll_init()
+bool CSocekt::ngx_reactor_init(lpngx_reactor_t pReactor)
+{
+    // (1) 创建事件后端(epoll树或io_uring)
+    pReactor->backend = CEventBackend::Create(m_iEventBackend, m_worker_connections);
+    if (pReactor->backend == NULL)
+    {
+        ngx_log_stderr(0, "CSocekt::ngx_reactor_init() 中 CEventBackend::Create() 失败.");
+        return false;
+    }
+
+    // (2) 0号reactor用父进程打开的监听socket, 其余reactor用SO_REUSEPORT自己再打开一份, 内核按连接的四元组在这些socket之间分配新连接
     for (auto pos = m_ListenSocketList.begin(); pos != m_ListenSocketList.end(); ++pos)
     {
-        lpngx_connection_t p_Conn = ngx_get_connection((*pos)->fd); // 从连接池中获取一个空闲连接对象
+        if (pReactor->index == 0)
+        {
+            pReactor->listenList.push_back(*pos);
+            continue;
+        }
+
+        int lfd = ngx_open_listening_socket((*pos)->port);
+        if (lfd == -1)
+        {
+            return false;
+        }
+        lpngx_listening_t p_listensocketitem = new ngx_listening_t;
+        memset(p_listensocketitem, 0, sizeof(ngx_listening_t));
+        p_listensocketitem->port = (*pos)->port;
+        p_listensocketitem->fd = lfd;
+        pReactor->listenList.push_back(p_listensocketitem);
+    }
+
+    // (3) 为每一个监听端口(ngx_listening_t) 创建连接(ngx_get_connection).
+    for (auto pos = pReactor->listenList.begin(); pos != pReactor->listenList.end(); ++pos)
+    {
+        lpngx_connection_t p_Conn = ngx_get_connection(pReactor, (*pos)->fd); // 从连接池中获取一个空闲连接对象
         if (p_Conn == NULL)
         {
-            ngx_log_stderr(errno, "CSocekt::ngx_epoll_init()中ngx_get_connection()失败.");
-            exit(2); // 刚开始连接池就为空, 致命问题, 直接退
+            ngx_log_stderr(errno, "CSocekt::ngx_reactor_init()中ngx_get_connection()失败.");
+            return false; // 刚开始连接池就为空, 致命问题
         }
 
         p_Conn->listening = (*pos);  // 连接对象 和监听对象关联, 方便通过连接对象找监听对象
@@ -511,25 +766,67 @@ int CSocekt::ngx_epoll_init()
 
         // (4) 将lfd上epoll树(ngx_epoll_oper_event).
         // EPOLLRDHUP: TCP连接的远端关闭或者半关闭
-        if (ngx_epoll_oper_event((*pos)->fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP, 0, p_Conn) == -1)
+        // ET模式下, ngx_event_accept() 要一直accept到EAGAIN为止
+        if (ngx_epoll_oper_event((*pos)->fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP | (m_ifEpollET == 1 ? (uint32_t)EPOLLET : 0u), 0, p_Conn) == -1)
         {
-            exit(2);
+            return false;
         }
     }
 
-    return 1;
+    return true;
+}
+
+// 释放一个reactor: 释放事件后端, 关闭reactor自己打开的监听socket(0号reactor用的是父进程打开的, 在析构函数中释放).
+// 连接池那一段由调用者处理.
+// 调用: CSocekt::Shutdown_subproc(), CSocekt::ngx_epoll_init()(reactor初始化失败时)
+void CSocekt::ngx_reactor_free(lpngx_reactor_t pReactor)
+{
+    if (pReactor->backend != NULL)
+    {
+        delete pReactor->backend;
+    }
+    if (pReactor->index != 0)
+    {
+        for (auto lpos = pReactor->listenList.begin(); lpos != pReactor->listenList.end(); ++lpos)
+        {
+            if ((*lpos)->fd != -1) // 平滑退出时已经关掉了
+                close((*lpos)->fd);
+            delete (*lpos);
+        }
+    }
+    delete pReactor;
 }
 
-// 主要是扩展了epoll_ctl()的能力.
+// 1号及以后的reactor 的线程, 不断处理本reactor上的事件, 直到程序退出.
+// epoll_wait()带超时, 以便能看到 g_stopEvent 和 m_bStopAccept.
+void *CSocekt::ServerReactorThread(void *threadData)
+{
+    lpngx_reactor_t pReactor = static_cast<lpngx_reactor_t>(threadData);
+    CSocekt *pSocketObj = pReactor->_pThis;
+
+    while (g_stopEvent == 0)
+    {
+        if (pSocketObj->m_bStopAccept && !pReactor->acceptStopped)
+        {
+            pSocketObj->ngx_reactor_stop_accept(pReactor);
+        }
+        pSocketObj->ngx_reactor_process_events(pReactor, 1000);
+    }
+
+    return (void *)0;
+}
+
+// 主要是扩展了epoll_ctl()的能力, 实际的注册由连接所属reactor的事件后端(CEventBackend::Ctl)完成.
 // 参数:
 //   eventtype: EPOLL_CTL_ADD, EPOLL_CTL_MOD, EPOLL_CTL_DEL
 //   flag: EPOLLIN, EPOLLOUT, EPOLLRDHUP
 //   bcaction: 用于补充 EPOLL_CTL_MOD 的动作, 0增加, 1去掉, 2完全覆盖
 //   pConn: 连接, 在EPOLL_CTL_ADD时增加到红黑树中去, 将来epoll_wait时能取出来用
 // 返回值: 成功1, 失败-1.
-// 调用: CSocekt::ngx_epoll_init()[为lfd使用]
+// 调用: CSocekt::ngx_reactor_init()[为lfd使用]
 // 调用: CSocekt::ngx_event_accept()[为cfd使用]
 // 调用: CSocekt::ngx_write_request_handler()[发送数据]
+// 调用: CSocekt::zdClosesocketProc()[关闭连接, EPOLL_CTL_DEL]
 int CSocekt::ngx_epoll_oper_event(int fd, uint32_t eventtype, uint32_t flag, int bcaction, lpngx_connection_t pConn)
 {
     struct epoll_event ev;
@@ -564,16 +861,16 @@ int CSocekt::ngx_epoll_oper_event(int fd, uint32_t eventtype, uint32_t flag, int
     }
     else
     {
-        // 删除红黑树中节点, 目前没这个需求, socket关闭这项会自动从红黑树移除, 所以将来再扩展
-        return 1; // 先直接返回1表示成功
+        // 删除: epoll下socket关闭会自动从红黑树移除, 什么都不用做; io_uring下要撤销poll请求, 否则socket关不掉
     }
 
     // 绑定ptr这个事, 只在EPOLL_CTL_ADD的时候做一次即可, 但是发现EPOLL_CTL_MOD似乎会破坏掉ev.data.ptr, 因此不管是EPOLL_CTL_ADD, 还是EPOLL_CTL_MOD, 都要重新赋值一次.
     // 找了下内核源码 SYSCALL_DEFINE4(epoll_ctl, int, epfd, int, op, int, fd, struct epoll_event __user *, event), 感觉真的会覆盖掉.
     // copy_from_user(&epds, event, sizeof(struct epoll_event))), 感觉这个内核处理这个事情太粗暴了.
-    ev.data.ptr = (void *)pConn;
+    // 所以事件后端每次都把 pConn 作为 ev.data.ptr 重新设置.
 
-    if (epoll_ctl(m_epollhandle, eventtype, fd, &ev) == -1)
+    // 连接属于哪个reactor, 就交给哪个reactor的事件后端, 后端都是线程安全的, 逻辑线程中的 msgSend() 也可以直接调用
+    if (pConn->reactor->backend->Ctl(fd, eventtype, ev.events, pConn) == -1)
     {
         ngx_log_stderr(errno, "CSocekt::ngx_epoll_oper_event()中epoll_ctl(%d,%ud,%ud,%d)失败.", fd, eventtype, flag, bcaction);
         return -1;
@@ -581,20 +878,54 @@ int CSocekt::ngx_epoll_oper_event(int fd, uint32_t eventtype, uint32_t flag, int
     return 1;
 }
 
-// 获取事件并处理
+// 获取0号reactor上的事件并处理, 其余reactor在各自的线程中处理(ServerReactorThread)
 // 参数timer: epoll_wait()阻塞的时长, 单位毫秒, -1表示阻塞.
 // 返回值: 1正常, 0错误, 一般不管是正常还是问题返回, 都应该保持进程继续运行.
 // 调用: ngx_worker_process_cycle() -> ngx_process_events_and_timers()
 int CSocekt::ngx_epoll_process_events(int timer)
 {
+    return ngx_reactor_process_events(m_reactorList[0], timer);
+}
+
+// 获取某个reactor上的事件并处理
+// 参数timer: epoll_wait()阻塞的时长, 单位毫秒, -1表示阻塞.
+// 返回值: 1正常, 0错误.
+// 调用: CSocekt::ngx_epoll_process_events(), CSocekt::ServerReactorThread()
+int CSocekt::ngx_reactor_process_events(lpngx_reactor_t pReactor, int timer)
+{
+    // fd用尽而暂停的accept(ET模式, io_uring), 时间到了就投递监听socket的读事件, 没到则最多等到那个时刻
+    if (pReactor->acceptRetryMsec != 0)
+    {
+        uint64_t now = ngx_current_msec();
+        if (now >= pReactor->acceptRetryMsec)
+        {
+            pReactor->acceptRetryMsec = 0;
+            for (auto pos = pReactor->listenList.begin(); pos != pReactor->listenList.end() && !pReactor->acceptStopped; ++pos)
+            {
+                ngx_post_event((*pos)->connection, EPOLLIN);
+            }
+        }
+        else if (timer == -1 || (uint64_t)timer > pReactor->acceptRetryMsec - now)
+        {
+            timer = (int)(pReactor->acceptRetryMsec - now);
+        }
+    }
+
+    // 上一轮有没处理完的事件(ET模式), 不能阻塞, 看一眼有没有新事件就去处理它们
+    if (!pReactor->postedEventList.empty())
+    {
+        timer = 0;
+    }
+
     // 如果你等待的是一段时间, 并且超时了, 则返回0
-    int events = epoll_wait(m_epollhandle, m_events, NGX_MAX_EVENTS, timer);
+    int events = pReactor->backend->Wait(pReactor->events, NGX_MAX_EVENTS, timer);
+    ngx_time_update(); // 每轮更新一次缓存的时间, 处理事件时都用它
     if (events == -1)
     {
         if (errno == EINTR)
         {
             // EINTR错误的产生: 当阻塞于某个慢系统调用的一个进程捕获某个信号且相应信号处理函数返回时, 该系统调用可能返回一个EINTR错误.
-            ngx_log_error_core(NGX_LOG_INFO, errno, "CSocekt::ngx_epoll_process_events()中epoll_wait()失败!");
+            ngx_log_error(NGX_LOG_INFO, errno, "CSocekt::ngx_epoll_process_events()中epoll_wait()失败!");
             return 1; //正常返回
         }
         else
@@ -604,12 +935,17 @@ int CSocekt::ngx_epoll_process_events(int timer)
         }
     }
 
+    // 处理事件期间进入临界区, 本轮用到的连接都不会被回收线程归还连接池; 阻塞在Wait()中时不在临界区, 不耽误回收.
+    // 取到事件之后才进入, 所以事件中的连接可能已经作废, 进入之后再按序号过滤.
+    CEpochGuard epochGuard(&m_epoch);
+
     // events为0, 如果timer>0表示超时, 返回1正常退出; 如果timer为-1, 阻塞等待竟然events为0, 不正常, 记录日志并返回0.
     if (events == 0)
     {
         if (timer != -1)
         {
             // 超时
+            ngx_process_posted_events(pReactor);
             return 1;
         }
 
@@ -622,7 +958,13 @@ int CSocekt::ngx_epoll_process_events(int timer)
     uint32_t revents; // 事件类型, 如EPOLLIN, EPOLLOUT等.
     for (int i = 0; i < events; ++i)
     {
-        p_Conn = (lpngx_connection_t)(m_events[i].data.ptr);
+        // 事件中保存的是 连接指针+序号, 连接在取到事件之后 被关闭(别的线程踢人, 或者本轮前面的事件处理中关闭), 序号就变了, 事件过期
+        uint64_t userdata = pReactor->events[i].data.u64;
+        if (ngx_event_expired(userdata))
+        {
+            continue;
+        }
+        p_Conn = ngx_event_conn(userdata);
 
         /*
         instance = (uintptr_t) c & 1;                             //将地址的最后一位取出来，用instance变量标识, 见ngx_epoll_add_event，该值是当时随着连接池中的连接一起给进来的
@@ -639,7 +981,7 @@ int CSocekt::ngx_epoll_process_events(int timer)
             //第三个事件，假如这第三个事件，也跟第一个事件对应的是同一个连接，那这个条件就会成立；那么这种事件，属于过期事件，不该处理
 
             //这里可以增加个日志，也可以不增加日志
-            ngx_log_error_core(NGX_LOG_DEBUG,0,"CSocekt::ngx_epoll_process_events()中遇到了fd=-1的过期事件:%p.",c); 
+            ngx_log_error(NGX_LOG_DEBUG, 0, "CSocekt::ngx_epoll_process_events()中遇到了fd=-1的过期事件:%p.", c);
             continue; //这种事件就不处理即可
         }
 
@@ -662,14 +1004,14 @@ int CSocekt::ngx_epoll_process_events(int timer)
             //如果收到了若干个事件，其中连接关闭也搞了多次，导致这个instance标志位被取反2次，那么，造成的结果就是：还是有可能遇到某些过期事件没有被发现【这里也就没有被continue】，照旧被当做没过期事件处理了；
                   //如果是这样，那就只能被照旧处理了。可能会造成偶尔某个连接被误关闭？但是整体服务器程序运行应该是平稳，问题不大的，这种漏网而被当成没过期来处理的的过期事件应该是极少发生的
 
-            ngx_log_error_core(NGX_LOG_DEBUG,0,"CSocekt::ngx_epoll_process_events()中遇到了instance值改变的过期事件:%p.",c); 
+            ngx_log_error(NGX_LOG_DEBUG, 0, "CSocekt::ngx_epoll_process_events()中遇到了instance值改变的过期事件:%p.", c);
             continue; //这种事件就不处理即可
         }
         //存在一种可能性，过期事件没被过滤完整【非常极端】，走下来的；
         */
 
         // 能走到这里, 我们认为这些事件都没过期, 就正常开始处理
-        revents = m_events[i].events;
+        revents = pReactor->events[i].events;
 
         /*
         if(revents & (EPOLLERR|EPOLLHUP)) //例如对方close掉套接字，这里会感应到【换句话说：如果发生了错误或者客户端断连】
@@ -699,8 +1041,7 @@ int CSocekt::ngx_epoll_process_events(int timer)
                 // EPOLLRDHUP: 表示TCP连接的远端关闭或者半关闭连接   8192    = 0010  0000   0000   0000
                 // 8221 = ‭0010 0000 0001 1101‬ = EPOLLRDHUP|EPOLLHUP|EPOLLERR
 
-                // 我们只有投递了 写事件，但对端断开时，程序流程才走到这里，投递了写事件意味着 iThrowsendCount标记肯定被+1了，这里我们减回
-                --p_Conn->iThrowsendCount;
+                // 我们只有投递了 写事件，但对端断开时，程序流程才走到这里. 不用管, 读事件那边会关闭连接, iThrowsendCount在 zdClosesocketProc() 中归0
             }
             else
             {
@@ -708,177 +1049,43 @@ int CSocekt::ngx_epoll_process_events(int timer)
             }
         }
     }
+
+    ngx_process_posted_events(pReactor);
     return 1;
 }
 
-// 发送数据 的线程, 在CSocket对象的初始化中被创建.
-// epoll + LT模式, 消息没发送完毕, socket会不停触发可写事件的处理.
-void *CSocekt::ServerSendQueueThread(void *threadData)
+// 投递一个延后处理的事件, 连接所属reactor的下一轮 ngx_reactor_process_events() 中处理.
+// ET模式下同一个事件不会再通知, 所以处理次数用完了还没到EAGAIN的连接必须自己记下来, 否则会一直卡住.
+// 调用: CSocekt::ngx_event_accept(), CSocekt::ngx_read_request_handler()
+void CSocekt::ngx_post_event(lpngx_connection_t pConn, uint32_t revents)
 {
-    ThreadItem *pThread = static_cast<ThreadItem *>(threadData);
-    CSocekt *pSocketObj = pThread->_pThis;
-
-    int err;
-    std::list<char *>::iterator pos, pos2, posend;
-    char *pMsgBuf;
-    LPSTRUC_MSG_HEADER pMsgHeader;
-    LPCOMM_PKG_HEADER pPkgHeader;
-    lpngx_connection_t p_Conn;
-    unsigned short itmp;
-    ssize_t sendsize;
-
-    CMemory *p_memory = CMemory::GetInstance();
+    ngx_posted_event_t ev;
+    ev.pConn = pConn;
+    ev.iCurrsequence = pConn->iCurrsequence;
+    ev.revents = revents;
+    pConn->reactor->postedEventList.push_back(ev); // 投递都发生在连接所属的reactor线程中, 不需要互斥
+}
 
-    while (g_stopEvent == 0) // 不退出
+// 处理上一轮投递的事件, 处理过程中新投递的事件留到再下一轮
+void CSocekt::ngx_process_posted_events(lpngx_reactor_t pReactor)
+{
+    if (pReactor->postedEventList.empty())
     {
-        // 在CSocekt::msgSend()调用sem_post()让这里sem_wait() 走下去. 整个程序退出之前, 也要sem_post()一下, 确保卡在sem_wait()的线程也能返回.
-        if (sem_wait(&pSocketObj->m_semEventSendQueue) == -1)
-        {
-            if (errno != EINTR)
-            {
-                ngx_log_stderr(errno, "CSocekt::ServerSendQueueThread()中sem_wait(&pSocketObj->m_semEventSendQueue)失败.");
-            }
-        }
+        return;
+    }
 
-        if (g_stopEvent != 0)
+    std::vector<ngx_posted_event_t> postedList;
+    postedList.swap(pReactor->postedEventList);
+    for (auto pos = postedList.begin(); pos != postedList.end(); ++pos)
+    {
+        lpngx_connection_t p_Conn = pos->pConn;
+        if (p_Conn->fd == -1 || p_Conn->iCurrsequence != pos->iCurrsequence) // 连接已经关闭或者被回收, 事件过期
         {
-            break;
+            continue;
         }
-
-        if (pSocketObj->m_iSendMsgQueueCount > 0)
+        if (pos->revents & EPOLLIN)
         {
-            // 从 发送消息队列 取
-            err = pthread_mutex_lock(&pSocketObj->m_sendMessageQueueMutex);
-            if (err != 0)
-            {
-                ngx_log_stderr(err, "CSocekt::ServerSendQueueThread()中pthread_mutex_lock()失败，返回的错误码为%d!", err);
-            }
-
-            pos = pSocketObj->m_MsgSendQueue.begin();
-            posend = pSocketObj->m_MsgSendQueue.end();
-
-            while (pos != posend)
-            {
-                pMsgBuf = (*pos); // 拿到的每个消息都是 消息头+包头+包体, 但要注意, 我们是不发送消息头给客户端的.
-
-                pMsgHeader = (LPSTRUC_MSG_HEADER)pMsgBuf;                                // 消息头
-                pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + pSocketObj->m_iLenMsgHeader); // 包头
-                p_Conn = pMsgHeader->pConn;
-
-                // 包过期处理.
-                // 包过期: 包中的iCurrsequence与连接中的iCurrsequence不同.
-                // 如果该连接已经被回收, 比如在ngx_close_connection()/inRecyConnectQueue()中都会p_Conn->iCurrsequence++.
-                // 如果不相等, 肯定是客户端连接已断, 要发送的数据肯定不需要发送了.
-                // 1) 从发消息队列中移除; 2) 释放消息内存.
-                if (p_Conn->iCurrsequence != pMsgHeader->iCurrsequence)
-                {
-                    pos2 = pos;
-                    pos++;
-                    pSocketObj->m_MsgSendQueue.erase(pos2);
-                    --pSocketObj->m_iSendMsgQueueCount;
-                    p_memory->FreeMemory(pMsgBuf);
-                    continue;
-                }
-
-                // 发送缓冲区慢了, 认为客户端不收, 此时不再发送.
-                if (p_Conn->iThrowsendCount > 0)
-                {
-                    pos++;
-                    continue;
-                }
-                --p_Conn->iSendCount; // 发送队列 中有的数据条目数-1
-
-                // 走到这里, 可以发送消息
-
-                p_Conn->psendMemPointer = pMsgBuf; // 发送后释放用的, 因为这段内存是new出来的
-                pos2 = pos;
-                pos++;
-                pSocketObj->m_MsgSendQueue.erase(pos2);
-                --pSocketObj->m_iSendMsgQueueCount;
-
-                p_Conn->psendbuf = (char *)pPkgHeader; // 要发送的数据的缓冲区指针, 因为发送数据不一定全部都能发送出去, 我们要记录数据发送到了哪里, 需要知道下次数据从哪里开始发送
-                itmp = ntohs(pPkgHeader->pkgLen);      // 包头+包体 长度, 打包时用了htons
-                p_Conn->isendlen = itmp;               // 要发送多少数据, 因为发送数据不一定全部都能发送出去, 我们需要知道剩余有多少数据还没发送
-
-                // 直接发送数据
-                sendsize = pSocketObj->sendproc(p_Conn, p_Conn->psendbuf, p_Conn->isendlen);
-                if (sendsize > 0)
-                {
-                    if (sendsize == p_Conn->isendlen) // 全部发送完毕.
-                    {
-                        p_memory->FreeMemory(p_Conn->psendMemPointer);
-                        p_Conn->psendMemPointer = NULL;
-                        p_Conn->iThrowsendCount = 0;                                                 // 这行其实可以没有, 因此此时此刻这东西就是=0的
-                        ngx_log_stderr(0, "CSocekt::ServerSendQueueThread()中数据发送完毕, 很好. "); // 提示, 商用时可以干掉
-                    }
-                    else // 只发送了一部分数据, 肯定是发送缓冲区满了, 现在要依靠epoll驱动, 调用ngx_write_request_handler()函数发送剩余数据
-                    {
-                        p_Conn->psendbuf = p_Conn->psendbuf + sendsize;
-                        p_Conn->isendlen = p_Conn->isendlen - sendsize;
-                        ++p_Conn->iThrowsendCount; // 标记发送缓冲区满了
-
-                        // 修改为EPOLLOUT事件
-                        if (pSocketObj->ngx_epoll_oper_event(
-                                p_Conn->fd,
-                                EPOLL_CTL_MOD,
-                                EPOLLOUT,
-                                0,
-                                p_Conn) == -1)
-                        {
-                            ngx_log_stderr(errno, "CSocekt::ServerSendQueueThread()ngx_epoll_oper_event()失败.");
-                        }
-
-                        ngx_log_stderr(errno, "CSocekt::ServerSendQueueThread()中数据没发送完毕[发送缓冲区满], 整个要发送%d, 实际发送了%d.", p_Conn->isendlen, sendsize);
-                    }
-                    continue; // 继续处理其他消息
-                }
-                // 能走到这里, 应该是有点问题的
-                else if (sendsize == 0)
-                {
-                    //发送0个字节，首先因为我发送的内容不是0个字节的；
-                    //然后如果发送 缓冲区满则返回的应该是-1，而错误码应该是EAGAIN，所以我综合认为，这种情况我就把这个发送的包丢弃了【按对端关闭了socket处理】
-                    //这个打印下日志，我还真想观察观察是否真有这种现象发生
-                    //ngx_log_stderr(errno,"CSocekt::ServerSendQueueThread()中sendproc()居然返回0？"); //如果对方关闭连接出现send=0，那么这个日志可能会常出现，商用时就 应该干掉
-                    //然后这个包干掉，不发送了
-                    p_memory->FreeMemory(p_Conn->psendMemPointer); //释放内存
-                    p_Conn->psendMemPointer = NULL;
-                    p_Conn->iThrowsendCount = 0; //这行其实可以没有，因此此时此刻这东西就是=0的
-                    continue;
-                }
-                // 能走到这里, 继续处理问题
-                else if (sendsize == -1)
-                {
-                    // 一个字节都没发出去, 说明发送时缓冲区当前正好是满的
-                    ++p_Conn->iThrowsendCount; // 标记发送缓冲区满了，需要通过epoll事件来驱动消息的继续发送
-                    //投递此事件后，我们将依靠epoll驱动调用ngx_write_request_handler()函数发送数据
-                    if (pSocketObj->ngx_epoll_oper_event(
-                            p_Conn->fd,    //socket句柄
-                            EPOLL_CTL_MOD, //事件类型，这里是增加【因为我们准备增加个写通知】
-                            EPOLLOUT,      //标志，这里代表要增加的标志,EPOLLOUT：可写【可写的时候通知我】
-                            0,             //对于事件类型为增加的，EPOLL_CTL_MOD需要这个参数, 0：增加   1：去掉 2：完全覆盖
-                            p_Conn         //连接池中的连接
-                            ) == -1)
-                    {
-                        ngx_log_stderr(errno, "CSocekt::ServerSendQueueThread()中ngx_epoll_add_event()_2失败.");
-                    }
-                    continue;
-                }
-                else
-                {
-                    // 能走到这里的, 应该就是返回值-2了, 一般就认为对端断开了, 等待recv()来做断开socket以及回收资源
-                    p_memory->FreeMemory(p_Conn->psendMemPointer);
-                    p_Conn->psendMemPointer = NULL;
-                    p_Conn->iThrowsendCount = 0; // 这行其实可以没有, 因此此时此刻这东西就是=0的
-                    continue;
-                }
-
-            } // while(pos != posend)
-
-            err = pthread_mutex_unlock(&pSocketObj->m_sendMessageQueueMutex);
-            if (err != 0)
-                ngx_log_stderr(err, "CSocekt::ServerSendQueueThread()pthread_mutex_unlock()失败, 返回的错误码为%d!", err);
+            (this->*(p_Conn->rhandler))(p_Conn);
         }
     }
-
-    return (void *)0;
 }
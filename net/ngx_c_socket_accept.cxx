@@ -22,10 +22,11 @@
 // ----------------------------
 
 // 建立新连接
-// 1. 调用accept4()获取cfd;
+// 1. 调用accept4()获取cfd(io_uring下新连接已经由multishot accept取好了, 从事件后端中拿);
 // 2. 从连接池中获取连接;
-// 3. 调用ngx_epoll_oper_event(), 将该事件(cfd+连接)上epoll树(LT模式, 非ET模式)
-// 调用: ngx_worker_process_cycle() -> ngx_process_events_and_timers() -> CSocekt::ngx_epoll_process_events()
+// 3. 调用ngx_epoll_oper_event(), 将该事件(cfd+连接)上epoll树(默认LT模式, 配置了Sock_EpollET则为ET模式)
+// LT模式下一次只accept一个连接, 还有没accept的epoll会接着通知; ET模式下要一直accept到EAGAIN为止, 每轮最多 m_iETBudget 个.
+// 调用: CSocekt::ngx_reactor_process_events()
 void CSocekt::ngx_event_accept(lpngx_connection_t oldc)
 {
     struct sockaddr mysockaddr; // 远端服务器的socket地址
@@ -35,15 +36,24 @@ void CSocekt::ngx_event_accept(lpngx_connection_t oldc)
     int s;
     static int use_accept4 = 1; // 1: 使用accept4()函数
     lpngx_connection_t newc;
+    int iaccept = 0;                        // 本轮已经accept的连接数
+    lpngx_reactor_t pReactor = oldc->reactor; // 监听socket所属的reactor
 
     // ngx_log_stderr(0, "这是几个\n"); // 这里会惊群, epoll技术本身有 惊群 的问题
 
     do
     {
+        if (m_ifEpollET == 1 && iaccept >= m_iETBudget)
+        {
+            // 这一轮的次数用完了, 可能还有没accept的连接, 先去处理别的事件, 下一轮接着accept
+            ngx_post_event(oldc, EPOLLIN);
+            return;
+        }
+
         if (use_accept4)
         {
-            // 参数SOCK_NONBLOCK: 返回一个非阻塞的socket, 节省一次ioctl调用
-            s = accept4(oldc->fd, &mysockaddr, &socklen, SOCK_NONBLOCK);
+            // 同accept4(SOCK_NONBLOCK): 返回一个非阻塞的socket, 节省一次ioctl调用
+            s = pReactor->backend->Accept(oldc, &mysockaddr, &socklen);
         }
         else
         {
@@ -85,48 +95,46 @@ void CSocekt::ngx_event_accept(lpngx_connection_t oldc)
                 continue;
             }
 
-            if (err == ECONNABORTED) // 对方关闭套接字, 可以忽略
+            if (err == ECONNABORTED || err == EINTR) // 对方关闭套接字/被信号打断, 可以忽略, 接着accept后面的连接(ET模式下直接返回, 剩下的连接就不会再通知了)
             {
+                continue;
             }
 
             if (err == EMFILE || err == ENFILE)
             {
                 // 官方做法: 先把读事件从listen socket上移除, 然后再弄个定时器, 定时器到了则继续执行该函数, 但是定时器到了有个标记, 会把读事件增加到listen socket上去.
+                // ET模式下这次的通知已经用掉了, 没accept的连接不会再通知, 所以记下重试时刻, 到时由ngx_reactor_process_events()投递读事件;
+                // io_uring的multishot accept出错后也不会再通知(等Accept()取空了才重新投递), LT模式下同样要靠它; epoll的LT模式下会一直通知, 多投递一次也没关系.
+                ngx_log_error_core(level, err, "CSocekt::ngx_event_accept()中accept4()失败, %d毫秒后重试!", NGX_ACCEPT_RETRY_MSEC);
+                pReactor->acceptRetryMsec = ngx_current_msec() + NGX_ACCEPT_RETRY_MSEC;
             }
 
             return;
         }
 
         // 执行到此处, 表示accept4()/accept()成功.
+        ++iaccept;
+
+        // 以下这些失败的情况, 关闭这个socket后接着accept下一个(ET模式下如果直接返回, 剩下的连接就不会再通知了)
 
         if (m_onlineUserCount >= m_worker_connections) // 用户连接数过多, 关闭该用户socket.
         {
             close(s);
-            return;
+            continue;
         }
 
         // 如果某些恶意用户连上来发了1条数据就断, 不断连接, 会导致频繁调用 ngx_get_connection() 使用我们短时间内产生大量连接, 危及本服务器安全
-        if (m_connectionList.size() > (m_worker_connections * 5))
-        {
-            // 比如你允许同时最大2048个连接, 但连接池却有了 2048*5 这么大的容量, 这肯定是表示短时间内 产生大量连接/断开, 因为我们的延迟回收机制, 这里连接还在垃圾池里没有被回收
+        // 关闭的连接在没有线程还拿着它时就会被回收(CEpoch), 不会在待释放连接队列里积压, 所以不用再按空闲连接数来判断恶意的频繁连接/断开.
+        // 连接池容量是固定的, 用完了 ngx_get_connection() 返回NULL, 关闭新连接即可.
 
-            if (m_freeconnectionList.size() < m_worker_connections)
-            {
-                // 整个连接池这么大了, 而空闲连接却这么少了, 所以认为是短时间内产生大量连接, 发一个包后就断开, 所以必须断开新入用户的连接
-
-                close(s);
-                return;
-            }
-        }
-
-        newc = ngx_get_connection(s);
+        newc = ngx_get_connection(pReactor, s); // 新连接放在监听socket所属的reactor中, 以后的读写都由这个reactor线程处理
         if (newc == NULL)
         {
             if (close(s) == -1)
             {
                 ngx_log_error_core(NGX_LOG_ALERT, errno, "CSocekt::ngx_event_accept()中close(%d)失败!", s);
             }
-            return;
+            continue;
         }
 
         // 成功的拿到了连接池中的一个连接
@@ -139,7 +147,7 @@ void CSocekt::ngx_event_accept(lpngx_connection_t oldc)
             if (setnonblocking(s) == false)
             {
                 ngx_close_connection(newc);
-                return;
+                continue;
             }
         }
 
@@ -152,10 +160,13 @@ void CSocekt::ngx_event_accept(lpngx_connection_t oldc)
 
         // EPOLLRDHUP: TCP连接的远端关闭或者半关闭
         // 事件类型为EPOLL_CTL_ADD时不需要这个参数
-        if (ngx_epoll_oper_event(s, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP, 0, newc) == -1)
+        if (ngx_epoll_oper_event(s, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP | (m_ifEpollET == 1 ? (uint32_t)EPOLLET : 0u), 0, newc) == -1)
         {
+            // io_uring下可能poll请求已经投递了, 后面的recv请求才失败, 先撤销, 否则close()关不掉socket.
+            // 要在ngx_close_connection()之前, 归还连接池后序号就变了, 撤销不到原来的请求
+            ngx_epoll_oper_event(s, EPOLL_CTL_DEL, 0, 0, newc);
             ngx_close_connection(newc);
-            return;
+            continue;
         }
 
         /*
@@ -189,7 +200,11 @@ void CSocekt::ngx_event_accept(lpngx_connection_t oldc)
         }
 
         ++m_onlineUserCount; // 连入用户数量+1
-        break;
+
+        if (m_ifEpollET == 0) // LT模式一次只accept一个
+        {
+            break;
+        }
 
     } while (1);
 
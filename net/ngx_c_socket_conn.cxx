@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -18,22 +19,50 @@
 #include "ngx_c_socket.h"
 #include "ngx_c_memory.h"
 #include "ngx_c_lockmutex.h"
+#include "ngx_c_recvbuf.h"
 
 //---------------------------------------------------------------
 // 和网络中 连接/连接池 有关的函数
 //---------------------------------------------------------------
 
+// 检查 ngx_connection_s 的内存布局: 各组成员都要落在自己的cache line里, 调整成员时如果破坏了分组, 编译就会失败.
+// ngx_connection_s 有虚函数, 不是标准布局, offsetof 会有警告, 这里的用法gcc是支持的.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+static_assert(alignof(ngx_connection_t) == 64, "ngx_connection_t should be cache line aligned");
+static_assert(offsetof(ngx_connection_t, iCurrsequence) + sizeof(uint64_t) <= 64, "dispatch fields should fit in the first cache line");
+static_assert(offsetof(ngx_connection_t, precvBufBase) == 64, "receive fields should start at the second cache line");
+static_assert(offsetof(ngx_connection_t, curStat) + sizeof(unsigned char) <= 128, "receive fields should fit in the second cache line");
+static_assert(offsetof(ngx_connection_t, sendMutex) % 64 == 0, "send fields should start on their own cache line");
+static_assert(offsetof(ngx_connection_t, logicPorcMutex) % 64 == 0, "logic fields should start on their own cache line");
+static_assert(offsetof(ngx_connection_t, listening) % 64 == 0, "cold fields should start on their own cache line");
+#pragma GCC diagnostic pop
+
 // 构造函数
 ngx_connection_s::ngx_connection_s()
 {
     iCurrsequence = 0;
+    precvBufBase = NULL;
+    precvBufOwn = NULL;
+    precvBuf = NULL;
+    timerNode.prev = NULL; // 不在时间轮中
+    timerNode.next = NULL;
+    timerNode.data = this;
     pthread_mutex_init(&logicPorcMutex, NULL); // 互斥量初始化
+    pthread_mutex_init(&sendMutex, NULL);
 }
 
 // 析构函数
 ngx_connection_s::~ngx_connection_s()
 {
+    if (precvBufOwn != NULL)
+    {
+        delete[] precvBufOwn;
+        precvBufOwn = NULL;
+    }
+    precvBufBase = NULL;
     pthread_mutex_destroy(&logicPorcMutex); // 互斥量释放
+    pthread_mutex_destroy(&sendMutex);
 }
 
 // 分配一个连接时, 成员变量的初始化
@@ -45,8 +74,12 @@ void ngx_connection_s::GetOneToUse()
     fd = -1;
 
     curStat = _PKG_HD_INIT;
-    precvbuf = dataHeadInfo;
-    irecvlen = sizeof(COMM_PKG_HEADER);
+    precvBufBase = precvBufOwn; // 零拷贝收包时, 第一次收包前才去池中取缓冲区
+    irecvBufHead = 0;
+    irecvBufTail = 0;
+    precvbuf = NULL;
+    irecvlen = 0;
+    irecvCrc = 0;
     precvMemPointer = NULL;
 
     iThrowsendCount = 0;
@@ -54,7 +87,7 @@ void ngx_connection_s::GetOneToUse()
 
     events = 0; // epoll事件, 先给0
 
-    lastPingTime = time(NULL);
+    lastPingTime = ngx_time();
 
     FloodkickLastTime = 0;
     FloodAttackCount = 0;
@@ -79,88 +112,165 @@ void ngx_connection_s::PutOneToFree()
         psendMemPointer = NULL;
     }
 
+    // 还有包没处理完的话, 缓冲区等它们处理完再归还
+    if (precvBuf != NULL)
+    {
+        CRecvBufPool::GetInstance()->Release(precvBuf);
+        precvBuf = NULL;
+    }
+
+    // 正常情况下关闭连接时(CSocekt::zdClosesocketProc)已经清空, 这里兜底
+    while (!sendMsgQueue.empty())
+    {
+        CMemory::GetInstance()->FreeMemory(sendMsgQueue.front());
+        sendMsgQueue.pop_front();
+    }
+
     iThrowsendCount = 0; // 设置不设置感觉都行
 }
 
 //---------------------------------------------------------------
 
-// 初始化连接池 (m_connectionList/m_freeconnectionList), 初始容量为 m_worker_connections, 如果不够用, 会在 ngx_get_connection()中扩容连接池.
+// 分配整个worker进程的连接池数组: 每个reactor一段, 每段 iPoolSize * NGX_CONNPOOL_OVERCOMMIT 个连接.
+// 数组按cache line对齐, 元素在各reactor的 initconnection(pReactor) 中构造.
 // 连接池作用: 把客户端连接(socket)和连接池中的一个连接对象(ngx_connection_t)绑到一起, 连接对象可以记录很多有关该客户端连接的信息.
 // 调用: CSocekt::ngx_epoll_init()
-void CSocekt::initconnection()
+bool CSocekt::initconnection()
 {
-    lpngx_connection_t p_Conn;
-    CMemory *p_memory = CMemory::GetInstance();
+    int iPoolSize = m_worker_connections / m_iReactorCount; // 连接池按reactor平分
+    iPoolSize = (iPoolSize > 0) ? iPoolSize : 1;
+    m_iConnPoolSize = iPoolSize * NGX_CONNPOOL_OVERCOMMIT * m_iReactorCount;
 
-    int ilenconnpool = sizeof(ngx_connection_t);
-    for (int i = 0; i < m_worker_connections; ++i)
+    void *pPool = NULL;
+    int err = posix_memalign(&pPool, alignof(ngx_connection_t), sizeof(ngx_connection_t) * (size_t)m_iConnPoolSize);
+    if (err != 0)
     {
-        p_Conn = (lpngx_connection_t)p_memory->AllocMemory(ilenconnpool, true);
-        p_Conn = new (p_Conn) ngx_connection_t(); // 定位new用法, 手工调用构造函数
-        p_Conn->GetOneToUse();
+        ngx_log_stderr(err, "CSocekt::initconnection()中posix_memalign()失败, 连接数: %d.", m_iConnPoolSize);
+        m_pConnPool = NULL;
+        m_iConnPoolSize = 0;
+        return false;
+    }
+    m_pConnPool = (lpngx_connection_t)pPool;
+    return true;
+}
 
-        m_connectionList.push_back(p_Conn);
-        m_freeconnectionList.push_back(p_Conn);
+// 构造某个reactor那一段连接, 并全部压入该reactor的空闲连接栈.
+// 调用: CSocekt::ngx_epoll_init()
+void CSocekt::initconnection(lpngx_reactor_t pReactor)
+{
+    pReactor->iPoolCapacity = pReactor->iPoolSize * NGX_CONNPOOL_OVERCOMMIT;
+    pReactor->iPoolBase = pReactor->index * pReactor->iPoolCapacity;
+    pReactor->freeTop = 0;
+    pReactor->iFreeCount = 0;
+
+    // 倒着压栈, 先分配出去的是下标小的
+    for (int i = pReactor->iPoolCapacity - 1; i >= 0; --i)
+    {
+        lpngx_connection_t p_Conn = new (&m_pConnPool[pReactor->iPoolBase + i]) ngx_connection_t(); // 定位new用法, 手工调用构造函数
+        p_Conn->index = pReactor->iPoolBase + i;
+        p_Conn->reactor = pReactor;
+        p_Conn->fd = -1;
+        p_Conn->iThrowsendCount = 0;
+        p_Conn->psendMemPointer = NULL;
+        p_Conn->precvMemPointer = NULL;
+        ngx_free_connection(p_Conn);
     }
 
     return;
 }
 
-// 回收连接池(m_connectionList), 释放所占内存.
+// 析构所有reactor的连接, 释放连接池数组.
 // 调用: CSocekt::Shutdown_subproc()
 void CSocekt::clearconnection()
 {
-    lpngx_connection_t p_Conn;
-    CMemory *p_memory = CMemory::GetInstance();
+    if (m_pConnPool == NULL)
+    {
+        return;
+    }
 
-    while (!m_connectionList.empty())
+    for (auto pos = m_reactorList.begin(); pos != m_reactorList.end(); ++pos)
     {
-        p_Conn = m_connectionList.front();
-        m_connectionList.pop_front();
-        p_Conn->~ngx_connection_t(); // 先析构, 再释放内存.
-        p_memory->FreeMemory(p_Conn);
+        for (int i = 0; i < (*pos)->iPoolCapacity; ++i)
+        {
+            m_pConnPool[(*pos)->iPoolBase + i].~ngx_connection_t(); // 先析构, 再释放内存.
+        }
+        (*pos)->freeTop = 0;
+        (*pos)->iFreeCount = 0;
     }
+    free(m_pConnPool);
+    m_pConnPool = NULL;
+    m_iConnPoolSize = 0;
 }
 
-// 从连接池中获取一个空闲连接, 如果没有空间连接就扩容连接池.
-// 调用: CSocekt::ngx_event_accept()(被cfd所使用), CSocekt::ngx_epoll_init()(被lfd所使用)
-lpngx_connection_t CSocekt::ngx_get_connection(int isock)
+// 从某个reactor的空闲连接栈中弹出一个连接, 连接池满了返回NULL.
+// 只有该reactor线程会取连接, 但回收线程会同时归还连接, 所以用带版本号的CAS.
+// 调用: CSocekt::ngx_event_accept()(被cfd所使用), CSocekt::ngx_reactor_init()(被lfd所使用)
+lpngx_connection_t CSocekt::ngx_get_connection(lpngx_reactor_t pReactor, int isock)
 {
-    CLock lock(&m_connectionMutex);
-
-    lpngx_connection_t p_Conn;
-    if (m_freeconnectionList.empty()) // 没空闲连接
+    lpngx_connection_t p_Conn = NULL;
+    uint64_t oldTop = pReactor->freeTop.load(std::memory_order_acquire);
+    while ((uint32_t)oldTop != 0)
     {
-        CMemory *p_memory = CMemory::GetInstance();
-        p_Conn = (lpngx_connection_t)p_memory->AllocMemory(sizeof(ngx_connection_t), true);
-        p_Conn = new (p_Conn) ngx_connection_t();
-        p_Conn->GetOneToUse();
-
-        m_connectionList.push_back(p_Conn); // 加入到连接池, 统一管理.
+        p_Conn = &m_pConnPool[(uint32_t)oldTop - 1];
+        // 节点可能刚被别人弹出又压回, next读到的是旧值也没关系, 版本号变了CAS会失败
+        lpngx_connection_t pNext = __atomic_load_n(&p_Conn->next, __ATOMIC_RELAXED);
+        uint64_t newTop = ((oldTop >> 32) + 1) << 32 | (pNext != NULL ? pNext->index + 1 : 0);
+        if (pReactor->freeTop.compare_exchange_weak(oldTop, newTop, std::memory_order_acquire, std::memory_order_acquire))
+        {
+            break;
+        }
+        p_Conn = NULL;
     }
-    else // 有空闲连接
+
+    if (p_Conn == NULL) // 没空闲连接
     {
-        p_Conn = m_freeconnectionList.front();
-        m_freeconnectionList.pop_front();
-        p_Conn->GetOneToUse();
+        return NULL;
     }
+    --pReactor->iFreeCount;
 
+    if (p_Conn->precvBufOwn == NULL) // 收包缓冲区在第一次用到时才分配, 用不到的那部分连接池不占内存
+    {
+        p_Conn->precvBufOwn = new char[m_iRecvBufSize];
+    }
+    p_Conn->GetOneToUse();
     p_Conn->fd = isock;
     return p_Conn;
 }
 
-// 归还连接到到连接池中
+// 归还连接到到所属reactor的空闲连接栈中
 void CSocekt::ngx_free_connection(lpngx_connection_t pConn)
 {
-    CLock lock(&m_connectionMutex);
+    lpngx_reactor_t pReactor = pConn->reactor;
+
     pConn->PutOneToFree();
-    m_freeconnectionList.push_back(pConn);
+
+    uint64_t oldTop = pReactor->freeTop.load(std::memory_order_relaxed);
+    uint64_t newTop;
+    do
+    {
+        __atomic_store_n(&pConn->next, ((uint32_t)oldTop != 0) ? &m_pConnPool[(uint32_t)oldTop - 1] : NULL, __ATOMIC_RELAXED);
+        newTop = ((oldTop >> 32) + 1) << 32 | (pConn->index + 1);
+    } while (!pReactor->freeTop.compare_exchange_weak(oldTop, newTop, std::memory_order_release, std::memory_order_relaxed));
+    ++pReactor->iFreeCount;
 
     return;
 }
 
+// 句柄换连接: 下标越界, 或者代数和连接当前的不一致(连接已经被回收/复用), 返回NULL.
+// 连接对象本身永远不会被释放(直到进程退出), 所以拿到的指针总是可以访问的, 只是使用期间仍可能作废, 需要的地方要在锁内再用 MatchHandle() 判断一次.
+lpngx_connection_t CSocekt::ngx_get_connection_by_handle(ngx_conn_handle_t hConn)
+{
+    uint32_t index = NGX_CONN_HANDLE_INDEX(hConn);
+    if (index >= (uint32_t)m_iConnPoolSize)
+    {
+        return NULL;
+    }
+    lpngx_connection_t p_Conn = &m_pConnPool[index];
+    return p_Conn->MatchHandle(hConn) ? p_Conn : NULL;
+}
+
 // 延迟回收: 用户已经接入进来开始干活, 干活过程中发生失败.
-// 将要回收的连接仍进一个队列, 后续有专门的线程会回收这个队列中的连接.
+// 将要回收的连接仍进一个队列, 后续有专门的线程会在没有线程还拿着它时回收(一般是几毫秒之内).
 // 调用: CSocekt::zdClosesocketProc()
 void CSocekt::inRecyConnectQueue(lpngx_connection_t pConn)
 {
@@ -184,8 +294,8 @@ void CSocekt::inRecyConnectQueue(lpngx_connection_t pConn)
 
     // (2) 仍进去.
 
-    pConn->inRecyTime = time(NULL); // 记录回收时间
-    ++pConn->iCurrsequence;
+    ++pConn->iCurrsequence;                 // 先作废: 之后句柄换不回这个连接, 事件也都过期了
+    pConn->iRetireEpoch = m_epoch.Retire(); // 再记下作废时的代, 在这之前进入临界区的线程都离开后才能回收
     m_recyconnectionList.push_back(pConn);
     ++m_total_recyconnection_n; // 待释放连接队列大小+1
     --m_onlineUserCount;        // 连入用户数量-1
@@ -193,7 +303,10 @@ void CSocekt::inRecyConnectQueue(lpngx_connection_t pConn)
     return;
 }
 
-// 清理 待释放连接队列 中的连接.
+#define NGX_RECY_BUSY_INTERVAL (5 * 1000)   // 有待回收的连接时, 回收线程每次休息5毫秒
+#define NGX_RECY_IDLE_INTERVAL (200 * 1000) // 没有待回收的连接时, 回收线程每次休息200毫秒
+
+// 清理 待释放连接队列 中的连接: 连接作废之前进入临界区的线程都离开了(CEpoch), 就可以回收.
 // (1) 从队列中erase();
 // (2) ngx_free_connection 对应的pConn.
 void *CSocekt::ServerRecyConnectionThread(void *threadData)
@@ -201,18 +314,19 @@ void *CSocekt::ServerRecyConnectionThread(void *threadData)
     ThreadItem *pThread = static_cast<ThreadItem *>(threadData);
     CSocekt *pSocketObj = pThread->_pThis;
 
-    time_t currtime;
+    uint64_t minEpoch;
     int err;
     std::list<lpngx_connection_t>::iterator pos, posend;
     lpngx_connection_t p_Conn;
 
     while (1)
     {
-        usleep(200 * 1000); // 为简化问题, 我们直接每次休息200毫秒
+        // 有待回收的连接时, 一般各线程很快就会离开临界区, 所以多看几次; 没有时就多睡一会
+        usleep((pSocketObj->m_total_recyconnection_n > 0) ? NGX_RECY_BUSY_INTERVAL : NGX_RECY_IDLE_INTERVAL);
 
         if (pSocketObj->m_total_recyconnection_n > 0)
         {
-            currtime = time(NULL);
+            minEpoch = pSocketObj->m_epoch.MinActive(); // 所有还在临界区中的线程进入时的最小的代
 
             err = pthread_mutex_lock(&pSocketObj->m_recyconnqueueMutex);
             if (err != 0)
@@ -220,31 +334,28 @@ void *CSocekt::ServerRecyConnectionThread(void *threadData)
                 ngx_log_stderr(err, "CSocekt::ServerRecyConnectionThread()中pthread_mutex_lock()失败，返回的错误码为%d!", err);
             }
 
-        lblRRTD:
             pos = pSocketObj->m_recyconnectionList.begin();
             posend = pSocketObj->m_recyconnectionList.end();
-            for (; pos != posend; ++pos)
+            while (pos != posend)
             {
                 p_Conn = (*pos);
-                if (((p_Conn->inRecyTime + pSocketObj->m_RecyConnectionWaitTime) > currtime) && (g_stopEvent == 0))
+                if (minEpoch < p_Conn->iRetireEpoch && g_stopEvent == 0)
                 {
-                    continue; // 没到释放的时间
+                    ++pos;
+                    continue; // 还有线程在连接作废之前进入了临界区, 可能拿着这个连接
                 }
-                // 到释放的时间了
+                // 没有线程拿着了
 
-                // 凡是到释放时间的, iThrowsendCount都应该为0, 这里我们加点日志判断下.
+                // 可以释放的, iThrowsendCount都应该为0, 这里我们加点日志判断下.
                 if (p_Conn->iThrowsendCount > 0) // 判断条件为>0, 不建议==0, 详细见 CSocekt::zdClosesocketProc().
                 {
                     ngx_log_stderr(0, "CSocekt::ServerRecyConnectionThread()中到释放时间却发现p_Conn.iThrowsendCount!=0，这个不该发生");
                 }
 
                 // 流程走到这里, 表示可以释放.
-                --pSocketObj->m_total_recyconnection_n;      // 待释放连接队列大小-1
-                pSocketObj->m_recyconnectionList.erase(pos); // 迭代器虽然失效, 但pos所指内容在p_Conn里保存着
-                pSocketObj->ngx_free_connection(p_Conn);     // 归还参数pConn所代表的连接到到连接池中
-
-                // 迭代器已经失效, 需要重新遍历
-                goto lblRRTD;
+                --pSocketObj->m_total_recyconnection_n;            // 待释放连接队列大小-1
+                pos = pSocketObj->m_recyconnectionList.erase(pos); // erase返回下一个位置, 接着遍历
+                pSocketObj->ngx_free_connection(p_Conn);           // 归还参数pConn所代表的连接到到连接池中
             }
 
             err = pthread_mutex_unlock(&pSocketObj->m_recyconnqueueMutex);
@@ -19,108 +19,100 @@
 #include "ngx_c_socket.h"
 #include "ngx_c_memory.h"
 #include "ngx_c_lockmutex.h"
+#include "ngx_c_recvbuf.h"
+#include "ngx_c_crc32.h"
 
 // --------------------------------------------
 // 和网络 中 客户端发送来数据/服务器端收包 有关的代码
 // --------------------------------------------
 
-// 收包思路: 先收"包头", 根据包头中的内容确定包长, 再收"包体".
-// (1) 调用 recvproc 收包
-// (2) 收包头
-// (3) 收包体
-// 调用: ngx_epoll_process_events()
+// 收包思路: 一次recv()尽量多收, 收到连接的收包缓冲区中, 再从缓冲区中解析出所有完整的包.
+// 客户端连续发来很多小包时, 一次recv()/一次epoll通知就能处理一大批, 而不是每个包收包头, 收包体各一次.
+// (1) 大包(比收包缓冲区还大)收包体中, 直接收到消息内存中
+// (2) 否则调用 recvproc() 收到收包缓冲区中, 调用 ngx_wait_request_handler_proc_p1() 解析
+// LT模式下收一次就返回, 没收完epoll还会通知; ET模式下要一直收到EAGAIN为止, 但每轮最多收 m_iETBudget 次, 以免一个连接饿死其他连接.
+// 开启 Sock_RecvCrcCheck 时, 大包的包体边收边算crc32(irecvCrc), 收完就能校验, 不用等逻辑线程.
+// 调用: ngx_reactor_process_events()
 void CSocekt::ngx_read_request_handler(lpngx_connection_t pConn)
 {
     bool isflood = false; // 是否flood攻击
+    ssize_t reco;
+    int icount = 0; // 本轮已经recv的次数
 
-    // (1) 调用 recvproc() 收包
-
-    ssize_t reco = recvproc(pConn, pConn->precvbuf, pConn->irecvlen);
-    if (reco <= 0)
+    do
     {
-        return; // 问题在 recvproc() 已经处理过了
-    }
+        // (1) 收包状态 _PKG_BD_RECVING 的处理
+        if (pConn->curStat == _PKG_BD_RECVING)
+        {
+            reco = recvproc(pConn, pConn->precvbuf, pConn->irecvlen);
+            if (reco <= 0)
+            {
+                return; // 没数据了(EAGAIN), 或者问题在 recvproc() 已经处理过了
+            }
 
-    // 走到这里, 说明成功收到了一些字节, 就要开始处理收到的数据
+            if (m_ifRecvCrcCheck == 1)
+            {
+                pConn->irecvCrc = CCRC32::GetInstance()->Update(pConn->irecvCrc, (unsigned char *)pConn->precvbuf, reco);
+            }
 
-    // (2) 收包状态 _PKG_HD_INIT 的处理
-    if (pConn->curStat == _PKG_HD_INIT)
-    {
-        if (reco == m_iLenPkgHeader) // 正好收到完整包头, 这里拆解包头
-        {
-            ngx_wait_request_handler_proc_p1(pConn, isflood); // 包头处理函数
-        }
-        else
-        {
-            // 收到的包头不完整, 我们不能预料每个包的长度, 也不能预料各种拆包/粘包情况, 所以收到不完整包头(缺包)是很可能的
-            pConn->curStat = _PKG_HD_RECVING;         // 接收包头中, 包头不完整, 要继续接收包头中
-            pConn->precvbuf = pConn->precvbuf + reco; // 下次要收包头数据的位置
-            pConn->irecvlen = pConn->irecvlen - reco; // 下次要收包头数据的长度
-        }
-    }
-    // (3) 收到状态 _PKG_HD_RECVING 的处理
-    else if (pConn->curStat == _PKG_HD_RECVING) // 包头没有收完整时, 这个条件才会成立
-    {
-        if (pConn->irecvlen == reco) // 缺多少, 收多少. 此时包头收完整.
-        {
-            ngx_wait_request_handler_proc_p1(pConn, isflood); // 包头处理函数
+            if (pConn->irecvlen == reco) // 缺多少, 收多少. 此时包体收完整.
+            {
+                // Flood攻击检测是否开启
+                if (m_floodAkEnable == 1)
+                {
+                    isflood = TestFlood(pConn);
+                }
+                bool ispkgok = true;
+                if (m_ifRecvCrcCheck == 1)
+                {
+                    ispkgok = TestPkgCrc((LPCOMM_PKG_HEADER)(pConn->precvMemPointer + m_iLenMsgHeader), pConn->irecvCrc);
+                }
+                ngx_wait_request_handler_proc_plast(pConn, isflood, ispkgok);
+            }
+            else
+            {
+                // 包体没收完整, 继续收
+                pConn->precvbuf = pConn->precvbuf + reco;
+                pConn->irecvlen = pConn->irecvlen - reco;
+            }
         }
+        // (2) 收包状态 _PKG_HD_INIT 的处理
         else
         {
-            // 包头还是没收完整, 继续收包头
-            pConn->precvbuf = pConn->precvbuf + reco; // 下次要收包头数据的位置
-            pConn->irecvlen = pConn->irecvlen - reco; // 下次要收包头数据的长度
-        }
-    }
-    // (4) 收包状态 _PKG_BD_INIT 的处理
-    else if (pConn->curStat == _PKG_BD_INIT)
-    {
-        if (reco == pConn->irecvlen)
-        {
-            // Flood攻击检测是否开启
-            if (m_floodAkEnable == 1)
+            // 零拷贝收包: 连接自己的缓冲区空着时, 换成池中的缓冲区(池空就接着用自己的)
+            if (m_ifZeroCopyRecv == 1 && pConn->precvBuf == NULL && pConn->irecvBufTail == 0)
             {
-                isflood = TestFlood(pConn);
+                pConn->precvBuf = CRecvBufPool::GetInstance()->Get(pConn->GetHandle());
+                if (pConn->precvBuf != NULL)
+                {
+                    pConn->precvBufBase = CRecvBufPool::Data(pConn->precvBuf);
+                }
             }
 
-            // 收到的宽度等于要收的宽度，包体也收完整了
-            ngx_wait_request_handler_proc_plast(pConn, isflood);
-        }
-        else
-        {
-            // 收到的宽度小于要收的宽度
-            pConn->curStat = _PKG_BD_RECVING;
-            pConn->precvbuf = pConn->precvbuf + reco;
-            pConn->irecvlen = pConn->irecvlen - reco;
-        }
-    }
-    // (5) 收到状态 _PKG_BD_RECVING 的处理
-    else if (pConn->curStat == _PKG_BD_RECVING)
-    {
-        // 接收包体中, 包体不完整, 继续接收中
-        if (pConn->irecvlen == reco)
-        {
-            // Flood攻击检测是否开启
-            if (m_floodAkEnable == 1)
+            // 收包缓冲区中剩下的不完整包总比缓冲区小(见 ngx_wait_request_handler_proc_p1()), 所以这里总有空间可收
+            reco = recvproc(pConn, pConn->precvBufBase + pConn->irecvBufTail, m_iRecvBufSize - pConn->irecvBufTail);
+            if (reco <= 0)
             {
-                isflood = TestFlood(pConn);
+                return; // 没数据了(EAGAIN), 或者问题在 recvproc() 已经处理过了
             }
-            // 包体收完整
-            ngx_wait_request_handler_proc_plast(pConn, isflood);
-        }
-        else
-        {
-            // 包体没收完整, 继续收
-            pConn->precvbuf = pConn->precvbuf + reco;
-            pConn->irecvlen = pConn->irecvlen - reco;
+
+            pConn->irecvBufTail += reco;
+            ngx_wait_request_handler_proc_p1(pConn, isflood); // 解析收包缓冲区
         }
-    }
+    } while (m_ifEpollET == 1 && isflood == false && ++icount < m_iETBudget);
 
     if (isflood == true)
     {
         // 客户端flood服务器, 则直接把客户端踢掉.
         ngx_log_stderr(errno, "发现客户端flood, 干掉该客户端!");
         zdClosesocketProc(pConn);
+        return;
+    }
+
+    if (m_ifEpollET == 1)
+    {
+        // 收了 m_iETBudget 次还没收到EAGAIN, 先去处理别的连接, 下一轮接着收
+        ngx_post_event(pConn, EPOLLIN);
     }
 
     return;
@@ -128,19 +120,24 @@ void CSocekt::ngx_read_request_handler(lpngx_connection_t pConn)
 
 // 封装了recv函数, 用来收包.
 // 返回值: -1, 有问题发生, 且本函数已经把问题处理完毕(释放连接池中连接, 然后直接关闭 socket)
+//         0, 没收到数据(EAGAIN), ET模式下表示已经收完
 //        >0, 实际收到的字节数
-// (1) 调用 recv() 收包.
+// (1) 调用 recv() 收包, 被信号中断(EINTR)就重新收.
 // (2) 处理 recv()返回0 的情况.
 // (2) 处理 recv()返回-1 的情况.
 ssize_t CSocekt::recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen)
 {
     ssize_t n; // 返回值
 
-    n = recv(pConn->fd, buff, buflen, 0); // 最后一个参数 flag 一般为0
+    do
+    {
+        n = pConn->reactor->backend->Recv(pConn, buff, buflen); // 一般就是recv(), io_uring后端可能是内核已经收好的数据
+    } while (n < 0 && errno == EINTR); // EINTR: 被信号中断的系统调用, Nginx官方不认为是错误, 重新收即可
+
     if (n == 0)
     {
         // 客户端关闭(完成4次挥手)
-        ngx_log_stderr(0, "连接被客户端正常关闭[4路挥手关闭]!");
+        ngx_log_error(NGX_LOG_INFO, 0, "连接被客户端正常关闭[4路挥手关闭]!");
         zdClosesocketProc(pConn);
         return -1;
     }
@@ -153,17 +150,12 @@ ssize_t CSocekt::recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen)
         // 一般在 ET 模式下会出现这个错误, 因为 ET 模式下是不停的 recv, 肯定有一个时刻收到这个 errno, 但 LT 模式下一般是来事件才收, 所以不该出现这个返回值.
         if (errno == EAGAIN || errno == EWOULDBLOCK)
         {
-            // LT 模式不该出现这个errno, 而且也不是错误, 所以不当做错误处理.
-            ngx_log_stderr(errno, "CSocekt::recvproc()中 errno==EAGAIN || errno==EWOULDBLOCK 成立, 出乎意料.");
-            return -1;
-        }
-
-        // EINTR 错误的产生: 服务器端设置了信号捕获机制和子进程, 当在父进程阻塞于慢的系统调用时, 由父进程捕获到了一个有效信号时, 内核会致使 accept() 返回一个EINTR错误(被中断的系统调用).
-        if (errno == EINTR) // Nginx官方不认为是错误
-        {
-            // LT 模式不该出现这个errno, 而且也不是错误, 所以不当做错误处理.
-            ngx_log_stderr(errno, "CSocekt::recvproc()中errno == EINTR成立，出乎我意料！");
-            return -1;
+            if (m_ifEpollET == 0)
+            {
+                // LT 模式不该出现这个errno, 而且也不是错误, 所以不当做错误处理.
+                ngx_log_stderr(errno, "CSocekt::recvproc()中 errno==EAGAIN || errno==EWOULDBLOCK 成立, 出乎意料.");
+            }
+            return 0;
         }
 
         // 如下都是异常, 需要关闭客户端socket, 回收连接池中连接
@@ -191,7 +183,7 @@ ssize_t CSocekt::recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen)
             }
         }
 
-        ngx_log_stderr(0,"连接被客户端 非正常关闭！");
+        ngx_log_error(NGX_LOG_INFO, 0, "连接被客户端 非正常关闭！");
         zdClosesocketProc(pConn);
 
         return -1;
@@ -200,63 +192,178 @@ ssize_t CSocekt::recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen)
     return n;
 }
 
-// 收包头, 包处理阶段1
+// 包处理阶段1: 从收包缓冲区中解析出尽量多的完整包, 每个完整包拷贝到一块 消息头+包头+包体 的内存中入消息队列.
+// 零拷贝收包时(pConn->precvBuf不为NULL), 完整包不拷贝, 缓冲区引用计数+1, 直接把包头的指针入消息队列.
+// 最后剩下的不完整包挪到缓冲区开头, 等下次recv()收到后续数据再解析.
+// 包长比收包缓冲区还大的, 拷贝已收到的部分, 转入 _PKG_BD_RECVING 状态直接收包体.
+// 开启 Sock_RecvCrcCheck 时, 完整的包在这里就校验crc32值, 错的直接丢掉, 不分配内存也不入消息队列.
 void CSocekt::ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &isflood)
 {
     CMemory *p_memory = CMemory::GetInstance();
+    CCRC32 *p_crc32 = CCRC32::GetInstance();
+    CRecvBufPool *p_recvbuf = CRecvBufPool::GetInstance();
+    char *pBuf = pConn->precvBufBase;
+    unsigned int iavail;
 
-    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)pConn->dataHeadInfo;
-    unsigned short e_pkgLen = ntohs(pPkgHeader->pkgLen);
-
-    // 包长不合法, 认为是恶意包/错误包
-    if (e_pkgLen < m_iLenPkgHeader || e_pkgLen > (_PKG_MAX_LENGTH - 1000))
-    {
-        // 复原"收包相关的变量"
-        pConn->curStat = _PKG_HD_INIT;
-        pConn->precvbuf = pConn->dataHeadInfo;
-        pConn->irecvlen = m_iLenPkgHeader;
-    }
-    else // 包长合法
+    while (isflood == false && pConn->curStat == _PKG_HD_INIT)
     {
+        iavail = pConn->irecvBufTail - pConn->irecvBufHead;
+        if (iavail < m_iLenPkgHeader) // 包头都不完整
+        {
+            break;
+        }
+
+        LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pBuf + pConn->irecvBufHead); // 包头是1字节对齐的, 不要求地址对齐
+        unsigned short e_pkgLen = ntohs(pPkgHeader->pkgLen);
+
+        // 包长不合法, 认为是恶意包/错误包, 丢掉这个包头, 接着往后解析
+        if (e_pkgLen < m_iLenPkgHeader || e_pkgLen > (_PKG_MAX_LENGTH - 1000))
+        {
+            pConn->irecvBufHead += m_iLenPkgHeader;
+            continue;
+        }
+
+        // 包不完整, 但缓冲区放得下整个包, 留在缓冲区里等后续数据
+        if (e_pkgLen > iavail && e_pkgLen <= (unsigned int)m_iRecvBufSize)
+        {
+            break;
+        }
+
+        // 整个包都在缓冲区里, 先校验crc32值
+        if (m_ifRecvCrcCheck == 1 && e_pkgLen <= iavail &&
+            TestPkgCrc(pPkgHeader, p_crc32->Update(0, (unsigned char *)pPkgHeader + m_iLenPkgHeader, e_pkgLen - m_iLenPkgHeader)) == false)
+        {
+            pConn->irecvBufHead += e_pkgLen;
+
+            // 错包也算收到的包, 照样参与flood检测
+            if (m_floodAkEnable == 1)
+            {
+                isflood = TestFlood(pConn);
+            }
+            continue;
+        }
+
+        // 零拷贝: 整个包都在池中的缓冲区里, 包就留在原地, 缓冲区在这个包处理完之前不会被改动
+        if (pConn->precvBuf != NULL && e_pkgLen <= iavail)
+        {
+            pConn->irecvBufHead += e_pkgLen;
+
+            if (m_floodAkEnable == 1)
+            {
+                isflood = TestFlood(pConn);
+            }
+            if (isflood == false)
+            {
+                p_recvbuf->AddRef(pConn->precvBuf);
+                g_threadpool.inMsgRecvQueueAndSignal((char *)pPkgHeader);
+            }
+            continue;
+        }
+
         char *pTmpBuffer = (char *)p_memory->AllocMemory(m_iLenMsgHeader + e_pkgLen, false); // 分配内存, 大小为 消息头长+包长
         pConn->precvMemPointer = pTmpBuffer;
 
         // 填写 消息头 内容
         LPSTRUC_MSG_HEADER ptmpMsgHeader = (LPSTRUC_MSG_HEADER)pTmpBuffer;
-        ptmpMsgHeader->pConn = pConn;
-        ptmpMsgHeader->iCurrsequence = pConn->iCurrsequence; // 给消息头中的 iCurrsequence赋值
-
-        // 填写 包头 内容
+        ptmpMsgHeader->hConn = pConn->GetHandle(); // 连接句柄中带着连接当前的代数
         pTmpBuffer += m_iLenMsgHeader;
-        memcpy(pTmpBuffer, pPkgHeader, m_iLenPkgHeader);
 
-        // 只有包头无包体
-        if (e_pkgLen == m_iLenPkgHeader)
+        if (e_pkgLen <= iavail) // 整个包都在缓冲区里
         {
+            memcpy(pTmpBuffer, pPkgHeader, e_pkgLen);
+            pConn->irecvBufHead += e_pkgLen;
+
             // Flood攻击检测是否开启
             if (m_floodAkEnable == 1)
             {
                 isflood = TestFlood(pConn);
             }
 
-            // 直接入 收消息队列, 待后续业务逻辑线程去处理
+            // 入 收消息队列, 待后续业务逻辑线程去处理
             ngx_wait_request_handler_proc_plast(pConn, isflood);
         }
-        else // 开始收包体
+        else // 大包, 缓冲区里的全拷走, 包体剩下的部分直接收
         {
-            pConn->curStat = _PKG_BD_INIT;                  // 准备接收包体
-            pConn->precvbuf = pTmpBuffer + m_iLenPkgHeader; // 指向包体
-            pConn->irecvlen = e_pkgLen - m_iLenPkgHeader;   // 包体长
+            memcpy(pTmpBuffer, pPkgHeader, iavail);
+            pConn->irecvBufHead += iavail;
+
+            pConn->curStat = _PKG_BD_RECVING;
+            pConn->precvbuf = pTmpBuffer + iavail;
+            pConn->irecvlen = e_pkgLen - iavail;
+            if (m_ifRecvCrcCheck == 1) // 已经收到的那部分包体先算上
+            {
+                pConn->irecvCrc = p_crc32->Update(0, (unsigned char *)pTmpBuffer + m_iLenPkgHeader, iavail - m_iLenPkgHeader);
+            }
         }
     }
 
+    // 池中的缓冲区里还有包没处理完, 不能挪动数据
+    if (pConn->precvBuf != NULL && p_recvbuf->IsShared(pConn->precvBuf))
+    {
+        ngx_wait_request_handler_compact(pConn);
+        return;
+    }
+
+    // 整理收包缓冲区: 解析完的丢掉, 剩下不完整的挪到开头
+    if (pConn->irecvBufHead == pConn->irecvBufTail)
+    {
+        pConn->irecvBufHead = 0;
+        pConn->irecvBufTail = 0;
+    }
+    else if (pConn->irecvBufHead > 0)
+    {
+        memmove(pBuf, pBuf + pConn->irecvBufHead, pConn->irecvBufTail - pConn->irecvBufHead);
+        pConn->irecvBufTail -= pConn->irecvBufHead;
+        pConn->irecvBufHead = 0;
+    }
+
     return;
 }
 
+#define NGX_RECVBUF_MIN_ROOM 4 // 零拷贝收包时, 缓冲区剩余空间不到 1/本值 就换一个新缓冲区
+
+// 零拷贝收包时整理收包缓冲区, 此时缓冲区中还有包在逻辑线程中没处理完, 数据不能挪动.
+// (1) 剩余空间还比较多, 并且剩下的不完整包在缓冲区里放得下, 下次接着往后收
+// (2) 否则从池中换一个新缓冲区, 把剩下的不完整包拷过去(最多一个包), 旧缓冲区等包都处理完后自动归还
+// (3) 池空了, 就拷到连接自己的缓冲区里, 以后池中有空闲时再换回来
+void CSocekt::ngx_wait_request_handler_compact(lpngx_connection_t pConn)
+{
+    CRecvBufPool *p_recvbuf = CRecvBufPool::GetInstance();
+    unsigned int ileft = pConn->irecvBufTail - pConn->irecvBufHead;
+
+    // (1)
+    if ((unsigned int)m_iRecvBufSize - pConn->irecvBufTail >= (unsigned int)m_iRecvBufSize / NGX_RECVBUF_MIN_ROOM)
+    {
+        if (ileft < m_iLenPkgHeader)
+        {
+            return;
+        }
+        unsigned short e_pkgLen = ntohs(((LPCOMM_PKG_HEADER)(pConn->precvBufBase + pConn->irecvBufHead))->pkgLen);
+        if (pConn->irecvBufHead + e_pkgLen <= (unsigned int)m_iRecvBufSize)
+        {
+            return;
+        }
+    }
+
+    // (2), (3)
+    lpngx_recvbuf_t pNewBuf = p_recvbuf->Get(pConn->GetHandle());
+    char *pNewBase = (pNewBuf != NULL) ? CRecvBufPool::Data(pNewBuf) : pConn->precvBufOwn;
+    if (ileft > 0)
+    {
+        memcpy(pNewBase, pConn->precvBufBase + pConn->irecvBufHead, ileft);
+    }
+    p_recvbuf->Release(pConn->precvBuf);
+    pConn->precvBuf = pNewBuf;
+    pConn->precvBufBase = pNewBase;
+    pConn->irecvBufHead = 0;
+    pConn->irecvBufTail = ileft;
+}
+
 // 收包体, 包处理阶段2
-void CSocekt::ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool &isflood) // 参数 isflood 是个引用
+// ispkgok为false表示在reactor线程中已经校验出是错包(TestPkgCrc), 和flood时一样直接释放, 但不踢人
+void CSocekt::ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool &isflood, bool ispkgok) // 参数 isflood 是个引用
 {
-    if (isflood == false)
+    if (isflood == false && ispkgok == true)
     {
         // 入消息队列, 并触发线程处理消息
         g_threadpool.inMsgRecvQueueAndSignal(pConn->precvMemPointer);
@@ -268,11 +375,11 @@ void CSocekt::ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool
         p_memory->FreeMemory(pConn->precvMemPointer);
     }
 
-    // 收到相关的复原操作
+    // 收到相关的复原操作, 接着从收包缓冲区中解析
     pConn->curStat = _PKG_HD_INIT;
     pConn->precvMemPointer = NULL;
-    pConn->precvbuf = pConn->dataHeadInfo;
-    pConn->irecvlen = m_iLenPkgHeader;
+    pConn->precvbuf = NULL;
+    pConn->irecvlen = 0;
 
     return;
 }
@@ -320,52 +427,312 @@ ssize_t CSocekt::sendproc(lpngx_connection_t c, char *buff, ssize_t size)
     }
 }
 
-// 设置数据发送时的写处理函数, 当数据可写时, epoll通知我们,  中调用此函数
-// 能走到这里, 数据就是没法送完毕, 要继续发送
-void CSocekt::ngx_write_request_handler(lpngx_connection_t pConn)
+// 封装sendmsg(), 把多段数据(iov)一次发送出去, 返回值同 sendproc().
+// 用MSG_NOSIGNAL, 对端已经关闭时返回EPIPE错误, 而不是产生SIGPIPE信号把进程杀掉.
+ssize_t CSocekt::sendvproc(lpngx_connection_t c, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    for (;;)
+    {
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (n > 0) // 发送成功一些数据, 可能没全部发完
+        {
+            return n;
+        }
+
+        if (n == 0) // 发送的字节不是0, 那就是对方主动关闭了连接
+        {
+            return 0;
+        }
+
+        if (errno == EAGAIN) // 等于EWOULDBLOCK, 表示发送缓冲区满了
+        {
+            return -1;
+        }
+
+        if (errno == EINTR)
+        {
+            ngx_log_stderr(errno, "CSocekt::sendvproc()中sendmsg()失败.");
+        }
+        else // 其他错误码
+        {
+            return -2;
+        }
+    }
+}
+
+// 把连接上待发送的数据尽量发出去: 发了一半的那个包 + 本连接发消息队列 中的包, 拼成iovec用一次sendmsg()发出去,
+// 每个包都直接从包头开始发(跳过消息头), 不拷贝. 直到发完或发送缓冲区满.
+// 调用者要持有 pConn->sendMutex.
+// 返回值:
+//   1, 全部发送完毕
+//   0, 发送缓冲区满了, 还有数据没发完, 需要依靠EPOLLOUT续发
+//  -1, 对端断开, 待发送的数据都丢弃了, 等待recv()来做断开socket以及回收资源
+// 调用: CSocekt::msgSend(), CSocekt::ngx_write_request_handler()
+int CSocekt::sendPendingProc(lpngx_connection_t pConn)
+{
+    CMemory *p_memory = CMemory::GetInstance();
+    struct iovec iov[NGX_MAX_SENDIOV];
+    int iovcnt;
+    ssize_t sendsize, totalsize;
+    char *pMsgBuf;
+    LPCOMM_PKG_HEADER pPkgHeader;
+    unsigned int ipkglen;
+
+    for (;;)
+    {
+        // (1) 拼iovec, 先放发了一半的包剩下的部分, 再放队列中的包
+        iovcnt = 0;
+        totalsize = 0;
+        if (pConn->psendMemPointer != NULL)
+        {
+            iov[iovcnt].iov_base = pConn->psendbuf;
+            iov[iovcnt].iov_len = pConn->isendlen;
+            totalsize += pConn->isendlen;
+            ++iovcnt;
+        }
+        for (auto pos = pConn->sendMsgQueue.begin(); pos != pConn->sendMsgQueue.end() && iovcnt < NGX_MAX_SENDIOV; ++pos)
+        {
+            pPkgHeader = (LPCOMM_PKG_HEADER)((*pos) + m_iLenMsgHeader);
+            ipkglen = ntohs(pPkgHeader->pkgLen); // 包头+包体 长度, 打包时用了htons
+            iov[iovcnt].iov_base = pPkgHeader;
+            iov[iovcnt].iov_len = ipkglen;
+            totalsize += ipkglen;
+            ++iovcnt;
+        }
+        if (iovcnt == 0) // 没有要发的了
+        {
+            return 1;
+        }
+
+        // (2) 发送
+        sendsize = sendvproc(pConn, iov, iovcnt);
+        if (sendsize == -1) // 一个字节都没发出去, 说明发送时缓冲区当前正好是满的
+        {
+            return 0;
+        }
+        if (sendsize <= 0) // 返回0或-2, 一般就认为对端断开了, 后边的包也没必要发了
+        {
+            clearConnSendQueue(pConn);
+            return -1;
+        }
+
+        // (3) 按发出去的字节数, 释放发送完的包. 最后一个没发完的包, 记录发送到了哪里, 成为"发了一半的包"
+        ssize_t remain = sendsize;
+        if (pConn->psendMemPointer != NULL)
+        {
+            if (remain < (ssize_t)pConn->isendlen)
+            {
+                pConn->psendbuf = pConn->psendbuf + remain;
+                pConn->isendlen = pConn->isendlen - remain;
+                return 0;
+            }
+            remain -= pConn->isendlen;
+            p_memory->FreeMemory(pConn->psendMemPointer);
+            pConn->psendMemPointer = NULL;
+        }
+        while (remain > 0)
+        {
+            pMsgBuf = pConn->sendMsgQueue.front();
+            pConn->sendMsgQueue.pop_front();
+            --pConn->iSendCount;
+            --m_iSendMsgQueueCount;
+
+            pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + m_iLenMsgHeader);
+            ipkglen = ntohs(pPkgHeader->pkgLen);
+            if (remain >= (ssize_t)ipkglen) // 这个包发送完毕
+            {
+                p_memory->FreeMemory(pMsgBuf);
+                remain -= ipkglen;
+            }
+            else // 只发送了一部分
+            {
+                pConn->psendMemPointer = pMsgBuf; // 发送后释放用的
+                pConn->psendbuf = (char *)pPkgHeader + remain;
+                pConn->isendlen = ipkglen - remain;
+                return 0;
+            }
+        }
+
+        if (sendsize < totalsize) // 正好发到某个包的结尾, 但没发完, 发送缓冲区满了
+        {
+            return 0;
+        }
+        // 这一批全发出去了, 队列中可能还有超过 NGX_MAX_SENDIOV 的包, 继续发
+    }
+}
+
+// 发送缓冲区满了, 把剩下的数据交给事件后端异步发送(io_uring): 发了一半的包和 发消息队列 中的包按顺序取出来放进一批中,
+// 每 NGX_SEND_BATCH_IOVS 个一组, 最多 NGX_SEND_BATCH_LINKS 组, 再多的留在队列中, 等这一批发完了再说.
+// 后端不支持, 或者投递不了时返回false, 取出来的包放回去, 由调用者投递EPOLLOUT续发.
+// 调用者要持有 pConn->sendMutex. 调用: CSocekt::msgSend(), CSocekt::ngx_write_request_handler()
+bool CSocekt::sendAsyncProc(lpngx_connection_t pConn)
+{
+    if (!pConn->reactor->backend->CanSendAsync())
+    {
+        return false;
+    }
+
+    ngx_send_batch_t *pBatch = new ngx_send_batch_t;
+    memset(pBatch->msg, 0, sizeof(pBatch->msg));
+    pBatch->pfnFree = &CSocekt::freeSendBatch;
+    pBatch->links = 0;
+
+    int iovcnt = 0;
+    if (pConn->psendMemPointer != NULL)
+    {
+        pBatch->iov[0][0].iov_base = pConn->psendbuf;
+        pBatch->iov[0][0].iov_len = pConn->isendlen;
+        pBatch->ppkg[0][0] = pConn->psendMemPointer;
+        pConn->psendMemPointer = NULL;
+        iovcnt = 1;
+    }
+    while (pBatch->links < NGX_SEND_BATCH_LINKS)
+    {
+        if (iovcnt < NGX_SEND_BATCH_IOVS && !pConn->sendMsgQueue.empty())
+        {
+            char *pMsgBuf = pConn->sendMsgQueue.front();
+            pConn->sendMsgQueue.pop_front();
+            --pConn->iSendCount;
+            --m_iSendMsgQueueCount;
+
+            LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + m_iLenMsgHeader);
+            pBatch->iov[pBatch->links][iovcnt].iov_base = pPkgHeader;
+            pBatch->iov[pBatch->links][iovcnt].iov_len = ntohs(pPkgHeader->pkgLen);
+            pBatch->ppkg[pBatch->links][iovcnt] = pMsgBuf;
+            ++iovcnt;
+            continue;
+        }
+        if (iovcnt == 0) // 没有要发的了
+        {
+            break;
+        }
+        pBatch->msg[pBatch->links].msg_iov = pBatch->iov[pBatch->links];
+        pBatch->msg[pBatch->links].msg_iovlen = iovcnt;
+        ++pBatch->links;
+        iovcnt = 0;
+    }
+
+    if (!pConn->reactor->backend->SendAsync(pConn, pBatch))
+    {
+        sendBatchReturn(pConn, pBatch, 0);
+        return false;
+    }
+    return true;
+}
+
+// 异步发送的一批回来了(或者没投递出去), 按发出去的字节数: 发完的包释放; 第一个没发完的成为"发了一半的包", 后面的按原来的顺序放回 发消息队列 的最前面.
+// 调用者要持有 pConn->sendMutex, pBatch在这里释放.
+// 调用: CSocekt::sendAsyncProc(), CSocekt::ngx_write_request_handler()
+void CSocekt::sendBatchReturn(lpngx_connection_t pConn, ngx_send_batch_t *pBatch, ssize_t sent)
 {
     CMemory *p_memory = CMemory::GetInstance();
+    std::list<char *> unsent;
 
-    ssize_t sendsize = sendproc(pConn, pConn->psendbuf, pConn->isendlen);
+    for (int i = 0; i < pBatch->links; ++i)
+    {
+        for (size_t j = 0; j < pBatch->msg[i].msg_iovlen; ++j)
+        {
+            struct iovec &iov = pBatch->iov[i][j];
+            if (sent >= (ssize_t)iov.iov_len) // 这个包发送完毕
+            {
+                sent -= iov.iov_len;
+                p_memory->FreeMemory(pBatch->ppkg[i][j]);
+            }
+            else if (pConn->psendMemPointer == NULL) // 只发送了一部分, 或者一点都没发
+            {
+                pConn->psendMemPointer = pBatch->ppkg[i][j];
+                pConn->psendbuf = (char *)iov.iov_base + sent;
+                pConn->isendlen = iov.iov_len - sent;
+                sent = 0;
+            }
+            else
+            {
+                unsent.push_back(pBatch->ppkg[i][j]);
+                ++pConn->iSendCount;
+                ++m_iSendMsgQueueCount;
+            }
+        }
+    }
+    pConn->sendMsgQueue.splice(pConn->sendMsgQueue.begin(), unsent);
+    delete pBatch;
+}
 
-    if (sendsize > 0 && sendsize != pConn->isendlen) // 只发出去一部分. LT模式会不停的通知, 所以此处直接退出即可
+// 释放一批异步发送的数据: 发完了但连接已经关闭, 没人取回了. 调用: 事件后端
+void CSocekt::freeSendBatch(ngx_send_batch_t *pBatch)
+{
+    CMemory *p_memory = CMemory::GetInstance();
+    for (int i = 0; i < pBatch->links; ++i)
     {
-        pConn->psendbuf = pConn->psendbuf + sendsize;
-        pConn->isendlen = pConn->isendlen - sendsize;
-        return;
+        for (size_t j = 0; j < pBatch->msg[i].msg_iovlen; ++j)
+        {
+            p_memory->FreeMemory(pBatch->ppkg[i][j]);
+        }
     }
-    else if (sendsize == -1) // 不可能, 可以发送数据时通知我发送数据, 我发送时你却通知我发送缓冲区满.
+    delete pBatch;
+}
+
+// 设置数据发送时的写处理函数, 当数据可写时, epoll通知我们,  中调用此函数
+// 能走到这里, 数据就是没法送完毕, 要继续发送, 把本连接上排队的数据也一起发出去
+// io_uring下交给内核异步发送的一批发完了也走到这里(EPOLLOUT), 先取回结果, 再把排队的数据接着发出去
+void CSocekt::ngx_write_request_handler(lpngx_connection_t pConn)
+{
+    CLock lock(&pConn->sendMutex);
+    if (pConn->fd == -1) // 连接已经被关闭了
     {
-        ngx_log_stderr(errno, "CSocekt::ngx_write_request_handler()时if(sendsize == -1)成立, 这很怪异.");
         return;
     }
 
-    if (sendsize > 0 && sendsize == pConn->isendlen) // 发送完毕
+    int ret;
+    ngx_send_batch_t *pBatch = pConn->reactor->backend->SendResult(pConn);
+    if (pBatch != NULL)
     {
-        // 如果是成功的发送完毕数据, 则把写事件通知从epoll中干掉吧. 其他情况, 那就是断线了, 等着系统内核把连接从红黑树中干掉即可.
+        // 这时没有投递EPOLLOUT, 不用再去掉
+        int err = pBatch->err;
+        sendBatchReturn(pConn, pBatch, pBatch->sent);
+        if (err != 0) // 同 sendPendingProc(), 认为对端断开了, 待发送的数据都丢弃
+        {
+            clearConnSendQueue(pConn);
+            ret = -1;
+        }
+        else
+        {
+            ret = sendPendingProc(pConn);
+        }
 
-        if (ngx_epoll_oper_event(
-                pConn->fd,
-                EPOLL_CTL_MOD, // 修改, 减去写通知
-                EPOLLOUT, 1,   // 减去EPOLLOUT事件
-                pConn) == -1)
+        // 又满了, 接着交给内核发; 投递不了的话退回EPOLLOUT续发
+        if (ret == 0 && !sendAsyncProc(pConn) && ngx_epoll_oper_event(pConn->fd, EPOLL_CTL_MOD, EPOLLOUT, 0, pConn) == -1)
         {
             ngx_log_stderr(errno, "CSocekt::ngx_write_request_handler()中ngx_epoll_oper_event()失败.");
         }
-
-        ngx_log_stderr(0, "CSocekt::ngx_write_request_handler()中数据发送完毕, 很好."); // 提示, 商用时可以干掉
+        if (ret != 0)
+        {
+            pConn->iThrowsendCount = 0;
+        }
+        return;
     }
 
-    // 数据发送完毕, 或对方断开连接.
-
-    p_memory->FreeMemory(pConn->psendMemPointer); // 释放内存
-    pConn->psendMemPointer = NULL;
+    ret = sendPendingProc(pConn);
+    if (ret == 0) // 还没发完. LT模式会不停的通知, 所以此处直接退出即可
+    {
+        return;
+    }
 
-    --pConn->iThrowsendCount; // 这个值恢复了, 触发下面一行的信号量才有意义
-    if (sem_post(&m_semEventSendQueue) == -1)
+    // 数据发送完毕, 或对方断开连接, 把写事件通知从epoll中干掉吧.
+    if (ngx_epoll_oper_event(
+            pConn->fd,
+            EPOLL_CTL_MOD, // 修改, 减去写通知
+            EPOLLOUT, 1,   // 减去EPOLLOUT事件
+            pConn) == -1)
     {
-        ngx_log_stderr(0, "CSocekt::ngx_write_request_handler()中sem_post(&m_semEventSendQueue)失败.");
+        ngx_log_stderr(errno, "CSocekt::ngx_write_request_handler()中ngx_epoll_oper_event()失败.");
     }
+    pConn->iThrowsendCount = 0; // 之后 msgSend() 又可以直接发送了
 
     return;
 }
@@ -0,0 +1,282 @@
+﻿// ---------------
+// CPU亲和性/NUMA相关
+// ---------------
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // cpu_set_t, sched_setaffinity, pthread_setaffinity_np
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h> // strcasecmp
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h> // MPOL_LOCAL
+
+#include "ngx_func.h"
+#include "ngx_macro.h"
+#include "ngx_c_conf.h"
+
+#define NGX_MAX_NUMA_NODES 64 // 最多看这么多个NUMA节点
+
+// 本worker进程绑定的CPU, 按顺序排好, reactor线程从中各挑一个(ngx_pin_thread_cpu)
+static int s_cpus[CPU_SETSIZE];
+static int s_cpuCount = 0;
+
+// 描述: 解析sysfs中的cpulist, 形如"0-7,16-23", 把其中master进程可以用的CPU依次放进cpus
+static int ngx_parse_cpulist(const char *plist, const cpu_set_t *pallowed, int *cpus, int count, cpu_set_t *pseen)
+{
+    const char *p = plist;
+    while (*p >= '0' && *p <= '9')
+    {
+        char *pend;
+        long first = strtol(p, &pend, 10);
+        long last = first;
+        if (*pend == '-')
+        {
+            last = strtol(pend + 1, &pend, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, pallowed) && !CPU_ISSET(cpu, pseen))
+            {
+                CPU_SET(cpu, pseen);
+                cpus[count++] = (int)cpu;
+            }
+        }
+        p = (*pend == ',') ? pend + 1 : pend;
+    }
+    return count;
+}
+
+// 描述: 取得本进程可以用的所有CPU, 同一个NUMA节点的排在一起(节点0的, 节点1的, ...), 没有NUMA信息时按编号排
+// 参数nodeFirst: 返回每个节点的第一个CPU在cpus中的下标, 没有可用CPU的节点不算, 不属于任何节点的CPU算作最后一个节点, nodeFirst[节点数]为CPU总数
+// 参数pnodes: 返回节点数
+static int ngx_get_numa_cpus(int *cpus, int *nodeFirst, int *pnodes)
+{
+    *pnodes = 0;
+    cpu_set_t allowed, seen;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        return 0;
+    }
+    CPU_ZERO(&seen);
+
+    int count = 0;
+    char path[100], list[1000];
+    for (int node = 0; node < NGX_MAX_NUMA_NODES; ++node)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+        {
+            continue; // 节点编号可能不连续
+        }
+        int first = count;
+        if (fgets(list, sizeof(list), fp) != NULL)
+        {
+            count = ngx_parse_cpulist(list, &allowed, cpus, count, &seen);
+        }
+        fclose(fp);
+        if (count > first)
+        {
+            nodeFirst[(*pnodes)++] = first;
+        }
+    }
+
+    int first = count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) // 不属于任何节点的(没有sysfs时就是全部)
+    {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &seen))
+        {
+            cpus[count++] = cpu;
+        }
+    }
+    if (count > first)
+    {
+        nodeFirst[(*pnodes)++] = first;
+    }
+    nodeFirst[*pnodes] = count;
+    return count;
+}
+
+// 描述: auto时算出第inum个worker进程的CPU.
+// worker进程数不少于节点数时, 先把worker进程分到节点上, 再把每个节点的CPU平分给分到这个节点的worker进程, 一个worker进程的CPU不会跨节点.
+// 分配: 前面的worker进程每个节点一个, 多出来的依次分给"CPU数 / (已分到的worker进程数 + 1)"最大的节点, 也就是按CPU数的比例分, 节点一样大时就是轮流分.
+// worker进程数比节点数少时, 节点轮流整个分给各个worker进程, 一个worker进程可能有几个节点, 但一个节点只属于一个worker进程.
+static int ngx_get_cpu_affinity_auto(int inum, int workers, int *cpus)
+{
+    static int allcpus[CPU_SETSIZE];
+    int nodeFirst[NGX_MAX_NUMA_NODES + 2];
+    int nodes = 0;
+    int total = ngx_get_numa_cpus(allcpus, nodeFirst, &nodes);
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    if (workers < nodes)
+    {
+        for (int node = inum % workers; node < nodes; node += workers)
+        {
+            for (int i = nodeFirst[node]; i < nodeFirst[node + 1]; ++i)
+            {
+                cpus[count++] = allcpus[i];
+            }
+        }
+        return count;
+    }
+
+    int assigned[NGX_MAX_NUMA_NODES + 1] = {0}; // 每个节点分到的worker进程数
+    int myNode = 0, myRank = 0;                 // 本worker进程分到的节点, 是这个节点上的第几个
+    for (int w = 0; w < workers; ++w)
+    {
+        int best = (w < nodes) ? w : 0;
+        for (int node = 1; w >= nodes && node < nodes; ++node)
+        {
+            // 节点node的CPU数 / (assigned[node] + 1) > 节点best的CPU数 / (assigned[best] + 1), 交叉相乘免得用浮点数
+            int64_t lhs = (int64_t)(nodeFirst[node + 1] - nodeFirst[node]) * (assigned[best] + 1);
+            int64_t rhs = (int64_t)(nodeFirst[best + 1] - nodeFirst[best]) * (assigned[node] + 1);
+            if (lhs > rhs)
+            {
+                best = node;
+            }
+        }
+        if (w == inum)
+        {
+            myNode = best;
+            myRank = assigned[best];
+        }
+        ++assigned[best];
+    }
+
+    // 节点的CPU平分给分到这个节点的worker进程, 除不尽时有的多一个; CPU比worker进程少时几个worker进程共用一个CPU
+    int nodeCpus = nodeFirst[myNode + 1] - nodeFirst[myNode];
+    int first = myRank * nodeCpus / assigned[myNode];
+    int last = (myRank + 1) * nodeCpus / assigned[myNode];
+    last = (last > first) ? last : first + 1;
+    for (int i = first; i < last; ++i)
+    {
+        cpus[count++] = allcpus[nodeFirst[myNode] + i];
+    }
+    return count;
+}
+
+// 描述: 按配置项 WorkerCpuAffinity 算出第inum个worker进程要绑定的CPU
+// auto: 先把worker进程分到NUMA节点上, 再平分每个节点的CPU, 见ngx_get_cpu_affinity_auto();
+// 位掩码: 空格分开, 每个worker进程一个, 最右边一位是CPU0, 比如"0011 1100", worker进程比掩码多时, 多出来的用最后一个.
+// 返回值: 绑定的CPU个数, 0表示不绑定(没配置或者配置有错)
+static int ngx_get_cpu_affinity(int inum, int *cpus)
+{
+    const ngx_conf_t *pconf = CConfig::GetInstance()->GetConf();
+    const char *paffinity = pconf->worker_cpu_affinity;
+    if (paffinity[0] == '\0' || strcasecmp(paffinity, "off") == 0)
+    {
+        return 0;
+    }
+
+    if (strcasecmp(paffinity, "auto") == 0)
+    {
+        return ngx_get_cpu_affinity_auto(inum, pconf->worker_processes, cpus);
+    }
+
+    // 位掩码, 找第inum个, 不够就用最后一个
+    const char *pmask = NULL;
+    size_t masklen = 0;
+    const char *p = paffinity;
+    for (int n = 0; *p != '\0'; ++n)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0')
+            break;
+        size_t len = strspn(p, "01");
+        if (len == 0 || (p[len] != '\0' && p[len] != ' ' && p[len] != '\t'))
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, 0, "配置项[WorkerCpuAffinity = %s]的值不合法, 不绑定CPU.", paffinity);
+            return 0;
+        }
+        if (n <= inum)
+        {
+            pmask = p;
+            masklen = len;
+        }
+        p += len;
+    }
+    if (pmask == NULL)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    for (size_t i = 0; i < masklen && i < CPU_SETSIZE; ++i)
+    {
+        if (pmask[masklen - 1 - i] == '1')
+        {
+            cpus[count++] = (int)i;
+        }
+    }
+    return count;
+}
+
+// 描述: worker进程绑定CPU, 并让内存从本地NUMA节点分配. 要在创建任何线程之前调用, 之后创建的线程都继承这个CPU集合.
+// 连接池, 收包缓冲区池, 内存池的slab都是worker进程自己分配并第一次写入的, 按"本地分配"策略就落在这些CPU所在的节点上.
+// 调用: ngx_worker_process_init()
+void ngx_set_cpu_affinity(int inum)
+{
+    s_cpuCount = ngx_get_cpu_affinity(inum, s_cpus);
+    if (s_cpuCount == 0)
+    {
+        return;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    char strcpus[200];
+    char *p = strcpus;
+    for (int i = 0; i < s_cpuCount; ++i)
+    {
+        CPU_SET(s_cpus[i], &cpuset);
+        if (p + 8 < strcpus + sizeof(strcpus))
+        {
+            p += sprintf(p, (i == 0) ? "%d" : ",%d", s_cpus[i]);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_set_cpu_affinity() 中 sched_setaffinity(%s) 失败.", strcpus);
+        s_cpuCount = 0;
+        return;
+    }
+
+    // 进程继承来的内存策略可能是交错分配(比如用numactl --interleave启动), 改成从当前CPU所在的节点分配
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1 && errno != ENOSYS)
+    {
+        ngx_log_error_core(NGX_LOG_INFO, errno, "ngx_set_cpu_affinity() 中 set_mempolicy(MPOL_LOCAL) 失败.");
+    }
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "worker进程[%d]绑定CPU: %s.", inum, strcpus);
+}
+
+// 描述: 把一个reactor线程绑定到本worker进程的CPU中的一个(第index个, 不够就轮回来), 一个连接的收发和状态就一直留在同一个CPU的cache里
+// 没有绑定CPU(WorkerCpuAffinity没配置)时什么都不做. 逻辑线程池/写日志/回收连接/时间队列线程不单独绑定, 在整个CPU集合中调度.
+// 调用: CSocekt::ngx_epoll_init(), ngx_worker_process_init()
+void ngx_pin_thread_cpu(pthread_t thread, int index)
+{
+    if (s_cpuCount <= 1)
+    {
+        return; // 只有一个CPU, 进程已经绑定过了
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(s_cpus[index % s_cpuCount], &cpuset);
+    int err = pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+    if (err != 0)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, err, "ngx_pin_thread_cpu() 中 pthread_setaffinity_np(%d) 失败.", s_cpus[index % s_cpuCount]);
+    }
+}
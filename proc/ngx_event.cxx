@@ -18,7 +18,8 @@
 // 调用: ngx_worker_process_cycle()
 void ngx_process_events_and_timers()
 {
-    g_socket.ngx_epoll_process_events(-1); // -1表示卡着等待吧
+    // 平滑退出中(ngx_quit)要定时醒来看看连接是否都处理完了, 平时-1表示卡着等待
+    g_socket.ngx_epoll_process_events(ngx_quit ? 1000 : -1);
 
     // 统计信息打印, 考虑到测试的时候总会收到各种数据信息, 所以上边的函数调用一般都不会卡住等待收数据.
     g_socket.printTDInfo();
@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/time.h> // setitimer
 
 #include "ngx_func.h"
 #include "ngx_macro.h"
@@ -15,13 +16,38 @@
 // ---------------
 
 static void ngx_start_worker_processes(int threadnums);
-static int ngx_spawn_process(int threadnums, const char *pprocname);
+static int ngx_spawn_process(int slot, const char *pprocname);
+static void ngx_reap_worker_processes();
 static void ngx_worker_process_cycle(int inum, const char *pprocname);
 static void ngx_worker_process_init(int inum);
+static void ngx_master_reconfigure();
+static void ngx_worker_reconfigure();
+static bool ngx_worker_process_drained();
+static void ngx_worker_process_exit();
 
 // 变量声明
 static u_char master_process[] = "master process";
 
+#define NGX_MAX_PROCESSES 1024
+
+#define NGX_RESPAWN_FAST_MSEC 10000 // worker进程运行不到这么久(毫秒)就退出, 算一次过快退出
+#define NGX_RESPAWN_FAST_LIMIT 3    // 连续过快退出超过这么多次, 推迟重新创建: 1秒, 2秒, 4秒...
+#define NGX_RESPAWN_MAX_DELAY 60000 // 最多推迟这么久(毫秒)
+
+// worker进程表中的一项, 一个槽位对应一个worker进程, 进程异常退出后按同样的编号(inum)在原槽位上重新创建
+typedef struct
+{
+    pid_t pid;            // -1: 已经退出, 等待重新创建
+    int inum;             // 进程编号, 从0开始, 传给 ngx_worker_process_cycle()
+    int exiting;          // 1: 重新载入配置时让它平滑退出了(SIGQUIT), 退出后不再创建
+    int failures;         // 连续过快退出的次数
+    uint64_t spawnTime;   // 创建的时间(毫秒)
+    uint64_t respawnTime; // 推迟到这个时间(毫秒)再重新创建, 0: 还没安排
+} ngx_worker_process_t;
+
+static ngx_worker_process_t ngx_workers[NGX_MAX_PROCESSES]; // 创建出来的worker进程, 给它们转发信号, 退出了重新创建
+static int ngx_worker_count = 0;
+
 // (1) 设置进程新的信号屏蔽字, 保护"不希望由信号中断"的代码临界区 (sigprocmask)
 // (2) 设置master进程标题 (ngx_setproctitle)
 // (3) 创建并启动的 worker 进程 (ngx_start_worker_processes)
@@ -52,6 +78,9 @@ void ngx_master_process_cycle()
     }
     // 即便 sigprocmask() 失败, 程序流程也继续往下走
 
+    // 启动写日志线程, 上面屏蔽了信号之后再创建, 信号仍然只由主线程(sigsuspend)处理
+    ngx_log_async_init();
+
     // (2) 设置master进程标题 (ngx_setproctitle)
     size_t size;
     int i;
@@ -72,7 +101,7 @@ void ngx_master_process_cycle()
 
     // (3) 创建并启动的 worker 进程 (ngx_start_worker_processes)
     CConfig *p_config = CConfig::GetInstance();
-    int workprocess = p_config->GetIntDefault("WorkerProcesses", 1);
+    int workprocess = p_config->GetConf()->worker_processes;
     ngx_start_worker_processes(workprocess); // 创建 worker 子进程
 
     // (4) 阻塞主进程 (sigsuspend)
@@ -88,44 +117,117 @@ void ngx_master_process_cycle()
 
         sigsuspend(&set); // 此时 master 进程完全靠信号驱动干活
         // sleep(1);         // 休息1秒
+
+        // 信号处理函数只做标记, 重活在这里做, 此时信号又被屏蔽了, 不会被打断
+        if (ngx_reap)
+        {
+            ngx_reap = 0;
+            ngx_reap_worker_processes();
+        }
+        if (ngx_reconfigure)
+        {
+            ngx_reconfigure = 0;
+            ngx_master_reconfigure();
+        }
     }
 
     return;
 }
 
+// 描述: master进程收到SIGHUP后重新载入配置文件(ngx_master_process_cycle中调用)
+// (1) 新配置有错: 继续用原来的配置, 什么都不做
+// (2) 修改都能直接生效: 通知worker进程也重新载入(SIGHUP)
+// (3) 有要新创建worker进程才能生效的修改: 按新配置创建worker进程, 它们继承master进程打开的监听socket;
+//     老的worker进程收到SIGQUIT后不再接受新连接, 处理完已有的连接后退出.
+static void ngx_master_reconfigure()
+{
+    CConfig *p_config = CConfig::GetInstance();
+    int rc = p_config->Reload();
+    if (rc == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, 0, "重新载入配置文件失败, 继续使用原来的配置.");
+        return;
+    }
+    ngx_log_reload();
+
+    if (rc == 0)
+    {
+        ngx_log_error_core(NGX_LOG_NOTICE, 0, "配置文件已重新载入, 通知worker进程直接生效.");
+        ngx_signal_worker_processes(SIGHUP);
+        return;
+    }
+
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "配置文件已重新载入, 创建新的worker进程, 老的worker进程处理完已有的连接后退出.");
+
+    // 老的worker进程都标记为平滑退出, 还在等待重新创建的槽位直接去掉
+    int oldcount = 0;
+    for (int i = 0; i < ngx_worker_count; ++i)
+    {
+        if (ngx_workers[i].pid != -1)
+        {
+            ngx_workers[i].exiting = 1;
+            ngx_workers[oldcount++] = ngx_workers[i];
+        }
+    }
+    ngx_worker_count = oldcount;
+
+    g_socket.ReadConf(); // 新的worker进程按新配置初始化
+    ngx_start_worker_processes(p_config->GetConf()->worker_processes);
+
+    for (int i = 0; i < oldcount; ++i)
+    {
+        if (ngx_workers[i].exiting && kill(ngx_workers[i].pid, SIGQUIT) == -1 && errno != ESRCH)
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, errno, "kill(%P, SIGQUIT) failed", ngx_workers[i].pid);
+        }
+    }
+}
+
 // 描述: 创建并启动指定数量的 worker 进程
 // 参数threadnums: 要创建的子进程数量, 实质是调用了 threadnums 次 ngx_spawn_process().
 static void ngx_start_worker_processes(int threadnums)
 {
     int i;
-    for (i = 0; i < threadnums; i++)
+    for (i = 0; i < threadnums && ngx_worker_count < NGX_MAX_PROCESSES; i++)
     {
-        ngx_spawn_process(i, "worker process");
+        ngx_worker_process_t *pworker = &ngx_workers[ngx_worker_count];
+        memset(pworker, 0, sizeof(ngx_worker_process_t));
+        pworker->pid = -1;
+        pworker->inum = i;
+        ngx_spawn_process(ngx_worker_count++, "worker process");
     }
     return;
 }
 
 // 描述: 调用fork()创建子进程, 父进程退出, 子进程继续(ngx_worker_process_cycle).
-// 参数inum: 进程编号, 从0开始
+// 参数slot: worker进程表(ngx_workers)中的槽位, 进程编号用槽位中的inum
 // 参数pprocname: 子进程名字 "worker process"
-static int ngx_spawn_process(int inum, const char *pprocname)
+static int ngx_spawn_process(int slot, const char *pprocname)
 {
     pid_t pid;
+    ngx_worker_process_t *pworker = &ngx_workers[slot];
+
+    pworker->spawnTime = ngx_current_msec();
+    pworker->respawnTime = 0;
 
     pid = fork();
     switch (pid)
     {
-    case -1: // fork()失败
-        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_spawn_process() 中 fork() 产生子进程num=[%d],procname=[\"%s\"]失败.", inum, pprocname);
+    case -1: // fork()失败, 稍后由 ngx_reap_worker_processes() 再试
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_spawn_process() 中 fork() 产生子进程num=[%d],procname=[\"%s\"]失败.", pworker->inum, pprocname);
+        pworker->pid = -1;
+        ngx_reap = 1;
         return -1;
 
     case 0: // 子进程分支
+        ngx_time_fork_child();
         ngx_parent = ngx_pid;
         ngx_pid = getpid();
-        ngx_worker_process_cycle(inum, pprocname); // 所有worker子进程, 在这个函数里不断循环着不出来
+        ngx_worker_process_cycle(pworker->inum, pprocname); // 所有worker子进程, 在这个函数里不断循环着不出来
         break;
 
-    default: // 父进程, 直接break
+    default: // 父进程, 记下worker进程的pid
+        pworker->pid = pid;
         break;
     }
 
@@ -133,6 +235,104 @@ static int ngx_spawn_process(int inum, const char *pprocname)
     return pid;
 }
 
+// 描述: 重新创建退出了的worker进程, master进程收到SIGCHLD/SIGALRM后在主流程中调用(ngx_master_process_cycle).
+// 槽位上的worker进程运行不到 NGX_RESPAWN_FAST_MSEC 就退出算过快退出, 连续过快退出超过 NGX_RESPAWN_FAST_LIMIT 次后
+// 推迟重新创建(1秒起, 每次翻倍, 最多 NGX_RESPAWN_MAX_DELAY), 用定时器(SIGALRM)到时间再来; 偶尔崩溃一次的马上重新创建.
+static void ngx_reap_worker_processes()
+{
+    ngx_time_update();
+    uint64_t now = ngx_current_msec();
+    uint64_t nextTime = 0; // 最早的推迟创建时间
+
+    for (int i = 0; i < ngx_worker_count; ++i)
+    {
+        ngx_worker_process_t *pworker = &ngx_workers[i];
+        if (pworker->pid != -1)
+        {
+            continue; // 还在运行
+        }
+
+        if (pworker->respawnTime == 0) // 刚退出, 安排重新创建的时间
+        {
+            uint64_t delay = 0;
+            pworker->failures = (now - pworker->spawnTime < NGX_RESPAWN_FAST_MSEC) ? pworker->failures + 1 : 0;
+            if (pworker->failures > NGX_RESPAWN_FAST_LIMIT)
+            {
+                int shift = pworker->failures - NGX_RESPAWN_FAST_LIMIT - 1;
+                delay = (shift < 6) ? (1000ULL << shift) : NGX_RESPAWN_MAX_DELAY;
+                delay = (delay < NGX_RESPAWN_MAX_DELAY) ? delay : NGX_RESPAWN_MAX_DELAY;
+                ngx_log_error_core(NGX_LOG_ALERT, 0, "worker进程[%d]连续%d次过快退出, %uL毫秒后再重新创建.", pworker->inum, pworker->failures, delay);
+            }
+            pworker->respawnTime = now + delay;
+        }
+
+        if (now >= pworker->respawnTime)
+        {
+            if (ngx_spawn_process(i, "worker process") != -1)
+            {
+                ngx_log_error_core(NGX_LOG_NOTICE, 0, "worker进程[%d]已重新创建, pid = %P.", pworker->inum, pworker->pid);
+                continue;
+            }
+            pworker->respawnTime = now + 1000; // fork()失败, 1秒后再试
+        }
+        if (nextTime == 0 || pworker->respawnTime < nextTime)
+        {
+            nextTime = pworker->respawnTime;
+        }
+    }
+
+    if (nextTime != 0) // 有推迟创建的, 到时间用SIGALRM叫醒sigsuspend()
+    {
+        struct itimerval itv;
+        memset(&itv, 0, sizeof(itv));
+        itv.it_value.tv_sec = (nextTime - now) / 1000;
+        itv.it_value.tv_usec = ((nextTime - now) % 1000) * 1000 + 1;
+        if (setitimer(ITIMER_REAL, &itv, NULL) == -1)
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_reap_worker_processes() 中 setitimer() 失败.");
+        }
+    }
+}
+
+// 描述: 给所有worker进程发信号, master进程中调用(信号处理函数中也可以调用)
+void ngx_signal_worker_processes(int signo)
+{
+    for (int i = 0; i < ngx_worker_count; ++i)
+    {
+        if (ngx_workers[i].pid == -1)
+        {
+            continue;
+        }
+        if (kill(ngx_workers[i].pid, signo) == -1 && errno != ESRCH) // ESRCH: 进程已经不在了
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, errno, "kill(%P, %d) failed", ngx_workers[i].pid, signo);
+        }
+    }
+}
+
+// 描述: worker进程退出了, 平滑退出的从 ngx_workers 中去掉; 其余的标记一下(ngx_reap), 由主流程重新创建.
+// 调用: ngx_process_get_status()[ngx_signal.cxx], master进程只在sigsuspend()中处理信号, 这时主流程不会同时修改 ngx_workers
+void ngx_worker_process_exited(pid_t pid)
+{
+    for (int i = 0; i < ngx_worker_count; ++i)
+    {
+        if (ngx_workers[i].pid != pid)
+        {
+            continue;
+        }
+        if (ngx_workers[i].exiting)
+        {
+            ngx_workers[i] = ngx_workers[--ngx_worker_count];
+        }
+        else
+        {
+            ngx_workers[i].pid = -1;
+            ngx_reap = 1;
+        }
+        return;
+    }
+}
+
 // 描述: worker子进程的功能函数
 // 参数inum: 进程编号, 从0开始
 // 参数pprocname: 子进程名字 "worker process"
@@ -147,40 +347,95 @@ static void ngx_worker_process_cycle(int inum, const char *pprocname)
     ngx_setproctitle(pprocname); // 重新为子进程设置进程名, 不要与父进程重复
     ngx_log_error_core(NGX_LOG_NOTICE, 0, "%s %P [worker进程]启动并开始运行......!", pprocname, ngx_pid);
 
-    // worker子进程在这个循环里一直不出来
+    // worker子进程在这个循环里一直不出来, 除非收到SIGQUIT(平滑退出)
     for (;;)
     {
         ngx_process_events_and_timers(); // 处理网络事件和定时器事件
+
+        if (ngx_reconfigure)
+        {
+            ngx_reconfigure = 0;
+            ngx_worker_reconfigure();
+        }
+        if (ngx_quit && ngx_worker_process_drained())
+        {
+            break;
+        }
     }
 
-    // 一般情况不会执行到这里
+    ngx_worker_process_exit();
+}
+
+// 描述: worker进程收到SIGHUP后重新载入配置文件, 能直接生效的配置项(日志等级, 心跳, flood检测等)马上生效.
+// 其余的修改由master进程创建新的worker进程来生效, 这里不管.
+static void ngx_worker_reconfigure()
+{
+    if (CConfig::GetInstance()->Reload() == -1)
+    {
+        return;
+    }
+    ngx_log_reload();
+    g_socket.ReadRuntimeConf();
+}
+
+// 描述: 平滑退出(SIGQUIT)中, 第一次调用时不再接受新连接; 之后每次看看已有的连接是否都处理完了.
+// 返回值: true可以退出了, 连接都处理完了或者等待超时(ProcWorkerShutdownTimeout); false继续处理已有的连接.
+static bool ngx_worker_process_drained()
+{
+    static time_t deadline = 0;
+    if (deadline == 0)
+    {
+        g_socket.StopAccepting();
+        deadline = ngx_time() + CConfig::GetInstance()->GetConf()->worker_shutdown_timeout;
+        ngx_log_error_core(NGX_LOG_NOTICE, 0, "worker进程 %P 不再接受新连接, 等待已有的%d个连接处理完.", ngx_pid, g_socket.GetOnlineUserCount());
+    }
+
+    if (g_socket.GetOnlineUserCount() == 0)
+    {
+        return true;
+    }
+    if (ngx_time() >= deadline)
+    {
+        ngx_log_error_core(NGX_LOG_WARN, 0, "worker进程 %P 等待超时, 还有%d个连接没有处理完, 强制关闭.", ngx_pid, g_socket.GetOnlineUserCount());
+        return true;
+    }
+    return false;
+}
+
+// 描述: worker进程退出: 停掉所有线程, 释放socket相关的资源, 日志都写出去后退出进程.
+static void ngx_worker_process_exit()
+{
+    g_stopEvent = 1;             // 各个线程看到它就退出
     g_threadpool.StopAll();      // 使线程池中的所有线程安全退出
     g_socket.Shutdown_subproc(); // socket需要释放的东西考虑释放
-    return;
+
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "worker进程 %P 退出.", ngx_pid);
+    ngx_log_async_stop();
+    exit(0);
 }
 
 // 描述: worker子进程创建时的初始化工作
 // 参数inum: 进程编号, 从0开始
-// (1) 取消信号屏蔽(sigprocmask)
+// (1) 绑定CPU(WorkerCpuAffinity), 启动本进程的写日志线程
 // (2) 创建 收消息队列 的线程池(CThreadPool::Create)
 // (3) 逻辑和通讯子类的初始化
 // (4) 初始化 epoll, 同时往监听 socket 上增加监听事件 (g_socket.ngx_epoll_init)
+// (5) 取消信号屏蔽(sigprocmask)
 static void ngx_worker_process_init(int inum)
 {
-    // (1) 取消信号屏蔽(sigprocmask)
-    sigset_t set;                                   // 信号集
-    sigemptyset(&set);                              // 清空信号集
-    if (sigprocmask(SIG_SETMASK, &set, NULL) == -1) // 原来是屏蔽那10个信号, 现在不再屏蔽任何信号
-    {
-        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_worker_process_init() 中 sigprocmask() 失败.");
-    }
+    // (1) 绑定CPU要在创建线程之前, 之后的线程都继承; 写日志线程不会跟着fork()过来, 子进程要自己再启动一个
+    ngx_set_cpu_affinity(inum);
+    ngx_log_async_init();
 
     // (2) 创建 收消息队列 的线程池(CThreadPool::Create)
     // 线程池代码, 要比和socket相关的内容优先执行
-    CConfig *p_config = CConfig::GetInstance();
-    int tmpthreadnums = p_config->GetIntDefault("ProcMsgRecvWorkThreadCount", 5); // 收消息队列的"线程池"
-    if (g_threadpool.Create(tmpthreadnums) == false)
+    const ngx_conf_t *pconf = CConfig::GetInstance()->GetConf();
+    int tmpthreadnums = pconf->recv_work_thread_count; // 收消息队列的"线程池"
+    int tmpqueuesize = pconf->recv_queue_size;         // 收消息队列的容量
+    int tmpordered = pconf->ordered_dispatch;          // 是否按连接分派消息
+    if (g_threadpool.Create(tmpthreadnums, tmpqueuesize, tmpordered == 1) == false)
     {
+        ngx_log_async_stop(); // 写日志线程已经启动了, 出错原因还在缓冲区里, 先写出去
         exit(-2); // 此时内存没释放, 但是简单粗暴退出.
     }
     // sleep(1); // 再休息1秒, 等待线程池中所有线程的ifrunning都为true.
@@ -188,6 +443,7 @@ static void ngx_worker_process_init(int inum)
     // (3) 逻辑和通讯子类的初始化
     if (g_socket.Initialize_subproc() == false) // 初始化子进程需要具备的一些多线程能力相关的信息
     {
+        ngx_log_async_stop();
         exit(-2); // 此时内存没释放, 但是简单粗暴退出.
     }
 
@@ -196,5 +452,18 @@ static void ngx_worker_process_init(int inum)
 
     // g_socket.ngx_epoll_listenportstart(); // 往监听 socket 上增加监听事件，从而开始让监听端口履行其职责. 如果不加这行, 虽然端口能连上, 但不会触发ngx_epoll_process_events() 里边的 epoll_wait() 往下走.
 
+    // 所有线程都创建完了, 主线程(0号reactor)再绑到单个CPU上, 1号及以后的reactor在 ngx_epoll_init() 中绑定
+    ngx_pin_thread_cpu(pthread_self(), 0);
+
+    // (5) 取消信号屏蔽(sigprocmask)
+    // 从master进程继承来的信号屏蔽字一直保持到所有线程都创建完, 这些线程也都屏蔽着信号,
+    // 信号就只会送到主线程, 打断0号reactor的epoll_wait(), 主线程马上就能看到 ngx_reconfigure/ngx_quit.
+    sigset_t set;                                   // 信号集
+    sigemptyset(&set);                              // 清空信号集
+    if (sigprocmask(SIG_SETMASK, &set, NULL) == -1) // 原来是屏蔽那10个信号, 现在不再屏蔽任何信号
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_worker_process_init() 中 sigprocmask() 失败.");
+    }
+
     return;
 }
@@ -37,7 +37,9 @@ ngx_signal_t signals[] =
         {SIGTERM, "SIGTERM", ngx_signal_handler}, // 标识15
         {SIGCHLD, "SIGCHLD", ngx_signal_handler}, // 子进程退出时，父进程会收到这个信号--标识17
         {SIGQUIT, "SIGQUIT", ngx_signal_handler}, // 标识3
+        {SIGUSR1, "SIGUSR1", ngx_signal_handler}, // 重新打开日志文件, 同官方nginx--标识10
         {SIGIO, "SIGIO", ngx_signal_handler},     // 指示一个异步I/O事件【通用异步I/O信号】
+        {SIGALRM, "SIGALRM", ngx_signal_handler}, // 定时器, master进程推迟重新创建worker进程时用--标识14
         {SIGSYS, "SIGSYS, SIG_IGN", NULL},        // 我们想忽略这个信号，SIGSYS表示收到了一个无效系统调用，如果我们不忽略，进程会被操作系统杀死，--标识31
                                                   // 所以我们把handler设置为NULL，代表 我要求忽略这个信号，请求操作系统不要执行缺省的该信号处理动作（杀掉我）
 
@@ -53,7 +55,7 @@ int ngx_init_signals()
 
     for (sig = signals; sig->signo != 0; sig++)
     {
-        memset(&sa, 0, sizeof(sigaction));
+        memset(&sa, 0, sizeof(struct sigaction));
         if (sig->handler) // 方式1
         {
             sa.sa_sigaction = sig->handler;
@@ -82,6 +84,8 @@ static void ngx_signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
     ngx_signal_t *sig;
     char *action; // 用于记录一个动作字符串, 以往日志文件中写
 
+    ngx_time_update(); // master进程平时睡在sigsuspend()里, 靠信号醒来时更新时间
+
     // 遍历信号数组, 找到对应信号
     for (sig = signals; sig->signo != 0; sig++)
     {
@@ -92,18 +96,18 @@ static void ngx_signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
     }
     action = (char *)""; // 目前还没有什么动作
 
-    // // 因为 ngx_reap 未使用, 所以这段if判断并没有用.
-    // if (ngx_process == NGX_PROCESS_MASTER) // master进程
-    // {
-    //     switch (signo)
-    //     {
-    //     case SIGCHLD:
-    //         ngx_reap = 1;
-    //         break;
-    //     default:
-    //         break;
-    //     }
-    // }
+    if (signo == SIGUSR1)
+    {
+        action = (char *)", reopening logs";
+    }
+    else if (signo == SIGHUP)
+    {
+        action = (char *)", reconfiguring";
+    }
+    else if (signo == SIGQUIT && ngx_process == NGX_PROCESS_WORKER)
+    {
+        action = (char *)", shutting down gracefully";
+    }
 
     if (siginfo && siginfo->si_pid) // si_pid: 发送该信号的进程id
     {
@@ -118,6 +122,26 @@ static void ngx_signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
     {
         ngx_process_get_status(); // 获取子进程的结束状态
     }
+    else if (signo == SIGUSR1) // 重新打开日志文件, master进程还要通知各个worker进程
+    {
+        ngx_log_reopen();
+        if (ngx_process == NGX_PROCESS_MASTER)
+        {
+            ngx_signal_worker_processes(SIGUSR1);
+        }
+    }
+    else if (signo == SIGHUP) // 重新载入配置文件, 只做标记, 由主流程去做(ngx_master_process_cycle/ngx_worker_process_cycle)
+    {
+        ngx_reconfigure = 1;
+    }
+    else if (signo == SIGQUIT && ngx_process == NGX_PROCESS_WORKER) // 平滑退出, 同样只做标记
+    {
+        ngx_quit = 1;
+    }
+    else if (signo == SIGALRM) // 推迟重新创建worker进程的时间到了
+    {
+        ngx_reap = 1;
+    }
 
     return;
 }
@@ -168,10 +192,11 @@ static void ngx_process_get_status()
         }
 
         one = 1; // 标记 waitpid() 是否返回了子进程的pid
+        ngx_worker_process_exited(pid); // worker进程异常退出的, 由master进程主流程重新创建
 
         if (WTERMSIG(status)) // 获取使子进程终止的信号
         {
-            ngx_log_error_core(NGX_LOG_ALERT, 0, "pid = %P exited on signal %d!", pid, WTERMSIG(status));
+            ngx_log_error_core(NGX_LOG_ALERT, 0, "pid = %P exited on signal %d%s!", pid, WTERMSIG(status), WCOREDUMP(status) ? " (core dumped)" : "");
         }
         else
         {
@@ -0,0 +1,156 @@
+﻿
+// ---------------------------------------
+// ngx_connection_s 成员分组(每组单独一个cache line)前后的对比:
+// reactor线程不断读事件分发字段, 改收包状态; 同时逻辑线程不断改发包计数和心跳时间, 都是同一批连接.
+// 成员挤在一起时, 逻辑线程每写一次, reactor线程那条cache line就失效一次(伪共享).
+// 用法: ngx_bench_connfields [连接数] [每个线程的轮数]
+// 注意: 只有一个CPU时两个线程是轮流跑的, 看不出伪共享的差别.
+// ---------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <new>
+
+// 原来的排法: 按声明顺序挤在一起, 一个连接的这些字段在同一条cache line里
+struct alignas(64) ngx_conn_packed_t
+{
+    int fd;                      // 事件分发, reactor线程只读
+    uint32_t events;
+    uint64_t iCurrsequence;
+    unsigned int irecvBufHead;   // 收包状态, reactor线程写
+    unsigned int irecvBufTail;
+    std::atomic<int> iSendCount; // 发包计数, 逻辑线程写
+    time_t lastPingTime;         // 心跳时间, 逻辑线程写
+};
+
+// 现在的排法: 和ngx_connection_s一样按访问的线程分组, 每组从新的cache line开始
+struct alignas(64) ngx_conn_grouped_t
+{
+    int fd;
+    uint32_t events;
+    uint64_t iCurrsequence;
+    alignas(64) unsigned int irecvBufHead;
+    unsigned int irecvBufTail;
+    alignas(64) std::atomic<int> iSendCount;
+    alignas(64) time_t lastPingTime;
+};
+
+static int s_connCount = 64;
+static long s_rounds = 200000;
+static std::atomic<bool> s_start(false);
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename T>
+struct ngx_bench_arg_t
+{
+    T *pConns;
+    double elapsed;
+    uint64_t sum; // 防止读操作被编译器优化掉
+};
+
+// 相当于reactor线程: 读分发字段, 更新收包位置
+template <typename T>
+static void *reactor_thread(void *parg)
+{
+    ngx_bench_arg_t<T> *pArg = (ngx_bench_arg_t<T> *)parg;
+    while (!s_start)
+        ;
+    double start = now_sec();
+    uint64_t sum = 0;
+    for (long r = 0; r < s_rounds; ++r)
+    {
+        for (int i = 0; i < s_connCount; ++i)
+        {
+            T *c = &pArg->pConns[i];
+            sum += (uint64_t)c->fd + c->events + c->iCurrsequence;
+            c->irecvBufTail += 8;
+            c->irecvBufHead = c->irecvBufTail;
+        }
+    }
+    pArg->elapsed = now_sec() - start;
+    pArg->sum = sum;
+    return NULL;
+}
+
+// 相当于逻辑线程: 入/出发消息队列计数, 更新心跳时间
+template <typename T>
+static void *logic_thread(void *parg)
+{
+    ngx_bench_arg_t<T> *pArg = (ngx_bench_arg_t<T> *)parg;
+    while (!s_start)
+        ;
+    double start = now_sec();
+    for (long r = 0; r < s_rounds; ++r)
+    {
+        for (int i = 0; i < s_connCount; ++i)
+        {
+            T *c = &pArg->pConns[i];
+            c->iSendCount.fetch_add(1, std::memory_order_relaxed);
+            c->lastPingTime = (time_t)r;
+        }
+    }
+    pArg->elapsed = now_sec() - start;
+    return NULL;
+}
+
+template <typename T>
+static void run(const char *name)
+{
+    void *pMem = NULL;
+    if (posix_memalign(&pMem, 64, sizeof(T) * (size_t)s_connCount) != 0)
+    {
+        fprintf(stderr, "posix_memalign()失败.\n");
+        exit(1);
+    }
+    T *pConns = (T *)pMem;
+    for (int i = 0; i < s_connCount; ++i)
+    {
+        new (&pConns[i]) T();
+        pConns[i].fd = i + 3;
+        pConns[i].events = 1;
+    }
+
+    ngx_bench_arg_t<T> reactorArg = {pConns, 0, 0};
+    ngx_bench_arg_t<T> logicArg = {pConns, 0, 0};
+    pthread_t reactor, logic;
+    s_start = false;
+    pthread_create(&reactor, NULL, reactor_thread<T>, &reactorArg);
+    pthread_create(&logic, NULL, logic_thread<T>, &logicArg);
+    s_start = true;
+    pthread_join(reactor, NULL);
+    pthread_join(logic, NULL);
+
+    double ops = (double)s_rounds * s_connCount;
+    printf("%-10s 每个连接%3d字节, reactor线程 %.2f纳秒/连接, 逻辑线程 %.2f纳秒/连接 (校验和%llu)\n",
+           name, (int)sizeof(T), reactorArg.elapsed * 1e9 / ops, logicArg.elapsed * 1e9 / ops, (unsigned long long)reactorArg.sum);
+    free(pMem);
+}
+
+int main(int argc, char *const *argv)
+{
+    if (argc > 1)
+        s_connCount = atoi(argv[1]);
+    if (argc > 2)
+        s_rounds = atol(argv[2]);
+    if (s_connCount <= 0 || s_rounds <= 0)
+    {
+        fprintf(stderr, "用法: %s [连接数] [每个线程的轮数]\n", argv[0]);
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("连接%d个, 每个线程%ld轮, CPU%ld个%s\n", s_connCount, s_rounds, cpus, (cpus < 2) ? "(两个线程不能同时跑, 结果没有参考价值)" : "");
+    run<ngx_conn_packed_t>("挤在一起");
+    run<ngx_conn_grouped_t>("按线程分组");
+    return 0;
+}
@@ -0,0 +1,95 @@
+﻿
+// ---------------------------------------
+// crc32各种计算方式的性能对比: bytewise(原来逐字节查crc32_table的循环), slicing-by-8, pclmul.
+// 包长从最小的包头(8字节)到最大包(_PKG_MAX_LENGTH - 1000), 每种都先核对结果和bytewise一样.
+// 用法: ngx_bench_crc32 [每种长度计算的总字节数(MB)]
+// ---------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ngx_comm.h"
+#include "ngx_c_crc32.h"
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *const *argv)
+{
+    static const char *engines[] = {"bytewise", "slicing-by-8", "pclmul"};
+    static const size_t sizes[] = {8, 16, 64, 256, 1024, 4096, _PKG_MAX_LENGTH - 1000};
+    const int engineCount = sizeof(engines) / sizeof(engines[0]);
+    const int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+
+    double totalMB = (argc > 1) ? atof(argv[1]) : 256;
+    if (totalMB <= 0)
+    {
+        fprintf(stderr, "用法: %s [每种长度计算的总字节数(MB)]\n", argv[0]);
+        return 1;
+    }
+
+    size_t maxSize = sizes[sizeCount - 1];
+    unsigned char *pbuf = new unsigned char[maxSize + 1];
+    srand(1);
+    for (size_t i = 0; i <= maxSize; ++i)
+    {
+        pbuf[i] = (unsigned char)rand();
+    }
+
+    CCRC32 *p_crc32 = CCRC32::GetInstance();
+    const char *pDefault = p_crc32->EngineName();
+
+    // 先核对结果, 再计时; 从第1个字节开始算, 和收包时包体不对齐的情况一样
+    printf("%8s", "包长");
+    for (int e = 0; e < engineCount; ++e)
+    {
+        printf("%22s", engines[e]);
+    }
+    printf("\n");
+    for (int s = 0; s < sizeCount; ++s)
+    {
+        size_t size = sizes[s];
+        long loops = (long)(totalMB * 1024 * 1024 / size);
+        p_crc32->SetEngine("bytewise");
+        unsigned int expect = p_crc32->Update(0, pbuf + 1, size);
+
+        printf("%8zu", size);
+        for (int e = 0; e < engineCount; ++e)
+        {
+            if (p_crc32->SetEngine(engines[e]) == false)
+            {
+                printf("%22s", "本机不支持");
+                continue;
+            }
+            if (p_crc32->Update(0, pbuf + 1, size) != expect)
+            {
+                printf("\n%s 在包长%zu时结果不对!\n", engines[e], size);
+                return 1;
+            }
+
+            unsigned int crc = 0;
+            double start = now_sec();
+            for (long i = 0; i < loops; ++i)
+            {
+                crc ^= p_crc32->Update(0, pbuf + 1, size);
+            }
+            double elapsed = now_sec() - start;
+            if (crc == 0x12345678) // 使用结果, 防止被优化掉
+            {
+                printf("!");
+            }
+            char result[32];
+            snprintf(result, sizeof(result), "%.0fMB/s %.0fns", (double)size * loops / elapsed / 1024 / 1024, elapsed * 1e9 / loops);
+            printf("%22s", result);
+        }
+        printf("\n");
+    }
+    printf("nginx中默认使用: %s\n", pDefault);
+
+    delete[] pbuf;
+    return 0;
+}
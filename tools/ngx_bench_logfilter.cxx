@@ -0,0 +1,133 @@
+﻿
+// ---------------------------------------
+// 被等级过滤掉的一条日志要花多少时间, 对比:
+// (1) 原来的做法: 取时间, 格式化整条日志, 最后才比较等级丢掉(这里照着原来的ngx_log_error_core()写了一份);
+// (2) 直接调用 ngx_log_error_core(): 函数开头就比较等级返回;
+// (3) ngx_log_error() 宏, 等级在运行时被LogLevel过滤: 只剩一次比较, 参数都不求值;
+// (4) ngx_log_error() 宏, 等级超过编译期的 NGX_LOG_MAX_LEVEL: 整个调用被编译掉.
+// 和release版一样用 -DNGX_LOG_MAX_LEVEL=NGX_LOG_NOTICE 编译, 链接nginx中真正的日志代码.
+// 用法: ngx_bench_logfilter [每种的调用次数]
+// ---------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ngx_global.h"
+#include "ngx_macro.h"
+#include "ngx_func.h"
+
+pid_t ngx_pid;   // 日志代码要用, nginx中在nginx.cxx里定义
+int ngx_process;
+
+static volatile unsigned int s_sink = 0; // 每轮都改一下, 循环不会被优化掉
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 原来的 ngx_log_error_core(): 先把时间/等级/pid/内容都格式化好, 最后才比较等级, 被过滤时不写
+static void __attribute__((noinline)) bench_log_format_first(int level, int err, const char *fmt, ...)
+{
+    u_char errstr[NGX_MAX_ERROR_STR] = {0};
+    u_char *begin = errstr;
+    u_char *end = errstr + NGX_MAX_ERROR_STR;
+
+    struct timeval tv;
+    struct tm tm;
+    gettimeofday(&tv, NULL);
+    time_t sec = tv.tv_sec;
+    localtime_r(&sec, &tm);
+    u_char strcurtime[40] = {0};
+    ngx_slprintf(strcurtime, (u_char *)-1, "%04d/%02d/%02d %02d:%02d:%02d",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    begin = ngx_cpymem(begin, strcurtime, strlen((const char *)strcurtime));
+    begin = ngx_slprintf(begin, end, " [%s] ", "debug");
+    begin = ngx_slprintf(begin, end, "%P: ", ngx_pid);
+
+    va_list args;
+    va_start(args, fmt);
+    begin = ngx_vslprintf(begin, end, fmt, args);
+    va_end(args);
+    if (err != 0)
+    {
+        begin = ngx_log_errno(begin, end, err);
+    }
+
+    if (level > ngx_log.log_level)
+    {
+        return;
+    }
+    write(ngx_log.fd, errstr, begin - errstr);
+}
+
+static void report(const char *name, long loops, double elapsed)
+{
+    printf("%8.2f纳秒/次  %s\n", elapsed * 1e9 / loops, name); // 中文名字printf对不齐, 数字放前面
+}
+
+int main(int argc, char *const *argv)
+{
+    long loops = (argc > 1) ? atol(argv[1]) : 2000000;
+    if (loops <= 0)
+    {
+        fprintf(stderr, "用法: %s [每种的调用次数]\n", argv[0]);
+        return 1;
+    }
+
+    ngx_pid = getpid();
+    ngx_log.fd = STDERR_FILENO;
+    ngx_log.log_level = NGX_LOG_WARN; // LogLevel = 5, notice/info/debug都被过滤
+    ngx_time_update();
+
+    // 和CLogicSocket::threadRecvProcFunc()中CRC正确时的那条日志一样
+    const char *fmt = "CLogicSocket::threadRecvProcFunc()中CRC正确[服务器:%d/客户端:%d].";
+    double start;
+
+    start = now_sec();
+    for (long i = 0; i < loops; ++i)
+    {
+        s_sink = s_sink + 1;
+    }
+    report("空循环(下面每种都包含这部分)", loops, now_sec() - start);
+
+    start = now_sec();
+    for (long i = 0; i < loops; ++i)
+    {
+        bench_log_format_first(NGX_LOG_DEBUG, 0, fmt, (int)i, (int)s_sink);
+        s_sink = s_sink + 1;
+    }
+    report("先格式化再比较等级(原来的做法)", loops, now_sec() - start);
+
+    start = now_sec();
+    for (long i = 0; i < loops; ++i)
+    {
+        ngx_log_error_core(NGX_LOG_DEBUG, 0, fmt, (int)i, (int)s_sink);
+        s_sink = s_sink + 1;
+    }
+    report("ngx_log_error_core()", loops, now_sec() - start);
+
+    start = now_sec();
+    for (long i = 0; i < loops; ++i)
+    {
+        ngx_log_error(NGX_LOG_NOTICE, 0, fmt, (int)i, (int)s_sink);
+        s_sink = s_sink + 1;
+    }
+    report("ngx_log_error(), 被LogLevel过滤", loops, now_sec() - start);
+
+    start = now_sec();
+    for (long i = 0; i < loops; ++i)
+    {
+        ngx_log_error(NGX_LOG_DEBUG, 0, fmt, (int)i, (int)s_sink);
+        s_sink = s_sink + 1;
+    }
+    report("ngx_log_error(), 被NGX_LOG_MAX_LEVEL编译掉", loops, now_sec() - start);
+    return 0;
+}
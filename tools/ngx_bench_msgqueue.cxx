@@ -0,0 +1,154 @@
+﻿
+// ---------------------------------------
+// 收消息队列的性能对比:
+// CMsgQueue(无锁MPMC, 现在CThreadPool用的) 和 原来的 std::list + 互斥量 + 条件变量.
+// 用法: ngx_bench_msgqueue [生产者数] [消费者数] [每个生产者的消息数]
+// ---------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <list>
+#include <atomic>
+
+#include "ngx_c_msgqueue.h"
+
+static int s_producers = 1; // 生产者相当于reactor线程
+static int s_consumers = 4; // 消费者相当于逻辑线程
+static long s_perProducer = 2000000;
+
+static std::atomic<bool> s_shutdown(false);
+static std::atomic<long> s_consumed(0);
+
+// 原来的实现: 入队加锁后push_back并signal, 出队加锁后cond_wait直到有消息
+static std::list<char *> s_list;
+static pthread_mutex_t s_listMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_listCond = PTHREAD_COND_INITIALIZER;
+
+static CMsgQueue s_queue;
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *list_producer(void *)
+{
+    for (long i = 0; i < s_perProducer; ++i)
+    {
+        pthread_mutex_lock(&s_listMutex);
+        s_list.push_back((char *)(i + 1));
+        pthread_mutex_unlock(&s_listMutex);
+        pthread_cond_signal(&s_listCond);
+    }
+    return NULL;
+}
+
+static void *list_consumer(void *)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&s_listMutex);
+        while (s_list.empty() && !s_shutdown)
+        {
+            pthread_cond_wait(&s_listCond, &s_listMutex);
+        }
+        if (s_list.empty()) // shutdown
+        {
+            pthread_mutex_unlock(&s_listMutex);
+            return NULL;
+        }
+        s_list.pop_front();
+        pthread_mutex_unlock(&s_listMutex);
+        s_consumed.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static void *mpmc_producer(void *)
+{
+    for (long i = 0; i < s_perProducer; ++i)
+    {
+        while (!s_queue.Push((char *)(i + 1))) // 满了就等消费者, 服务器里是丢弃并计数
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *mpmc_consumer(void *)
+{
+    while (s_queue.WaitPop(s_shutdown) != NULL)
+    {
+        s_consumed.fetch_add(1, std::memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void shutdown_list()
+{
+    pthread_mutex_lock(&s_listMutex);
+    s_shutdown = true;
+    pthread_mutex_unlock(&s_listMutex);
+    pthread_cond_broadcast(&s_listCond);
+}
+
+static void shutdown_mpmc()
+{
+    s_shutdown = true;
+    s_queue.WakeAll();
+}
+
+// 跑一轮: 所有消息都被取走后计时结束
+static void run(const char *name, void *(*producer)(void *), void *(*consumer)(void *), void (*shutdown)())
+{
+    pthread_t *pproducers = new pthread_t[s_producers];
+    pthread_t *pconsumers = new pthread_t[s_consumers];
+    long total = s_perProducer * s_producers;
+    s_shutdown = false;
+    s_consumed = 0;
+
+    double start = now_sec();
+    for (int i = 0; i < s_consumers; ++i)
+        pthread_create(&pconsumers[i], NULL, consumer, NULL);
+    for (int i = 0; i < s_producers; ++i)
+        pthread_create(&pproducers[i], NULL, producer, NULL);
+    for (int i = 0; i < s_producers; ++i)
+        pthread_join(pproducers[i], NULL);
+    while (s_consumed.load(std::memory_order_relaxed) < total)
+    {
+        sched_yield();
+    }
+    double elapsed = now_sec() - start;
+
+    shutdown();
+    for (int i = 0; i < s_consumers; ++i)
+        pthread_join(pconsumers[i], NULL);
+
+    printf("%-22s %ld条, %.3f秒, %.2f万条/秒, %.1f纳秒/条\n", name, total, elapsed, total / elapsed / 1e4, elapsed * 1e9 / total);
+    delete[] pproducers;
+    delete[] pconsumers;
+}
+
+int main(int argc, char *const *argv)
+{
+    if (argc > 1)
+        s_producers = atoi(argv[1]);
+    if (argc > 2)
+        s_consumers = atoi(argv[2]);
+    if (argc > 3)
+        s_perProducer = atol(argv[3]);
+    if (s_producers <= 0 || s_consumers <= 0 || s_perProducer <= 0)
+    {
+        fprintf(stderr, "用法: %s [生产者数] [消费者数] [每个生产者的消息数]\n", argv[0]);
+        return 1;
+    }
+    s_queue.Init(65536); // 和ProcMsgRecvQueueSize的默认值一样
+
+    printf("生产者%d个, 消费者%d个\n", s_producers, s_consumers);
+    run("list+mutex+cond", list_producer, list_consumer, shutdown_list);
+    run("CMsgQueue(MPMC)", mpmc_producer, mpmc_consumer, shutdown_mpmc);
+    return 0;
+}
@@ -0,0 +1,240 @@
+﻿// ------------------
+// 二进制日志解码工具: 把 LogBinary = 1 时写出的日志文件还原成文本, 格式和文本日志一样:
+//     2019/01/08 19:57:11 [error] 2037: 日志内容 (错误码: 错误信息)
+// 用法: ./ngx_logdecode logs/error.log > error.txt
+// 文件格式见 ngx_logbin.h. 格式串的定义不一定写在用到它的日志前面(异步日志时各线程的缓冲区是分别写出的),
+// 所以先扫一遍收集所有格式串, 再扫一遍解码.
+// ------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_macro.h"
+#include "ngx_func.h"
+#include "ngx_logbin.h"
+
+// 和 ngx_log.cxx 中的一致
+static const char *err_levels[] = {"stderr", "emerg", "alert", "crit", "error", "warn", "notice", "info", "debug"};
+
+typedef std::map<std::pair<int32_t, uint64_t>, std::string> ngx_fmt_map_t; // (boot, fmtid) -> 格式串
+
+// 取出一个参数, 剩下的不够时返回false
+template <typename T>
+static bool ngx_logdecode_take(const u_char *&parg, const u_char *pargend, T &value)
+{
+    if (parg + sizeof(T) > pargend)
+    {
+        return false;
+    }
+    memcpy(&value, parg, sizeof(T));
+    parg += sizeof(T);
+    return true;
+}
+
+// 按格式串把参数还原成文本. 每个%...单独取出来交给ngx_slprintf(), 保证和文本日志的输出一模一样.
+// 参数不够(写日志时放不下被截掉了)就到此为止.
+static u_char *ngx_logdecode_args(u_char *begin, u_char *end, const char *fmt, const u_char *parg, const u_char *pargend)
+{
+    while (*fmt && begin < end)
+    {
+        if (*fmt != '%')
+        {
+            *begin++ = *fmt++;
+            continue;
+        }
+
+        const char *spec = fmt++;
+        while (*fmt >= '0' && *fmt <= '9')
+        {
+            fmt++;
+        }
+        switch (*fmt)
+        {
+        case 'u':
+        case 'x':
+        case 'X':
+            fmt++;
+            break;
+        case '.':
+            fmt++;
+            while (*fmt >= '0' && *fmt <= '9')
+            {
+                fmt++;
+            }
+            break;
+        default:
+            break;
+        }
+        if (*fmt == '\0')
+        {
+            break;
+        }
+        char conv = *fmt++;
+        std::string onespec(spec, fmt - spec);
+
+        switch (conv)
+        {
+        case 'd':
+        case 'P':
+        {
+            int32_t value;
+            if (!ngx_logdecode_take(parg, pargend, value))
+                return begin;
+            begin = ngx_slprintf(begin, end, onespec.c_str(), value);
+            break;
+        }
+        case 'L':
+        {
+            int64_t value;
+            if (!ngx_logdecode_take(parg, pargend, value))
+                return begin;
+            begin = ngx_slprintf(begin, end, onespec.c_str(), value);
+            break;
+        }
+        case 'f':
+        {
+            double value;
+            if (!ngx_logdecode_take(parg, pargend, value))
+                return begin;
+            begin = ngx_slprintf(begin, end, onespec.c_str(), value);
+            break;
+        }
+        case 's':
+        {
+            uint16_t len;
+            if (!ngx_logdecode_take(parg, pargend, len) || parg + len > pargend)
+                return begin;
+            if (len > end - begin)
+                len = (uint16_t)(end - begin);
+            begin = ngx_cpymem(begin, parg, len);
+            parg += len;
+            break;
+        }
+        default: // %%等, 没有参数
+            begin = ngx_slprintf(begin, end, onespec.c_str());
+            break;
+        }
+    }
+    return begin;
+}
+
+// 解码一条日志, 输出一行
+static void ngx_logdecode_event(const ngx_logbin_event_t *pEvent, const ngx_fmt_map_t &fmts)
+{
+    u_char line[NGX_MAX_ERROR_STR];
+    u_char *begin = line;
+    u_char *end = line + NGX_MAX_ERROR_STR;
+
+    struct tm tm;
+    time_t sec = (time_t)pEvent->sec;
+    localtime_r(&sec, &tm);
+    begin = ngx_slprintf(begin, end, "%4d/%02d/%02d %02d:%02d:%02d",
+                         tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    if (pEvent->level < sizeof(err_levels) / sizeof(err_levels[0]))
+    {
+        begin = ngx_slprintf(begin, end, " [%s] ", err_levels[pEvent->level]);
+    }
+    else
+    {
+        begin = ngx_slprintf(begin, end, " [%d] ", (int)pEvent->level);
+    }
+    begin = ngx_slprintf(begin, end, "%P: ", (pid_t)pEvent->pid);
+
+    const u_char *pdata = (const u_char *)(pEvent + 1);
+    const u_char *pdataend = (const u_char *)pEvent + pEvent->head.len;
+    if (pEvent->head.type == NGX_LOGBIN_TEXT)
+    {
+        size_t len = pdataend - pdata;
+        if (len > (size_t)(end - begin))
+            len = end - begin;
+        begin = ngx_cpymem(begin, pdata, len);
+    }
+    else
+    {
+        auto pos = fmts.find(std::make_pair(pEvent->head.boot, pEvent->head.fmtid));
+        if (pos == fmts.end()) // 定义丢了(比如异步日志缓冲区满被丢弃)
+        {
+            begin = ngx_slprintf(begin, end, "[未知格式串 %xL]", pEvent->head.fmtid);
+        }
+        else
+        {
+            begin = ngx_logdecode_args(begin, end, pos->second.c_str(), pdata, pdataend);
+        }
+    }
+
+    if (pEvent->err != 0) // 同 ngx_log_errno()
+    {
+        begin = ngx_slprintf(begin, end, " (%d: %s) ", pEvent->err, strerror(pEvent->err));
+    }
+
+    if (begin >= end)
+    {
+        begin = end - 1;
+    }
+    *begin++ = '\n';
+    fwrite(line, 1, begin - line, stdout);
+}
+
+int main(int argc, char *const *argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "用法: %s 二进制日志文件\n", argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "打开文件[%s]失败: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    std::vector<u_char> data;
+    u_char chunk[64 * 1024];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(fp);
+
+    // 第一遍: 收集格式串; 顺便找出有效数据的长度, 文件末尾不完整的记录(比如写到一半进程被杀)不要
+    ngx_fmt_map_t fmts;
+    size_t total = 0;
+    while (total + sizeof(ngx_logbin_head_t) <= data.size())
+    {
+        const ngx_logbin_head_t *pHead = (const ngx_logbin_head_t *)&data[total];
+        if (pHead->len < sizeof(ngx_logbin_head_t) || total + pHead->len > data.size() ||
+            (pHead->type != NGX_LOGBIN_FMT && pHead->len < sizeof(ngx_logbin_event_t)))
+        {
+            break;
+        }
+        if (pHead->type == NGX_LOGBIN_FMT)
+        {
+            fmts[std::make_pair(pHead->boot, pHead->fmtid)].assign((const char *)(pHead + 1), pHead->len - sizeof(ngx_logbin_head_t));
+        }
+        total += pHead->len;
+    }
+    if (total != data.size())
+    {
+        fprintf(stderr, "文件[%s]在偏移%zu处的记录不完整或已损坏, 后面的内容忽略.\n", argv[1], total);
+    }
+
+    // 第二遍: 解码日志
+    for (size_t offset = 0; offset < total;)
+    {
+        const ngx_logbin_head_t *pHead = (const ngx_logbin_head_t *)&data[offset];
+        if (pHead->type == NGX_LOGBIN_EVENT || pHead->type == NGX_LOGBIN_TEXT)
+        {
+            ngx_logdecode_event((const ngx_logbin_event_t *)pHead, fmts);
+        }
+        offset += pHead->len;
+    }
+    return 0;
+}